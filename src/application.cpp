@@ -3,11 +3,19 @@
 #include <SDL_events.h>
 #include <SDL_keycode.h>
 #include <SDL_scancode.h>
+#include <algorithm>
 
 using namespace monokl;
 
+// How far a new window is moved from the one it was opened from
+static const int NEW_WINDOW_OFFSET = 32;
+
 std::filesystem::path ApplicationSettings::get_settings_path() {
-  return Util::get_user_home_dir() / ".monokl" / "settings.toml";
+  return get_data_dir() / "settings.toml";
+}
+
+std::filesystem::path ApplicationSettings::get_data_dir() {
+  return Util::get_user_home_dir() / ".monokl";
 }
 
 ApplicationSettings ApplicationSettings::load() {
@@ -39,6 +47,78 @@ ApplicationSettings ApplicationSettings::load() {
     }
   }
 
+  if (data.contains("memory") && data.at("memory").is_table()) {
+    auto memory_entry = data.at("memory");
+
+    if (memory_entry.contains("budget_mb") && memory_entry.at("budget_mb").is_integer()) {
+      settings.memory_options.budget_bytes = toml::find<uint64_t>(memory_entry, "budget_mb") * 1024 * 1024;
+    }
+  }
+
+  if (data.contains("color") && data.at("color").is_table()) {
+    auto color_entry = data.at("color");
+
+    if (color_entry.contains("management") && color_entry.at("management").is_boolean()) {
+      settings.color_management = toml::find<bool>(color_entry, "management");
+    }
+  }
+
+  if (data.contains("metadata") && data.at("metadata").is_table()) {
+    auto metadata_entry = data.at("metadata");
+
+    if (metadata_entry.contains("central") && metadata_entry.at("central").is_boolean()) {
+      settings.central_metadata = toml::find<bool>(metadata_entry, "central");
+    }
+  }
+
+  if (data.contains("session") && data.at("session").is_table()) {
+    auto session_entry = data.at("session");
+
+    if (session_entry.contains("restore") && session_entry.at("restore").is_boolean()) {
+      settings.restore_session = toml::find<bool>(session_entry, "restore");
+    }
+  }
+
+  if (data.contains("log") && data.at("log").is_table()) {
+    auto log_entry = data.at("log");
+
+    if (log_entry.contains("file") && log_entry.at("file").is_string()) {
+      settings.log_file = std::filesystem::u8path(toml::find<std::string>(log_entry, "file"));
+    }
+  }
+
+  if (data.contains("export") && data.at("export").is_table()) {
+    auto export_entry = data.at("export");
+
+    if (export_entry.contains("directory") && export_entry.at("directory").is_string()) {
+      settings.export_options.directory = std::filesystem::u8path(toml::find<std::string>(export_entry, "directory"));
+    }
+
+    if (export_entry.contains("max_size") && export_entry.at("max_size").is_integer()) {
+      settings.export_options.max_size = toml::find<unsigned int>(export_entry, "max_size");
+    }
+
+    if (export_entry.contains("format") && export_entry.at("format").is_string()) {
+      settings.export_options.format = parse_export_format(toml::find<std::string>(export_entry, "format"));
+    }
+
+    if (export_entry.contains("quality") && export_entry.at("quality").is_integer()) {
+      settings.export_options.quality = toml::find<unsigned int>(export_entry, "quality");
+    }
+  }
+
+  if (data.contains("render") && data.at("render").is_table()) {
+    auto render_entry = data.at("render");
+
+    if (render_entry.contains("compositor") && render_entry.at("compositor").is_string()) {
+      settings.render_options.compositor = parse_compositor_mode(toml::find<std::string>(render_entry, "compositor"));
+    }
+
+    if (render_entry.contains("filter") && render_entry.at("filter").is_string()) {
+      settings.render_options.filter = parse_resample_kernel(toml::find<std::string>(render_entry, "filter"));
+    }
+  }
+
   log_debug("Loaded settings from %s", path.string().c_str());
 
   return settings;
@@ -56,25 +136,87 @@ void ApplicationSettings::save() {
   data["playlist"]["only_favorites"] = playlist_options.only_favorites;
   data["playlist"]["skip_hidden"] = playlist_options.skip_hidden;
   data["playlist"]["sort_order"] = static_cast<int>(playlist_options.sort_order);
+  data["memory"]["budget_mb"] = memory_options.budget_bytes / (1024 * 1024);
+  data["color"]["management"] = color_management;
+  data["session"]["restore"] = restore_session;
+  data["metadata"]["central"] = central_metadata;
+  data["log"]["file"] = log_file.u8string();
+  data["export"]["directory"] = export_options.directory.u8string();
+  data["export"]["max_size"] = export_options.max_size;
+  data["export"]["format"] = export_format_name(export_options.format);
+  data["export"]["quality"] = export_options.quality;
+  data["render"]["compositor"] = compositor_mode_name(render_options.compositor);
+  data["render"]["filter"] = resample_kernel_name(render_options.filter);
+
+  PersistenceWriter::get().write(path, toml::format(data));
+  log_debug("Settings queued for %s", path.string().c_str());
+}
 
-  auto result = toml::format(data);
-  std::ofstream file(path);
-  file << result;
-  file.close();
+// SDL's own messages end up in the same place as ours, instead of being printed on the spot
+static void forward_sdl_log(void* userdata, int category, SDL_LogPriority priority, const char* message) {
+  LogLevel level = static_cast<LogLevel>(std::clamp(static_cast<int>(priority) - 1, static_cast<int>(LogLevelVerbose), static_cast<int>(LogLevelCritical)));
+  Logger::get().write_message(level, message);
+}
 
-  log_debug("Settings saved to %s", path.string().c_str());
+static void preload_codecs() {
+  ScopedTimer timer("startup.codec_preload");
+  if (sail::context::init(SAIL_FLAG_PRELOAD_CODECS) != SAIL_OK) {
+    log_warn("Failed to preload image codecs, they will be loaded on first use");
+  }
 }
 
-Application::Application() {
+Application::Application(const std::vector<std::string>& paths) : started_at(std::chrono::steady_clock::now()), decode_cache(std::make_shared<DecodeCache>()) {
   if (SDL_Init(SDL_INIT_VIDEO) != 0) {
     throw MonoklError(fmt::format("Failed to initialize SDL: %s", SDL_GetError()));
   }
 
-  SDL_LogSetAllPriority(SDL_LOG_PRIORITY_DEBUG);
+  SDL_LogSetAllPriority(MONOKL_LOG_LEVEL <= MONOKL_LOG_LEVEL_DEBUG ? SDL_LOG_PRIORITY_DEBUG : SDL_LOG_PRIORITY_INFO);
+  SDL_LogSetOutputFunction(forward_sdl_log, nullptr);
 
   sail::log::set_barrier(SailLogLevel::SAIL_LOG_LEVEL_WARNING);
 
-  settings = std::make_shared<ApplicationSettings>(ApplicationSettings::load());
+  // Everything that doesn't need the window runs while the main thread creates it,
+  // `finish_initialization` and `open_startup_paths` pick up the results
+  pending_settings = std::async(std::launch::async, []() {
+    ScopedTimer timer("startup.settings");
+    auto settings = ApplicationSettings::load();
+    if (!settings.log_file.empty()) {
+      Logger::get().open_file(settings.log_file);
+    }
+    if (settings.central_metadata) {
+      MetadataStore::get().open(ApplicationSettings::get_data_dir());
+    }
+    return settings;
+  }).share();
+  codec_preload = std::async(std::launch::async, preload_codecs);
+
+  if (!paths.empty()) {
+    // Favorites are read during the scan, so it has to know where they're stored first
+    pending_startup_playlist = std::async(std::launch::async, [paths, settings = pending_settings]() {
+      settings.wait();
+      ScopedTimer timer("startup.scan");
+      auto playlist = std::make_shared<Playlist>();
+      playlist->reload_images_from(paths);
+      return playlist;
+    });
+
+    // The first path is what an "open with" asks for, so it's read without waiting for the scan
+    std::error_code error;
+    if (std::filesystem::is_regular_file(paths.front(), error) && !Archive::is_archive(paths.front())) {
+      startup_frame_path = paths.front();
+      pending_startup_frame = std::async(std::launch::async, [path = startup_frame_path]() {
+        ScopedTimer timer("startup.first_read");
+        // TIFFs the window reads by their strips and tiles aren't worth going through the codec for
+        if (TiledImage::may_be_tiled(path)) {
+          auto tiled = TiledImage::open(path);
+          if (tiled != nullptr && (tiled->needs_region_decode() || tiled->can_decode_whole())) {
+            return sail::image();
+          }
+        }
+        return ImageDecoder::read_first_frame(path);
+      });
+    }
+  }
 
   log_debug("Application initialized");
   log_debug("Library versions:");
@@ -84,37 +226,138 @@ Application::Application() {
   log_debug(" - toml11: %d.%d.%d", TOML11_VERSION_MAJOR, TOML11_VERSION_MINOR, TOML11_VERSION_PATCH);
 }
 
+void Application::finish_initialization() {
+  if (settings != nullptr) {
+    return;
+  }
+
+  settings = std::make_shared<ApplicationSettings>(pending_settings.get());
+  memory_governor = std::make_shared<MemoryGovernor>(settings->memory_options);
+
+  if (settings->color_management) {
+    color_manager = std::make_shared<ColorManager>(memory_governor);
+  }
+}
+
+void Application::open_startup_paths(Window& window) {
+  auto playlist = pending_startup_playlist.get();
+
+  sail::image frame;
+  if (pending_startup_frame.valid()) {
+    frame = pending_startup_frame.get();
+  }
+
+  // Individual files get sorted along with everything else, so the one asked for is selected explicitly
+  for (size_t i = 0; i < playlist->shown_entries.size(); i++) {
+    if (!startup_frame_path.empty() && playlist->shown_entries[i]->path == std::filesystem::path(startup_frame_path)) {
+      playlist->go_to(static_cast<int>(i));
+      break;
+    }
+  }
+
+  auto current = playlist->get_current();
+  if (current != nullptr && current->path == std::filesystem::path(startup_frame_path)) {
+    window.open_playlist(playlist, &frame);
+  } else {
+    window.open_playlist(playlist, nullptr);
+  }
+}
+
 Application::~Application() {
+  // Windows save their session on the way out and still need the settings for that. The focused
+  // one goes last, so it's what's restored next time
+  auto focused = windows.find(focused_window_id);
+  std::shared_ptr<Window> last = focused != windows.end() ? focused->second : nullptr;
+  windows.clear();
+  last.reset();
+
   if (settings != nullptr) {
     settings->save();
     settings.reset();
   }
 
-  if (window != nullptr) {
-    window.reset();
-  }
+  // Bounded, so a hung network mount can't keep the process from exiting
+  PersistenceWriter::get().flush(PersistenceWriter::FLUSH_TIMEOUT);
+
+  MetadataStore::get().close();
 
   log_debug("SDL application terminating");
   SDL_Quit();
+
+  Logger::get().shutdown();
 }
 
 std::shared_ptr<ApplicationSettings> Application::get_settings() const {
   return settings;
 }
 
+std::shared_ptr<MemoryGovernor> Application::get_memory_governor() const {
+  return memory_governor;
+}
+
+std::shared_ptr<ColorManager> Application::get_color_manager() const {
+  return color_manager;
+}
+
+std::shared_ptr<DecodeCache> Application::get_decode_cache() const {
+  return decode_cache;
+}
+
+std::chrono::steady_clock::time_point Application::get_started_at() const {
+  return started_at;
+}
+
 void Application::run_main_loop() {
   bool running = true;
   while (running) {
     SDL_Event event;
 
     while (running && SDL_PollEvent(&event)) {
+      if (event.type == SDL_QUIT) {
+        log_debug("User requested exit");
+        running = false;
+        break;
+      }
+
+      Window* window = find_window(event);
+      if (window == nullptr) {
+        continue;
+      }
+
       switch (event.type) {
-        case SDL_QUIT: {
-          log_debug("User requested exit");
-          running = false;
-        } break;
 
         case SDL_KEYDOWN: {
+          if (window->is_searching()) {
+            switch (event.key.keysym.scancode) {
+              case SDL_SCANCODE_ESCAPE:
+                window->end_search(false);
+                break;
+
+              case SDL_SCANCODE_RETURN:
+              case SDL_SCANCODE_KP_ENTER:
+                window->end_search(true);
+                break;
+
+              case SDL_SCANCODE_BACKSPACE:
+                window->search_backspace();
+                break;
+
+              case SDL_SCANCODE_LEFT:
+              case SDL_SCANCODE_UP:
+                window->search_step(-1);
+                break;
+
+              case SDL_SCANCODE_RIGHT:
+              case SDL_SCANCODE_DOWN:
+                window->search_step(1);
+                break;
+
+              default:
+                break;
+            }
+            break;
+          }
+
           switch (event.key.keysym.scancode) {
             case SDL_SCANCODE_LEFT:
               window->playlist_advance(-1);
@@ -140,6 +383,84 @@ void Application::run_main_loop() {
               window->set_original_image_size();
               break;
 
+            case SDL_SCANCODE_R:
+              if (event.key.keysym.mod & KMOD_SHIFT) {
+                window->transform_current_image(OrientationRotate270);
+                break;
+              }
+              window->transform_current_image(OrientationRotate90);
+              break;
+
+            case SDL_SCANCODE_M:
+              if (event.key.keysym.mod & KMOD_SHIFT) {
+                window->transform_current_image(OrientationMirrorVertical);
+                break;
+              }
+              window->transform_current_image(OrientationMirrorHorizontal);
+              break;
+
+            case SDL_SCANCODE_LEFTBRACKET:
+              window->change_exposure(-0.5f);
+              break;
+
+            case SDL_SCANCODE_RIGHTBRACKET:
+              window->change_exposure(0.5f);
+              break;
+
+            case SDL_SCANCODE_I:
+              Instrumentation::get().log_summary();
+              break;
+
+            case SDL_SCANCODE_S:
+              if (event.key.keysym.mod & KMOD_SHIFT) {
+                window->playlist_reverse_sort_order();
+                break;
+              }
+              window->playlist_cycle_sort_order();
+              break;
+
+            case SDL_SCANCODE_E:
+              window->playlist_export_metadata();
+              break;
+
+            case SDL_SCANCODE_X:
+              window->playlist_export_shown();
+              break;
+
+            case SDL_SCANCODE_D:
+              if (event.key.keysym.mod & KMOD_SHIFT) {
+                window->playlist_group_by_similarity();
+                break;
+              }
+              window->playlist_show_duplicates();
+              break;
+
+            case SDL_SCANCODE_C:
+              if (event.key.keysym.mod & KMOD_SHIFT) {
+                window->toggle_compare(4);
+                break;
+              }
+              window->toggle_compare(2);
+              break;
+
+            case SDL_SCANCODE_H:
+              window->toggle_overlay();
+              break;
+
+            case SDL_SCANCODE_N:
+              if (event.key.keysym.mod & KMOD_CTRL) {
+                open_window_like(*window);
+              }
+              break;
+
+            case SDL_SCANCODE_SLASH:
+              window->begin_search();
+              break;
+
+            case SDL_SCANCODE_G:
+              window->begin_search(":");
+              break;
+
             case SDL_SCANCODE_F:
               if (event.key.keysym.mod & KMOD_SHIFT) {
                 window->playlist_toggle_only_favorites();
@@ -153,6 +474,20 @@ void Application::run_main_loop() {
           }
         } break;
 
+        case SDL_TEXTINPUT:
+          if (window->is_searching()) {
+            window->search_input(event.text.text);
+          }
+          break;
+
+        case SDL_MOUSEMOTION:
+          window->move_cursor(event.motion.x, event.motion.y);
+          // Dragging with the left button pans images that are larger than the window
+          if (event.motion.state & SDL_BUTTON_LMASK) {
+            window->pan_by(event.motion.xrel, event.motion.yrel);
+          }
+          break;
+
         case SDL_MOUSEWHEEL:
           if (event.wheel.y > 0) {
             window->change_zoom(0.1);
@@ -167,6 +502,23 @@ void Application::run_main_loop() {
             case SDL_WINDOWEVENT_RESIZED:
               window->refresh_size();
               break;
+
+            case SDL_WINDOWEVENT_LEAVE:
+              window->move_cursor(-1, -1);
+              break;
+
+            case SDL_WINDOWEVENT_FOCUS_GAINED:
+              focused_window_id = event.window.windowID;
+              break;
+
+            case SDL_WINDOWEVENT_CLOSE:
+              // SDL only sends `SDL_QUIT` once the last window is closed
+              close_window(event.window.windowID);
+              break;
+
+            case SDL_WINDOWEVENT_ICCPROF_CHANGED:
+              window->refresh_display_profile();
+              break;
           }
         } break;
 
@@ -186,18 +538,114 @@ void Application::run_main_loop() {
       }
     }
 
-    if (window != nullptr) {
-      window->render();
+    memory_governor->poll();
+
+    for (const auto& item : windows) {
+      item.second->render();
     }
   }
 }
 
 std::shared_ptr<Window> Application::create_main_window(const WindowOptions& options) {
-  if (window != nullptr) {
+  if (!windows.empty()) {
     throw new MonoklError("Application already has a main window.");
   }
 
-  Window* window = new Window(*this, options);
-  this->window.reset(window);
-  return this->window;
+  auto window = add_window(options);
+
+  finish_initialization();
+
+  if (pending_startup_playlist.valid()) {
+    open_startup_paths(*window);
+    window->startup_image_pending = true;
+  } else if (settings->restore_session) {
+    window->restore_session();
+    window->startup_image_pending = true;
+  }
+
+  return window;
+}
+
+std::shared_ptr<Window> Application::create_window(const WindowOptions& options, const Window& source) {
+  finish_initialization();
+
+  auto window = add_window(options);
+  window->open_like(source);
+  return window;
+}
+
+std::shared_ptr<Window> Application::add_window(const WindowOptions& options) {
+  std::shared_ptr<Window> window(new Window(*this, options));
+  windows[window->id] = window;
+  focused_window_id = window->id;
+  decode_cache->set_capacity(DecodeCache::IMAGES_PER_WINDOW * windows.size());
+  log_debug("Opened window %u, %lu open", window->id, windows.size());
+  return window;
+}
+
+void Application::close_window(unsigned int window_id) {
+  auto it = windows.find(window_id);
+  if (it == windows.end()) {
+    return;
+  }
+
+  // Saves its session, the last window closed is what's restored next time
+  windows.erase(it);
+  decode_cache->set_capacity(DecodeCache::IMAGES_PER_WINDOW * std::max<size_t>(1, windows.size()));
+  decode_cache->trim(memory_governor);
+  if (focused_window_id == window_id) {
+    focused_window_id = windows.empty() ? 0 : windows.begin()->first;
+  }
+  log_debug("Closed window %u, %lu open", window_id, windows.size());
+}
+
+Window* Application::find_window(const SDL_Event& event) const {
+  unsigned int window_id = 0;
+  switch (event.type) {
+    case SDL_KEYDOWN:
+    case SDL_KEYUP:
+      window_id = event.key.windowID;
+      break;
+    case SDL_TEXTINPUT:
+      window_id = event.text.windowID;
+      break;
+    case SDL_MOUSEMOTION:
+      window_id = event.motion.windowID;
+      break;
+    case SDL_MOUSEBUTTONDOWN:
+    case SDL_MOUSEBUTTONUP:
+      window_id = event.button.windowID;
+      break;
+    case SDL_MOUSEWHEEL:
+      window_id = event.wheel.windowID;
+      break;
+    case SDL_WINDOWEVENT:
+      window_id = event.window.windowID;
+      break;
+    case SDL_DROPBEGIN:
+    case SDL_DROPFILE:
+    case SDL_DROPCOMPLETE:
+      window_id = event.drop.windowID;
+      break;
+  }
+
+  // Events that aren't tied to a window, like drops on some platforms, go to the focused one
+  auto it = windows.find(window_id != 0 ? window_id : focused_window_id);
+  return it != windows.end() ? it->second.get() : nullptr;
+}
+
+void Application::open_window_like(const Window& source) {
+  // Cascaded from the window it was opened from, so it doesn't land right on top of it
+  WindowOptions options;
+  SDL_GetWindowPosition(source.window, &options.x, &options.y);
+  SDL_GetWindowSize(source.window, &options.width, &options.height);
+  options.x += NEW_WINDOW_OFFSET;
+  options.y += NEW_WINDOW_OFFSET;
+  options.centered = false;
+
+  try {
+    create_window(options, source);
+  } catch (const MonoklError& e) {
+    log_error("Failed to open another window: %s", e.what());
+  }
 }
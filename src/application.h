@@ -5,6 +5,10 @@
 #include <string>
 #include <filesystem>
 #include <set>
+#include <map>
+#include <vector>
+#include <future>
+#include <chrono>
 
 #include <fmt/format.h>
 
@@ -28,31 +32,75 @@
 #include "error.h"
 #include "window.h"
 #include "util.h"
+#include "memory_governor.h"
+#include "instrumentation.h"
+#include "color.h"
+#include "decoder.h"
+#include "metadata_store.h"
+#include "persistence_writer.h"
+#include "batch_export.h"
+#include "viewport_compositor.h"
+#include "decode_cache.h"
 
 namespace monokl {
 
 struct ApplicationSettings {
   PlaylistOptions playlist_options;
+  MemoryGovernorOptions memory_options;
+  ExportOptions export_options;
+  RenderOptions render_options;
+  bool color_management = true;
+  bool restore_session = true;
+  bool central_metadata = false;
+  // Messages are also appended to this file when it's set
+  std::filesystem::path log_file;
 
   static ApplicationSettings load();
   static std::filesystem::path get_settings_path();
+  static std::filesystem::path get_data_dir();
   void save();
 };
 
 class Application {
 public:
-  Application();
+  explicit Application(const std::vector<std::string>& paths = {});
   ~Application();
 
   void run_main_loop();
 
+  // The first window, it shows the paths given on the command line or the restored session
   std::shared_ptr<Window> create_main_window(const WindowOptions& options);
+  // Another window, showing what `source` shows with a playlist of its own
+  std::shared_ptr<Window> create_window(const WindowOptions& options, const Window& source);
   std::shared_ptr<ApplicationSettings> get_settings() const;
+  std::shared_ptr<MemoryGovernor> get_memory_governor() const;
+  std::shared_ptr<ColorManager> get_color_manager() const;
+  std::shared_ptr<DecodeCache> get_decode_cache() const;
+  std::chrono::steady_clock::time_point get_started_at() const;
 
 private:
+  std::chrono::steady_clock::time_point started_at;
+  std::shared_future<ApplicationSettings> pending_settings;
+  std::future<void> codec_preload;
+  std::future<std::shared_ptr<Playlist>> pending_startup_playlist;
+  std::future<sail::image> pending_startup_frame;
+  std::string startup_frame_path;
+
+  void finish_initialization();
+  void open_startup_paths(Window& window);
+
   unsigned int focused_window_id = 0;
-  std::shared_ptr<Window> window = nullptr;
+  // By SDL window ID. Decodes, memory and worker threads are shared between them
+  std::map<unsigned int, std::shared_ptr<Window>> windows;
+  std::shared_ptr<Window> add_window(const WindowOptions& options);
+  void close_window(unsigned int window_id);
+  // The window an event is meant for, or `nullptr` if it was closed in the meantime
+  Window* find_window(const SDL_Event& event) const;
+  void open_window_like(const Window& source);
   std::shared_ptr<ApplicationSettings> settings;
+  std::shared_ptr<MemoryGovernor> memory_governor;
+  std::shared_ptr<ColorManager> color_manager;
+  std::shared_ptr<DecodeCache> decode_cache;
 };
 
 }
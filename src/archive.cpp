@@ -0,0 +1,326 @@
+#include "archive.h"
+#include "util.h"
+#include "logging.h"
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <ctime>
+#include <cstring>
+
+#include <zlib.h>
+
+using namespace monokl;
+
+static const uint32_t END_OF_CENTRAL_DIRECTORY_SIGNATURE = 0x06054b50;
+static const uint32_t ZIP64_END_OF_CENTRAL_DIRECTORY_SIGNATURE = 0x06064b50;
+static const uint32_t ZIP64_LOCATOR_SIGNATURE = 0x07064b50;
+static const uint32_t CENTRAL_HEADER_SIGNATURE = 0x02014b50;
+static const uint32_t LOCAL_HEADER_SIGNATURE = 0x04034b50;
+
+static const size_t END_OF_CENTRAL_DIRECTORY_SIZE = 22;
+static const size_t ZIP64_LOCATOR_SIZE = 20;
+static const size_t ZIP64_END_OF_CENTRAL_DIRECTORY_SIZE = 56;
+static const size_t CENTRAL_HEADER_SIZE = 46;
+static const size_t LOCAL_HEADER_SIZE = 30;
+static const size_t MAX_COMMENT_SIZE = 0xFFFF;
+
+static const uint16_t METHOD_STORED = 0;
+static const uint16_t METHOD_DEFLATED = 8;
+static const uint16_t FLAG_ENCRYPTED = 1;
+static const uint16_t EXTRA_ZIP64 = 0x0001;
+
+// ZIP is little endian regardless of the machine reading it
+static uint16_t read_u16(const uint8_t* p) {
+  return static_cast<uint16_t>(p[0] | (p[1] << 8));
+}
+
+static uint32_t read_u32(const uint8_t* p) {
+  return static_cast<uint32_t>(p[0]) | (static_cast<uint32_t>(p[1]) << 8) | (static_cast<uint32_t>(p[2]) << 16) | (static_cast<uint32_t>(p[3]) << 24);
+}
+
+static uint64_t read_u64(const uint8_t* p) {
+  return static_cast<uint64_t>(read_u32(p)) | (static_cast<uint64_t>(read_u32(p + 4)) << 32);
+}
+
+// DOS timestamps are local time with two second resolution
+static int64_t dos_time_to_file_time(uint16_t time, uint16_t date) {
+  std::tm tm = {};
+  tm.tm_year = ((date >> 9) & 0x7F) + 80;
+  tm.tm_mon = ((date >> 5) & 0x0F) - 1;
+  tm.tm_mday = date & 0x1F;
+  tm.tm_hour = time >> 11;
+  tm.tm_min = (time >> 5) & 0x3F;
+  tm.tm_sec = (time & 0x1F) * 2;
+  tm.tm_isdst = -1;
+
+  std::time_t seconds = std::mktime(&tm);
+  if (seconds == static_cast<std::time_t>(-1)) {
+    return 0;
+  }
+
+  // The filesystem clock doesn't necessarily share the system clock's epoch
+  auto system_now = std::chrono::system_clock::now();
+  auto file_now = std::filesystem::file_time_type::clock::now();
+  auto file_time = file_now + std::chrono::duration_cast<std::filesystem::file_time_type::duration>(std::chrono::system_clock::from_time_t(seconds) - system_now);
+  return std::chrono::duration_cast<std::chrono::milliseconds>(file_time.time_since_epoch()).count();
+}
+
+std::shared_ptr<Archive> Archive::open(const std::filesystem::path& path) {
+  auto t0 = std::chrono::high_resolution_clock::now();
+
+  std::shared_ptr<Archive> archive(new Archive());
+  archive->path = path;
+  archive->file = MappedFile::open(path);
+  if (archive->file == nullptr || !archive->read_central_directory()) {
+    log_warn("Failed to read archive %s", path.string().c_str());
+    return nullptr;
+  }
+
+  auto t1 = std::chrono::high_resolution_clock::now();
+  auto duration_ms = static_cast<long long int>(std::chrono::duration_cast<std::chrono::milliseconds>(t1 - t0).count());
+  log_debug("Indexed %lu images in archive %s in %lld ms", archive->members.size(), path.string().c_str(), duration_ms);
+
+  return archive;
+}
+
+bool Archive::is_archive(const std::filesystem::path& path) {
+  auto extension = path.extension().string();
+  std::transform(extension.begin(), extension.end(), extension.begin(), [](unsigned char c) {
+    return static_cast<char>(std::tolower(c));
+  });
+  return extension == ".zip" || extension == ".cbz";
+}
+
+const std::filesystem::path& Archive::get_path() const {
+  return path;
+}
+
+const std::vector<ArchiveMember>& Archive::get_members() const {
+  return members;
+}
+
+const ArchiveMember* Archive::find(const std::string& name) const {
+  auto it = member_index.find(name);
+  return it != member_index.end() ? &members[it->second] : nullptr;
+}
+
+bool Archive::read_central_directory() {
+  const uint8_t* data = file->data();
+  size_t size = file->size();
+  if (size < END_OF_CENTRAL_DIRECTORY_SIZE) {
+    return false;
+  }
+
+  // The end record sits before a comment of up to 64K, so it's searched for backwards
+  size_t lowest = size > END_OF_CENTRAL_DIRECTORY_SIZE + MAX_COMMENT_SIZE ? size - END_OF_CENTRAL_DIRECTORY_SIZE - MAX_COMMENT_SIZE : 0;
+  size_t end_offset = SIZE_MAX;
+  for (size_t offset = size - END_OF_CENTRAL_DIRECTORY_SIZE + 1; offset-- > lowest;) {
+    if (read_u32(data + offset) == END_OF_CENTRAL_DIRECTORY_SIGNATURE) {
+      end_offset = offset;
+      break;
+    }
+  }
+  if (end_offset == SIZE_MAX) {
+    return false;
+  }
+
+  uint64_t entry_count = read_u16(data + end_offset + 10);
+  uint64_t directory_size = read_u32(data + end_offset + 12);
+  uint64_t directory_offset = read_u32(data + end_offset + 16);
+
+  // Archives past 4 GB or 65535 entries keep the real values in the ZIP64 end record
+  if (end_offset >= ZIP64_LOCATOR_SIZE && read_u32(data + end_offset - ZIP64_LOCATOR_SIZE) == ZIP64_LOCATOR_SIGNATURE) {
+    uint64_t zip64_offset = read_u64(data + end_offset - ZIP64_LOCATOR_SIZE + 8);
+    if (size < ZIP64_END_OF_CENTRAL_DIRECTORY_SIZE || zip64_offset > size - ZIP64_END_OF_CENTRAL_DIRECTORY_SIZE || read_u32(data + zip64_offset) != ZIP64_END_OF_CENTRAL_DIRECTORY_SIGNATURE) {
+      return false;
+    }
+    entry_count = read_u64(data + zip64_offset + 32);
+    directory_size = read_u64(data + zip64_offset + 40);
+    directory_offset = read_u64(data + zip64_offset + 48);
+  }
+
+  if (directory_offset > size || directory_size > size - directory_offset) {
+    return false;
+  }
+
+  members.reserve(static_cast<size_t>(std::min<uint64_t>(entry_count, directory_size / CENTRAL_HEADER_SIZE)));
+
+  const uint8_t* p = data + directory_offset;
+  const uint8_t* end = p + directory_size;
+  uint32_t last_timestamp = UINT32_MAX;
+  int64_t last_modified_at = 0;
+  for (uint64_t i = 0; i < entry_count; i++) {
+    if (end - p < static_cast<ptrdiff_t>(CENTRAL_HEADER_SIZE) || read_u32(p) != CENTRAL_HEADER_SIGNATURE) {
+      return false;
+    }
+
+    uint16_t flags = read_u16(p + 8);
+    uint16_t method = read_u16(p + 10);
+    uint16_t time = read_u16(p + 12);
+    uint16_t date = read_u16(p + 14);
+    uint32_t crc32 = read_u32(p + 16);
+    uint64_t compressed_size = read_u32(p + 20);
+    uint64_t uncompressed_size = read_u32(p + 24);
+    uint16_t name_length = read_u16(p + 28);
+    uint16_t extra_length = read_u16(p + 30);
+    uint16_t comment_length = read_u16(p + 32);
+    uint64_t local_header_offset = read_u32(p + 42);
+
+    size_t record_size = CENTRAL_HEADER_SIZE + name_length + extra_length + comment_length;
+    if (end - p < static_cast<ptrdiff_t>(record_size)) {
+      return false;
+    }
+
+    std::string name(reinterpret_cast<const char*>(p + CENTRAL_HEADER_SIZE), name_length);
+
+    // Only the fields that overflowed their 32 bits are in the ZIP64 extra field, in this order
+    const uint8_t* extra = p + CENTRAL_HEADER_SIZE + name_length;
+    const uint8_t* extra_end = extra + extra_length;
+    while (extra_end - extra >= 4) {
+      uint16_t id = read_u16(extra);
+      uint16_t length = read_u16(extra + 2);
+      const uint8_t* field = extra + 4;
+      const uint8_t* field_end = std::min(field + length, extra_end);
+      if (id == EXTRA_ZIP64) {
+        if (uncompressed_size == UINT32_MAX && field_end - field >= 8) {
+          uncompressed_size = read_u64(field);
+          field += 8;
+        }
+        if (compressed_size == UINT32_MAX && field_end - field >= 8) {
+          compressed_size = read_u64(field);
+          field += 8;
+        }
+        if (local_header_offset == UINT32_MAX && field_end - field >= 8) {
+          local_header_offset = read_u64(field);
+        }
+      }
+      extra = field_end;
+    }
+
+    p += record_size;
+
+    bool is_directory = !name.empty() && name.back() == '/';
+    bool is_supported = (method == METHOD_STORED || method == METHOD_DEFLATED) && (flags & FLAG_ENCRYPTED) == 0;
+    // macOS adds resource forks as `__MACOSX/._name`, which carry the image's extension too
+    bool is_resource_fork = name.rfind("__MACOSX/", 0) == 0;
+    if (is_directory || !is_supported || is_resource_fork || !Util::is_valid_image(std::filesystem::u8path(name))) {
+      continue;
+    }
+
+    // The data follows the local header, whose extra field may differ from the central one
+    if (local_header_offset > size - LOCAL_HEADER_SIZE || read_u32(data + local_header_offset) != LOCAL_HEADER_SIGNATURE) {
+      continue;
+    }
+    uint64_t data_offset = local_header_offset + LOCAL_HEADER_SIZE + read_u16(data + local_header_offset + 26) + read_u16(data + local_header_offset + 28);
+    if (data_offset > size || compressed_size > size - data_offset) {
+      continue;
+    }
+
+    ArchiveMember member;
+    member.name = std::move(name);
+    member.data_offset = data_offset;
+    member.compressed_size = compressed_size;
+    member.uncompressed_size = uncompressed_size;
+    member.crc32 = crc32;
+    member.method = method;
+    // Members are mostly written within seconds of each other, and `mktime` is slow enough to notice
+    uint32_t timestamp = (static_cast<uint32_t>(date) << 16) | time;
+    if (timestamp != last_timestamp) {
+      last_timestamp = timestamp;
+      last_modified_at = dos_time_to_file_time(time, date);
+    }
+    member.last_modified_at = last_modified_at;
+
+    member_index.emplace(member.name, members.size());
+    members.push_back(std::move(member));
+  }
+
+  return true;
+}
+
+bool Archive::read(const std::string& name, ArchiveData& out, const std::shared_ptr<MemoryGovernor>& governor) const {
+  const ArchiveMember* member = find(name);
+  if (member == nullptr) {
+    log_error("No member %s in archive %s", name.c_str(), path.string().c_str());
+    return false;
+  }
+
+  const uint8_t* compressed = file->data() + member->data_offset;
+
+  if (member->method == METHOD_STORED) {
+    out.data = compressed;
+    out.size = static_cast<size_t>(member->compressed_size);
+    return true;
+  }
+
+  auto t0 = std::chrono::high_resolution_clock::now();
+
+  // The sizes come from the central directory, which is whatever the archive says
+  uint64_t size = member->uncompressed_size;
+  if (size > MAX_INFLATED_SIZE || size > member->compressed_size * MAX_DEFLATE_RATIO + 1024 || (governor != nullptr && size > governor->budget())) {
+    log_error("Refusing to inflate %s in archive %s, it claims %llu bytes from %llu", name.c_str(), path.string().c_str(),
+              static_cast<unsigned long long>(size), static_cast<unsigned long long>(member->compressed_size));
+    return false;
+  }
+
+  // Raw deflate, without a zlib header; pages of the mapping are only read as the inflater gets to them
+  try {
+    out.lease = MemoryLease(governor, MemoryCategoryDecodedImages, size);
+    out.inflated.resize(static_cast<size_t>(size));
+  } catch (const std::exception& e) {
+    log_error("Failed to allocate %llu bytes for %s in archive %s: %s", static_cast<unsigned long long>(size), name.c_str(), path.string().c_str(), e.what());
+    out.lease.reset();
+    return false;
+  }
+
+  z_stream stream = {};
+  if (inflateInit2(&stream, -MAX_WBITS) != Z_OK) {
+    return false;
+  }
+
+  uint64_t consumed = 0;
+  uint64_t produced = 0;
+  int status = Z_OK;
+  while (status == Z_OK) {
+    // zlib counts in 32 bits, so anything bigger goes through in slices
+    stream.next_in = const_cast<Bytef*>(compressed + consumed);
+    stream.avail_in = static_cast<uInt>(std::min<uint64_t>(member->compressed_size - consumed, UINT32_MAX));
+    stream.next_out = out.inflated.data() + produced;
+    stream.avail_out = static_cast<uInt>(std::min<uint64_t>(member->uncompressed_size - produced, UINT32_MAX));
+
+    uInt available_in = stream.avail_in;
+    uInt available_out = stream.avail_out;
+    status = inflate(&stream, Z_NO_FLUSH);
+    consumed += available_in - stream.avail_in;
+    produced += available_out - stream.avail_out;
+
+    if (status == Z_OK && available_in == stream.avail_in && available_out == stream.avail_out) {
+      status = Z_BUF_ERROR;
+    }
+  }
+  inflateEnd(&stream);
+
+  if (status != Z_STREAM_END || produced != member->uncompressed_size) {
+    log_error("Failed to inflate %s in archive %s", name.c_str(), path.string().c_str());
+    std::vector<uint8_t>().swap(out.inflated);
+    out.lease.reset();
+    return false;
+  }
+
+  if (crc32_z(0L, out.inflated.data(), out.inflated.size()) != member->crc32) {
+    log_error("Checksum mismatch for %s in archive %s", name.c_str(), path.string().c_str());
+    std::vector<uint8_t>().swap(out.inflated);
+    out.lease.reset();
+    return false;
+  }
+
+  out.data = out.inflated.data();
+  out.size = out.inflated.size();
+
+  auto t1 = std::chrono::high_resolution_clock::now();
+  auto duration_ms = static_cast<long long int>(std::chrono::duration_cast<std::chrono::milliseconds>(t1 - t0).count());
+  log_debug("Inflated %s (%lu bytes) in %lld ms", name.c_str(), out.size, duration_ms);
+
+  return true;
+}
@@ -0,0 +1,76 @@
+#ifndef MONOKL__ARCHIVE_H
+#define MONOKL__ARCHIVE_H
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <filesystem>
+#include <cstdint>
+#include <cstddef>
+
+#include "mapped_file.h"
+#include "memory_governor.h"
+
+namespace monokl {
+
+struct ArchiveMember {
+  // Path inside the archive, with `/` separators
+  std::string name;
+  uint64_t data_offset = 0;
+  uint64_t compressed_size = 0;
+  uint64_t uncompressed_size = 0;
+  uint32_t crc32 = 0;
+  uint16_t method = 0;
+  // Milliseconds since the filesystem clock's epoch, like `PlaylistEntry::last_modified_at`
+  int64_t last_modified_at = 0;
+};
+
+struct ArchiveData {
+  const uint8_t* data = nullptr;
+  size_t size = 0;
+  // Only used by compressed members, stored ones point straight into the mapping
+  std::vector<uint8_t> inflated;
+  MemoryLease lease;
+};
+
+/**
+ * A ZIP (or CBZ) file that is read in place. The archive is memory mapped and its central
+ * directory indexed once on open; reading a stored member then costs nothing, and a deflated
+ * one is inflated straight from the mapping into a buffer of its final size.
+ */
+class Archive {
+public:
+  // Larger than any image a codec here would decode
+  static const uint64_t MAX_INFLATED_SIZE = 1ull << 30;
+  // Deflate can't do better than about 1032:1, bigger claims come from a broken or hostile archive
+  static const uint64_t MAX_DEFLATE_RATIO = 1032;
+
+  // Returns `nullptr` when the file can't be mapped or has no readable central directory
+  static std::shared_ptr<Archive> open(const std::filesystem::path& path);
+  // Goes by the extension only, like `Util::is_valid_image`
+  static bool is_archive(const std::filesystem::path& path);
+
+  const std::filesystem::path& get_path() const;
+  // Members that look like images, in the order of the central directory
+  const std::vector<ArchiveMember>& get_members() const;
+  const ArchiveMember* find(const std::string& name) const;
+
+  // Members claiming more than `MAX_INFLATED_SIZE`, the memory budget or what deflate can
+  // possibly produce from their compressed size are refused rather than allocated for
+  bool read(const std::string& name, ArchiveData& out, const std::shared_ptr<MemoryGovernor>& governor = nullptr) const;
+
+private:
+  Archive() = default;
+
+  std::filesystem::path path;
+  std::unique_ptr<MappedFile> file;
+  std::vector<ArchiveMember> members;
+  std::unordered_map<std::string, size_t> member_index;
+
+  bool read_central_directory();
+};
+
+}
+
+#endif
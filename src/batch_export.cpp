@@ -0,0 +1,345 @@
+#include "batch_export.h"
+#include "bounded_queue.h"
+#include "decoder.h"
+#include "paged_document.h"
+#include "resize.h"
+#include "instrumentation.h"
+#include "parallel.h"
+#include "io_scheduler.h"
+#include "util.h"
+#include "logging.h"
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <fstream>
+#include <set>
+#include <thread>
+
+#include <sail-c++/image_input.h>
+#include <sail-c++/image_output.h>
+#include <sail-c++/codec_info.h>
+#include <sail-c++/save_options.h>
+
+using namespace monokl;
+
+// Images waiting between two stages, per worker of the stage that takes them
+static const size_t QUEUED_PER_WORKER = 2;
+
+struct ReadItem {
+  size_t job = 0;
+  // Empty for archive members and later pages, which are read by the decoders
+  std::vector<uint8_t> bytes;
+};
+
+struct EncodeItem {
+  size_t job = 0;
+  std::shared_ptr<ImageBuffer> pixels;
+};
+
+std::filesystem::path ExportOptions::get_directory() const {
+  if (!directory.empty()) {
+    return directory;
+  }
+  return Util::get_user_home_dir() / "Pictures" / "monokl";
+}
+
+const char* monokl::export_format_name(ExportFormat format) {
+  switch (format) {
+    case ExportFormatWebp:
+      return "webp";
+    default:
+      return "jpeg";
+  }
+}
+
+ExportFormat monokl::parse_export_format(const std::string& name) {
+  return name == "webp" ? ExportFormatWebp : ExportFormatJpeg;
+}
+
+static const char* export_extension(ExportFormat format) {
+  return format == ExportFormatWebp ? ".webp" : ".jpg";
+}
+
+static bool read_file(const std::filesystem::path& path, std::vector<uint8_t>& bytes) {
+  std::ifstream file(path, std::ios::binary | std::ios::ate);
+  if (!file) {
+    return false;
+  }
+
+  auto size = file.tellg();
+  if (size <= 0) {
+    return false;
+  }
+
+  bytes.resize(static_cast<size_t>(size));
+  file.seekg(0);
+  return static_cast<bool>(file.read(reinterpret_cast<char*>(bytes.data()), size));
+}
+
+static bool encode(const ImageBuffer& pixels, const std::filesystem::path& target, const ExportOptions& options) {
+  sail::image image(const_cast<uint32_t*>(pixels.pixels.data()), SAIL_PIXEL_FORMAT_BPP32_RGBA, pixels.width, pixels.height);
+
+  // JPEG has no alpha channel
+  if (options.format == ExportFormatJpeg && image.convert(SAIL_PIXEL_FORMAT_BPP24_RGB) != SAIL_OK) {
+    return false;
+  }
+
+  auto codec = sail::codec_info::from_path(target.string());
+  sail::save_options save_options;
+  if (!codec.is_valid() || codec.save_features().to_options(&save_options) != SAIL_OK) {
+    log_error("No codec to export %s with", target.string().c_str());
+    return false;
+  }
+  // SAIL's compression level runs the other way, 0 is the best quality
+  save_options.set_compression_level(100.0 - std::min(options.quality, 100u));
+
+  sail::image_output output(target.string());
+  output.with(save_options);
+  return output.next_frame(image) == SAIL_OK && output.finish() == SAIL_OK;
+}
+
+BatchExport::BatchExport(const std::shared_ptr<MemoryGovernor>& governor, const std::shared_ptr<ColorManager>& color_manager)
+  : governor(governor), color_manager(color_manager) {
+}
+
+BatchExport::~BatchExport() {
+  cancel();
+  if (job.valid()) {
+    job.wait();
+  }
+}
+
+void BatchExport::start(const std::vector<std::shared_ptr<ImageEntry>>& entries, const ExportOptions& options) {
+  cancel();
+  if (job.valid()) {
+    job.wait();
+  }
+
+  auto directory = options.get_directory();
+  std::error_code error;
+  std::filesystem::create_directories(directory, error);
+  if (error) {
+    log_error("Failed to create export directory %s: %s", directory.string().c_str(), error.message().c_str());
+    return;
+  }
+
+  // Names are picked up front, so images with the same name from different folders don't overwrite each other
+  std::vector<ExportJob> jobs;
+  jobs.reserve(entries.size());
+  std::set<std::string> names;
+  for (const auto& entry : entries) {
+    ExportJob export_job;
+    export_job.entry = entry;
+
+    std::string stem = entry->member.empty() ? entry->path.stem().u8string() : std::filesystem::u8path(entry->member).stem().u8string();
+    if (entry->page > 0) {
+      stem += "-p" + std::to_string(entry->page + 1);
+    }
+
+    std::string name = stem + export_extension(options.format);
+    for (int copy = 2; ; copy++) {
+      std::string key = name;
+      std::transform(key.begin(), key.end(), key.begin(), [](unsigned char c) {
+        return static_cast<char>(std::tolower(c));
+      });
+      if (names.insert(key).second) {
+        break;
+      }
+      name = stem + "-" + std::to_string(copy) + export_extension(options.format);
+    }
+    export_job.target = directory / std::filesystem::u8path(name);
+
+    if (!entry->member.empty() && entry->parent != nullptr) {
+      export_job.archive = entry->parent->get_archive();
+    }
+
+    jobs.push_back(std::move(export_job));
+  }
+
+  cancelled = false;
+  finished = 0;
+  failed = 0;
+  total = jobs.size();
+  job = std::async(std::launch::async, &BatchExport::run, this, std::move(jobs), options);
+}
+
+void BatchExport::cancel() {
+  cancelled = true;
+}
+
+bool BatchExport::is_running() const {
+  return job.valid() && job.wait_for(std::chrono::seconds(0)) != std::future_status::ready;
+}
+
+size_t BatchExport::finished_count() const {
+  return finished;
+}
+
+size_t BatchExport::failed_count() const {
+  return failed;
+}
+
+size_t BatchExport::total_count() const {
+  return total;
+}
+
+void BatchExport::run(std::vector<ExportJob> jobs, ExportOptions options) {
+  auto t0 = std::chrono::high_resolution_clock::now();
+
+  // Encoding a downscaled image takes a fraction of decoding the original, so most cores decode
+  size_t workers = parallel_worker_count();
+  size_t encoders = std::max<size_t>(1, workers / 4);
+  size_t decoders = std::max<size_t>(1, workers - encoders);
+  // Every decoder holds a full size image, so they're cut down when memory is already tight
+  if (governor != nullptr && governor->should_downscale_inactive()) {
+    decoders = 1;
+  }
+
+  BoundedQueue<ReadItem> read_queue(decoders * QUEUED_PER_WORKER);
+  BoundedQueue<EncodeItem> encode_queue(encoders * QUEUED_PER_WORKER);
+
+  auto fail = [&](size_t index, const char* stage) {
+    log_error("Failed to %s %s for export", stage, jobs[index].entry->path.string().c_str());
+    failed++;
+    finished++;
+  };
+
+  std::thread reader([&]() {
+    for (size_t index = 0; index < jobs.size() && !cancelled; index++) {
+      ReadItem item;
+      item.job = index;
+      const auto& entry = jobs[index].entry;
+      if (entry->member.empty() && entry->page == 0) {
+        ScopedTimer timer("export.read");
+        // Read ahead of the decoders, after the image on screen but before background hashing
+        auto path = entry->path;
+        std::function<std::vector<uint8_t>()> read = [path]() {
+          std::vector<uint8_t> bytes;
+          if (!read_file(path, bytes)) {
+            throw MonoklError("Failed to read the file");
+          }
+          return bytes;
+        };
+        if (!IoScheduler::get().run(path, IoPriorityPrefetch, IoScheduler::READ_TIMEOUT, read, item.bytes)) {
+          fail(index, "read");
+          continue;
+        }
+      }
+      if (!read_queue.push(std::move(item))) {
+        break;
+      }
+    }
+    read_queue.close();
+  });
+
+  // Review sites and browsers mostly ignore ICC profiles, and the files are written untagged, so
+  // wide gamut images are converted to sRGB rather than left looking washed out
+  auto srgb = std::make_shared<const ColorProfile>();
+
+  auto decode = [&]() {
+    DecodeContext context;
+    context.governor = governor;
+    context.color_manager = color_manager;
+    context.display_profile = srgb;
+
+    ReadItem item;
+    while (read_queue.pop(item)) {
+      // Whatever is still queued is drained without being worked on
+      if (cancelled) {
+        continue;
+      }
+
+      ScopedTimer timer("export.decode");
+      const auto& export_job = jobs[item.job];
+      const auto& entry = export_job.entry;
+
+      sail::image image;
+      if (entry->page > 0) {
+        auto document = PagedDocument::open(entry->path);
+        image = document != nullptr ? document->read_page(entry->page) : sail::image();
+      } else if (export_job.archive != nullptr) {
+        image = ImageDecoder::read_first_frame(*export_job.archive, entry->member, governor);
+      } else {
+        sail::image_input input(item.bytes.data(), item.bytes.size());
+        image = input.next_frame();
+      }
+      std::vector<uint8_t>().swap(item.bytes);
+
+      auto decoded = ImageDecoder::decode(image, entry->path.string(), context);
+      if (decoded == nullptr) {
+        fail(item.job, "decode");
+        continue;
+      }
+
+      EncodeItem encode_item;
+      encode_item.job = item.job;
+      encode_item.pixels = decoded->pixels;
+
+      unsigned int width = decoded->pixels->width;
+      unsigned int height = decoded->pixels->height;
+      unsigned int longest = std::max(width, height);
+      if (options.max_size > 0 && longest > options.max_size) {
+        auto resized = std::make_shared<ImageBuffer>();
+        resize_image(*decoded->pixels,
+            *resized,
+            std::max(1u, static_cast<unsigned int>(static_cast<uint64_t>(width) * options.max_size / longest)),
+            std::max(1u, static_cast<unsigned int>(static_cast<uint64_t>(height) * options.max_size / longest)));
+        resized->lease = MemoryLease(governor, MemoryCategoryDecodedImages, resized->size_in_bytes());
+        encode_item.pixels = resized;
+      }
+      decoded.reset();
+
+      if (!encode_queue.push(std::move(encode_item))) {
+        break;
+      }
+    }
+  };
+
+  auto encode_images = [&]() {
+    EncodeItem item;
+    while (encode_queue.pop(item)) {
+      if (cancelled) {
+        continue;
+      }
+
+      ScopedTimer timer("export.encode");
+      const auto& target = jobs[item.job].target;
+      if (!encode(*item.pixels, target, options)) {
+        std::error_code error;
+        std::filesystem::remove(target, error);
+        fail(item.job, "encode");
+        continue;
+      }
+      item.pixels.reset();
+      finished++;
+    }
+  };
+
+  std::vector<std::thread> decode_threads;
+  for (size_t i = 0; i < decoders; i++) {
+    decode_threads.emplace_back(decode);
+  }
+  std::vector<std::thread> encode_threads;
+  for (size_t i = 0; i < encoders; i++) {
+    encode_threads.emplace_back(encode_images);
+  }
+
+  reader.join();
+  for (auto& thread : decode_threads) {
+    thread.join();
+  }
+  encode_queue.close();
+  for (auto& thread : encode_threads) {
+    thread.join();
+  }
+
+  auto t1 = std::chrono::high_resolution_clock::now();
+  auto duration_ms = static_cast<long long int>(std::chrono::duration_cast<std::chrono::milliseconds>(t1 - t0).count());
+  if (cancelled) {
+    log_info("Export cancelled after %lu of %lu images", finished.load(), jobs.size());
+  } else {
+    log_info("Exported %lu of %lu images to %s in %lld ms (%lu decoders, %lu encoders)",
+        finished.load() - failed.load(), jobs.size(), options.get_directory().string().c_str(), duration_ms, decoders, encoders);
+  }
+}
@@ -0,0 +1,83 @@
+#ifndef MONOKL__BATCH_EXPORT_H
+#define MONOKL__BATCH_EXPORT_H
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <future>
+#include <atomic>
+#include <filesystem>
+#include <cstddef>
+
+#include "playlist.h"
+#include "memory_governor.h"
+#include "color.h"
+
+namespace monokl {
+
+typedef enum {
+  ExportFormatJpeg,
+  ExportFormatWebp
+} ExportFormat;
+
+struct ExportOptions {
+  // Empty for `~/Pictures/monokl`, created when the first export starts
+  std::filesystem::path directory;
+  // Longest side of exported images, 0 keeps their size. Images are never upscaled
+  unsigned int max_size = 2048;
+  ExportFormat format = ExportFormatJpeg;
+  // From 0 to 100
+  unsigned int quality = 85;
+
+  std::filesystem::path get_directory() const;
+};
+
+const char* export_format_name(ExportFormat format);
+// Accepts the names `export_format_name` returns, anything else is JPEG
+ExportFormat parse_export_format(const std::string& name);
+
+/**
+ * Exports images as resized JPEG or WebP files through a pipeline of three stages, connected by
+ * bounded queues: files are read by a single thread, so the disk isn't hit by competing reads,
+ * decoded and resized on most cores, and encoded and written on the rest. Every stage blocks once
+ * the next one falls behind, so only a few images per worker are in memory however long the batch.
+ */
+class BatchExport {
+public:
+  // Images are converted to sRGB through `color_manager`, or written as they are without one
+  BatchExport(const std::shared_ptr<MemoryGovernor>& governor, const std::shared_ptr<ColorManager>& color_manager);
+  ~BatchExport();
+
+  // Waits for a previous batch to wind down first
+  void start(const std::vector<std::shared_ptr<ImageEntry>>& entries, const ExportOptions& options);
+  // Returns right away, images already being worked on are finished first
+  void cancel();
+
+  bool is_running() const;
+  // Exported and failed images together
+  size_t finished_count() const;
+  size_t failed_count() const;
+  size_t total_count() const;
+
+private:
+  struct ExportJob {
+    std::shared_ptr<ImageEntry> entry;
+    std::shared_ptr<Archive> archive;
+    std::filesystem::path target;
+  };
+
+  std::shared_ptr<MemoryGovernor> governor;
+  std::shared_ptr<ColorManager> color_manager;
+
+  std::future<void> job;
+  std::atomic<bool> cancelled{false};
+  std::atomic<size_t> finished{0};
+  std::atomic<size_t> failed{0};
+  std::atomic<size_t> total{0};
+
+  void run(std::vector<ExportJob> jobs, ExportOptions options);
+};
+
+}
+
+#endif
@@ -0,0 +1,71 @@
+#ifndef MONOKL__BOUNDED_QUEUE_H
+#define MONOKL__BOUNDED_QUEUE_H
+
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <cstddef>
+
+namespace monokl {
+
+/**
+ * FIFO between pipeline stages. `push` blocks while the queue is full, so a fast stage can't run
+ * ahead of a slow one and pile up work in memory. Once closed, `push` fails and `pop` drains
+ * what's left before failing too.
+ */
+template<typename T>
+class BoundedQueue {
+public:
+  explicit BoundedQueue(size_t capacity) : capacity(capacity > 0 ? capacity : 1) {}
+
+  bool push(T item) {
+    std::unique_lock<std::mutex> lock(mutex);
+    not_full.wait(lock, [this]() { return closed || items.size() < capacity; });
+    if (closed) {
+      return false;
+    }
+    items.push_back(std::move(item));
+    not_empty.notify_one();
+    return true;
+  }
+
+  bool pop(T& item) {
+    std::unique_lock<std::mutex> lock(mutex);
+    not_empty.wait(lock, [this]() { return closed || !items.empty(); });
+    if (items.empty()) {
+      return false;
+    }
+    item = std::move(items.front());
+    items.pop_front();
+    not_full.notify_one();
+    return true;
+  }
+
+  void close() {
+    std::lock_guard<std::mutex> lock(mutex);
+    closed = true;
+    not_full.notify_all();
+    not_empty.notify_all();
+  }
+
+  // Closes the queue and drops whatever is still in it
+  void clear() {
+    std::lock_guard<std::mutex> lock(mutex);
+    closed = true;
+    items.clear();
+    not_full.notify_all();
+    not_empty.notify_all();
+  }
+
+private:
+  size_t capacity;
+  std::mutex mutex;
+  std::condition_variable not_full;
+  std::condition_variable not_empty;
+  std::deque<T> items;
+  bool closed = false;
+};
+
+}
+
+#endif
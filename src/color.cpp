@@ -0,0 +1,241 @@
+#include "color.h"
+#include "simd.h"
+#include "logging.h"
+
+#include <algorithm>
+#include <chrono>
+
+#include <lcms2.h>
+
+using namespace monokl;
+
+// Offsets between neighbouring lattice nodes, in floats
+static const uint32_t NODE_STRIDE_B = 4;
+static const uint32_t NODE_STRIDE_G = ColorLut::GRID_SIZE * NODE_STRIDE_B;
+static const uint32_t NODE_STRIDE_R = ColorLut::GRID_SIZE * NODE_STRIDE_G;
+
+ColorProfile ColorProfile::from_bytes(const void* bytes, size_t size) {
+  ColorProfile profile;
+  if (bytes == nullptr || size == 0) {
+    return profile;
+  }
+
+  auto begin = static_cast<const uint8_t*>(bytes);
+  profile.data.assign(begin, begin + size);
+
+  // FNV-1a, only used to key the LUT cache
+  uint64_t hash = 14695981039346656037ULL;
+  for (size_t i = 0; i < size; i++) {
+    hash ^= begin[i];
+    hash *= 1099511628211ULL;
+  }
+  profile.hash = hash == 0 ? 1 : hash;
+
+  return profile;
+}
+
+bool ColorProfile::is_srgb() const {
+  return data.empty();
+}
+
+ColorLut::ColorLut(std::vector<float> nodes) : nodes(std::move(nodes)) {
+  for (int v = 0; v < 256; v++) {
+    float position = v * (GRID_SIZE - 1) / 255.0f;
+    int index = std::min(static_cast<int>(position), GRID_SIZE - 2);
+    index_of[v] = static_cast<uint32_t>(index);
+    weight_of[v] = position - index;
+  }
+}
+
+size_t ColorLut::size_in_bytes() const {
+  return nodes.size() * sizeof(float);
+}
+
+void ColorLut::apply(uint32_t* pixels, size_t count) const {
+  const float* lattice = nodes.data();
+
+  for (size_t i = 0; i < count; i++) {
+    uint32_t pixel = pixels[i];
+    uint32_t r = pixel & 0xFF;
+    uint32_t g = (pixel >> 8) & 0xFF;
+    uint32_t b = (pixel >> 16) & 0xFF;
+
+    float fr = weight_of[r];
+    float fg = weight_of[g];
+    float fb = weight_of[b];
+
+    const float* c000 = lattice + index_of[r] * NODE_STRIDE_R + index_of[g] * NODE_STRIDE_G + index_of[b] * NODE_STRIDE_B;
+
+    // Pick the tetrahedron the point falls into, by the order of its fractional coordinates
+    uint32_t o1, o2;
+    float w1, w2, w3;
+    if (fr > fg) {
+      if (fg > fb) {
+        o1 = NODE_STRIDE_R; o2 = NODE_STRIDE_R + NODE_STRIDE_G; w1 = fr; w2 = fg; w3 = fb;
+      } else if (fr > fb) {
+        o1 = NODE_STRIDE_R; o2 = NODE_STRIDE_R + NODE_STRIDE_B; w1 = fr; w2 = fb; w3 = fg;
+      } else {
+        o1 = NODE_STRIDE_B; o2 = NODE_STRIDE_R + NODE_STRIDE_B; w1 = fb; w2 = fr; w3 = fg;
+      }
+    } else {
+      if (fb > fg) {
+        o1 = NODE_STRIDE_B; o2 = NODE_STRIDE_G + NODE_STRIDE_B; w1 = fb; w2 = fg; w3 = fr;
+      } else if (fb > fr) {
+        o1 = NODE_STRIDE_G; o2 = NODE_STRIDE_G + NODE_STRIDE_B; w1 = fg; w2 = fb; w3 = fr;
+      } else {
+        o1 = NODE_STRIDE_G; o2 = NODE_STRIDE_R + NODE_STRIDE_G; w1 = fg; w2 = fr; w3 = fb;
+      }
+    }
+
+    const float* c1 = c000 + o1;
+    const float* c2 = c000 + o2;
+    const float* c111 = c000 + NODE_STRIDE_R + NODE_STRIDE_G + NODE_STRIDE_B;
+
+    // Nodes are stored pre-scaled to 0..255, so only rounding and packing is left
+#if defined(MONOKL_SIMD_SSE2)
+    __m128 v000 = _mm_loadu_ps(c000);
+    __m128 v1 = _mm_loadu_ps(c1);
+    __m128 v2 = _mm_loadu_ps(c2);
+    __m128 v111 = _mm_loadu_ps(c111);
+
+    __m128 out = _mm_add_ps(v000, _mm_mul_ps(_mm_sub_ps(v1, v000), _mm_set1_ps(w1)));
+    out = _mm_add_ps(out, _mm_mul_ps(_mm_sub_ps(v2, v1), _mm_set1_ps(w2)));
+    out = _mm_add_ps(out, _mm_mul_ps(_mm_sub_ps(v111, v2), _mm_set1_ps(w3)));
+
+    __m128i rounded = _mm_cvttps_epi32(_mm_add_ps(out, _mm_set1_ps(0.5f)));
+    __m128i words = _mm_packs_epi32(rounded, rounded);
+    __m128i packed = _mm_packus_epi16(words, words);
+    uint32_t rgb = static_cast<uint32_t>(_mm_cvtsi128_si32(packed));
+#elif defined(MONOKL_SIMD_NEON)
+    float32x4_t v000 = vld1q_f32(c000);
+    float32x4_t v1 = vld1q_f32(c1);
+    float32x4_t v2 = vld1q_f32(c2);
+    float32x4_t v111 = vld1q_f32(c111);
+
+    float32x4_t out = vmlaq_n_f32(v000, vsubq_f32(v1, v000), w1);
+    out = vmlaq_n_f32(out, vsubq_f32(v2, v1), w2);
+    out = vmlaq_n_f32(out, vsubq_f32(v111, v2), w3);
+
+    uint32x4_t rounded = vcvtq_u32_f32(vaddq_f32(out, vdupq_n_f32(0.5f)));
+    uint16x4_t narrowed = vqmovn_u32(rounded);
+    uint8x8_t packed = vqmovn_u16(vcombine_u16(narrowed, narrowed));
+    uint32_t rgb = vget_lane_u32(vreinterpret_u32_u8(packed), 0);
+#else
+    uint32_t rgb = 0;
+    for (int c = 0; c < 3; c++) {
+      float value = c000[c] + (c1[c] - c000[c]) * w1 + (c2[c] - c1[c]) * w2 + (c111[c] - c2[c]) * w3;
+      uint32_t byte = static_cast<uint32_t>(std::min(255.0f, std::max(0.0f, value + 0.5f)));
+      rgb |= byte << (c * 8);
+    }
+#endif
+
+    pixels[i] = (rgb & 0x00FFFFFF) | (pixel & 0xFF000000);
+  }
+}
+
+ColorManager::ColorManager(const std::shared_ptr<MemoryGovernor>& governor) : governor(governor) {
+  if (governor != nullptr) {
+    pressure_listener_id = governor->add_listener([this](MemoryPressure pressure) {
+      if (pressure >= MemoryPressureShrinkCaches) {
+        clear_cache();
+      }
+    });
+  }
+}
+
+ColorManager::~ColorManager() {
+  if (governor != nullptr) {
+    governor->remove_listener(pressure_listener_id);
+  }
+}
+
+std::shared_ptr<const ColorLut> ColorManager::get_transform(const ColorProfile& source, const ColorProfile& display) {
+  if (source.hash == display.hash) {
+    return nullptr;
+  }
+
+  auto key = std::make_pair(source.hash, display.hash);
+
+  std::lock_guard<std::mutex> lock(mutex);
+
+  auto it = cache.find(key);
+  if (it != cache.end()) {
+    return it->second.lut;
+  }
+
+  // Failures are cached as well, so a broken profile isn't parsed again for every image
+  CachedLut cached;
+  cached.lut = build_lut(source, display);
+  if (cached.lut != nullptr) {
+    cached.lease = MemoryLease(governor, MemoryCategoryCaches, cached.lut->size_in_bytes());
+  }
+
+  auto lut = cached.lut;
+  cache.emplace(key, std::move(cached));
+  return lut;
+}
+
+void ColorManager::clear_cache() {
+  std::lock_guard<std::mutex> lock(mutex);
+  if (!cache.empty()) {
+    log_debug("Dropping %lu cached color transforms", cache.size());
+    cache.clear();
+  }
+}
+
+std::shared_ptr<ColorLut> ColorManager::build_lut(const ColorProfile& source, const ColorProfile& display) {
+  auto t0 = std::chrono::high_resolution_clock::now();
+
+  cmsHPROFILE source_profile = source.is_srgb() ? cmsCreate_sRGBProfile() : cmsOpenProfileFromMem(source.data.data(), source.data.size());
+  cmsHPROFILE display_profile = display.is_srgb() ? cmsCreate_sRGBProfile() : cmsOpenProfileFromMem(display.data.data(), display.data.size());
+
+  cmsHTRANSFORM transform = nullptr;
+  if (source_profile != nullptr && display_profile != nullptr && cmsGetColorSpace(source_profile) == cmsSigRgbData && cmsGetColorSpace(display_profile) == cmsSigRgbData) {
+    transform = cmsCreateTransform(source_profile, TYPE_RGB_FLT, display_profile, TYPE_RGB_FLT, INTENT_PERCEPTUAL, 0);
+  }
+
+  if (source_profile != nullptr) {
+    cmsCloseProfile(source_profile);
+  }
+  if (display_profile != nullptr) {
+    cmsCloseProfile(display_profile);
+  }
+
+  if (transform == nullptr) {
+    log_warn("Unsupported color profile, images will be shown without color management");
+    return nullptr;
+  }
+
+  const int n = ColorLut::GRID_SIZE;
+  const size_t node_count = static_cast<size_t>(n) * n * n;
+
+  std::vector<float> input(node_count * 3);
+  size_t i = 0;
+  for (int r = 0; r < n; r++) {
+    for (int g = 0; g < n; g++) {
+      for (int b = 0; b < n; b++) {
+        input[i++] = r / static_cast<float>(n - 1);
+        input[i++] = g / static_cast<float>(n - 1);
+        input[i++] = b / static_cast<float>(n - 1);
+      }
+    }
+  }
+
+  std::vector<float> output(node_count * 3);
+  cmsDoTransform(transform, input.data(), output.data(), static_cast<cmsUInt32Number>(node_count));
+  cmsDeleteTransform(transform);
+
+  std::vector<float> nodes(node_count * 4);
+  for (size_t node = 0; node < node_count; node++) {
+    for (int c = 0; c < 3; c++) {
+      nodes[node * 4 + c] = std::min(255.0f, std::max(0.0f, output[node * 3 + c] * 255.0f));
+    }
+    nodes[node * 4 + 3] = 0.0f;
+  }
+
+  auto t1 = std::chrono::high_resolution_clock::now();
+  auto duration_ms = static_cast<long long int>(std::chrono::duration_cast<std::chrono::milliseconds>(t1 - t0).count());
+  log_debug("Built color transform LUT in %lld ms", duration_ms);
+
+  return std::make_shared<ColorLut>(std::move(nodes));
+}
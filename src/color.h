@@ -0,0 +1,78 @@
+#ifndef MONOKL__COLOR_H
+#define MONOKL__COLOR_H
+
+#include <memory>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <utility>
+#include <cstdint>
+#include <cstddef>
+
+#include "orientation.h"
+#include "memory_governor.h"
+
+namespace monokl {
+
+/**
+ * Raw ICC profile bytes plus their hash. An empty profile stands for sRGB, which is what
+ * untagged images and displays without a profile are assumed to be.
+ */
+struct ColorProfile {
+  std::vector<uint8_t> data;
+  uint64_t hash = 0;
+
+  static ColorProfile from_bytes(const void* bytes, size_t size);
+  bool is_srgb() const;
+};
+
+/**
+ * RGB to RGB transform baked into a 33x33x33 lattice, applied with tetrahedral interpolation.
+ * Each lattice node is stored as 4 floats, so the interpolation works on whole nodes as vectors.
+ */
+class ColorLut : public PixelTransform {
+public:
+  static const int GRID_SIZE = 33;
+
+  explicit ColorLut(std::vector<float> nodes);
+
+  void apply(uint32_t* pixels, size_t count) const override;
+  size_t size_in_bytes() const;
+
+private:
+  std::vector<float> nodes;
+  // Lattice offsets and interpolation weights for every possible 8-bit channel value
+  uint32_t index_of[256];
+  float weight_of[256];
+};
+
+/**
+ * Builds and caches one LUT per (source profile, display profile) pair, shared by every window.
+ */
+class ColorManager {
+public:
+  explicit ColorManager(const std::shared_ptr<MemoryGovernor>& governor);
+  ~ColorManager();
+
+  // Returns `nullptr` when no transform is needed, or the profiles can't be used
+  std::shared_ptr<const ColorLut> get_transform(const ColorProfile& source, const ColorProfile& display);
+  void clear_cache();
+
+private:
+  struct CachedLut {
+    std::shared_ptr<const ColorLut> lut;
+    MemoryLease lease;
+  };
+
+  std::shared_ptr<MemoryGovernor> governor;
+  int pressure_listener_id = 0;
+
+  std::mutex mutex;
+  std::map<std::pair<uint64_t, uint64_t>, CachedLut> cache;
+
+  static std::shared_ptr<ColorLut> build_lut(const ColorProfile& source, const ColorProfile& display);
+};
+
+}
+
+#endif
@@ -0,0 +1,103 @@
+#include "decode_cache.h"
+#include "resize.h"
+#include "parallel.h"
+#include "logging.h"
+
+using namespace monokl;
+
+DecodeKey::DecodeKey(const ImageEntry& entry, uint64_t display_profile)
+    : path(entry.path.string()), member(entry.member), page(entry.page), last_modified_at(entry.last_modified_at), display_profile(display_profile) {
+}
+
+bool DecodeKey::operator==(const DecodeKey& other) const {
+  return page == other.page && last_modified_at == other.last_modified_at && display_profile == other.display_profile && path == other.path && member == other.member;
+}
+
+std::shared_ptr<DecodedImage> DecodeCache::find(const DecodeKey& key) {
+  for (auto it = images.begin(); it != images.end(); ++it) {
+    if (it->first == key) {
+      images.splice(images.begin(), images, it);
+      return it->second;
+    }
+  }
+  return nullptr;
+}
+
+void DecodeCache::insert(const DecodeKey& key, const std::shared_ptr<DecodedImage>& image) {
+  if (image == nullptr || image->is_high_bit_depth()) {
+    return;
+  }
+
+  erase(key);
+  images.emplace_front(key, image);
+  while (images.size() > capacity) {
+    images.pop_back();
+  }
+}
+
+void DecodeCache::erase(const DecodeKey& key) {
+  images.remove_if([&key](const auto& item) {
+    return item.first == key;
+  });
+}
+
+void DecodeCache::clear() {
+  images.clear();
+}
+
+// A copy at half the size in each direction, a quarter of the memory
+static std::shared_ptr<DecodedImage> downscale(const DecodedImage& image, const std::shared_ptr<MemoryGovernor>& governor) {
+  const auto& src = *image.pixels;
+  auto halved = std::make_shared<ImageBuffer>();
+  halved->allocate(src.width / 2, src.height / 2);
+  parallel_for(0, halved->height, 64, [&](size_t first, size_t last) {
+    for (size_t y = first; y < last; y++) {
+      halve_rows(src.row(y * 2), src.row(y * 2 + 1), halved->width, halved->row(y));
+    }
+  });
+  halved->lease = MemoryLease(governor, MemoryCategoryDecodedImages, halved->size_in_bytes());
+
+  auto copy = std::make_shared<DecodedImage>();
+  copy->pixels = halved;
+  copy->color_transform = image.color_transform;
+  copy->histogram = image.histogram;
+  copy->downscaled = true;
+  return copy;
+}
+
+void DecodeCache::trim(const std::shared_ptr<MemoryGovernor>& governor) {
+  if (governor == nullptr || !governor->should_downscale_inactive()) {
+    return;
+  }
+
+  if (governor->should_drop_inactive()) {
+    size_t before = images.size();
+    images.remove_if([](const auto& item) {
+      return item.second.use_count() == 1;
+    });
+    if (images.size() < before) {
+      log_debug("Dropped %lu cached decodes, memory is running low", before - images.size());
+    }
+    return;
+  }
+
+  // Images that are still shown somewhere are left alone, halving them wouldn't free anything
+  size_t downscaled = 0;
+  for (auto& item : images) {
+    auto& image = item.second;
+    if (image.use_count() == 1 && !image->downscaled && image->pixels->width >= 2 && image->pixels->height >= 2) {
+      image = downscale(*image, governor);
+      downscaled++;
+    }
+  }
+  if (downscaled > 0) {
+    log_debug("Downscaled %lu cached decodes, memory is running low", downscaled);
+  }
+}
+
+void DecodeCache::set_capacity(size_t capacity) {
+  this->capacity = capacity;
+  while (images.size() > capacity) {
+    images.pop_back();
+  }
+}
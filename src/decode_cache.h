@@ -0,0 +1,59 @@
+#ifndef MONOKL__DECODE_CACHE_H
+#define MONOKL__DECODE_CACHE_H
+
+#include <memory>
+#include <list>
+#include <string>
+#include <utility>
+#include <cstddef>
+#include <cstdint>
+
+#include "playlist.h"
+#include "decoder.h"
+#include "memory_governor.h"
+
+namespace monokl {
+
+// Identifies a decode across windows, whose playlists each have entries of their own
+struct DecodeKey {
+  std::string path;
+  std::string member;
+  uint32_t page = 0;
+  int64_t last_modified_at = 0;
+  // The display transform is baked into the pixels, so windows on different displays decode apart
+  uint64_t display_profile = 0;
+
+  DecodeKey(const ImageEntry& entry, uint64_t display_profile);
+
+  bool operator==(const DecodeKey& other) const;
+};
+
+/**
+ * The last few images decoded by any window, so the panes of compare mode, the single view and
+ * other windows showing the same file share one decode of it and stepping back and forth doesn't
+ * decode again. High bit depth images are tone mapped in place and never kept.
+ */
+class DecodeCache {
+public:
+  // The four panes of compare mode, and the image that was just stepped away from
+  static const size_t IMAGES_PER_WINDOW = 5;
+
+  std::shared_ptr<DecodedImage> find(const DecodeKey& key);
+  void insert(const DecodeKey& key, const std::shared_ptr<DecodedImage>& image);
+  // For images that were changed in place, like rotated ones
+  void erase(const DecodeKey& key);
+  void clear();
+  // Halves every image nothing else holds on to once memory is running low, and drops them once it's nearly gone
+  void trim(const std::shared_ptr<MemoryGovernor>& governor);
+  // Grows and shrinks with the number of windows
+  void set_capacity(size_t capacity);
+
+private:
+  size_t capacity = IMAGES_PER_WINDOW;
+  // Most recently used first
+  std::list<std::pair<DecodeKey, std::shared_ptr<DecodedImage>>> images;
+};
+
+}
+
+#endif
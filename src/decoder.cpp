@@ -0,0 +1,163 @@
+#include "decoder.h"
+#include "orientation.h"
+#include "parallel.h"
+#include "logging.h"
+
+#include <sail-common/status.h>
+
+using namespace monokl;
+
+// Rows tone mapped per work item when a whole image is mapped at once
+static const size_t TONE_MAPPING_BAND_HEIGHT = 64;
+
+static bool is_high_bit_depth_format(SailPixelFormat pixel_format) {
+  switch (pixel_format) {
+    case SAIL_PIXEL_FORMAT_BPP16_GRAYSCALE:
+    case SAIL_PIXEL_FORMAT_BPP32_GRAYSCALE_ALPHA:
+    case SAIL_PIXEL_FORMAT_BPP48_RGB:
+    case SAIL_PIXEL_FORMAT_BPP48_BGR:
+    case SAIL_PIXEL_FORMAT_BPP64_RGBA:
+    case SAIL_PIXEL_FORMAT_BPP64_BGRA:
+    case SAIL_PIXEL_FORMAT_BPP64_ARGB:
+    case SAIL_PIXEL_FORMAT_BPP64_ABGR:
+      return true;
+    default:
+      return false;
+  }
+}
+
+bool DecodedImage::is_high_bit_depth() const {
+  return wide_pixels != nullptr;
+}
+
+void DecodedImage::tone_map(const ToneMappingParams& params, const std::vector<PixelRect>& regions) {
+  if (wide_pixels == nullptr || pixels == nullptr) {
+    return;
+  }
+
+  ToneMapper mapper(params);
+  parallel_for(0, regions.size(), 1, [&](size_t first, size_t last) {
+    for (size_t i = first; i < last; i++) {
+      mapper.map(*wide_pixels, regions[i], *pixels, color_transform.get());
+    }
+  });
+}
+
+std::shared_ptr<DecodedImage> ImageDecoder::decode(const std::string& path, const DecodeContext& context, IoPriority priority) {
+  sail::image image = read_first_frame(path, priority);
+  return decode(image, path, context);
+}
+
+sail::image ImageDecoder::read_first_frame(const std::string& path, IoPriority priority) {
+  sail::image frame;
+  bool read = IoScheduler::get().run<sail::image>(path, priority, IoScheduler::READ_TIMEOUT, [path]() {
+    sail::image_input input(path);
+    return input.next_frame();
+  }, frame);
+  if (!read) {
+    log_warn("Gave up reading %s, its device didn't respond within %lld ms", path.c_str(), static_cast<long long int>(IoScheduler::READ_TIMEOUT.count()));
+  }
+  return frame;
+}
+
+sail::image ImageDecoder::read_first_frame(const Archive& archive, const std::string& member, const std::shared_ptr<MemoryGovernor>& governor) {
+  ArchiveData data;
+  if (!archive.read(member, data, governor)) {
+    return sail::image();
+  }
+
+  // The codec is picked by magic number, the member's extension isn't needed
+  sail::image_input input(data.data, data.size);
+  return input.next_frame();
+}
+
+std::shared_ptr<DecodedImage> ImageDecoder::decode(sail::image& image, const std::string& path, const DecodeContext& context) {
+  if (!image.is_valid()) {
+    log_error("Failed to load image: %s", path.c_str());
+    return nullptr;
+  }
+
+  auto orientation = read_exif_orientation(image);
+
+  auto decoded = std::make_shared<DecodedImage>();
+
+  if (context.color_manager != nullptr && context.display_profile != nullptr) {
+    ColorProfile source_profile;
+    if (image.iccp().is_valid()) {
+      const auto& iccp_data = image.iccp().data();
+      source_profile = ColorProfile::from_bytes(iccp_data.data(), iccp_data.size());
+    }
+    decoded->color_transform = context.color_manager->get_transform(source_profile, *context.display_profile);
+  }
+
+  if (is_high_bit_depth_format(image.pixel_format()) && image.convert(SAIL_PIXEL_FORMAT_BPP64_RGBA) == SAIL_OK) {
+    auto wide = std::make_shared<WideImageBuffer>();
+    copy_oriented(static_cast<const uint64_t*>(image.pixels()), image.width(), image.height(), image.bytes_per_line() / sizeof(uint64_t), orientation, *wide);
+    wide->lease = MemoryLease(context.governor, MemoryCategoryDecodedImages, wide->size_in_bytes());
+
+    auto buffer = std::make_shared<ImageBuffer>();
+    buffer->allocate(wide->width, wide->height);
+    buffer->lease = MemoryLease(context.governor, MemoryCategoryDecodedImages, buffer->size_in_bytes());
+
+    decoded->wide_pixels = wide;
+    decoded->pixels = buffer;
+
+    std::vector<PixelRect> bands;
+    for (unsigned int y = 0; y < wide->height; y += TONE_MAPPING_BAND_HEIGHT) {
+      PixelRect band;
+      band.y = y;
+      band.w = wide->width;
+      band.h = TONE_MAPPING_BAND_HEIGHT;
+      bands.push_back(band);
+    }
+    decoded->tone_map(context.tone_mapping, bands);
+
+    log_debug("Keeping %s at 16 bits per channel", path.c_str());
+  } else {
+    if (image.pixel_format() != SAIL_PIXEL_FORMAT_BPP32_RGBA) {
+      auto convert_result = image.convert(SAIL_PIXEL_FORMAT_BPP32_RGBA);
+      if (convert_result != SAIL_OK) {
+        log_error("Failed to convert image to RGBA: %s", path.c_str());
+        return nullptr;
+      }
+    }
+
+    HistogramCollector collector(decoded->color_transform);
+    auto buffer = std::make_shared<ImageBuffer>();
+    copy_oriented(static_cast<const uint32_t*>(image.pixels()), image.width(), image.height(), image.bytes_per_line() / sizeof(uint32_t), orientation, *buffer, &collector);
+    buffer->lease = MemoryLease(context.governor, MemoryCategoryDecodedImages, buffer->size_in_bytes());
+
+    decoded->pixels = buffer;
+    decoded->histogram = collector.collect();
+  }
+
+  if (orientation != OrientationNormal) {
+    log_debug("Applied EXIF orientation %d to %s", static_cast<int>(orientation), path.c_str());
+  }
+
+  return decoded;
+}
+
+std::shared_ptr<DecodedImage> ImageDecoder::decode(TiledImage& image, const std::string& path, const DecodeContext& context) {
+  auto decoded = std::make_shared<DecodedImage>();
+
+  // Applied to each strip or tile as it's decoded, rather than in a pass of its own
+  if (context.color_manager != nullptr && context.display_profile != nullptr) {
+    decoded->color_transform = context.color_manager->get_transform(image.get_color_profile(), *context.display_profile);
+  }
+  auto collector = std::make_shared<HistogramCollector>(decoded->color_transform);
+  image.set_color_transform(collector);
+
+  auto buffer = std::make_shared<ImageBuffer>();
+  bool succeeded = image.decode(*buffer);
+  image.set_color_transform(decoded->color_transform);
+  if (!succeeded) {
+    log_error("Failed to load image: %s", path.c_str());
+    return nullptr;
+  }
+  buffer->lease = MemoryLease(context.governor, MemoryCategoryDecodedImages, buffer->size_in_bytes());
+
+  decoded->pixels = buffer;
+  decoded->histogram = collector->collect();
+  return decoded;
+}
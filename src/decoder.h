@@ -0,0 +1,68 @@
+#ifndef MONOKL__DECODER_H
+#define MONOKL__DECODER_H
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <sail-c++/sail-c++.h>
+#include <sail-c++/image.h>
+#include <sail-c++/image_input.h>
+
+#include "image_buffer.h"
+#include "memory_governor.h"
+#include "color.h"
+#include "tone_mapping.h"
+#include "archive.h"
+#include "tiled_image.h"
+#include "histogram.h"
+#include "io_scheduler.h"
+
+namespace monokl {
+
+struct DecodeContext {
+  std::shared_ptr<MemoryGovernor> governor;
+  // Left empty to skip color management altogether
+  std::shared_ptr<ColorManager> color_manager;
+  std::shared_ptr<const ColorProfile> display_profile;
+  ToneMappingParams tone_mapping;
+};
+
+struct DecodedImage {
+  // RGBA8 pixels that end up on screen
+  std::shared_ptr<ImageBuffer> pixels;
+  // Native RGBA16 pixels of high bit depth images, `pixels` is tone mapped from these
+  std::shared_ptr<WideImageBuffer> wide_pixels;
+  // Display transform that has been applied to `pixels`, and has to be applied again whenever they're tone mapped
+  std::shared_ptr<const ColorLut> color_transform;
+  // Of `pixels`, counted while they were converted. Left empty when they're tone mapped, since that changes them
+  std::shared_ptr<const Histogram> histogram;
+  // Halved by `DecodeCache` while memory was running low, it only stands in until the image is decoded again
+  bool downscaled = false;
+
+  bool is_high_bit_depth() const;
+  void tone_map(const ToneMappingParams& params, const std::vector<PixelRect>& regions);
+};
+
+class ImageDecoder {
+public:
+  /**
+   * Decodes the first frame of the image at `path` into display order, with its EXIF orientation
+   * and embedded color profile already applied. Images with more than 8 bits per channel are kept
+   * at 16 bits and tone mapped for display. Returns `nullptr` if the image couldn't be loaded.
+   */
+  static std::shared_ptr<DecodedImage> decode(const std::string& path, const DecodeContext& context, IoPriority priority = IoPriorityCurrent);
+
+  // Reading the file is split from the rest of `decode`, so it can start before there's a display to convert for.
+  // It's read on the I/O threads of its device, and given up on after `IoScheduler::READ_TIMEOUT`
+  static sail::image read_first_frame(const std::string& path, IoPriority priority = IoPriorityCurrent);
+  // Stored members are decoded straight from the archive's mapping, deflated ones after inflating them
+  static sail::image read_first_frame(const Archive& archive, const std::string& member, const std::shared_ptr<MemoryGovernor>& governor);
+  static std::shared_ptr<DecodedImage> decode(sail::image& image, const std::string& path, const DecodeContext& context);
+  // Decoded without the codec, a strip or tile per core. Returns `nullptr` unless `image.can_decode_whole()`
+  static std::shared_ptr<DecodedImage> decode(TiledImage& image, const std::string& path, const DecodeContext& context);
+};
+
+}
+
+#endif
@@ -0,0 +1,123 @@
+#include "durable_file.h"
+#include "logging.h"
+
+#include <algorithm>
+
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#include <share.h>
+#include <sys/stat.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#endif
+
+using namespace monokl;
+
+#ifdef _WIN32
+int DurableFile::open(const std::filesystem::path& path, bool append, bool truncate) {
+  int fd = -1;
+  int flags = _O_RDWR | _O_CREAT | _O_BINARY | (append ? _O_APPEND : 0) | (truncate ? _O_TRUNC : 0);
+  _wsopen_s(&fd, path.c_str(), flags, _SH_DENYNO, _S_IREAD | _S_IWRITE);
+  return fd;
+}
+
+bool DurableFile::write_all(int fd, const char* data, size_t size) {
+  while (size > 0) {
+    int written = _write(fd, data, static_cast<unsigned int>(std::min<size_t>(size, 1 << 30)));
+    if (written <= 0) {
+      return false;
+    }
+    data += written;
+    size -= written;
+  }
+  return true;
+}
+
+bool DurableFile::sync(int fd) {
+  return _commit(fd) == 0;
+}
+
+bool DurableFile::truncate(int fd, uint64_t size) {
+  return _chsize_s(fd, static_cast<long long>(size)) == 0;
+}
+
+void DurableFile::close(int fd) {
+  _close(fd);
+}
+
+void DurableFile::sync_directory(const std::filesystem::path&) {
+  // NTFS journals the rename itself, there is no directory handle to flush
+}
+#else
+int DurableFile::open(const std::filesystem::path& path, bool append, bool truncate) {
+  int flags = O_RDWR | O_CREAT | (append ? O_APPEND : 0) | (truncate ? O_TRUNC : 0);
+  return ::open(path.c_str(), flags, 0644);
+}
+
+bool DurableFile::write_all(int fd, const char* data, size_t size) {
+  while (size > 0) {
+    ssize_t written = ::write(fd, data, size);
+    if (written < 0 && errno == EINTR) {
+      continue;
+    }
+    if (written <= 0) {
+      return false;
+    }
+    data += written;
+    size -= static_cast<size_t>(written);
+  }
+  return true;
+}
+
+bool DurableFile::sync(int fd) {
+  return ::fsync(fd) == 0;
+}
+
+bool DurableFile::truncate(int fd, uint64_t size) {
+  return ::ftruncate(fd, static_cast<off_t>(size)) == 0;
+}
+
+void DurableFile::close(int fd) {
+  ::close(fd);
+}
+
+void DurableFile::sync_directory(const std::filesystem::path& path) {
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd >= 0) {
+    ::fsync(fd);
+    ::close(fd);
+  }
+}
+#endif
+
+bool DurableFile::replace(const std::filesystem::path& path, const std::string& contents) {
+  auto tmp_path = path;
+  tmp_path += ".tmp";
+
+  int fd = open(tmp_path, false, true);
+  bool written = fd >= 0 && write_all(fd, contents.data(), contents.size()) && sync(fd);
+  if (fd >= 0) {
+    close(fd);
+  }
+  if (!written) {
+    log_error("Failed to write %s", tmp_path.string().c_str());
+    std::error_code error;
+    std::filesystem::remove(tmp_path, error);
+    return false;
+  }
+
+  std::error_code error;
+  std::filesystem::rename(tmp_path, path, error);
+  if (error) {
+    log_error("Failed to replace %s: %s", path.string().c_str(), error.message().c_str());
+    std::filesystem::remove(tmp_path, error);
+    return false;
+  }
+
+  // The rename itself is only durable once the directory entry is
+  sync_directory(path.parent_path());
+  return true;
+}
@@ -0,0 +1,32 @@
+#ifndef MONOKL__DURABLE_FILE_H
+#define MONOKL__DURABLE_FILE_H
+
+#include <filesystem>
+#include <string>
+#include <cstdint>
+#include <cstddef>
+
+namespace monokl {
+
+/**
+ * Thin wrappers over the platform's file descriptors, for writes that have to be on disk before
+ * they are reported as done.
+ */
+class DurableFile {
+public:
+  // Returns -1 on failure
+  static int open(const std::filesystem::path& path, bool append, bool truncate);
+  static bool write_all(int fd, const char* data, size_t size);
+  static bool sync(int fd);
+  static bool truncate(int fd, uint64_t size);
+  static void close(int fd);
+  static void sync_directory(const std::filesystem::path& path);
+
+  // Writes `contents` next to `path`, syncs it and renames it over `path`, so a crash leaves either
+  // the old or the new file behind, never half of one
+  static bool replace(const std::filesystem::path& path, const std::string& contents);
+};
+
+}
+
+#endif
@@ -0,0 +1,264 @@
+#include "histogram.h"
+#include "parallel.h"
+#include "simd.h"
+
+#include <algorithm>
+
+using namespace monokl;
+
+// Rec. 709 luma in 8-bit fixed point, the weights add up to 256
+static const uint32_t LUMA_RED = 54;
+static const uint32_t LUMA_GREEN = 183;
+static const uint32_t LUMA_BLUE = 19;
+
+void Histogram::count(const uint32_t* pixels, size_t count) {
+  size_t i = 0;
+#if defined(MONOKL_SIMD_SSE2)
+  const __m128i mask = _mm_set1_epi32(0xff);
+  const __m128i red_weight = _mm_set1_epi32(LUMA_RED);
+  const __m128i green_weight = _mm_set1_epi32(LUMA_GREEN);
+  const __m128i blue_weight = _mm_set1_epi32(LUMA_BLUE);
+  const __m128i half = _mm_set1_epi32(128);
+  alignas(16) uint32_t lumas[4];
+  for (; i + 4 <= count; i += 4) {
+    __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pixels + i));
+    // Every product fits in the low half of its lane, so the 16-bit multiply is enough
+    __m128i y = _mm_mullo_epi16(_mm_and_si128(block, mask), red_weight);
+    y = _mm_add_epi32(y, _mm_mullo_epi16(_mm_and_si128(_mm_srli_epi32(block, 8), mask), green_weight));
+    y = _mm_add_epi32(y, _mm_mullo_epi16(_mm_and_si128(_mm_srli_epi32(block, 16), mask), blue_weight));
+    _mm_store_si128(reinterpret_cast<__m128i*>(lumas), _mm_srli_epi32(_mm_add_epi32(y, half), 8));
+
+    const uint8_t* channels = reinterpret_cast<const uint8_t*>(pixels + i);
+    for (int k = 0; k < 4; k++) {
+      red[channels[k * 4]]++;
+      green[channels[k * 4 + 1]]++;
+      blue[channels[k * 4 + 2]]++;
+      luma[lumas[k]]++;
+    }
+  }
+#elif defined(MONOKL_SIMD_NEON)
+  alignas(16) uint8_t lumas[8];
+  for (; i + 8 <= count; i += 8) {
+    uint8x8x4_t block = vld4_u8(reinterpret_cast<const uint8_t*>(pixels + i));
+    uint16x8_t y = vmull_u8(block.val[0], vdup_n_u8(LUMA_RED));
+    y = vmlal_u8(y, block.val[1], vdup_n_u8(LUMA_GREEN));
+    y = vmlal_u8(y, block.val[2], vdup_n_u8(LUMA_BLUE));
+    vst1_u8(lumas, vrshrn_n_u16(y, 8));
+
+    uint8_t channels[3][8];
+    vst1_u8(channels[0], block.val[0]);
+    vst1_u8(channels[1], block.val[1]);
+    vst1_u8(channels[2], block.val[2]);
+    for (int k = 0; k < 8; k++) {
+      red[channels[0][k]]++;
+      green[channels[1][k]]++;
+      blue[channels[2][k]]++;
+      luma[lumas[k]]++;
+    }
+  }
+#endif
+  for (; i < count; i++) {
+    const uint8_t* channels = reinterpret_cast<const uint8_t*>(pixels + i);
+    red[channels[0]]++;
+    green[channels[1]]++;
+    blue[channels[2]]++;
+    luma[(channels[0] * LUMA_RED + channels[1] * LUMA_GREEN + channels[2] * LUMA_BLUE + 128) >> 8]++;
+  }
+}
+
+void Histogram::add(const Histogram& other) {
+  for (size_t i = 0; i < BINS; i++) {
+    red[i] += other.red[i];
+    green[i] += other.green[i];
+    blue[i] += other.blue[i];
+    luma[i] += other.luma[i];
+  }
+}
+
+HistogramCollector::HistogramCollector(const std::shared_ptr<const PixelTransform>& inner) : inner(inner) {
+}
+
+void HistogramCollector::apply(uint32_t* pixels, size_t count) const {
+  if (inner != nullptr) {
+    inner->apply(pixels, count);
+  }
+
+  Histogram* histogram = nullptr;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto& slot = histograms[std::this_thread::get_id()];
+    if (slot == nullptr) {
+      slot = std::make_unique<Histogram>();
+    }
+    histogram = slot.get();
+  }
+  histogram->count(pixels, count);
+}
+
+std::shared_ptr<const Histogram> HistogramCollector::collect() const {
+  auto total = std::make_shared<Histogram>();
+  std::lock_guard<std::mutex> lock(mutex);
+  for (const auto& item : histograms) {
+    total->add(*item.second);
+  }
+  return total;
+}
+
+RegionHistogram::~RegionHistogram() {
+  wait();
+}
+
+void RegionHistogram::set_image(const std::shared_ptr<const ImageBuffer>& pixels, const std::shared_ptr<const Histogram>& whole) {
+  clear();
+  this->pixels = pixels;
+  this->whole = whole;
+  if (pixels == nullptr) {
+    return;
+  }
+
+  columns = (pixels->width + TILE_SIZE - 1) / TILE_SIZE;
+  rows = (pixels->height + TILE_SIZE - 1) / TILE_SIZE;
+  tiles.resize(static_cast<size_t>(columns) * rows);
+  counted.assign(tiles.size(), 0);
+}
+
+void RegionHistogram::clear() {
+  wait();
+  pixels.reset();
+  whole.reset();
+  columns = 0;
+  rows = 0;
+  std::vector<Histogram>().swap(tiles);
+  counted.clear();
+  stale_regions.clear();
+  has_pending = false;
+  has_ready = false;
+}
+
+void RegionHistogram::wait_for_count() {
+  if (!job.valid()) {
+    return;
+  }
+  ready = job.get();
+  has_ready = true;
+  forget_stale_tiles();
+}
+
+void RegionHistogram::invalidate(const PixelRect& region) {
+  if (pixels == nullptr || region.w == 0 || region.h == 0) {
+    return;
+  }
+
+  whole.reset();
+  stale_regions.push_back(region);
+  if (!job.valid()) {
+    forget_stale_tiles();
+  } else if (!has_pending) {
+    // What's being counted may include the old pixels, so it's counted again afterwards
+    pending = requested;
+    has_pending = true;
+  }
+}
+
+void RegionHistogram::request(const PixelRect& region) {
+  if (pixels == nullptr) {
+    return;
+  }
+
+  if (whole != nullptr && region.x == 0 && region.y == 0 && region.w >= pixels->width && region.h >= pixels->height) {
+    ready = *whole;
+    has_ready = true;
+    has_pending = false;
+    return;
+  }
+
+  requested = region;
+  if (job.valid()) {
+    pending = region;
+    has_pending = true;
+    return;
+  }
+  start(region);
+}
+
+bool RegionHistogram::poll(Histogram& out) {
+  if (job.valid() && job.wait_for(std::chrono::seconds(0)) == std::future_status::ready) {
+    ready = job.get();
+    has_ready = true;
+    forget_stale_tiles();
+  }
+  if (!job.valid() && has_pending) {
+    has_pending = false;
+    start(pending);
+  }
+
+  if (!has_ready) {
+    return false;
+  }
+  out = ready;
+  has_ready = false;
+  return true;
+}
+
+void RegionHistogram::start(const PixelRect& region) {
+  unsigned int first_column = std::min(columns, region.x / TILE_SIZE);
+  unsigned int first_row = std::min(rows, region.y / TILE_SIZE);
+  unsigned int last_column = std::min(columns, (region.x + region.w + TILE_SIZE - 1) / TILE_SIZE);
+  unsigned int last_row = std::min(rows, (region.y + region.h + TILE_SIZE - 1) / TILE_SIZE);
+
+  job = std::async(std::launch::async, [this, first_column, first_row, last_column, last_row]() {
+    std::vector<size_t> missing;
+    for (unsigned int row = first_row; row < last_row; row++) {
+      for (unsigned int column = first_column; column < last_column; column++) {
+        if (!counted[static_cast<size_t>(row) * columns + column]) {
+          missing.push_back(static_cast<size_t>(row) * columns + column);
+        }
+      }
+    }
+
+    parallel_for(0, missing.size(), 1, [&](size_t first, size_t last) {
+      for (size_t i = first; i < last; i++) {
+        size_t index = missing[i];
+        unsigned int x = static_cast<unsigned int>(index % columns) * TILE_SIZE;
+        unsigned int y = static_cast<unsigned int>(index / columns) * TILE_SIZE;
+        unsigned int width = std::min(TILE_SIZE, pixels->width - x);
+        unsigned int height = std::min(TILE_SIZE, pixels->height - y);
+
+        Histogram& tile = tiles[index];
+        tile = Histogram();
+        for (unsigned int row = 0; row < height; row++) {
+          tile.count(pixels->row(y + row) + x, width);
+        }
+        counted[index] = 1;
+      }
+    });
+
+    Histogram total;
+    for (unsigned int row = first_row; row < last_row; row++) {
+      for (unsigned int column = first_column; column < last_column; column++) {
+        total.add(tiles[static_cast<size_t>(row) * columns + column]);
+      }
+    }
+    return total;
+  });
+}
+
+void RegionHistogram::wait() {
+  if (job.valid()) {
+    job.wait();
+    job = std::future<Histogram>();
+  }
+}
+
+void RegionHistogram::forget_stale_tiles() {
+  for (const auto& region : stale_regions) {
+    unsigned int last_row = std::min(rows, (region.y + region.h + TILE_SIZE - 1) / TILE_SIZE);
+    unsigned int last_column = std::min(columns, (region.x + region.w + TILE_SIZE - 1) / TILE_SIZE);
+    for (unsigned int row = region.y / TILE_SIZE; row < last_row; row++) {
+      for (unsigned int column = region.x / TILE_SIZE; column < last_column; column++) {
+        counted[static_cast<size_t>(row) * columns + column] = 0;
+      }
+    }
+  }
+  stale_regions.clear();
+}
@@ -0,0 +1,99 @@
+#ifndef MONOKL__HISTOGRAM_H
+#define MONOKL__HISTOGRAM_H
+
+#include <memory>
+#include <vector>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <cstdint>
+#include <cstddef>
+
+#include "image_buffer.h"
+#include "orientation.h"
+
+namespace monokl {
+
+struct Histogram {
+  static const size_t BINS = 256;
+
+  uint32_t red[BINS] = {};
+  uint32_t green[BINS] = {};
+  uint32_t blue[BINS] = {};
+  // Rec. 709 weights
+  uint32_t luma[BINS] = {};
+
+  // Counts `count` RGBA8 pixels, with the luma of several pixels worked out at once
+  void count(const uint32_t* pixels, size_t count);
+  void add(const Histogram& other);
+};
+
+/**
+ * Goes in the place of the color transform passed to `copy_oriented` or `TiledImage`, and still
+ * applies it, so the converted pixels are counted while they're in cache instead of in another
+ * pass over the whole image. Every thread counts into a histogram of its own.
+ */
+class HistogramCollector : public PixelTransform {
+public:
+  explicit HistogramCollector(const std::shared_ptr<const PixelTransform>& inner);
+
+  void apply(uint32_t* pixels, size_t count) const override;
+  // What every thread counted, added up. Only once the pass is done
+  std::shared_ptr<const Histogram> collect() const;
+
+private:
+  std::shared_ptr<const PixelTransform> inner;
+  mutable std::mutex mutex;
+  mutable std::unordered_map<std::thread::id, std::unique_ptr<Histogram>> histograms;
+};
+
+/**
+ * Histograms of the part of an image that's on screen, to the nearest tile. Tiles are counted on
+ * a background thread the first time they come into view and kept, so zooming and panning only
+ * count the tiles that weren't seen before, and asking for a histogram costs the caller nothing.
+ */
+class RegionHistogram {
+public:
+  static const unsigned int TILE_SIZE = 256;
+
+  ~RegionHistogram();
+
+  // `whole` is the histogram of the whole image when it's already known, like from the decode
+  void set_image(const std::shared_ptr<const ImageBuffer>& pixels, const std::shared_ptr<const Histogram>& whole);
+  void clear();
+  // Waits for the running count, so the pixels can be changed in place. What it counted is kept for `poll`
+  void wait_for_count();
+  // The pixels of `region` were changed in place
+  void invalidate(const PixelRect& region);
+
+  // Starts counting what `region` needs, or queues it behind the count that's already running
+  void request(const PixelRect& region);
+  // Returns true with the histogram of the last region asked for, once it's been counted
+  bool poll(Histogram& out);
+
+private:
+  std::shared_ptr<const ImageBuffer> pixels = nullptr;
+  std::shared_ptr<const Histogram> whole = nullptr;
+  unsigned int columns = 0;
+  unsigned int rows = 0;
+  // Only touched by the background thread while `job` is running
+  std::vector<Histogram> tiles;
+  std::vector<uint8_t> counted;
+
+  std::future<Histogram> job;
+  std::vector<PixelRect> stale_regions;
+  PixelRect requested;
+  PixelRect pending;
+  bool has_pending = false;
+  Histogram ready;
+  bool has_ready = false;
+
+  void start(const PixelRect& region);
+  void wait();
+  void forget_stale_tiles();
+};
+
+}
+
+#endif
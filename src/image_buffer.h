@@ -0,0 +1,57 @@
+#ifndef MONOKL__IMAGE_BUFFER_H
+#define MONOKL__IMAGE_BUFFER_H
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+#include "memory_governor.h"
+
+namespace monokl {
+
+/**
+ * Decoded image in display order, one `Pixel` per pixel. Rows are tightly packed so the stride
+ * is always `width` pixels.
+ */
+template<typename Pixel>
+struct PixelBuffer {
+  unsigned int width = 0;
+  unsigned int height = 0;
+  std::vector<Pixel> pixels;
+  MemoryLease lease;
+
+  void allocate(unsigned int width, unsigned int height) {
+    this->width = width;
+    this->height = height;
+    pixels.resize(static_cast<size_t>(width) * height);
+  }
+
+  size_t size_in_bytes() const {
+    return pixels.size() * sizeof(Pixel);
+  }
+
+  Pixel* row(unsigned int y) {
+    return pixels.data() + static_cast<size_t>(y) * width;
+  }
+
+  const Pixel* row(unsigned int y) const {
+    return pixels.data() + static_cast<size_t>(y) * width;
+  }
+};
+
+// RGBA8, byte order R, G, B, A
+typedef PixelBuffer<uint32_t> ImageBuffer;
+
+// RGBA16, 16-bit channels in the order R, G, B, A
+typedef PixelBuffer<uint64_t> WideImageBuffer;
+
+struct PixelRect {
+  unsigned int x = 0;
+  unsigned int y = 0;
+  unsigned int w = 0;
+  unsigned int h = 0;
+};
+
+}
+
+#endif
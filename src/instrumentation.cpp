@@ -0,0 +1,83 @@
+#include "instrumentation.h"
+#include "logging.h"
+
+using namespace monokl;
+
+Instrumentation& Instrumentation::get() {
+  static Instrumentation instance;
+  return instance;
+}
+
+void Instrumentation::set_gauge(const std::string& name, int64_t value) {
+  std::lock_guard<std::mutex> lock(mutex);
+  gauges[name] = value;
+}
+
+void Instrumentation::add_to_counter(const std::string& name, int64_t by) {
+  std::lock_guard<std::mutex> lock(mutex);
+  counters[name] += by;
+}
+
+void Instrumentation::record_timing(const std::string& name, double ms) {
+  std::lock_guard<std::mutex> lock(mutex);
+  auto& stats = timings[name];
+  if (stats.count == 0 || ms < stats.min_ms) {
+    stats.min_ms = ms;
+  }
+  if (stats.count == 0 || ms > stats.max_ms) {
+    stats.max_ms = ms;
+  }
+  stats.count += 1;
+  stats.total_ms += ms;
+  stats.last_ms = ms;
+}
+
+int64_t Instrumentation::get_gauge(const std::string& name) const {
+  std::lock_guard<std::mutex> lock(mutex);
+  auto it = gauges.find(name);
+  return it == gauges.end() ? 0 : it->second;
+}
+
+int64_t Instrumentation::get_counter(const std::string& name) const {
+  std::lock_guard<std::mutex> lock(mutex);
+  auto it = counters.find(name);
+  return it == counters.end() ? 0 : it->second;
+}
+
+TimingStats Instrumentation::get_timing(const std::string& name) const {
+  std::lock_guard<std::mutex> lock(mutex);
+  auto it = timings.find(name);
+  return it == timings.end() ? TimingStats() : it->second;
+}
+
+void Instrumentation::log_summary() const {
+  std::lock_guard<std::mutex> lock(mutex);
+
+  log_info("Instrumentation summary:");
+
+  for (const auto& [name, value] : gauges) {
+    log_info(" - %s = %lld", name.c_str(), static_cast<long long int>(value));
+  }
+
+  for (const auto& [name, value] : counters) {
+    log_info(" - %s += %lld", name.c_str(), static_cast<long long int>(value));
+  }
+
+  for (const auto& [name, stats] : timings) {
+    double avg_ms = stats.count > 0 ? stats.total_ms / stats.count : 0.0;
+    log_info(" - %s: last %.2f ms, avg %.2f ms, min %.2f ms, max %.2f ms (%llu samples)", name.c_str(), stats.last_ms, avg_ms, stats.min_ms, stats.max_ms, static_cast<unsigned long long>(stats.count));
+  }
+}
+
+ScopedTimer::ScopedTimer(const std::string& name)
+  : name(name), started_at(std::chrono::steady_clock::now()) {
+}
+
+ScopedTimer::~ScopedTimer() {
+  Instrumentation::get().record_timing(name, elapsed_ms());
+}
+
+double ScopedTimer::elapsed_ms() const {
+  auto elapsed = std::chrono::steady_clock::now() - started_at;
+  return std::chrono::duration<double, std::milli>(elapsed).count();
+}
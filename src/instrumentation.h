@@ -0,0 +1,65 @@
+#ifndef MONOKL__INSTRUMENTATION_H
+#define MONOKL__INSTRUMENTATION_H
+
+#include <string>
+#include <map>
+#include <mutex>
+#include <chrono>
+#include <cstdint>
+
+namespace monokl {
+
+struct TimingStats {
+  uint64_t count = 0;
+  double total_ms = 0.0;
+  double min_ms = 0.0;
+  double max_ms = 0.0;
+  double last_ms = 0.0;
+};
+
+/**
+ * Process-wide registry of gauges, counters and timings that the rest of the application
+ * reports into. It's cheap enough to be updated a few times per frame, and its contents
+ * can be dumped to the log at any time.
+ */
+class Instrumentation {
+public:
+  static Instrumentation& get();
+
+  void set_gauge(const std::string& name, int64_t value);
+  void add_to_counter(const std::string& name, int64_t by = 1);
+  void record_timing(const std::string& name, double ms);
+
+  int64_t get_gauge(const std::string& name) const;
+  int64_t get_counter(const std::string& name) const;
+  TimingStats get_timing(const std::string& name) const;
+
+  void log_summary() const;
+
+private:
+  Instrumentation() = default;
+
+  mutable std::mutex mutex;
+  std::map<std::string, int64_t> gauges;
+  std::map<std::string, int64_t> counters;
+  std::map<std::string, TimingStats> timings;
+};
+
+/**
+ * Records the time between its construction and destruction under the given timing name.
+ */
+class ScopedTimer {
+public:
+  explicit ScopedTimer(const std::string& name);
+  ~ScopedTimer();
+
+  double elapsed_ms() const;
+
+private:
+  std::string name;
+  std::chrono::steady_clock::time_point started_at;
+};
+
+}
+
+#endif
@@ -0,0 +1,182 @@
+#include "io_scheduler.h"
+#include "logging.h"
+
+#include <thread>
+#include <vector>
+
+#ifndef _WIN32
+#include <sys/stat.h>
+#endif
+
+using namespace monokl;
+
+// Set on the devices of paths that didn't answer in time, which aren't real `st_dev`s
+static const uint64_t UNRESPONSIVE_DEVICE = 1ull << 63;
+
+struct DeviceProbe {
+  bool found = false;
+  uint64_t device = 0;
+  bool is_directory = false;
+};
+
+// The device of the closest part of `path` that exists, like the archive of one of its members
+static DeviceProbe probe_device(const std::filesystem::path& path) {
+  DeviceProbe probe;
+#ifdef _WIN32
+  probe.found = true;
+  probe.device = std::hash<std::wstring>()(path.root_name().native());
+#else
+  for (auto current = path; !current.empty(); current = current.parent_path()) {
+    struct stat info;
+    if (::stat(current.c_str(), &info) == 0) {
+      probe.found = true;
+      probe.device = static_cast<uint64_t>(info.st_dev);
+      probe.is_directory = current == path && S_ISDIR(info.st_mode);
+      break;
+    }
+    if (current == current.parent_path()) {
+      break;
+    }
+  }
+#endif
+  return probe;
+}
+
+IoScheduler& IoScheduler::get() {
+  // Never destroyed, its threads may still be stuck on a hung mount on the way out
+  static IoScheduler* scheduler = new IoScheduler();
+  return *scheduler;
+}
+
+bool IoScheduler::is_stalled(const std::filesystem::path& path) {
+  uint64_t id = device_of(path);
+
+  std::lock_guard<std::mutex> lock(mutex);
+  auto it = devices.find(id);
+  if (it == devices.end()) {
+    return (id & UNRESPONSIVE_DEVICE) != 0;
+  }
+  const auto& running = it->second->running;
+  return !running.empty() && *running.begin() < std::chrono::steady_clock::now();
+}
+
+void IoScheduler::enqueue(const std::filesystem::path& path, IoPriority priority, std::chrono::milliseconds timeout, std::function<void()> run, std::function<void()> expire) {
+  uint64_t id = device_of(path);
+
+  std::lock_guard<std::mutex> lock(mutex);
+  auto& device = devices[id];
+  if (device == nullptr) {
+    device = std::make_unique<Device>();
+    device->id = id;
+  }
+
+  device->queues[priority].push_back(Job{std::chrono::steady_clock::now() + timeout, timeout, std::move(run), std::move(expire)});
+  if (device->idle > 0) {
+    device->wake.notify_one();
+  } else if (device->threads < THREADS_PER_DEVICE) {
+    device->threads++;
+    std::thread(&IoScheduler::work, this, std::ref(*device)).detach();
+  }
+}
+
+uint64_t IoScheduler::device_of(const std::filesystem::path& path) {
+  auto directory = path.parent_path();
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    // Only exact matches, a folder below a known one may well be a mount of its own
+    auto it = known_devices.find(path);
+    if (it == known_devices.end()) {
+      it = known_devices.find(directory);
+    }
+    if (it != known_devices.end()) {
+      return it->second;
+    }
+  }
+
+  // `stat` itself blocks on a hung mount, so it's only waited on for a while
+  auto probe = std::make_shared<std::promise<DeviceProbe>>();
+  auto probed = probe->get_future();
+  std::thread([probe, path]() {
+    probe->set_value(probe_device(path));
+  }).detach();
+
+  uint64_t id = 0;
+  if (probed.wait_for(PROBE_TIMEOUT) == std::future_status::ready) {
+    auto result = probed.get();
+    id = result.device;
+    if (result.is_directory) {
+      directory = path;
+    }
+    // Nothing to cache for paths that don't exist yet, they may be created on another device
+    if (!result.found) {
+      return id;
+    }
+  } else {
+    id = UNRESPONSIVE_DEVICE | std::hash<std::filesystem::path::string_type>()(directory.native());
+    log_warn("%s didn't respond within %lld ms, its files get an I/O queue of their own", directory.string().c_str(), static_cast<long long int>(PROBE_TIMEOUT.count()));
+  }
+
+  std::lock_guard<std::mutex> lock(mutex);
+  known_devices[directory] = id;
+  return id;
+}
+
+void IoScheduler::work(Device& device) {
+  std::unique_lock<std::mutex> lock(mutex);
+  while (true) {
+    auto now = std::chrono::steady_clock::now();
+
+    // Jobs nobody waits on anymore are failed, the most urgent of the others is run
+    std::vector<Job> expired;
+    Job job;
+    bool found = false;
+    for (auto& queue : device.queues) {
+      while (!found && !queue.empty()) {
+        if (queue.front().deadline < now) {
+          expired.push_back(std::move(queue.front()));
+        } else {
+          job = std::move(queue.front());
+          found = true;
+        }
+        queue.pop_front();
+      }
+    }
+
+    if (!expired.empty()) {
+      lock.unlock();
+      for (auto& item : expired) {
+        item.expire();
+      }
+      lock.lock();
+    }
+
+    if (!found) {
+      if (!expired.empty()) {
+        continue;
+      }
+      device.idle++;
+      bool woken = device.wake.wait_for(lock, IDLE_TIMEOUT) == std::cv_status::no_timeout;
+      device.idle--;
+      bool has_work = false;
+      for (const auto& queue : device.queues) {
+        has_work = has_work || !queue.empty();
+      }
+      if (!woken && !has_work) {
+        device.threads--;
+        return;
+      }
+      continue;
+    }
+
+    auto done_by = std::chrono::steady_clock::now() + job.timeout;
+    auto running = device.running.insert(done_by);
+    lock.unlock();
+    job.run();
+    lock.lock();
+    device.running.erase(running);
+
+    if (std::chrono::steady_clock::now() > done_by) {
+      log_warn("I/O on device %llx took longer than its timeout", static_cast<unsigned long long>(device.id));
+    }
+  }
+}
@@ -0,0 +1,119 @@
+#ifndef MONOKL__IO_SCHEDULER_H
+#define MONOKL__IO_SCHEDULER_H
+
+#include <map>
+#include <set>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <future>
+#include <chrono>
+#include <functional>
+#include <condition_variable>
+#include <filesystem>
+#include <cstddef>
+#include <cstdint>
+
+#include "error.h"
+
+namespace monokl {
+
+typedef enum {
+  // What the user is waiting on, like the image being shown or the files that were just dropped
+  IoPriorityCurrent,
+  // What will be needed soon, like the files an export reads ahead of its decoders
+  IoPriorityPrefetch,
+  // What nobody is waiting on, like hashing and revalidating the session
+  IoPriorityBackground
+} IoPriority;
+
+/**
+ * Runs file I/O on threads of its own for every device, keyed by `st_dev`, so a slow or hung
+ * mount only holds up the work on that mount. Each device works through its jobs by priority,
+ * with at most a few at once, and drops the ones that weren't started before their timeout.
+ * Threads stuck in the kernel can't be interrupted, they're just left behind.
+ */
+class IoScheduler {
+public:
+  // A hung mount ties up at most this many threads
+  static const size_t THREADS_PER_DEVICE = 4;
+  static constexpr std::chrono::milliseconds READ_TIMEOUT{10000};
+  // Scans that don't start, or then stop making progress, for this long are given up on
+  static constexpr std::chrono::milliseconds SCAN_TIMEOUT{15000};
+  // Even finding the device of a path can hang, paths that take longer get a queue of their own
+  static constexpr std::chrono::milliseconds PROBE_TIMEOUT{2000};
+  // Idle threads exit after this long
+  static constexpr std::chrono::milliseconds IDLE_TIMEOUT{30000};
+
+  static IoScheduler& get();
+
+  // Runs `job` on a thread of the device holding `path`. The future fails if the job didn't start within `timeout`
+  template<typename T>
+  std::future<T> submit(const std::filesystem::path& path, IoPriority priority, std::chrono::milliseconds timeout, std::function<T()> job) {
+    auto promise = std::make_shared<std::promise<T>>();
+    auto future = promise->get_future();
+    enqueue(path, priority, timeout, [promise, job]() {
+      try {
+        promise->set_value(job());
+      } catch (...) {
+        promise->set_exception(std::current_exception());
+      }
+    }, [promise]() {
+      promise->set_exception(std::make_exception_ptr(MonoklError("Timed out waiting for the device")));
+    });
+    return future;
+  }
+
+  // Waits for `job` at most `timeout`, returns false if it didn't finish in time or failed
+  template<typename T>
+  bool run(const std::filesystem::path& path, IoPriority priority, std::chrono::milliseconds timeout, std::function<T()> job, T& result) {
+    auto future = submit<T>(path, priority, timeout, std::move(job));
+    if (future.wait_for(timeout) != std::future_status::ready) {
+      return false;
+    }
+    try {
+      result = future.get();
+    } catch (...) {
+      return false;
+    }
+    return true;
+  }
+
+  // Whether a job on the device of `path` has been running for longer than its timeout, so background work can skip it
+  bool is_stalled(const std::filesystem::path& path);
+
+private:
+  IoScheduler() = default;
+
+  struct Job {
+    // When the job has to have started by, and how long it may then take
+    std::chrono::steady_clock::time_point deadline;
+    std::chrono::milliseconds timeout;
+    std::function<void()> run;
+    std::function<void()> expire;
+  };
+
+  struct Device {
+    uint64_t id = 0;
+    std::deque<Job> queues[IoPriorityBackground + 1];
+    size_t threads = 0;
+    size_t idle = 0;
+    // When the jobs being worked on should be done, their start plus their timeout
+    std::multiset<std::chrono::steady_clock::time_point> running;
+    std::condition_variable wake;
+  };
+
+  std::mutex mutex;
+  // Never removed, their threads hold on to them
+  std::map<uint64_t, std::unique_ptr<Device>> devices;
+  // Of directories, and of the files that aren't in a directory known here
+  std::map<std::filesystem::path, uint64_t> known_devices;
+
+  void enqueue(const std::filesystem::path& path, IoPriority priority, std::chrono::milliseconds timeout, std::function<void()> run, std::function<void()> expire);
+  uint64_t device_of(const std::filesystem::path& path);
+  void work(Device& device);
+};
+
+}
+
+#endif
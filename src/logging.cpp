@@ -0,0 +1,275 @@
+#include "logging.h"
+
+#include <algorithm>
+#include <cstring>
+#include <string>
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+using namespace monokl;
+
+static const char* level_name(LogLevel level) {
+  switch (level) {
+    case LogLevelVerbose:
+      return "VERBOSE";
+    case LogLevelDebug:
+      return "DEBUG";
+    case LogLevelInfo:
+      return "INFO";
+    case LogLevelWarn:
+      return "WARN";
+    case LogLevelError:
+      return "ERROR";
+    default:
+      return "CRITICAL";
+  }
+}
+
+Logger& Logger::get() {
+  // Never destroyed, threads that are still running during exit can keep logging
+  static Logger* logger = new Logger();
+  return *logger;
+}
+
+Logger::Logger() : started_at(std::chrono::steady_clock::now()) {
+  running = true;
+  writer = std::thread(&Logger::run, this);
+}
+
+Logger::RingHandle::~RingHandle() {
+  if (ring != nullptr) {
+    ring->abandoned.store(true, std::memory_order_release);
+  }
+}
+
+Logger::Ring* Logger::thread_ring() {
+  static thread_local RingHandle handle;
+  if (handle.ring != nullptr) {
+    return handle.ring;
+  }
+
+  std::lock_guard<std::mutex> lock(rings_mutex);
+  if (!free_rings.empty()) {
+    handle.ring = free_rings.back();
+    free_rings.pop_back();
+    handle.ring->abandoned = false;
+  } else {
+    handle.ring = new Ring();
+  }
+  rings.push_back(handle.ring);
+  return handle.ring;
+}
+
+void Logger::write(LogLevel level, const char* format, ...) {
+  va_list arguments;
+  va_start(arguments, format);
+  get().enqueue(level, format, arguments);
+  va_end(arguments);
+}
+
+void Logger::write_message(LogLevel level, const char* message) {
+  write(level, "%s", message);
+}
+
+void Logger::enqueue(LogLevel level, const char* format, va_list arguments) {
+  auto time_us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - started_at).count();
+
+  if (!running.load(std::memory_order_acquire)) {
+    char message[MESSAGE_SIZE];
+    int length = std::vsnprintf(message, sizeof(message), format, arguments);
+    output(time_us, level, message, std::min(sizeof(message) - 1, static_cast<size_t>(std::max(0, length))));
+    return;
+  }
+
+  Ring* ring = thread_ring();
+  uint64_t head = ring->head.load(std::memory_order_relaxed);
+  uint64_t used = head - ring->tail.load(std::memory_order_acquire);
+  if (used >= RING_CAPACITY) {
+    ring->dropped.fetch_add(1, std::memory_order_relaxed);
+  } else {
+    Record& record = ring->records[head % RING_CAPACITY];
+    int length = std::vsnprintf(record.message, sizeof(record.message), format, arguments);
+    record.time_us = time_us;
+    record.level = level;
+    record.length = static_cast<uint32_t>(std::min(sizeof(record.message) - 1, static_cast<size_t>(std::max(0, length))));
+    ring->head.store(head + 1, std::memory_order_release);
+  }
+
+  // A ring filling up is drained early, before it starts dropping messages
+  if (level >= LogLevelWarn || used == RING_CAPACITY / 2) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      urgent = true;
+    }
+    wake.notify_one();
+  }
+}
+
+bool Logger::open_file(const std::filesystem::path& path) {
+  std::error_code error;
+  std::filesystem::create_directories(path.parent_path(), error);
+
+#ifdef _WIN32
+  FILE* opened = _wfopen(path.c_str(), L"ab");
+#else
+  FILE* opened = std::fopen(path.c_str(), "ab");
+#endif
+  if (opened == nullptr) {
+    log_error("Failed to open log file %s", path.string().c_str());
+    return false;
+  }
+
+  std::lock_guard<std::mutex> lock(output_mutex);
+  if (file != nullptr) {
+    std::fclose(file);
+  }
+  file = opened;
+  return true;
+}
+
+void Logger::flush() {
+  std::unique_lock<std::mutex> lock(mutex);
+  if (!running) {
+    return;
+  }
+
+  // A drain that is already underway may have missed the latest messages, so it has to be the next one
+  uint64_t target = drains_started + 1;
+  urgent = true;
+  wake.notify_one();
+  drained.wait(lock, [this, target]() {
+    return drains_finished >= target || !running;
+  });
+}
+
+void Logger::shutdown() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!running) {
+      return;
+    }
+    stopping = true;
+  }
+  wake.notify_one();
+  writer.join();
+
+  std::lock_guard<std::mutex> lock(output_mutex);
+  if (file != nullptr) {
+    std::fclose(file);
+    file = nullptr;
+  }
+}
+
+void Logger::run() {
+  std::unique_lock<std::mutex> lock(mutex);
+  while (true) {
+    wake.wait_for(lock, DRAIN_INTERVAL, [this]() {
+      return stopping || urgent;
+    });
+    urgent = false;
+    bool stop = stopping;
+    drains_started++;
+
+    lock.unlock();
+    drain();
+    lock.lock();
+
+    drains_finished++;
+    drained.notify_all();
+
+    if (stop) {
+      break;
+    }
+  }
+
+  // Threads still logging from here on write straight to the outputs
+  running = false;
+  drained.notify_all();
+  lock.unlock();
+  drain();
+}
+
+void Logger::drain() {
+  struct Pending {
+    int64_t time_us;
+    LogLevel level;
+    std::string message;
+  };
+
+  std::vector<Ring*> current;
+  {
+    std::lock_guard<std::mutex> lock(rings_mutex);
+    current = rings;
+  }
+
+  std::vector<Pending> pending;
+  std::vector<Ring*> emptied;
+  for (Ring* ring : current) {
+    // Read before the head, so a ring marked as abandoned is known to have all its messages in
+    bool abandoned = ring->abandoned.load(std::memory_order_acquire);
+    uint64_t head = ring->head.load(std::memory_order_acquire);
+    uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+    for (; tail < head; tail++) {
+      const Record& record = ring->records[tail % RING_CAPACITY];
+      pending.push_back({record.time_us, record.level, std::string(record.message, record.length)});
+    }
+    ring->tail.store(head, std::memory_order_release);
+
+    uint64_t dropped = ring->dropped.exchange(0, std::memory_order_relaxed);
+    if (dropped > 0) {
+      auto time_us = pending.empty() ? 0 : pending.back().time_us;
+      pending.push_back({time_us, LogLevelWarn, "Dropped " + std::to_string(dropped) + " log messages, a thread logged faster than they could be written"});
+    }
+
+    if (abandoned) {
+      emptied.push_back(ring);
+    }
+  }
+
+  if (!emptied.empty()) {
+    std::lock_guard<std::mutex> lock(rings_mutex);
+    for (Ring* ring : emptied) {
+      rings.erase(std::remove(rings.begin(), rings.end(), ring), rings.end());
+      free_rings.push_back(ring);
+    }
+  }
+
+  if (pending.empty()) {
+    return;
+  }
+
+  // Every ring is in order by itself, interleaving them puts the whole batch in the order it was logged
+  std::stable_sort(pending.begin(), pending.end(), [](const Pending& a, const Pending& b) {
+    return a.time_us < b.time_us;
+  });
+
+  for (const auto& message : pending) {
+    output(message.time_us, message.level, message.message.data(), message.message.size());
+  }
+
+  std::lock_guard<std::mutex> lock(output_mutex);
+  std::fflush(stderr);
+  if (file != nullptr) {
+    std::fflush(file);
+  }
+}
+
+void Logger::output(int64_t time_us, LogLevel level, const char* message, size_t length) {
+  char line[MESSAGE_SIZE + 64];
+  int prefix = std::snprintf(line, sizeof(line), "[%10.3f] %s: ", time_us / 1000000.0, level_name(level));
+  size_t size = std::min(sizeof(line) - 2, static_cast<size_t>(std::max(0, prefix)) + length);
+  std::memcpy(line + prefix, message, size - prefix);
+  line[size] = '\n';
+  line[size + 1] = '\0';
+
+  std::lock_guard<std::mutex> lock(output_mutex);
+  std::fwrite(line, 1, size + 1, stderr);
+  if (file != nullptr) {
+    std::fwrite(line, 1, size + 1, file);
+  }
+#ifdef _WIN32
+  OutputDebugStringA(line);
+#endif
+}
@@ -1,15 +1,143 @@
 #ifndef MONOKL__LOGGING_H
 #define MONOKL__LOGGING_H
 
-#include <SDL2/SDL_log.h>
-
-#define log_verbose(...) SDL_LogVerbose(SDL_LOG_CATEGORY_CUSTOM, __VA_ARGS__)
-#define log_debug(...) SDL_LogDebug(SDL_LOG_CATEGORY_CUSTOM, __VA_ARGS__)
-#define log_message(...) SDL_LogMessage(SDL_LOG_CATEGORY_CUSTOM, SDL_LOG_PRIORITY_INFO, __VA_ARGS__)
-#define log(...) log_message(__VA_ARGS__)
-#define log_info(...) SDL_LogInfo(SDL_LOG_CATEGORY_CUSTOM, __VA_ARGS__)
-#define log_warn(...) SDL_LogWarn(SDL_LOG_CATEGORY_CUSTOM, __VA_ARGS__)
-#define log_error(...) SDL_LogError(SDL_LOG_CATEGORY_CUSTOM, __VA_ARGS__)
-#define log_critical(...) SDL_LogCritical(SDL_LOG_CATEGORY_CUSTOM, __VA_ARGS__)
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <vector>
+#include <chrono>
+#include <filesystem>
+#include <cstdio>
+#include <cstdarg>
+#include <cstdint>
+#include <cstddef>
+
+#define MONOKL_LOG_LEVEL_VERBOSE 0
+#define MONOKL_LOG_LEVEL_DEBUG 1
+#define MONOKL_LOG_LEVEL_INFO 2
+#define MONOKL_LOG_LEVEL_WARN 3
+#define MONOKL_LOG_LEVEL_ERROR 4
+#define MONOKL_LOG_LEVEL_CRITICAL 5
+
+// Calls below this level compile to nothing, and their arguments are never evaluated
+#ifndef MONOKL_LOG_LEVEL
+#ifdef NDEBUG
+#define MONOKL_LOG_LEVEL MONOKL_LOG_LEVEL_INFO
+#else
+#define MONOKL_LOG_LEVEL MONOKL_LOG_LEVEL_DEBUG
+#endif
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define MONOKL_PRINTF_FORMAT(format_index, first_argument) __attribute__((format(printf, format_index, first_argument)))
+#else
+#define MONOKL_PRINTF_FORMAT(format_index, first_argument)
+#endif
+
+namespace monokl {
+
+typedef enum {
+  LogLevelVerbose = MONOKL_LOG_LEVEL_VERBOSE,
+  LogLevelDebug = MONOKL_LOG_LEVEL_DEBUG,
+  LogLevelInfo = MONOKL_LOG_LEVEL_INFO,
+  LogLevelWarn = MONOKL_LOG_LEVEL_WARN,
+  LogLevelError = MONOKL_LOG_LEVEL_ERROR,
+  LogLevelCritical = MONOKL_LOG_LEVEL_CRITICAL
+} LogLevel;
+
+/**
+ * Every thread formats its messages into a ring buffer of its own, without taking a lock or
+ * touching a file, and a background thread writes them out to stderr and optionally a file in
+ * the order they were logged. A thread that logs faster than the rings are drained loses messages
+ * rather than waiting, and the loss is reported. Warnings and errors wake the writer right away.
+ */
+class Logger {
+public:
+  static constexpr std::chrono::milliseconds DRAIN_INTERVAL{50};
+  // Longer messages are cut off
+  static const size_t MESSAGE_SIZE = 480;
+  static const size_t RING_CAPACITY = 128;
+
+  static Logger& get();
+
+  static void write(LogLevel level, const char* format, ...) MONOKL_PRINTF_FORMAT(2, 3);
+  // For messages that were already formatted elsewhere, like SDL's
+  void write_message(LogLevel level, const char* message);
+
+  // Also writes every message to `path`, after what's already in it
+  bool open_file(const std::filesystem::path& path);
+  // Waits until everything logged so far has been written out
+  void flush();
+  // Writes what's left and stops the background thread, anything logged afterwards is written right away
+  void shutdown();
+
+private:
+  struct Record {
+    int64_t time_us;
+    LogLevel level;
+    uint32_t length;
+    char message[MESSAGE_SIZE];
+  };
+
+  // Written by one thread and read by the writer, so the two indices are all they share
+  struct Ring {
+    Record records[RING_CAPACITY];
+    std::atomic<uint64_t> head{0};
+    std::atomic<uint64_t> tail{0};
+    std::atomic<uint64_t> dropped{0};
+    // Set once its thread has exited, the ring is reused by the next new thread once drained
+    std::atomic<bool> abandoned{false};
+  };
+
+  struct RingHandle {
+    Ring* ring = nullptr;
+    ~RingHandle();
+  };
+
+  Logger();
+
+  std::chrono::steady_clock::time_point started_at;
+
+  std::mutex rings_mutex;
+  std::vector<Ring*> rings;
+  std::vector<Ring*> free_rings;
+
+  std::mutex mutex;
+  std::condition_variable wake;
+  std::condition_variable drained;
+  bool stopping = false;
+  bool urgent = false;
+  uint64_t drains_started = 0;
+  uint64_t drains_finished = 0;
+  std::atomic<bool> running{false};
+  std::thread writer;
+
+  std::mutex output_mutex;
+  FILE* file = nullptr;
+
+  Ring* thread_ring();
+  void enqueue(LogLevel level, const char* format, va_list arguments);
+  void run();
+  void drain();
+  void output(int64_t time_us, LogLevel level, const char* message, size_t length);
+};
+
+}
+
+#define MONOKL_LOG_AT(level, ...) \
+  do { \
+    if (MONOKL_LOG_LEVEL <= level) { \
+      ::monokl::Logger::write(static_cast<::monokl::LogLevel>(level), __VA_ARGS__); \
+    } \
+  } while (0)
+
+#define log_verbose(...) MONOKL_LOG_AT(MONOKL_LOG_LEVEL_VERBOSE, __VA_ARGS__)
+#define log_debug(...) MONOKL_LOG_AT(MONOKL_LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define log_message(...) MONOKL_LOG_AT(MONOKL_LOG_LEVEL_INFO, __VA_ARGS__)
+#define log_info(...) MONOKL_LOG_AT(MONOKL_LOG_LEVEL_INFO, __VA_ARGS__)
+#define log_warn(...) MONOKL_LOG_AT(MONOKL_LOG_LEVEL_WARN, __VA_ARGS__)
+#define log_error(...) MONOKL_LOG_AT(MONOKL_LOG_LEVEL_ERROR, __VA_ARGS__)
+#define log_critical(...) MONOKL_LOG_AT(MONOKL_LOG_LEVEL_CRITICAL, __VA_ARGS__)
 
 #endif
@@ -1,4 +1,6 @@
 #include <exception>
+#include <string>
+#include <vector>
 
 #include "application.h"
 #include "window.h"
@@ -7,14 +9,20 @@ using namespace monokl;
 
 int main(int argc, char* argv[]) {
   try {
-    Application app;
+    std::vector<std::string> paths;
+    for (int i = 1; i < argc; i++) {
+      paths.push_back(argv[i]);
+    }
+
+    Application app(paths);
 
     WindowOptions options;
     options.width = 1366;
     options.height = 768;
     options.centered = true;
 
-    auto window = app.create_main_window(options);
+    // Owned by the application, which closes it when it's closed rather than at exit
+    app.create_main_window(options);
 
     app.run_main_loop();
   } catch (const MonoklError& e) {
@@ -0,0 +1,102 @@
+#include "mapped_file.h"
+#include "logging.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+using namespace monokl;
+
+std::unique_ptr<MappedFile> MappedFile::open(const std::filesystem::path& path, bool copy_on_write) {
+  std::unique_ptr<MappedFile> mapped(new MappedFile());
+  mapped->writable = copy_on_write;
+
+#ifdef _WIN32
+  HANDLE file = CreateFileW(path.wstring().c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+  if (file == INVALID_HANDLE_VALUE) {
+    return nullptr;
+  }
+  mapped->file_handle = file;
+
+  LARGE_INTEGER file_size;
+  if (!GetFileSizeEx(file, &file_size) || file_size.QuadPart == 0) {
+    return nullptr;
+  }
+
+  HANDLE mapping = CreateFileMappingW(file, nullptr, copy_on_write ? PAGE_WRITECOPY : PAGE_READONLY, 0, 0, nullptr);
+  if (mapping == nullptr) {
+    log_error("Failed to map %s", path.string().c_str());
+    return nullptr;
+  }
+  mapped->mapping_handle = mapping;
+
+  void* view = MapViewOfFile(mapping, copy_on_write ? FILE_MAP_COPY : FILE_MAP_READ, 0, 0, 0);
+  if (view == nullptr) {
+    log_error("Failed to map %s", path.string().c_str());
+    return nullptr;
+  }
+
+  mapped->bytes = static_cast<const uint8_t*>(view);
+  mapped->length = static_cast<size_t>(file_size.QuadPart);
+#else
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return nullptr;
+  }
+  mapped->fd = fd;
+
+  struct stat file_stat;
+  if (fstat(fd, &file_stat) != 0 || file_stat.st_size == 0) {
+    return nullptr;
+  }
+
+  void* view = mmap(nullptr, static_cast<size_t>(file_stat.st_size), PROT_READ | (copy_on_write ? PROT_WRITE : 0), MAP_PRIVATE, fd, 0);
+  if (view == MAP_FAILED) {
+    log_error("Failed to map %s", path.string().c_str());
+    return nullptr;
+  }
+
+  mapped->bytes = static_cast<const uint8_t*>(view);
+  mapped->length = static_cast<size_t>(file_stat.st_size);
+#endif
+
+  return mapped;
+}
+
+MappedFile::~MappedFile() {
+#ifdef _WIN32
+  if (bytes != nullptr) {
+    UnmapViewOfFile(bytes);
+  }
+  if (mapping_handle != nullptr) {
+    CloseHandle(mapping_handle);
+  }
+  if (file_handle != nullptr) {
+    CloseHandle(file_handle);
+  }
+#else
+  if (bytes != nullptr) {
+    munmap(const_cast<uint8_t*>(bytes), length);
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+#endif
+}
+
+const uint8_t* MappedFile::data() const {
+  return bytes;
+}
+
+uint8_t* MappedFile::mutable_data() {
+  return writable ? const_cast<uint8_t*>(bytes) : nullptr;
+}
+
+size_t MappedFile::size() const {
+  return length;
+}
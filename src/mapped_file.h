@@ -0,0 +1,46 @@
+#ifndef MONOKL__MAPPED_FILE_H
+#define MONOKL__MAPPED_FILE_H
+
+#include <memory>
+#include <filesystem>
+#include <cstdint>
+#include <cstddef>
+
+namespace monokl {
+
+/**
+ * Read-only memory mapping of a whole file. Pages are only read from disk when touched, so
+ * opening a large file is about as cheap as opening a small one.
+ */
+class MappedFile {
+public:
+  // Returns `nullptr` when the file doesn't exist, is empty or can't be mapped. With `copy_on_write`
+  // the mapping can be written to, only the touched pages are copied and the file never changes
+  static std::unique_ptr<MappedFile> open(const std::filesystem::path& path, bool copy_on_write = false);
+
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+  ~MappedFile();
+
+  const uint8_t* data() const;
+  // `nullptr` unless mapped copy-on-write
+  uint8_t* mutable_data();
+  size_t size() const;
+
+private:
+  MappedFile() = default;
+
+  const uint8_t* bytes = nullptr;
+  size_t length = 0;
+  bool writable = false;
+#ifdef _WIN32
+  void* file_handle = nullptr;
+  void* mapping_handle = nullptr;
+#else
+  int fd = -1;
+#endif
+};
+
+}
+
+#endif
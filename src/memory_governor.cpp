@@ -0,0 +1,301 @@
+#include "memory_governor.h"
+#include "instrumentation.h"
+#include "logging.h"
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <SDL2/SDL_cpuinfo.h>
+
+using namespace monokl;
+
+// Fractions of the budget (or of the system memory being in use) at which each pressure level kicks in
+static const double SHRINK_CACHES_THRESHOLD = 0.70;
+static const double DOWNSCALE_INACTIVE_THRESHOLD = 0.85;
+static const double DROP_INACTIVE_THRESHOLD = 0.95;
+
+#ifdef __linux__
+static bool read_uint64_file(const std::string& path, uint64_t& out) {
+  std::ifstream file(path);
+  if (!file.is_open()) {
+    return false;
+  }
+
+  std::string value;
+  file >> value;
+  if (value.empty() || value == "max") {
+    return false;
+  }
+
+  try {
+    out = std::stoull(value);
+  } catch (const std::exception&) {
+    return false;
+  }
+
+  return true;
+}
+
+static void read_proc_meminfo(SystemMemoryInfo& info) {
+  std::ifstream file("/proc/meminfo");
+  std::string line;
+  while (std::getline(file, line)) {
+    std::istringstream stream(line);
+    std::string key;
+    uint64_t value_kb = 0;
+    stream >> key >> value_kb;
+
+    if (key == "MemTotal:") {
+      info.total = value_kb * 1024;
+    } else if (key == "MemAvailable:") {
+      info.available = value_kb * 1024;
+    }
+  }
+}
+
+static void read_cgroup_limits(SystemMemoryInfo& info) {
+  // cgroup v2 exposes a single unified hierarchy, the process' own group is listed as `0::/some/path`
+  std::ifstream cgroup_file("/proc/self/cgroup");
+  std::string line;
+  while (std::getline(cgroup_file, line)) {
+    if (line.rfind("0::", 0) != 0) {
+      continue;
+    }
+
+    auto group_root = "/sys/fs/cgroup" + line.substr(3);
+    uint64_t limit = 0;
+    if (read_uint64_file(group_root + "/memory.max", limit)) {
+      info.cgroup_limit = limit;
+      read_uint64_file(group_root + "/memory.current", info.cgroup_usage);
+      return;
+    }
+  }
+
+  // cgroup v1 reports "unlimited" as a huge page-aligned number instead of "max"
+  uint64_t limit = 0;
+  if (read_uint64_file("/sys/fs/cgroup/memory/memory.limit_in_bytes", limit) && limit < (static_cast<uint64_t>(1) << 62)) {
+    info.cgroup_limit = limit;
+    read_uint64_file("/sys/fs/cgroup/memory/memory.usage_in_bytes", info.cgroup_usage);
+  }
+}
+#endif
+
+SystemMemoryInfo SystemMemoryInfo::read() {
+  SystemMemoryInfo info;
+
+#ifdef __linux__
+  read_proc_meminfo(info);
+  read_cgroup_limits(info);
+#endif
+
+  if (info.total == 0) {
+    info.total = static_cast<uint64_t>(SDL_GetSystemRAM()) * 1024 * 1024;
+  }
+
+  if (info.available == 0) {
+    info.available = info.total;
+  }
+
+  return info;
+}
+
+uint64_t SystemMemoryInfo::effective_limit() const {
+  if (cgroup_limit > 0 && cgroup_limit < total) {
+    return cgroup_limit;
+  }
+  return total;
+}
+
+uint64_t SystemMemoryInfo::effective_available() const {
+  if (cgroup_limit > 0 && cgroup_limit < total) {
+    uint64_t cgroup_available = cgroup_usage < cgroup_limit ? cgroup_limit - cgroup_usage : 0;
+    return std::min(cgroup_available, available);
+  }
+  return available;
+}
+
+MemoryGovernor::MemoryGovernor(const MemoryGovernorOptions& options) : options(options) {
+  for (auto& usage : usages) {
+    usage = 0;
+  }
+
+  poll(true);
+
+  log_debug("Memory governor initialized with a budget of %llu MB (system limit %llu MB)", static_cast<unsigned long long>(budget() / (1024 * 1024)), static_cast<unsigned long long>(system_info.effective_limit() / (1024 * 1024)));
+}
+
+void MemoryGovernor::track(MemoryCategory category, int64_t delta) {
+  usages[category] += delta;
+}
+
+uint64_t MemoryGovernor::usage(MemoryCategory category) const {
+  int64_t value = usages[category];
+  return value > 0 ? static_cast<uint64_t>(value) : 0;
+}
+
+uint64_t MemoryGovernor::total_usage() const {
+  uint64_t total = 0;
+  for (int i = 0; i < MemoryCategoryCount; i++) {
+    total += usage(static_cast<MemoryCategory>(i));
+  }
+  return total;
+}
+
+uint64_t MemoryGovernor::budget() const {
+  return effective_budget;
+}
+
+MemoryPressure MemoryGovernor::pressure() const {
+  return static_cast<MemoryPressure>(current_pressure.load());
+}
+
+bool MemoryGovernor::should_shrink_caches() const {
+  return pressure() >= MemoryPressureShrinkCaches;
+}
+
+bool MemoryGovernor::should_downscale_inactive() const {
+  return pressure() >= MemoryPressureDownscaleInactive;
+}
+
+bool MemoryGovernor::should_drop_inactive() const {
+  return pressure() >= MemoryPressureDropInactive;
+}
+
+int MemoryGovernor::add_listener(const PressureListener& listener) {
+  std::lock_guard<std::mutex> lock(listeners_mutex);
+  int id = next_listener_id++;
+  listeners[id] = listener;
+  return id;
+}
+
+void MemoryGovernor::remove_listener(int id) {
+  std::lock_guard<std::mutex> lock(listeners_mutex);
+  listeners.erase(id);
+}
+
+MemoryPressure MemoryGovernor::evaluate_pressure() const {
+  double budget_ratio = budget() > 0 ? static_cast<double>(total_usage()) / static_cast<double>(budget()) : 0.0;
+
+  uint64_t limit = system_info.effective_limit();
+  double system_ratio = limit > 0 ? 1.0 - static_cast<double>(system_info.effective_available()) / static_cast<double>(limit) : 0.0;
+
+  double ratio = std::max(budget_ratio, system_ratio);
+
+  if (ratio >= DROP_INACTIVE_THRESHOLD) {
+    return MemoryPressureDropInactive;
+  } else if (ratio >= DOWNSCALE_INACTIVE_THRESHOLD) {
+    return MemoryPressureDownscaleInactive;
+  } else if (ratio >= SHRINK_CACHES_THRESHOLD) {
+    return MemoryPressureShrinkCaches;
+  }
+  return MemoryPressureNone;
+}
+
+void MemoryGovernor::poll(bool force) {
+  auto now = std::chrono::steady_clock::now();
+  if (!force && now - last_polled_at < std::chrono::milliseconds(options.poll_interval_ms)) {
+    return;
+  }
+  last_polled_at = now;
+
+  system_info = SystemMemoryInfo::read();
+
+  if (options.budget_bytes > 0) {
+    effective_budget = options.budget_bytes;
+  } else {
+    effective_budget = static_cast<uint64_t>(system_info.effective_limit() * options.budget_ratio);
+  }
+
+  auto new_pressure = evaluate_pressure();
+  auto old_pressure = static_cast<MemoryPressure>(current_pressure.exchange(new_pressure));
+
+  publish_instrumentation();
+
+  if (new_pressure == old_pressure) {
+    return;
+  }
+
+  log_info("Memory pressure changed from %s to %s (%llu MB in use, %llu MB budget)", memory_pressure_name(old_pressure), memory_pressure_name(new_pressure), static_cast<unsigned long long>(total_usage() / (1024 * 1024)), static_cast<unsigned long long>(budget() / (1024 * 1024)));
+
+  std::vector<PressureListener> to_notify;
+  {
+    std::lock_guard<std::mutex> lock(listeners_mutex);
+    for (const auto& [id, listener] : listeners) {
+      to_notify.push_back(listener);
+    }
+  }
+
+  for (const auto& listener : to_notify) {
+    listener(new_pressure);
+  }
+}
+
+void MemoryGovernor::publish_instrumentation() const {
+  auto& instrumentation = Instrumentation::get();
+  instrumentation.set_gauge("memory.decoded_images", usage(MemoryCategoryDecodedImages));
+  instrumentation.set_gauge("memory.textures", usage(MemoryCategoryTextures));
+  instrumentation.set_gauge("memory.caches", usage(MemoryCategoryCaches));
+  instrumentation.set_gauge("memory.total", total_usage());
+  instrumentation.set_gauge("memory.budget", budget());
+  instrumentation.set_gauge("memory.system_available", system_info.effective_available());
+  instrumentation.set_gauge("memory.pressure", pressure());
+}
+
+MemoryLease::MemoryLease(const std::shared_ptr<MemoryGovernor>& governor, MemoryCategory category, uint64_t bytes)
+  : governor(governor), category(category), bytes(bytes) {
+  if (governor != nullptr) {
+    governor->track(category, static_cast<int64_t>(bytes));
+  }
+}
+
+MemoryLease::MemoryLease(MemoryLease&& other) noexcept
+  : governor(std::move(other.governor)), category(other.category), bytes(other.bytes) {
+  other.governor = nullptr;
+  other.bytes = 0;
+}
+
+MemoryLease& MemoryLease::operator=(MemoryLease&& other) noexcept {
+  if (this != &other) {
+    reset();
+    governor = std::move(other.governor);
+    category = other.category;
+    bytes = other.bytes;
+    other.governor = nullptr;
+    other.bytes = 0;
+  }
+  return *this;
+}
+
+MemoryLease::~MemoryLease() {
+  reset();
+}
+
+void MemoryLease::reset() {
+  if (governor != nullptr) {
+    governor->track(category, -static_cast<int64_t>(bytes));
+  }
+  governor = nullptr;
+  bytes = 0;
+}
+
+uint64_t MemoryLease::size() const {
+  return bytes;
+}
+
+const char* monokl::memory_pressure_name(MemoryPressure pressure) {
+  switch (pressure) {
+    case MemoryPressureNone:
+      return "none";
+    case MemoryPressureShrinkCaches:
+      return "shrink-caches";
+    case MemoryPressureDownscaleInactive:
+      return "downscale-inactive";
+    case MemoryPressureDropInactive:
+      return "drop-inactive";
+    default:
+      return "unknown";
+  }
+}
@@ -0,0 +1,120 @@
+#ifndef MONOKL__MEMORY_GOVERNOR_H
+#define MONOKL__MEMORY_GOVERNOR_H
+
+#include <memory>
+#include <functional>
+#include <atomic>
+#include <mutex>
+#include <map>
+#include <chrono>
+#include <cstdint>
+
+namespace monokl {
+
+typedef enum {
+  MemoryCategoryDecodedImages,
+  MemoryCategoryTextures,
+  MemoryCategoryCaches,
+  MemoryCategoryCount
+} MemoryCategory;
+
+/**
+ * Pressure levels are cumulative, each level implies the responses of the ones before it:
+ * caches are shrunk first, then non-current images are kept only at a downscaled level,
+ * and finally they aren't kept at all.
+ */
+typedef enum {
+  MemoryPressureNone,
+  MemoryPressureShrinkCaches,
+  MemoryPressureDownscaleInactive,
+  MemoryPressureDropInactive
+} MemoryPressure;
+
+struct MemoryGovernorOptions {
+  // Hard budget for everything monokl tracks, 0 means it's derived from the system limits
+  uint64_t budget_bytes = 0;
+  // Share of the effective system (or cgroup) memory monokl allows itself when no explicit budget is set
+  double budget_ratio = 0.5;
+  unsigned int poll_interval_ms = 1000;
+};
+
+struct SystemMemoryInfo {
+  uint64_t total = 0;
+  uint64_t available = 0;
+  // 0 when there's no cgroup limit, or it couldn't be determined
+  uint64_t cgroup_limit = 0;
+  uint64_t cgroup_usage = 0;
+
+  uint64_t effective_limit() const;
+  uint64_t effective_available() const;
+
+  static SystemMemoryInfo read();
+};
+
+class MemoryGovernor {
+public:
+  typedef std::function<void(MemoryPressure)> PressureListener;
+
+  explicit MemoryGovernor(const MemoryGovernorOptions& options);
+
+  void track(MemoryCategory category, int64_t delta);
+  uint64_t usage(MemoryCategory category) const;
+  uint64_t total_usage() const;
+  uint64_t budget() const;
+
+  MemoryPressure pressure() const;
+  bool should_shrink_caches() const;
+  bool should_downscale_inactive() const;
+  bool should_drop_inactive() const;
+
+  int add_listener(const PressureListener& listener);
+  void remove_listener(int id);
+
+  void poll(bool force = false);
+
+private:
+  MemoryGovernorOptions options;
+
+  std::atomic<int64_t> usages[MemoryCategoryCount];
+  std::atomic<uint64_t> effective_budget{0};
+  std::atomic<int> current_pressure{MemoryPressureNone};
+
+  SystemMemoryInfo system_info;
+  std::chrono::steady_clock::time_point last_polled_at;
+
+  std::mutex listeners_mutex;
+  int next_listener_id = 1;
+  std::map<int, PressureListener> listeners;
+
+  MemoryPressure evaluate_pressure() const;
+  void publish_instrumentation() const;
+};
+
+/**
+ * RAII handle for a tracked allocation. Moving the lease moves the accounting along with it,
+ * destroying or resetting it gives the bytes back to the governor.
+ */
+class MemoryLease {
+public:
+  MemoryLease() = default;
+  MemoryLease(const std::shared_ptr<MemoryGovernor>& governor, MemoryCategory category, uint64_t bytes);
+  MemoryLease(MemoryLease&& other) noexcept;
+  MemoryLease& operator=(MemoryLease&& other) noexcept;
+  MemoryLease(const MemoryLease&) = delete;
+  MemoryLease& operator=(const MemoryLease&) = delete;
+  ~MemoryLease();
+
+  void reset();
+  uint64_t size() const;
+
+private:
+  std::shared_ptr<MemoryGovernor> governor = nullptr;
+  MemoryCategory category = MemoryCategoryDecodedImages;
+  uint64_t bytes = 0;
+};
+
+const char* memory_pressure_name(MemoryPressure pressure);
+
+}
+
+#endif
@@ -0,0 +1,612 @@
+#include "metadata_store.h"
+#include "durable_file.h"
+#include "util.h"
+#include "logging.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <vector>
+
+#include <toml.hpp>
+
+using namespace monokl;
+
+// "MKDM" and "MWAL" when read back on a machine with the same byte order
+static const uint32_t STORE_MAGIC = 0x4D444B4D;
+static const uint32_t STORE_VERSION = 1;
+static const uint32_t WAL_MAGIC = 0x4C41574D;
+static const size_t COMPACT_AFTER_RECORDS = 4096;
+
+/*
+ * `metadata.bin` is the header, the folders sorted by hash, the records grouped by folder, the
+ * open addressing table of record indices (plus one, 0 is an empty slot) and the string pool.
+ */
+struct StoreHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t folder_count;
+  uint32_t record_count;
+  uint32_t slot_count;
+  uint32_t reserved;
+  uint64_t strings_size;
+};
+
+struct StoreFolder {
+  uint64_t hash;
+  uint32_t path_offset;
+  uint32_t path_length;
+  uint32_t first_record;
+  uint32_t record_count;
+};
+
+struct StoreRecord {
+  uint64_t folder_hash;
+  uint64_t name_hash;
+  uint32_t name_offset;
+  uint32_t name_length;
+  uint32_t flags;
+  uint32_t reserved;
+};
+
+// Followed by the folder path, the file name and a checksum of everything before it
+struct WalHeader {
+  uint32_t magic;
+  uint32_t flags;
+  uint64_t folder_hash;
+  uint64_t name_hash;
+  uint32_t folder_length;
+  uint32_t name_length;
+};
+
+static_assert(sizeof(StoreHeader) % 8 == 0, "StoreHeader must keep the tables 8 byte aligned");
+static_assert(sizeof(StoreFolder) % 8 == 0, "StoreFolder must keep the tables 8 byte aligned");
+static_assert(sizeof(StoreRecord) % 8 == 0, "StoreRecord must keep the tables 8 byte aligned");
+
+struct SnapshotView {
+  const StoreHeader* header = nullptr;
+  const StoreFolder* folders = nullptr;
+  const StoreRecord* records = nullptr;
+  const uint32_t* slots = nullptr;
+  const char* strings = nullptr;
+};
+
+static uint32_t checksum(const char* data, size_t size) {
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < size; i++) {
+    hash ^= static_cast<unsigned char>(data[i]);
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static uint64_t slot_hash(uint64_t folder_hash, uint64_t name_hash) {
+  uint64_t hash = folder_hash ^ (name_hash * 0x9E3779B97F4A7C15ULL);
+  return hash ^ (hash >> 29);
+}
+
+static std::string folder_key(const std::filesystem::path& folder) {
+  auto key = folder.lexically_normal().u8string();
+  while (key.size() > 1 && (key.back() == '/' || key.back() == '\\')) {
+    key.pop_back();
+  }
+  return key;
+}
+
+// The folder's own record, which only carries `MetadataFlagFolderKnown`
+static const uint64_t FOLDER_RECORD_HASH = Util::hash_string("");
+
+static bool view_snapshot(const MappedFile* file, SnapshotView& view) {
+  if (file == nullptr || file->size() < sizeof(StoreHeader)) {
+    return false;
+  }
+
+  const uint8_t* data = file->data();
+  const auto* header = reinterpret_cast<const StoreHeader*>(data);
+  if (header->magic != STORE_MAGIC || header->version != STORE_VERSION) {
+    return false;
+  }
+
+  uint64_t expected_size = sizeof(StoreHeader)
+    + static_cast<uint64_t>(header->folder_count) * sizeof(StoreFolder)
+    + static_cast<uint64_t>(header->record_count) * sizeof(StoreRecord)
+    + static_cast<uint64_t>(header->slot_count) * sizeof(uint32_t)
+    + header->strings_size;
+  if (expected_size != file->size() || (header->slot_count & (header->slot_count - 1)) != 0) {
+    return false;
+  }
+
+  view.header = header;
+  view.folders = reinterpret_cast<const StoreFolder*>(data + sizeof(StoreHeader));
+  view.records = reinterpret_cast<const StoreRecord*>(view.folders + header->folder_count);
+  view.slots = reinterpret_cast<const uint32_t*>(view.records + header->record_count);
+  view.strings = reinterpret_cast<const char*>(view.slots + header->slot_count);
+  return true;
+}
+
+// Checked once when mapped, so readers can trust every offset, count and slot of the snapshot
+static bool validate_snapshot(const SnapshotView& view) {
+  const auto* header = view.header;
+  auto in_strings = [&](uint32_t offset, uint32_t length) {
+    return static_cast<uint64_t>(offset) + length <= header->strings_size;
+  };
+
+  for (uint32_t i = 0; i < header->folder_count; i++) {
+    const auto& folder = view.folders[i];
+    if (static_cast<uint64_t>(folder.first_record) + folder.record_count > header->record_count
+        || !in_strings(folder.path_offset, folder.path_length)
+        || (i > 0 && view.folders[i - 1].hash >= folder.hash)) {
+      return false;
+    }
+  }
+
+  for (uint32_t i = 0; i < header->record_count; i++) {
+    if (!in_strings(view.records[i].name_offset, view.records[i].name_length)) {
+      return false;
+    }
+  }
+
+  for (uint32_t i = 0; i < header->slot_count; i++) {
+    if (view.slots[i] > header->record_count) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static const StoreFolder* find_snapshot_folder(const SnapshotView& view, uint64_t folder_hash) {
+  const StoreFolder* begin = view.folders;
+  const StoreFolder* end = view.folders + view.header->folder_count;
+  auto it = std::lower_bound(begin, end, folder_hash, [](const StoreFolder& folder, uint64_t hash) {
+    return folder.hash < hash;
+  });
+  return it != end && it->hash == folder_hash ? it : nullptr;
+}
+
+MetadataStore& MetadataStore::get() {
+  static MetadataStore store;
+  return store;
+}
+
+bool MetadataStore::open(const std::filesystem::path& directory) {
+  std::lock_guard<std::mutex> lock(mutex);
+  if (wal_fd >= 0) {
+    return true;
+  }
+
+  std::error_code error;
+  std::filesystem::create_directories(directory, error);
+
+  this->directory = directory;
+  map_snapshot();
+
+  wal_fd = DurableFile::open(directory / "metadata.wal", true, false);
+  if (wal_fd < 0) {
+    log_error("Failed to open metadata log in %s", directory.string().c_str());
+    snapshot.reset();
+    return false;
+  }
+
+  replay_wal();
+  if (wal_records >= COMPACT_AFTER_RECORDS) {
+    compact_locked();
+  }
+
+  SnapshotView view;
+  size_t snapshot_records = view_snapshot(snapshot.get(), view) ? view.header->record_count : 0;
+  log_debug("Opened metadata store with %lu records and %lu logged changes", snapshot_records, wal_records);
+  return true;
+}
+
+void MetadataStore::close() {
+  std::lock_guard<std::mutex> lock(mutex);
+  if (wal_fd < 0) {
+    return;
+  }
+
+  if (wal_records > 0) {
+    compact_locked();
+  }
+
+  DurableFile::close(wal_fd);
+  wal_fd = -1;
+  snapshot.reset();
+  overlay.clear();
+  wal_records = 0;
+}
+
+bool MetadataStore::is_open() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  return wal_fd >= 0;
+}
+
+bool MetadataStore::map_snapshot() {
+  snapshot = MappedFile::open(directory / "metadata.bin");
+
+  SnapshotView view;
+  if (snapshot != nullptr && (!view_snapshot(snapshot.get(), view) || !validate_snapshot(view))) {
+    log_warn("Ignoring corrupted metadata snapshot in %s", directory.string().c_str());
+    snapshot.reset();
+  }
+  return snapshot != nullptr;
+}
+
+void MetadataStore::replay_wal() {
+  std::ifstream file(directory / "metadata.wal", std::ios::binary);
+  std::string data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+
+  size_t offset = 0;
+  while (offset + sizeof(WalHeader) + sizeof(uint32_t) <= data.size()) {
+    WalHeader header;
+    std::memcpy(&header, data.data() + offset, sizeof(header));
+    if (header.magic != WAL_MAGIC) {
+      break;
+    }
+
+    size_t payload = static_cast<size_t>(header.folder_length) + header.name_length;
+    size_t record_size = sizeof(WalHeader) + payload + sizeof(uint32_t);
+    if (offset + record_size > data.size()) {
+      break;
+    }
+
+    uint32_t stored_checksum;
+    std::memcpy(&stored_checksum, data.data() + offset + sizeof(WalHeader) + payload, sizeof(stored_checksum));
+    if (stored_checksum != checksum(data.data() + offset, sizeof(WalHeader) + payload)) {
+      break;
+    }
+
+    const char* strings = data.data() + offset + sizeof(WalHeader);
+    apply(header.folder_hash, header.name_hash, std::string(strings, header.folder_length), std::string(strings + header.folder_length, header.name_length), header.flags);
+
+    offset += record_size;
+    wal_records++;
+  }
+
+  // A torn write at the end is dropped, otherwise new records would be appended after it
+  if (offset < data.size()) {
+    log_warn("Dropping %lu bytes of incomplete metadata log", data.size() - offset);
+    if (!DurableFile::truncate(wal_fd, offset)) {
+      log_warn("Failed to truncate metadata log");
+    }
+  }
+}
+
+bool MetadataStore::append_to_wal(uint64_t folder_hash, uint64_t name_hash, const std::string& folder, const std::string& name, uint32_t flags) {
+  WalHeader header;
+  header.magic = WAL_MAGIC;
+  header.flags = flags;
+  header.folder_hash = folder_hash;
+  header.name_hash = name_hash;
+  header.folder_length = static_cast<uint32_t>(folder.size());
+  header.name_length = static_cast<uint32_t>(name.size());
+
+  std::string record;
+  record.reserve(sizeof(header) + folder.size() + name.size() + sizeof(uint32_t));
+  record.append(reinterpret_cast<const char*>(&header), sizeof(header));
+  record.append(folder);
+  record.append(name);
+  uint32_t record_checksum = checksum(record.data(), record.size());
+  record.append(reinterpret_cast<const char*>(&record_checksum), sizeof(record_checksum));
+
+  if (!DurableFile::write_all(wal_fd, record.data(), record.size())) {
+    log_error("Failed to write to metadata log");
+    return false;
+  }
+
+  wal_records++;
+  return true;
+}
+
+void MetadataStore::apply(uint64_t folder_hash, uint64_t name_hash, const std::string& folder, const std::string& name, uint32_t flags) {
+  auto& overlay_folder = overlay[folder_hash];
+  if (overlay_folder.path.empty()) {
+    overlay_folder.path = folder;
+  }
+
+  auto& entry = overlay_folder.entries[name_hash];
+  entry.name = name;
+  entry.flags = flags;
+}
+
+uint32_t MetadataStore::lookup(uint64_t folder_hash, uint64_t name_hash) const {
+  auto folder = overlay.find(folder_hash);
+  if (folder != overlay.end()) {
+    auto entry = folder->second.entries.find(name_hash);
+    if (entry != folder->second.entries.end()) {
+      return entry->second.flags;
+    }
+  }
+
+  SnapshotView view;
+  if (!view_snapshot(snapshot.get(), view) || view.header->slot_count == 0) {
+    return 0;
+  }
+
+  // A table without an empty slot would otherwise be probed forever
+  uint32_t mask = view.header->slot_count - 1;
+  uint32_t slot = slot_hash(folder_hash, name_hash) & mask;
+  for (uint32_t probes = 0; probes < view.header->slot_count; probes++, slot = (slot + 1) & mask) {
+    uint32_t index = view.slots[slot];
+    if (index == 0) {
+      return 0;
+    }
+
+    const auto& record = view.records[index - 1];
+    if (record.folder_hash == folder_hash && record.name_hash == name_hash) {
+      return record.flags;
+    }
+  }
+  return 0;
+}
+
+uint32_t MetadataStore::get_flags(const std::filesystem::path& folder, const std::string& name) const {
+  std::lock_guard<std::mutex> lock(mutex);
+  return lookup(Util::hash_string(folder_key(folder)), Util::hash_string(name));
+}
+
+bool MetadataStore::set_flags(const std::filesystem::path& folder, const std::string& name, uint32_t flags) {
+  std::lock_guard<std::mutex> lock(mutex);
+  if (wal_fd < 0) {
+    return false;
+  }
+
+  auto key = folder_key(folder);
+  uint64_t folder_hash = Util::hash_string(key);
+  uint64_t name_hash = Util::hash_string(name);
+  if (lookup(folder_hash, name_hash) == flags) {
+    return true;
+  }
+
+  if (!append_to_wal(folder_hash, name_hash, key, name, flags) || !DurableFile::sync(wal_fd)) {
+    return false;
+  }
+  apply(folder_hash, name_hash, key, name, flags);
+
+  if (wal_records >= COMPACT_AFTER_RECORDS) {
+    compact_locked();
+  }
+  return true;
+}
+
+bool MetadataStore::load_folder(const std::filesystem::path& folder, std::set<std::string>& favorites, std::set<std::string>& hidden) const {
+  std::lock_guard<std::mutex> lock(mutex);
+
+  uint64_t folder_hash = Util::hash_string(folder_key(folder));
+  if ((lookup(folder_hash, FOLDER_RECORD_HASH) & MetadataFlagFolderKnown) == 0) {
+    return false;
+  }
+
+  auto add = [&](const std::string& name, uint32_t flags) {
+    if (flags & MetadataFlagFavorite) {
+      favorites.insert(name);
+    }
+    if (flags & MetadataFlagHidden) {
+      hidden.insert(name);
+    }
+  };
+
+  auto overlay_folder = overlay.find(folder_hash);
+
+  SnapshotView view;
+  const StoreFolder* snapshot_folder = view_snapshot(snapshot.get(), view) ? find_snapshot_folder(view, folder_hash) : nullptr;
+  if (snapshot_folder != nullptr) {
+    for (uint32_t i = snapshot_folder->first_record; i < snapshot_folder->first_record + snapshot_folder->record_count; i++) {
+      const auto& record = view.records[i];
+      if (overlay_folder != overlay.end() && overlay_folder->second.entries.count(record.name_hash) != 0) {
+        continue;
+      }
+      add(std::string(view.strings + record.name_offset, record.name_length), record.flags);
+    }
+  }
+
+  if (overlay_folder != overlay.end()) {
+    for (const auto& entry : overlay_folder->second.entries) {
+      add(entry.second.name, entry.second.flags);
+    }
+  }
+
+  return true;
+}
+
+void MetadataStore::import_folder(const std::filesystem::path& folder, const std::set<std::string>& favorites, const std::set<std::string>& hidden) {
+  std::lock_guard<std::mutex> lock(mutex);
+  if (wal_fd < 0) {
+    return;
+  }
+
+  auto key = folder_key(folder);
+  uint64_t folder_hash = Util::hash_string(key);
+
+  std::map<std::string, uint32_t> flags;
+  for (const auto& name : favorites) {
+    flags[name] |= MetadataFlagFavorite;
+  }
+  for (const auto& name : hidden) {
+    flags[name] |= MetadataFlagHidden;
+  }
+  flags[""] = MetadataFlagFolderKnown;
+
+  // One sync for the whole folder, the folder's own record goes last so a torn import is retried
+  bool written = true;
+  for (const auto& entry : flags) {
+    if (entry.first.empty()) {
+      continue;
+    }
+    written = written && append_to_wal(folder_hash, Util::hash_string(entry.first), key, entry.first, entry.second);
+  }
+  written = written && append_to_wal(folder_hash, FOLDER_RECORD_HASH, key, "", MetadataFlagFolderKnown);
+  if (!written || !DurableFile::sync(wal_fd)) {
+    return;
+  }
+
+  for (const auto& entry : flags) {
+    apply(folder_hash, Util::hash_string(entry.first), key, entry.first, entry.second);
+  }
+
+  if (wal_records >= COMPACT_AFTER_RECORDS) {
+    compact_locked();
+  }
+}
+
+bool MetadataStore::export_folder(const std::filesystem::path& folder, const std::filesystem::path& settings_path) const {
+  std::set<std::string> favorites;
+  std::set<std::string> hidden;
+  if (!load_folder(folder, favorites, hidden)) {
+    return false;
+  }
+
+  toml::value data;
+  data["favorites"] = std::vector<std::string>(favorites.begin(), favorites.end());
+  data["hidden"] = std::vector<std::string>(hidden.begin(), hidden.end());
+
+  if (!DurableFile::replace(settings_path, toml::format(data))) {
+    return false;
+  }
+
+  log_debug("Exported %lu favorites and %lu hidden images to %s", favorites.size(), hidden.size(), settings_path.string().c_str());
+  return true;
+}
+
+void MetadataStore::compact() {
+  std::lock_guard<std::mutex> lock(mutex);
+  if (wal_fd >= 0) {
+    compact_locked();
+  }
+}
+
+bool MetadataStore::compact_locked() {
+  struct MergedFolder {
+    std::string path;
+    std::map<uint64_t, OverlayEntry> entries;
+  };
+
+  // Snapshot first, then the logged changes on top of it
+  std::map<uint64_t, MergedFolder> merged;
+
+  SnapshotView view;
+  if (view_snapshot(snapshot.get(), view)) {
+    for (uint32_t i = 0; i < view.header->folder_count; i++) {
+      const auto& folder = view.folders[i];
+      auto& merged_folder = merged[folder.hash];
+      merged_folder.path.assign(view.strings + folder.path_offset, folder.path_length);
+      for (uint32_t r = folder.first_record; r < folder.first_record + folder.record_count; r++) {
+        const auto& record = view.records[r];
+        auto& entry = merged_folder.entries[record.name_hash];
+        entry.name.assign(view.strings + record.name_offset, record.name_length);
+        entry.flags = record.flags;
+      }
+    }
+  }
+
+  for (const auto& folder : overlay) {
+    auto& merged_folder = merged[folder.first];
+    if (merged_folder.path.empty()) {
+      merged_folder.path = folder.second.path;
+    }
+    for (const auto& entry : folder.second.entries) {
+      merged_folder.entries[entry.first] = entry.second;
+    }
+  }
+
+  std::vector<StoreFolder> folders;
+  std::vector<StoreRecord> records;
+  std::string strings;
+
+  for (const auto& folder : merged) {
+    StoreFolder store_folder = {};
+    store_folder.hash = folder.first;
+    store_folder.path_offset = static_cast<uint32_t>(strings.size());
+    store_folder.path_length = static_cast<uint32_t>(folder.second.path.size());
+    store_folder.first_record = static_cast<uint32_t>(records.size());
+    strings.append(folder.second.path);
+
+    for (const auto& entry : folder.second.entries) {
+      // Cleared flags carry no information once they're no longer needed to shadow the snapshot
+      if (entry.second.flags == 0) {
+        continue;
+      }
+
+      StoreRecord record = {};
+      record.folder_hash = folder.first;
+      record.name_hash = entry.first;
+      record.name_offset = static_cast<uint32_t>(strings.size());
+      record.name_length = static_cast<uint32_t>(entry.second.name.size());
+      record.flags = entry.second.flags;
+      strings.append(entry.second.name);
+      records.push_back(record);
+    }
+
+    store_folder.record_count = static_cast<uint32_t>(records.size()) - store_folder.first_record;
+    if (store_folder.record_count > 0) {
+      folders.push_back(store_folder);
+    }
+  }
+
+  // At most half full, so probe sequences stay short; always even to keep the strings aligned
+  uint32_t slot_count = 2;
+  while (slot_count < records.size() * 2) {
+    slot_count *= 2;
+  }
+  std::vector<uint32_t> slots(slot_count, 0);
+  for (uint32_t i = 0; i < records.size(); i++) {
+    uint32_t slot = slot_hash(records[i].folder_hash, records[i].name_hash) & (slot_count - 1);
+    while (slots[slot] != 0) {
+      slot = (slot + 1) & (slot_count - 1);
+    }
+    slots[slot] = i + 1;
+  }
+
+  StoreHeader header = {};
+  header.magic = STORE_MAGIC;
+  header.version = STORE_VERSION;
+  header.folder_count = static_cast<uint32_t>(folders.size());
+  header.record_count = static_cast<uint32_t>(records.size());
+  header.slot_count = slot_count;
+  header.strings_size = strings.size();
+
+  std::string out;
+  out.append(reinterpret_cast<const char*>(&header), sizeof(header));
+  out.append(reinterpret_cast<const char*>(folders.data()), folders.size() * sizeof(StoreFolder));
+  out.append(reinterpret_cast<const char*>(records.data()), records.size() * sizeof(StoreRecord));
+  out.append(reinterpret_cast<const char*>(slots.data()), slots.size() * sizeof(uint32_t));
+  out.append(strings);
+
+  auto path = directory / "metadata.bin";
+  auto tmp_path = directory / "metadata.bin.tmp";
+
+  int fd = DurableFile::open(tmp_path, false, true);
+  bool written = fd >= 0 && DurableFile::write_all(fd, out.data(), out.size()) && DurableFile::sync(fd);
+  if (fd >= 0) {
+    DurableFile::close(fd);
+  }
+  if (!written) {
+    log_error("Failed to write metadata snapshot to %s", tmp_path.string().c_str());
+    return false;
+  }
+
+  // The old snapshot has to be unmapped before it can be replaced on Windows
+  snapshot.reset();
+
+  std::error_code error;
+  std::filesystem::rename(tmp_path, path, error);
+  if (error) {
+    log_error("Failed to replace metadata snapshot: %s", error.message().c_str());
+    map_snapshot();
+    return false;
+  }
+  DurableFile::sync_directory(directory);
+  map_snapshot();
+
+  // Replaying a log over the snapshot it was folded into changes nothing, so a crash right here is harmless
+  DurableFile::close(wal_fd);
+  wal_fd = DurableFile::open(directory / "metadata.wal", true, true);
+  if (wal_fd < 0) {
+    log_error("Failed to reopen metadata log, further changes won't be stored");
+  }
+  overlay.clear();
+  wal_records = 0;
+
+  log_debug("Compacted metadata store to %lu records in %lu folders", records.size(), folders.size());
+  return true;
+}
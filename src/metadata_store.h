@@ -0,0 +1,81 @@
+#ifndef MONOKL__METADATA_STORE_H
+#define MONOKL__METADATA_STORE_H
+
+#include <memory>
+#include <string>
+#include <set>
+#include <mutex>
+#include <unordered_map>
+#include <filesystem>
+#include <cstdint>
+
+#include "mapped_file.h"
+
+namespace monokl {
+
+typedef enum {
+  MetadataFlagFavorite = 1 << 0,
+  MetadataFlagHidden = 1 << 1,
+  // Set on a folder's own record once its `.monokl.toml` has been imported, or found missing
+  MetadataFlagFolderKnown = 1 << 2
+} MetadataFlag;
+
+/**
+ * Favorites and hidden flags of every folder in one place, instead of a `.monokl.toml` per folder.
+ *
+ * The state lives in `metadata.bin`, a memory mapped snapshot with an open addressing table over
+ * (folder hash, file name hash) for O(1) lookups and the records grouped per folder for listing.
+ * Every change is appended to `metadata.wal` and synced before the call returns, so a crash loses
+ * nothing; the log is replayed on open and folded into a new snapshot once it grows too long.
+ */
+class MetadataStore {
+public:
+  static MetadataStore& get();
+
+  bool open(const std::filesystem::path& directory);
+  void close();
+  bool is_open() const;
+
+  uint32_t get_flags(const std::filesystem::path& folder, const std::string& name) const;
+  bool set_flags(const std::filesystem::path& folder, const std::string& name, uint32_t flags);
+
+  // Returns false if nothing is known about the folder yet, so it should be imported first
+  bool load_folder(const std::filesystem::path& folder, std::set<std::string>& favorites, std::set<std::string>& hidden) const;
+  void import_folder(const std::filesystem::path& folder, const std::set<std::string>& favorites, const std::set<std::string>& hidden);
+  // Writes the folder's flags to its `.monokl.toml` at `settings_path`, for use without the store
+  bool export_folder(const std::filesystem::path& folder, const std::filesystem::path& settings_path) const;
+
+  void compact();
+
+private:
+  MetadataStore() = default;
+
+  struct OverlayEntry {
+    std::string name;
+    uint32_t flags = 0;
+  };
+
+  struct OverlayFolder {
+    std::string path;
+    std::unordered_map<uint64_t, OverlayEntry> entries;
+  };
+
+  mutable std::mutex mutex;
+  std::filesystem::path directory;
+  std::unique_ptr<MappedFile> snapshot;
+  // Changes since the snapshot was written, by folder hash and then file name hash
+  std::unordered_map<uint64_t, OverlayFolder> overlay;
+  int wal_fd = -1;
+  size_t wal_records = 0;
+
+  bool map_snapshot();
+  void replay_wal();
+  bool append_to_wal(uint64_t folder_hash, uint64_t name_hash, const std::string& folder, const std::string& name, uint32_t flags);
+  void apply(uint64_t folder_hash, uint64_t name_hash, const std::string& folder, const std::string& name, uint32_t flags);
+  uint32_t lookup(uint64_t folder_hash, uint64_t name_hash) const;
+  bool compact_locked();
+};
+
+}
+
+#endif
@@ -0,0 +1,160 @@
+#include "name_index.h"
+
+#include <algorithm>
+#include <iterator>
+#include <string_view>
+#include <utility>
+
+using namespace monokl;
+
+static const uint32_t BUCKET_BITS = 16;
+static const uint32_t BUCKET_COUNT = 1u << BUCKET_BITS;
+
+static char to_lower_ascii(char c) {
+  return (c >= 'A' && c <= 'Z') ? static_cast<char>(c - 'A' + 'a') : c;
+}
+
+static uint32_t trigram_bucket(const char* p) {
+  uint32_t trigram = static_cast<uint8_t>(p[0]) | (static_cast<uint8_t>(p[1]) << 8) | (static_cast<uint8_t>(p[2]) << 16);
+  return (trigram * 2654435761u) >> (32 - BUCKET_BITS);
+}
+
+// Distinct buckets of all trigrams in `text`, so a name is listed at most once per bucket.
+// `stamps` remembers the last name each bucket was seen in, which is cheaper than sorting.
+static void collect_buckets(const char* text, size_t length, uint32_t stamp, std::vector<uint32_t>& stamps, std::vector<uint32_t>& buckets) {
+  buckets.clear();
+  for (size_t i = 0; i + 3 <= length; i++) {
+    uint32_t bucket = trigram_bucket(text + i);
+    if (stamps[bucket] != stamp) {
+      stamps[bucket] = stamp;
+      buckets.push_back(bucket);
+    }
+  }
+}
+
+void NameIndex::build(const std::vector<std::string>& names) {
+  clear();
+
+  size_t pool_size = 0;
+  for (const auto& name : names) {
+    pool_size += name.size();
+  }
+
+  pool.reserve(pool_size);
+  name_offsets.reserve(names.size() + 1);
+  for (const auto& name : names) {
+    name_offsets.push_back(static_cast<uint32_t>(pool.size()));
+    for (char c : name) {
+      pool.push_back(to_lower_ascii(c));
+    }
+  }
+  name_offsets.push_back(static_cast<uint32_t>(pool.size()));
+
+  // Counted first and filled second, so the postings end up in one flat array
+  uint32_t name_count = static_cast<uint32_t>(names.size());
+  std::vector<uint32_t> buckets;
+  std::vector<uint32_t> stamps(BUCKET_COUNT, 0);
+
+  bucket_offsets.assign(BUCKET_COUNT + 1, 0);
+  for (uint32_t i = 0; i < name_count; i++) {
+    collect_buckets(pool.data() + name_offsets[i], name_offsets[i + 1] - name_offsets[i], i + 1, stamps, buckets);
+    for (uint32_t bucket : buckets) {
+      bucket_offsets[bucket + 1]++;
+    }
+  }
+  for (uint32_t bucket = 0; bucket < BUCKET_COUNT; bucket++) {
+    bucket_offsets[bucket + 1] += bucket_offsets[bucket];
+  }
+
+  postings.resize(bucket_offsets[BUCKET_COUNT]);
+  std::vector<uint32_t> cursors(bucket_offsets.begin(), bucket_offsets.end() - 1);
+  std::fill(stamps.begin(), stamps.end(), 0);
+  for (uint32_t i = 0; i < name_count; i++) {
+    collect_buckets(pool.data() + name_offsets[i], name_offsets[i + 1] - name_offsets[i], i + 1, stamps, buckets);
+    for (uint32_t bucket : buckets) {
+      postings[cursors[bucket]++] = i;
+    }
+  }
+}
+
+void NameIndex::clear() {
+  pool.clear();
+  name_offsets.clear();
+  bucket_offsets.clear();
+  postings.clear();
+  last_query.clear();
+  last_results.clear();
+  has_last_results = false;
+}
+
+bool NameIndex::empty() const {
+  return name_offsets.size() <= 1;
+}
+
+size_t NameIndex::size_in_bytes() const {
+  return pool.capacity() + (name_offsets.capacity() + bucket_offsets.capacity() + postings.capacity()) * sizeof(uint32_t);
+}
+
+bool NameIndex::name_contains(uint32_t name, const std::string& needle) const {
+  std::string_view text(pool.data() + name_offsets[name], name_offsets[name + 1] - name_offsets[name]);
+  return text.find(needle) != std::string_view::npos;
+}
+
+const std::vector<uint32_t>& NameIndex::find(const std::string& query) {
+  std::string needle;
+  needle.reserve(query.size());
+  for (char c : query) {
+    needle.push_back(to_lower_ascii(c));
+  }
+
+  if (has_last_results && needle == last_query) {
+    return last_results;
+  }
+
+  uint32_t name_count = empty() ? 0 : static_cast<uint32_t>(name_offsets.size() - 1);
+  std::vector<uint32_t> results;
+
+  if (has_last_results && needle.find(last_query) != std::string::npos) {
+    // Every name containing the new query also contained the previous one
+    for (uint32_t name : last_results) {
+      if (name_contains(name, needle)) {
+        results.push_back(name);
+      }
+    }
+  } else if (needle.size() < 3) {
+    for (uint32_t name = 0; name < name_count; name++) {
+      if (name_contains(name, needle)) {
+        results.push_back(name);
+      }
+    }
+  } else {
+    std::vector<uint32_t> buckets;
+    std::vector<uint32_t> stamps(BUCKET_COUNT, 0);
+    collect_buckets(needle.data(), needle.size(), 1, stamps, buckets);
+
+    // Intersecting the shortest lists first keeps the candidate set small from the start
+    std::sort(buckets.begin(), buckets.end(), [this](uint32_t a, uint32_t b) {
+      return bucket_offsets[a + 1] - bucket_offsets[a] < bucket_offsets[b + 1] - bucket_offsets[b];
+    });
+
+    std::vector<uint32_t> candidates(postings.begin() + bucket_offsets[buckets[0]], postings.begin() + bucket_offsets[buckets[0] + 1]);
+    std::vector<uint32_t> intersection;
+    for (size_t i = 1; i < buckets.size() && !candidates.empty(); i++) {
+      intersection.clear();
+      std::set_intersection(candidates.begin(), candidates.end(), postings.begin() + bucket_offsets[buckets[i]], postings.begin() + bucket_offsets[buckets[i] + 1], std::back_inserter(intersection));
+      candidates.swap(intersection);
+    }
+
+    // Buckets are shared between trigrams, so the candidates still have to be checked
+    for (uint32_t name : candidates) {
+      if (name_contains(name, needle)) {
+        results.push_back(name);
+      }
+    }
+  }
+
+  last_query = std::move(needle);
+  last_results = std::move(results);
+  has_last_results = true;
+  return last_results;
+}
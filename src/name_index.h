@@ -0,0 +1,43 @@
+#ifndef MONOKL__NAME_INDEX_H
+#define MONOKL__NAME_INDEX_H
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+namespace monokl {
+
+/**
+ * Case-insensitive substring search over a list of file names. The names are lowercased into
+ * one contiguous pool, and every trigram of every name is hashed into one of 64K buckets that
+ * list the names containing it. A query only verifies the names found in all of its trigrams'
+ * buckets, and a query that extends the previous one only re-checks the previous results.
+ */
+class NameIndex {
+public:
+  void build(const std::vector<std::string>& names);
+  void clear();
+  bool empty() const;
+
+  // Indices of the names containing `query`, in ascending order
+  const std::vector<uint32_t>& find(const std::string& query);
+
+  size_t size_in_bytes() const;
+
+private:
+  std::string pool;
+  std::vector<uint32_t> name_offsets;
+  std::vector<uint32_t> bucket_offsets;
+  std::vector<uint32_t> postings;
+
+  std::string last_query;
+  std::vector<uint32_t> last_results;
+  bool has_last_results = false;
+
+  bool name_contains(uint32_t name, const std::string& needle) const;
+};
+
+}
+
+#endif
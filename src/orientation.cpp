@@ -0,0 +1,413 @@
+#include "orientation.h"
+#include "parallel.h"
+#include "simd.h"
+#include "logging.h"
+
+#include <algorithm>
+#include <cstring>
+#include <type_traits>
+#include <utility>
+
+using namespace monokl;
+
+// Blocks of 64x64 pixels (16 KB) fit comfortably in L1 together with their transposed counterpart
+static const unsigned int BLOCK_SIZE = 64;
+
+#if defined(MONOKL_SIMD_SSE2)
+typedef __m128i pixel4;
+
+static inline pixel4 load4(const uint32_t* p) {
+  return _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+}
+
+static inline void store4(uint32_t* p, pixel4 v) {
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(p), v);
+}
+
+static inline pixel4 reverse4(pixel4 v) {
+  return _mm_shuffle_epi32(v, _MM_SHUFFLE(0, 1, 2, 3));
+}
+
+static inline void transpose4(pixel4& r0, pixel4& r1, pixel4& r2, pixel4& r3) {
+  pixel4 t0 = _mm_unpacklo_epi32(r0, r1);
+  pixel4 t1 = _mm_unpacklo_epi32(r2, r3);
+  pixel4 t2 = _mm_unpackhi_epi32(r0, r1);
+  pixel4 t3 = _mm_unpackhi_epi32(r2, r3);
+  r0 = _mm_unpacklo_epi64(t0, t1);
+  r1 = _mm_unpackhi_epi64(t0, t1);
+  r2 = _mm_unpacklo_epi64(t2, t3);
+  r3 = _mm_unpackhi_epi64(t2, t3);
+}
+#elif defined(MONOKL_SIMD_NEON)
+typedef uint32x4_t pixel4;
+
+static inline pixel4 load4(const uint32_t* p) {
+  return vld1q_u32(p);
+}
+
+static inline void store4(uint32_t* p, pixel4 v) {
+  vst1q_u32(p, v);
+}
+
+static inline pixel4 reverse4(pixel4 v) {
+  pixel4 r = vrev64q_u32(v);
+  return vcombine_u32(vget_high_u32(r), vget_low_u32(r));
+}
+
+static inline void transpose4(pixel4& r0, pixel4& r1, pixel4& r2, pixel4& r3) {
+  uint32x4x2_t t01 = vtrnq_u32(r0, r1);
+  uint32x4x2_t t23 = vtrnq_u32(r2, r3);
+  r0 = vcombine_u32(vget_low_u32(t01.val[0]), vget_low_u32(t23.val[0]));
+  r1 = vcombine_u32(vget_low_u32(t01.val[1]), vget_low_u32(t23.val[1]));
+  r2 = vcombine_u32(vget_high_u32(t01.val[0]), vget_high_u32(t23.val[0]));
+  r3 = vcombine_u32(vget_high_u32(t01.val[1]), vget_high_u32(t23.val[1]));
+}
+#else
+struct pixel4 {
+  uint32_t v[4];
+};
+
+static inline pixel4 load4(const uint32_t* p) {
+  pixel4 r;
+  std::memcpy(r.v, p, sizeof(r.v));
+  return r;
+}
+
+static inline void store4(uint32_t* p, pixel4 v) {
+  std::memcpy(p, v.v, sizeof(v.v));
+}
+
+static inline pixel4 reverse4(pixel4 v) {
+  return pixel4{{v.v[3], v.v[2], v.v[1], v.v[0]}};
+}
+
+static inline void transpose4(pixel4& r0, pixel4& r1, pixel4& r2, pixel4& r3) {
+  pixel4 c0{{r0.v[0], r1.v[0], r2.v[0], r3.v[0]}};
+  pixel4 c1{{r0.v[1], r1.v[1], r2.v[1], r3.v[1]}};
+  pixel4 c2{{r0.v[2], r1.v[2], r2.v[2], r3.v[2]}};
+  pixel4 c3{{r0.v[3], r1.v[3], r2.v[3], r3.v[3]}};
+  r0 = c0;
+  r1 = c1;
+  r2 = c2;
+  r3 = c3;
+}
+#endif
+
+static inline void apply_transform(const PixelTransform* transform, uint32_t* pixels, size_t count) {
+  if (transform != nullptr) {
+    transform->apply(pixels, count);
+  }
+}
+
+static inline void apply_transform(const PixelTransform*, uint64_t*, size_t) {
+}
+
+// Swaps a[k] with b_end[-1 - k] for every k < count, the two ranges must not overlap
+template<typename Pixel>
+static void swap_reversed(Pixel* a, Pixel* b_end, size_t count) {
+  size_t k = 0;
+  if constexpr (std::is_same<Pixel, uint32_t>::value) {
+    for (; k + 4 <= count; k += 4) {
+      pixel4 lo = load4(a + k);
+      pixel4 hi = load4(b_end - 4 - k);
+      store4(a + k, reverse4(hi));
+      store4(b_end - 4 - k, reverse4(lo));
+    }
+  }
+  for (; k < count; k++) {
+    std::swap(a[k], b_end[-1 - static_cast<ptrdiff_t>(k)]);
+  }
+}
+
+// Copies `count` pixels from `src` into `dst_end - count .. dst_end` in reverse order
+template<typename Pixel>
+static void copy_reversed(const Pixel* src, Pixel* dst_end, size_t count) {
+  size_t k = 0;
+  if constexpr (std::is_same<Pixel, uint32_t>::value) {
+    for (; k + 4 <= count; k += 4) {
+      store4(dst_end - 4 - k, reverse4(load4(src + k)));
+    }
+  }
+  for (; k < count; k++) {
+    dst_end[-1 - static_cast<ptrdiff_t>(k)] = src[k];
+  }
+}
+
+// Transposes the 4x4 tile at `s` into 4 destination rows starting at column `col`
+static inline void transpose_tile(const uint32_t* s, size_t src_stride, uint32_t* d0, uint32_t* d1, uint32_t* d2, uint32_t* d3, unsigned int col, bool reverse_cols) {
+  pixel4 c0 = load4(s);
+  pixel4 c1 = load4(s + src_stride);
+  pixel4 c2 = load4(s + 2 * src_stride);
+  pixel4 c3 = load4(s + 3 * src_stride);
+  transpose4(c0, c1, c2, c3);
+
+  if (reverse_cols) {
+    c0 = reverse4(c0);
+    c1 = reverse4(c1);
+    c2 = reverse4(c2);
+    c3 = reverse4(c3);
+  }
+
+  store4(d0 + col, c0);
+  store4(d1 + col, c1);
+  store4(d2 + col, c2);
+  store4(d3 + col, c3);
+}
+
+static inline void transpose_tile(const uint64_t* s, size_t src_stride, uint64_t* d0, uint64_t* d1, uint64_t* d2, uint64_t* d3, unsigned int col, bool reverse_cols) {
+  uint64_t* rows[4] = {d0, d1, d2, d3};
+  for (unsigned int j = 0; j < 4; j++) {
+    for (unsigned int k = 0; k < 4; k++) {
+      rows[j][col + (reverse_cols ? 3 - k : k)] = s[k * src_stride + j];
+    }
+  }
+}
+
+/**
+ * Writes src[y][x] into dst[row][col] with row = x (or w - 1 - x) and col = y (or h - 1 - y),
+ * which covers transpose, transverse and the 90°/270° rotations. Each worker owns a band of
+ * source columns, which is a band of destination rows, so no two threads write the same lines.
+ */
+template<typename Pixel>
+static void transpose_blocked(const Pixel* src, unsigned int w, unsigned int h, size_t src_stride, Pixel* dst, bool reverse_rows, bool reverse_cols, const PixelTransform* transform) {
+  size_t dst_stride = h;
+  size_t column_blocks = (w + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+  auto dst_row = [&](unsigned int x) {
+    return dst + static_cast<size_t>(reverse_rows ? w - 1 - x : x) * dst_stride;
+  };
+
+  parallel_for(0, column_blocks, 4, [&](size_t first_block, size_t last_block) {
+    for (size_t bx = first_block; bx < last_block; bx++) {
+      unsigned int x0 = bx * BLOCK_SIZE;
+      unsigned int x1 = std::min(w, x0 + BLOCK_SIZE);
+
+      for (unsigned int y0 = 0; y0 < h; y0 += BLOCK_SIZE) {
+        unsigned int y1 = std::min(h, y0 + BLOCK_SIZE);
+
+        unsigned int y_end = y0 + ((y1 - y0) & ~3u);
+
+        // Walking down 4-column strips keeps each group of stores sequential within its 4 destination rows
+        unsigned int x = x0;
+        for (; x + 4 <= x1; x += 4) {
+          Pixel* d0 = dst_row(x);
+          Pixel* d1 = dst_row(x + 1);
+          Pixel* d2 = dst_row(x + 2);
+          Pixel* d3 = dst_row(x + 3);
+
+          for (unsigned int y = y0; y < y_end; y += 4) {
+            unsigned int col = reverse_cols ? h - 4 - y : y;
+            transpose_tile(src + static_cast<size_t>(y) * src_stride + x, src_stride, d0, d1, d2, d3, col, reverse_cols);
+          }
+        }
+
+        for (; x < x1; x++) {
+          Pixel* d = dst_row(x);
+          for (unsigned int y = y0; y < y_end; y++) {
+            d[reverse_cols ? h - 1 - y : y] = src[static_cast<size_t>(y) * src_stride + x];
+          }
+        }
+
+        for (unsigned int y = y_end; y < y1; y++) {
+          const Pixel* s = src + static_cast<size_t>(y) * src_stride;
+          unsigned int col = reverse_cols ? h - 1 - y : y;
+          for (x = x0; x < x1; x++) {
+            dst_row(x)[col] = s[x];
+          }
+        }
+
+        if (transform != nullptr) {
+          unsigned int col = reverse_cols ? h - y1 : y0;
+          for (x = x0; x < x1; x++) {
+            apply_transform(transform, dst_row(x) + col, y1 - y0);
+          }
+        }
+      }
+    }
+  });
+}
+
+static bool swaps_dimensions(ImageOrientation orientation) {
+  return orientation == OrientationTranspose || orientation == OrientationRotate90 || orientation == OrientationTransverse || orientation == OrientationRotate270;
+}
+
+template<typename Pixel>
+void monokl::copy_oriented(const Pixel* src, unsigned int width, unsigned int height, size_t src_stride, ImageOrientation orientation, PixelBuffer<Pixel>& dst, const PixelTransform* transform) {
+  if (swaps_dimensions(orientation)) {
+    dst.allocate(height, width);
+  } else {
+    dst.allocate(width, height);
+  }
+
+  if (width == 0 || height == 0) {
+    return;
+  }
+
+  Pixel* out = dst.pixels.data();
+
+  switch (orientation) {
+    case OrientationTranspose:
+      transpose_blocked(src, width, height, src_stride, out, false, false, transform);
+      return;
+    case OrientationRotate90:
+      transpose_blocked(src, width, height, src_stride, out, false, true, transform);
+      return;
+    case OrientationTransverse:
+      transpose_blocked(src, width, height, src_stride, out, true, true, transform);
+      return;
+    case OrientationRotate270:
+      transpose_blocked(src, width, height, src_stride, out, true, false, transform);
+      return;
+    default:
+      break;
+  }
+
+  bool flip_x = orientation == OrientationMirrorHorizontal || orientation == OrientationRotate180;
+  bool flip_y = orientation == OrientationMirrorVertical || orientation == OrientationRotate180;
+
+  parallel_for(0, height, 64, [&](size_t first_row, size_t last_row) {
+    for (size_t y = first_row; y < last_row; y++) {
+      const Pixel* s = src + y * src_stride;
+      Pixel* d = out + (flip_y ? height - 1 - y : y) * width;
+      if (flip_x) {
+        copy_reversed(s, d + width, width);
+      } else {
+        std::memcpy(d, s, width * sizeof(Pixel));
+      }
+
+      apply_transform(transform, d, width);
+    }
+  });
+}
+
+template<typename Pixel>
+void monokl::apply_orientation(PixelBuffer<Pixel>& buffer, ImageOrientation orientation) {
+  if (buffer.pixels.empty()) {
+    return;
+  }
+
+  unsigned int w = buffer.width;
+  unsigned int h = buffer.height;
+  Pixel* pixels = buffer.pixels.data();
+
+  switch (orientation) {
+    case OrientationNormal:
+      return;
+
+    case OrientationMirrorHorizontal:
+      parallel_for(0, h, 64, [&](size_t first_row, size_t last_row) {
+        for (size_t y = first_row; y < last_row; y++) {
+          Pixel* row = pixels + y * w;
+          swap_reversed(row, row + w, w / 2);
+        }
+      });
+      return;
+
+    case OrientationMirrorVertical:
+      parallel_for(0, h / 2, 64, [&](size_t first_row, size_t last_row) {
+        for (size_t y = first_row; y < last_row; y++) {
+          std::swap_ranges(pixels + y * w, pixels + (y + 1) * w, pixels + (h - 1 - y) * w);
+        }
+      });
+      return;
+
+    case OrientationRotate180: {
+      // With tightly packed rows, a 180° rotation is simply the whole pixel array reversed
+      size_t count = buffer.pixels.size();
+      Pixel* end = pixels + count;
+      parallel_for(0, count / 2, 1 << 16, [&](size_t first, size_t last) {
+        swap_reversed(pixels + first, end - first, last - first);
+      });
+    } return;
+
+    default: {
+      PixelBuffer<Pixel> scratch;
+      copy_oriented(pixels, w, h, w, orientation, scratch);
+      buffer.pixels.swap(scratch.pixels);
+      buffer.width = scratch.width;
+      buffer.height = scratch.height;
+    } return;
+  }
+}
+
+template void monokl::copy_oriented<uint32_t>(const uint32_t*, unsigned int, unsigned int, size_t, ImageOrientation, ImageBuffer&, const PixelTransform*);
+template void monokl::copy_oriented<uint64_t>(const uint64_t*, unsigned int, unsigned int, size_t, ImageOrientation, WideImageBuffer&, const PixelTransform*);
+template void monokl::apply_orientation<uint32_t>(ImageBuffer&, ImageOrientation);
+template void monokl::apply_orientation<uint64_t>(WideImageBuffer&, ImageOrientation);
+
+static uint16_t read_u16(const uint8_t* p, bool little_endian) {
+  return little_endian ? static_cast<uint16_t>(p[0] | (p[1] << 8)) : static_cast<uint16_t>((p[0] << 8) | p[1]);
+}
+
+static uint32_t read_u32(const uint8_t* p, bool little_endian) {
+  if (little_endian) {
+    return static_cast<uint32_t>(p[0]) | (static_cast<uint32_t>(p[1]) << 8) | (static_cast<uint32_t>(p[2]) << 16) | (static_cast<uint32_t>(p[3]) << 24);
+  }
+  return (static_cast<uint32_t>(p[0]) << 24) | (static_cast<uint32_t>(p[1]) << 16) | (static_cast<uint32_t>(p[2]) << 8) | static_cast<uint32_t>(p[3]);
+}
+
+ImageOrientation monokl::parse_exif_orientation(const uint8_t* data, size_t size) {
+  // Codecs hand over the APP1 payload either with or without the `Exif\0\0` preamble
+  if (size >= 6 && std::memcmp(data, "Exif\0\0", 6) == 0) {
+    data += 6;
+    size -= 6;
+  }
+
+  if (size < 8) {
+    return OrientationNormal;
+  }
+
+  bool little_endian;
+  if (data[0] == 'I' && data[1] == 'I') {
+    little_endian = true;
+  } else if (data[0] == 'M' && data[1] == 'M') {
+    little_endian = false;
+  } else {
+    return OrientationNormal;
+  }
+
+  uint32_t ifd_offset = read_u32(data + 4, little_endian);
+  if (static_cast<uint64_t>(ifd_offset) + 2 > size) {
+    return OrientationNormal;
+  }
+
+  uint16_t entry_count = read_u16(data + ifd_offset, little_endian);
+  for (uint16_t i = 0; i < entry_count; i++) {
+    uint64_t entry_offset = static_cast<uint64_t>(ifd_offset) + 2 + static_cast<uint64_t>(i) * 12;
+    if (entry_offset + 12 > size) {
+      break;
+    }
+
+    const uint8_t* entry = data + entry_offset;
+    if (read_u16(entry, little_endian) != 0x0112) {
+      continue;
+    }
+
+    // Orientation is a single SHORT, stored left-aligned in the value field
+    uint16_t value = read_u16(entry + 8, little_endian);
+    if (value >= OrientationNormal && value <= OrientationRotate270) {
+      return static_cast<ImageOrientation>(value);
+    }
+    break;
+  }
+
+  return OrientationNormal;
+}
+
+ImageOrientation monokl::read_exif_orientation(const sail::image& image) {
+  for (const auto& meta_data : image.meta_data()) {
+    if (meta_data.key() != SAIL_META_DATA_EXIF) {
+      continue;
+    }
+
+    const auto& value = meta_data.value();
+    if (!value.has_value<sail::arbitrary_data>()) {
+      continue;
+    }
+
+    const auto& exif = value.value<sail::arbitrary_data>();
+    return parse_exif_orientation(exif.data(), exif.size());
+  }
+
+  return OrientationNormal;
+}
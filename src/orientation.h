@@ -0,0 +1,56 @@
+#ifndef MONOKL__ORIENTATION_H
+#define MONOKL__ORIENTATION_H
+
+#include <cstdint>
+#include <cstddef>
+
+#include <sail-c++/image.h>
+
+#include "image_buffer.h"
+
+namespace monokl {
+
+// Values match the EXIF `Orientation` tag (0x0112), rotations are clockwise
+typedef enum {
+  OrientationNormal = 1,
+  OrientationMirrorHorizontal = 2,
+  OrientationRotate180 = 3,
+  OrientationMirrorVertical = 4,
+  OrientationTranspose = 5,
+  OrientationRotate90 = 6,
+  OrientationTransverse = 7,
+  OrientationRotate270 = 8
+} ImageOrientation;
+
+/**
+ * Per-pixel transform that can be fused into the oriented copy, so it's applied while the
+ * destination lines are still in cache instead of in a second pass over the whole image.
+ */
+class PixelTransform {
+public:
+  virtual ~PixelTransform() = default;
+  virtual void apply(uint32_t* pixels, size_t count) const = 0;
+};
+
+ImageOrientation parse_exif_orientation(const uint8_t* data, size_t size);
+ImageOrientation read_exif_orientation(const sail::image& image);
+
+/**
+ * Copies a `width`x`height` image with a stride of `src_stride` pixels into `dst`, applying
+ * the orientation on the way. Rotations and transpositions go through cache-blocked 4x4
+ * transposes (SIMD for RGBA8) and are spread over all cores, so this costs about as much as a
+ * plain copy. The optional `transform` is applied to every RGBA8 pixel as part of the same pass.
+ */
+template<typename Pixel>
+void copy_oriented(const Pixel* src, unsigned int width, unsigned int height, size_t src_stride, ImageOrientation orientation, PixelBuffer<Pixel>& dst, const PixelTransform* transform = nullptr);
+
+/**
+ * Reorients the buffer. Flips and 180° rotations are done in place, rotations by 90° and 270°
+ * (and the transpositions) swap the pixels through a single scratch buffer.
+ */
+template<typename Pixel>
+void apply_orientation(PixelBuffer<Pixel>& buffer, ImageOrientation orientation);
+
+}
+
+#endif
@@ -0,0 +1,191 @@
+#include "paged_document.h"
+#include "tiff.h"
+#include "logging.h"
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstring>
+#include <unordered_set>
+
+#include <sail-c++/image_input.h>
+#include <sail-c++/codec_info.h>
+
+using namespace monokl;
+
+static const size_t ICO_HEADER_SIZE = 6;
+static const size_t ICO_ENTRY_SIZE = 16;
+
+// Nothing legitimate comes close, it only stops a malicious chain from running for ages
+static const size_t MAX_PAGES = 65536;
+
+bool PagedDocument::may_have_pages(const std::filesystem::path& path) {
+  auto extension = path.extension().string();
+  std::transform(extension.begin(), extension.end(), extension.begin(), [](unsigned char c) {
+    return static_cast<char>(std::tolower(c));
+  });
+  return extension == ".tif" || extension == ".tiff" || extension == ".ico" || extension == ".cur";
+}
+
+std::shared_ptr<PagedDocument> PagedDocument::open(const std::filesystem::path& path) {
+  std::shared_ptr<PagedDocument> document(new PagedDocument());
+  document->path = path;
+  document->file = MappedFile::open(path, true);
+  if (document->file == nullptr || document->file->size() < 16) {
+    return nullptr;
+  }
+
+  const uint8_t* data = document->file->data();
+  if ((data[0] == 'I' && data[1] == 'I') || (data[0] == 'M' && data[1] == 'M')) {
+    document->format = PagedDocumentFormatTiff;
+    document->big_endian = data[0] == 'M';
+    uint16_t magic = tiff_read_u16(data + 2, document->big_endian);
+    if (magic != TIFF_MAGIC && magic != BIG_TIFF_MAGIC) {
+      return nullptr;
+    }
+    document->big_tiff = magic == BIG_TIFF_MAGIC;
+  } else if (tiff_read_u16(data, false) == 0 && (tiff_read_u16(data + 2, false) == 1 || tiff_read_u16(data + 2, false) == 2)) {
+    document->format = PagedDocumentFormatIco;
+  } else {
+    return nullptr;
+  }
+
+  return document;
+}
+
+const std::filesystem::path& PagedDocument::get_path() const {
+  return path;
+}
+
+size_t PagedDocument::page_count() {
+  std::lock_guard<std::mutex> lock(mutex);
+  build_index();
+  return pages.size();
+}
+
+void PagedDocument::build_index() {
+  if (indexed) {
+    return;
+  }
+  indexed = true;
+
+  auto t0 = std::chrono::high_resolution_clock::now();
+
+  if (format == PagedDocumentFormatTiff) {
+    index_tiff();
+  } else {
+    index_ico();
+  }
+
+  auto t1 = std::chrono::high_resolution_clock::now();
+  auto duration_ms = static_cast<long long int>(std::chrono::duration_cast<std::chrono::milliseconds>(t1 - t0).count());
+  log_debug("Indexed %lu pages of %s in %lld ms", pages.size(), path.string().c_str(), duration_ms);
+}
+
+void PagedDocument::index_tiff() {
+  const uint8_t* data = file->data();
+  uint64_t size = file->size();
+
+  size_t count_size = big_tiff ? 8 : 2;
+  size_t entry_size = big_tiff ? 20 : 12;
+  size_t next_size = big_tiff ? 8 : 4;
+  size_t value_offset = big_tiff ? 12 : 8;
+
+  uint64_t offset = big_tiff ? tiff_read_u64(data + 8, big_endian) : tiff_read_u32(data + 4, big_endian);
+  std::unordered_set<uint64_t> visited;
+  while (offset != 0 && visited.size() < MAX_PAGES && visited.insert(offset).second) {
+    if (offset > size || offset + count_size + next_size > size) {
+      break;
+    }
+    uint64_t entry_count = big_tiff ? tiff_read_u64(data + offset, big_endian) : tiff_read_u16(data + offset, big_endian);
+    uint64_t entries = offset + count_size;
+    if (entry_count > (size - entries - next_size) / entry_size) {
+      break;
+    }
+
+    DocumentPage page;
+    page.offset = offset;
+    uint64_t subfile_type = 0;
+    for (uint64_t i = 0; i < entry_count; i++) {
+      const uint8_t* entry = data + entries + i * entry_size;
+      uint16_t tag = tiff_read_u16(entry, big_endian);
+      uint16_t type = tiff_read_u16(entry + 2, big_endian);
+      const uint8_t* value_data = entry + value_offset;
+
+      uint64_t value = 0;
+      if (type == TIFF_TYPE_SHORT) {
+        value = tiff_read_u16(value_data, big_endian);
+      } else if (type == TIFF_TYPE_LONG) {
+        value = tiff_read_u32(value_data, big_endian);
+      } else if (type == TIFF_TYPE_LONG8 && big_tiff) {
+        value = tiff_read_u64(value_data, big_endian);
+      }
+
+      if (tag == TIFF_TAG_IMAGE_WIDTH) {
+        page.width = static_cast<uint32_t>(value);
+      } else if (tag == TIFF_TAG_IMAGE_LENGTH) {
+        page.height = static_cast<uint32_t>(value);
+      } else if (tag == TIFF_TAG_NEW_SUBFILE_TYPE) {
+        subfile_type = value;
+      }
+    }
+
+    if ((subfile_type & TIFF_SUBFILE_REDUCED_IMAGE) == 0) {
+      pages.push_back(page);
+    }
+
+    const uint8_t* next = data + entries + entry_count * entry_size;
+    offset = big_tiff ? tiff_read_u64(next, big_endian) : tiff_read_u32(next, big_endian);
+  }
+}
+
+void PagedDocument::index_ico() {
+  const uint8_t* data = file->data();
+  size_t size = file->size();
+
+  size_t entry_count = tiff_read_u16(data + 4, false);
+  size_t directory_size = ICO_HEADER_SIZE + entry_count * ICO_ENTRY_SIZE;
+  if (directory_size > size) {
+    return;
+  }
+
+  original_header.assign(data, data + directory_size);
+
+  for (size_t i = 0; i < entry_count; i++) {
+    const uint8_t* entry = data + ICO_HEADER_SIZE + i * ICO_ENTRY_SIZE;
+
+    // Sizes are stored in a byte, where 0 stands for 256
+    DocumentPage page;
+    page.offset = ICO_HEADER_SIZE + i * ICO_ENTRY_SIZE;
+    page.width = entry[0] == 0 ? 256 : entry[0];
+    page.height = entry[1] == 0 ? 256 : entry[1];
+    pages.push_back(page);
+  }
+}
+
+sail::image PagedDocument::read_page(size_t page) {
+  std::lock_guard<std::mutex> lock(mutex);
+  build_index();
+
+  if (page >= pages.size()) {
+    log_error("No page %lu in %s", page + 1, path.string().c_str());
+    return sail::image();
+  }
+
+  // Only the first page of the mapping gets copied by these writes, the file itself is untouched
+  uint8_t* data = file->mutable_data();
+  if (format == PagedDocumentFormatTiff) {
+    if (big_tiff) {
+      tiff_write_u64(data + 8, pages[page].offset, big_endian);
+    } else {
+      tiff_write_u32(data + 4, static_cast<uint32_t>(pages[page].offset), big_endian);
+    }
+  } else {
+    tiff_write_u16(data + 4, 1, false);
+    std::memcpy(data + ICO_HEADER_SIZE, original_header.data() + pages[page].offset, ICO_ENTRY_SIZE);
+  }
+
+  sail::image_input input(data, file->size());
+  input.with(sail::codec_info::from_path(path.string()));
+  return input.next_frame();
+}
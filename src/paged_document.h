@@ -0,0 +1,71 @@
+#ifndef MONOKL__PAGED_DOCUMENT_H
+#define MONOKL__PAGED_DOCUMENT_H
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <filesystem>
+#include <cstdint>
+#include <cstddef>
+
+#include <sail-c++/sail-c++.h>
+#include <sail-c++/image.h>
+
+#include "mapped_file.h"
+
+namespace monokl {
+
+typedef enum {
+  PagedDocumentFormatTiff,
+  PagedDocumentFormatIco
+} PagedDocumentFormat;
+
+struct DocumentPage {
+  // Offset of the page's TIFF directory, or of its ICO directory entry
+  uint64_t offset = 0;
+  uint32_t width = 0;
+  uint32_t height = 0;
+};
+
+/**
+ * A TIFF with several pages, or an ICO with several sizes. The page index is built on first use
+ * from the directory headers alone, without decoding any pixels. A page is read by pointing the
+ * file header at it in a copy-on-write mapping, so any page is the first one as far as the codec
+ * is concerned and it never has to go through the pages before it.
+ */
+class PagedDocument {
+public:
+  // Goes by the extension, to avoid mapping every image just to find out it has one page
+  static bool may_have_pages(const std::filesystem::path& path);
+  // Returns `nullptr` if the file can't be mapped or isn't a TIFF or ICO file after all
+  static std::shared_ptr<PagedDocument> open(const std::filesystem::path& path);
+
+  const std::filesystem::path& get_path() const;
+  size_t page_count();
+
+  sail::image read_page(size_t page);
+
+private:
+  PagedDocument() = default;
+
+  std::filesystem::path path;
+  std::unique_ptr<MappedFile> file;
+  PagedDocumentFormat format = PagedDocumentFormatTiff;
+  bool big_endian = false;
+  bool big_tiff = false;
+
+  std::mutex mutex;
+  bool indexed = false;
+  std::vector<DocumentPage> pages;
+  // The ICO directory as it was before entries got moved around to select a page
+  std::vector<uint8_t> original_header;
+
+  void build_index();
+  void index_tiff();
+  void index_ico();
+};
+
+}
+
+#endif
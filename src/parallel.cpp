@@ -0,0 +1,127 @@
+#include "parallel.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace monokl;
+
+namespace {
+
+// One call of `parallel_for`, its chunks are claimed by whoever gets to them first
+struct Batch {
+  const std::function<void(size_t, size_t)>* fn = nullptr;
+  size_t begin = 0;
+  size_t end = 0;
+  size_t chunk = 0;
+  size_t chunks = 0;
+  std::atomic<size_t> next{0};
+  size_t done = 0;
+  std::mutex mutex;
+  std::condition_variable finished;
+
+  // Runs chunks until none are left, returns once it can't claim another
+  void help() {
+    size_t index;
+    while ((index = next++) < chunks) {
+      size_t chunk_begin = begin + index * chunk;
+      (*fn)(chunk_begin, std::min(end, chunk_begin + chunk));
+
+      std::lock_guard<std::mutex> lock(mutex);
+      if (++done == chunks) {
+        finished.notify_all();
+      }
+    }
+  }
+};
+
+/**
+ * Worker threads shared by every window and background job, started once instead of on every
+ * call. The caller of `parallel_for` works on its own batch too, so a batch still finishes when
+ * every worker is busy elsewhere, including when `parallel_for` is called from inside a chunk.
+ */
+class WorkerPool {
+public:
+  static WorkerPool& get() {
+    // Never destroyed, detached workers may still be waiting on it on the way out
+    static WorkerPool* pool = new WorkerPool(parallel_worker_count() - 1);
+    return *pool;
+  }
+
+  void post(const std::shared_ptr<Batch>& batch, size_t helpers) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      for (size_t i = 0; i < helpers; i++) {
+        queue.push_back(batch);
+      }
+    }
+    if (helpers == 1) {
+      wake.notify_one();
+    } else {
+      wake.notify_all();
+    }
+  }
+
+private:
+  std::mutex mutex;
+  std::condition_variable wake;
+  std::deque<std::shared_ptr<Batch>> queue;
+
+  explicit WorkerPool(size_t threads) {
+    for (size_t i = 0; i < threads; i++) {
+      std::thread(&WorkerPool::work, this).detach();
+    }
+  }
+
+  void work() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+      wake.wait(lock, [this]() { return !queue.empty(); });
+      auto batch = std::move(queue.front());
+      queue.pop_front();
+      lock.unlock();
+      batch->help();
+      batch.reset();
+      lock.lock();
+    }
+  }
+};
+
+}
+
+size_t monokl::parallel_worker_count() {
+  return std::max(1u, std::thread::hardware_concurrency());
+}
+
+void monokl::parallel_for(size_t begin, size_t end, size_t min_chunk, const std::function<void(size_t, size_t)>& fn) {
+  if (end <= begin) {
+    return;
+  }
+
+  size_t count = end - begin;
+  size_t workers = std::min(parallel_worker_count(), std::max<size_t>(1, count / std::max<size_t>(1, min_chunk)));
+
+  if (workers <= 1) {
+    fn(begin, end);
+    return;
+  }
+
+  auto batch = std::make_shared<Batch>();
+  batch->fn = &fn;
+  batch->begin = begin;
+  batch->end = end;
+  batch->chunk = (count + workers - 1) / workers;
+  batch->chunks = (count + batch->chunk - 1) / batch->chunk;
+
+  WorkerPool::get().post(batch, batch->chunks - 1);
+  batch->help();
+
+  // Workers that pick the batch up after the last chunk was claimed return without touching `fn`
+  std::unique_lock<std::mutex> lock(batch->mutex);
+  batch->finished.wait(lock, [&]() { return batch->done == batch->chunks; });
+}
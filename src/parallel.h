@@ -0,0 +1,66 @@
+#ifndef MONOKL__PARALLEL_H
+#define MONOKL__PARALLEL_H
+
+#include <cstddef>
+#include <functional>
+#include <algorithm>
+#include <iterator>
+#include <vector>
+
+namespace monokl {
+
+/**
+ * Splits `[begin, end)` into contiguous chunks of at least `min_chunk` items, runs them on all
+ * available cores and blocks until every chunk is done. The chunks go to one pool of threads
+ * shared by the whole process, and the calling thread processes chunks too. Not meant for work
+ * that blocks on I/O, which would hold pool threads up for everyone else.
+ */
+void parallel_for(size_t begin, size_t end, size_t min_chunk, const std::function<void(size_t, size_t)>& fn);
+
+size_t parallel_worker_count();
+
+/**
+ * Sorts `items` like `std::sort`, but on all cores: one contiguous run per core is sorted
+ * in parallel, then runs are merged pairwise with every round of merges running in parallel.
+ * Lists shorter than two `min_run`s are sorted in place on the calling thread.
+ */
+template<typename T, typename Compare>
+void parallel_sort(std::vector<T>& items, Compare comp, size_t min_run = 16384) {
+  size_t count = items.size();
+  size_t runs = std::min(parallel_worker_count(), count / std::max<size_t>(1, min_run));
+  if (runs <= 1) {
+    std::sort(items.begin(), items.end(), comp);
+    return;
+  }
+
+  std::vector<size_t> bounds(runs + 1);
+  for (size_t i = 0; i <= runs; i++) {
+    bounds[i] = count * i / runs;
+  }
+
+  parallel_for(0, runs, 1, [&](size_t first, size_t last) {
+    for (size_t run = first; run < last; run++) {
+      std::sort(items.begin() + bounds[run], items.begin() + bounds[run + 1], comp);
+    }
+  });
+
+  std::vector<T> merged(count);
+  for (size_t width = 1; width < runs; width *= 2) {
+    size_t pairs = (runs + 2 * width - 1) / (2 * width);
+    parallel_for(0, pairs, 1, [&](size_t first, size_t last) {
+      for (size_t pair = first; pair < last; pair++) {
+        size_t begin = bounds[pair * 2 * width];
+        size_t middle = bounds[std::min(runs, pair * 2 * width + width)];
+        size_t end = bounds[std::min(runs, pair * 2 * width + 2 * width)];
+        std::merge(std::make_move_iterator(items.begin() + begin), std::make_move_iterator(items.begin() + middle),
+                   std::make_move_iterator(items.begin() + middle), std::make_move_iterator(items.begin() + end),
+                   merged.begin() + begin, comp);
+      }
+    });
+    items.swap(merged);
+  }
+}
+
+}
+
+#endif
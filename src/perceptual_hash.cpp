@@ -0,0 +1,235 @@
+#include <cmath>
+
+#include "perceptual_hash.h"
+#include "simd.h"
+
+#include <algorithm>
+#include <array>
+
+using namespace monokl;
+
+static const unsigned int SIZE = PerceptualHash::SIZE;
+static const unsigned int LOW = PerceptualHash::LOW_FREQUENCIES;
+
+// Rec. 601 luma weights out of 256, which is plenty for a hash
+static const int LUMA_R = 77;
+static const int LUMA_G = 150;
+static const int LUMA_B = 29;
+
+typedef std::array<float, LOW * SIZE> CosineTable;
+
+// Rows of the DCT-II basis for the lowest frequencies, `cosines[u * SIZE + x]`
+static const CosineTable& dct_cosines() {
+  static const CosineTable cosines = []() {
+    CosineTable table;
+    const double pi = 3.14159265358979323846;
+    for (unsigned int u = 0; u < LOW; u++) {
+      for (unsigned int x = 0; x < SIZE; x++) {
+        table[u * SIZE + x] = static_cast<float>(std::cos((2.0 * x + 1.0) * u * pi / (2.0 * SIZE)));
+      }
+    }
+    return table;
+  }();
+  return cosines;
+}
+
+static float dot(const float* a, const float* b) {
+#if defined(MONOKL_SIMD_SSE2)
+  __m128 sum = _mm_setzero_ps();
+  for (unsigned int i = 0; i < SIZE; i += 4) {
+    sum = _mm_add_ps(sum, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+  }
+  sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+  sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+  return _mm_cvtss_f32(sum);
+#elif defined(MONOKL_SIMD_NEON)
+  float32x4_t sum = vdupq_n_f32(0.0f);
+  for (unsigned int i = 0; i < SIZE; i += 4) {
+    sum = vmlaq_f32(sum, vld1q_f32(a + i), vld1q_f32(b + i));
+  }
+  float32x2_t half = vadd_f32(vget_low_f32(sum), vget_high_f32(sum));
+  return vget_lane_f32(vpadd_f32(half, half), 0);
+#else
+  float sum = 0.0f;
+  for (unsigned int i = 0; i < SIZE; i++) {
+    sum += a[i] * b[i];
+  }
+  return sum;
+#endif
+}
+
+// Luma of `count` pixels, scaled by 256
+static void luma_row(const uint32_t* pixels, unsigned int count, float* out) {
+  unsigned int x = 0;
+#if defined(MONOKL_SIMD_SSE2)
+  const __m128i weights = _mm_setr_epi16(LUMA_R, LUMA_G, LUMA_B, 0, LUMA_R, LUMA_G, LUMA_B, 0);
+  const __m128i zero = _mm_setzero_si128();
+  for (; x + 4 <= count; x += 4) {
+    __m128i quad = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pixels + x));
+    // Each 32-bit lane holds R * wr + G * wg, or B * wb, of one pixel
+    __m128i low = _mm_madd_epi16(_mm_unpacklo_epi8(quad, zero), weights);
+    __m128i high = _mm_madd_epi16(_mm_unpackhi_epi8(quad, zero), weights);
+    __m128 even = _mm_shuffle_ps(_mm_castsi128_ps(low), _mm_castsi128_ps(high), _MM_SHUFFLE(2, 0, 2, 0));
+    __m128 odd = _mm_shuffle_ps(_mm_castsi128_ps(low), _mm_castsi128_ps(high), _MM_SHUFFLE(3, 1, 3, 1));
+    __m128i luma = _mm_add_epi32(_mm_castps_si128(even), _mm_castps_si128(odd));
+    _mm_storeu_ps(out + x, _mm_cvtepi32_ps(luma));
+  }
+#elif defined(MONOKL_SIMD_NEON)
+  for (; x + 8 <= count; x += 8) {
+    uint8x8x4_t rgba = vld4_u8(reinterpret_cast<const uint8_t*>(pixels + x));
+    uint16x8_t luma = vmull_u8(rgba.val[0], vdup_n_u8(LUMA_R));
+    luma = vmlal_u8(luma, rgba.val[1], vdup_n_u8(LUMA_G));
+    luma = vmlal_u8(luma, rgba.val[2], vdup_n_u8(LUMA_B));
+    vst1q_f32(out + x, vcvtq_f32_u32(vmovl_u16(vget_low_u16(luma))));
+    vst1q_f32(out + x + 4, vcvtq_f32_u32(vmovl_u16(vget_high_u16(luma))));
+  }
+#endif
+  for (; x < count; x++) {
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(pixels + x);
+    out[x] = static_cast<float>(p[0] * LUMA_R + p[1] * LUMA_G + p[2] * LUMA_B);
+  }
+}
+
+uint64_t PerceptualHash::compute(const uint32_t* pixels, unsigned int width, unsigned int height, size_t stride) {
+  if (width == 0 || height == 0) {
+    return 0;
+  }
+
+  // Box filter: every source pixel lands in exactly one of the 32x32 cells
+  std::vector<unsigned int> cell_of_x(width);
+  for (unsigned int x = 0; x < width; x++) {
+    cell_of_x[x] = static_cast<unsigned int>(static_cast<uint64_t>(x) * SIZE / width);
+  }
+
+  std::array<float, SIZE * SIZE> cells = {};
+  std::array<float, SIZE * SIZE> weights = {};
+  std::vector<float> luma(width);
+  for (unsigned int y = 0; y < height; y++) {
+    luma_row(pixels + y * stride, width, luma.data());
+
+    unsigned int row = static_cast<unsigned int>(static_cast<uint64_t>(y) * SIZE / height) * SIZE;
+    for (unsigned int x = 0; x < width; x++) {
+      cells[row + cell_of_x[x]] += luma[x];
+      weights[row + cell_of_x[x]] += 1.0f;
+    }
+  }
+
+  // Images smaller than 32 pixels leave cells empty, those repeat their left or upper neighbor
+  for (unsigned int i = 0; i < SIZE * SIZE; i++) {
+    if (weights[i] > 0.0f) {
+      cells[i] /= weights[i];
+    } else {
+      cells[i] = i % SIZE > 0 ? cells[i - 1] : (i >= SIZE ? cells[i - SIZE] : 0.0f);
+    }
+  }
+
+  // The 2D DCT is separable: rows first, then the columns of that result
+  const auto& cosines = dct_cosines();
+  std::array<float, LOW * SIZE> rows;
+  for (unsigned int v = 0; v < LOW; v++) {
+    for (unsigned int y = 0; y < SIZE; y++) {
+      rows[v * SIZE + y] = dot(cells.data() + y * SIZE, cosines.data() + v * SIZE);
+    }
+  }
+
+  std::array<float, LOW * LOW> coefficients;
+  for (unsigned int u = 0; u < LOW; u++) {
+    for (unsigned int v = 0; v < LOW; v++) {
+      coefficients[u * LOW + v] = dot(cosines.data() + u * SIZE, rows.data() + v * SIZE);
+    }
+  }
+
+  // The DC term only says how bright the image is, it's left out of the median
+  std::array<float, LOW * LOW - 1> ac;
+  std::copy(coefficients.begin() + 1, coefficients.end(), ac.begin());
+  std::nth_element(ac.begin(), ac.begin() + ac.size() / 2, ac.end());
+  float median = ac[ac.size() / 2];
+
+  uint64_t hash = 0;
+  for (unsigned int i = 1; i < LOW * LOW; i++) {
+    if (coefficients[i] > median) {
+      hash |= 1ull << i;
+    }
+  }
+  return hash;
+}
+
+int PerceptualHash::distance(uint64_t a, uint64_t b) {
+#if defined(__GNUC__) || defined(__clang__)
+  return __builtin_popcountll(a ^ b);
+#else
+  uint64_t bits = a ^ b;
+  bits = bits - ((bits >> 1) & 0x5555555555555555ull);
+  bits = (bits & 0x3333333333333333ull) + ((bits >> 2) & 0x3333333333333333ull);
+  bits = (bits + (bits >> 4)) & 0x0F0F0F0F0F0F0F0Full;
+  return static_cast<int>((bits * 0x0101010101010101ull) >> 56);
+#endif
+}
+
+static uint32_t chunk_of(uint64_t hash, unsigned int chunk) {
+  return static_cast<uint32_t>((hash >> (chunk * HashIndex::CHUNK_BITS)) & ((1u << HashIndex::CHUNK_BITS) - 1));
+}
+
+void HashIndex::build(const std::vector<uint64_t>& hashes) {
+  this->hashes = hashes;
+
+  // Counting sort of the items by each chunk's value
+  const size_t buckets = size_t(1) << CHUNK_BITS;
+  for (unsigned int chunk = 0; chunk < CHUNKS; chunk++) {
+    offsets[chunk].assign(buckets + 1, 0);
+    for (uint64_t hash : hashes) {
+      offsets[chunk][chunk_of(hash, chunk) + 1]++;
+    }
+    for (size_t bucket = 0; bucket < buckets; bucket++) {
+      offsets[chunk][bucket + 1] += offsets[chunk][bucket];
+    }
+
+    items[chunk].resize(hashes.size());
+    std::vector<uint32_t> next(offsets[chunk].begin(), offsets[chunk].end() - 1);
+    for (uint32_t item = 0; item < hashes.size(); item++) {
+      items[chunk][next[chunk_of(hashes[item], chunk)]++] = item;
+    }
+  }
+}
+
+size_t HashIndex::size() const {
+  return hashes.size();
+}
+
+void HashIndex::find(uint64_t hash, int max_distance, std::vector<uint32_t>& out) const {
+  if (hashes.empty() || max_distance < 0) {
+    return;
+  }
+
+  int radius = max_distance / static_cast<int>(CHUNKS);
+  for (unsigned int chunk = 0; chunk < CHUNKS; chunk++) {
+    find_in_chunk(chunk, chunk_of(hash, chunk), radius, 0, hash, max_distance, out);
+  }
+}
+
+void HashIndex::find_in_chunk(unsigned int chunk, uint32_t value, int radius, int lowest_bit, uint64_t hash, int max_distance, std::vector<uint32_t>& out) const {
+  int chunk_radius = max_distance / static_cast<int>(CHUNKS);
+  for (uint32_t i = offsets[chunk][value]; i < offsets[chunk][value + 1]; i++) {
+    uint32_t item = items[chunk][i];
+    if (PerceptualHash::distance(hash, hashes[item]) > max_distance) {
+      continue;
+    }
+
+    // An item close enough in an earlier chunk was already reported from there
+    bool reported = false;
+    for (unsigned int earlier = 0; earlier < chunk && !reported; earlier++) {
+      reported = PerceptualHash::distance(chunk_of(hash, earlier), chunk_of(hashes[item], earlier)) <= chunk_radius;
+    }
+    if (!reported) {
+      out.push_back(item);
+    }
+  }
+
+  // Every value within `radius` bits is visited once, by only ever flipping bits above the last one flipped
+  if (radius == 0) {
+    return;
+  }
+  for (int bit = lowest_bit; bit < static_cast<int>(CHUNK_BITS); bit++) {
+    find_in_chunk(chunk, value ^ (1u << bit), radius - 1, bit + 1, hash, max_distance, out);
+  }
+}
@@ -0,0 +1,54 @@
+#ifndef MONOKL__PERCEPTUAL_HASH_H
+#define MONOKL__PERCEPTUAL_HASH_H
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+namespace monokl {
+
+/**
+ * 64-bit pHash of an RGBA8 image: the luma is box filtered down to 32x32, and each bit tells
+ * whether one of the 8x8 lowest frequencies of its DCT is above their median. Resizing,
+ * recompressing or slightly editing an image flips only a few bits.
+ */
+class PerceptualHash {
+public:
+  static const unsigned int SIZE = 32;
+  static const unsigned int LOW_FREQUENCIES = 8;
+
+  // `stride` is in pixels, bytes are in the order R, G, B, A
+  static uint64_t compute(const uint32_t* pixels, unsigned int width, unsigned int height, size_t stride);
+
+  static int distance(uint64_t a, uint64_t b);
+};
+
+/**
+ * Multi-index hash over 64-bit hashes. Each hash is split into 4 chunks of 16 bits with a table
+ * per chunk; two hashes at most `r` bits apart have at least one chunk at most `r / 4` bits apart,
+ * so a query only looks up the few buckets near each of its own chunks and checks what's in them,
+ * instead of comparing against every hash.
+ */
+class HashIndex {
+public:
+  static const unsigned int CHUNKS = 4;
+  static const unsigned int CHUNK_BITS = 16;
+
+  void build(const std::vector<uint64_t>& hashes);
+  size_t size() const;
+
+  // Appends the positions in `hashes` of those at most `max_distance` bits away from `hash`
+  void find(uint64_t hash, int max_distance, std::vector<uint32_t>& items) const;
+
+private:
+  std::vector<uint64_t> hashes;
+  // Per chunk, the items whose chunk has value `v` are `items[offsets[v]]` up to `items[offsets[v + 1]]`
+  std::vector<uint32_t> offsets[CHUNKS];
+  std::vector<uint32_t> items[CHUNKS];
+
+  void find_in_chunk(unsigned int chunk, uint32_t value, int radius, int lowest_bit, uint64_t hash, int max_distance, std::vector<uint32_t>& out) const;
+};
+
+}
+
+#endif
@@ -0,0 +1,114 @@
+#include "persistence_writer.h"
+#include "durable_file.h"
+#include "instrumentation.h"
+#include "logging.h"
+
+#include <algorithm>
+
+using namespace monokl;
+
+PersistenceWriter& PersistenceWriter::get() {
+  // Never destroyed, so a write that is stuck on a slow mount past the exit deadline can't hold up
+  // the process on its way out
+  static PersistenceWriter* writer = new PersistenceWriter();
+  return *writer;
+}
+
+void PersistenceWriter::write(const std::filesystem::path& path, std::string contents) {
+  auto now = std::chrono::steady_clock::now();
+
+  std::lock_guard<std::mutex> lock(mutex);
+  auto it = pending.find(path);
+  if (it == pending.end()) {
+    it = pending.emplace(path, PendingWrite{std::string(), now, now}).first;
+  }
+  it->second.contents = std::move(contents);
+  it->second.due_at = std::min(now + DEBOUNCE, it->second.queued_at + MAX_DELAY);
+
+  if (!worker.joinable()) {
+    worker = std::thread(&PersistenceWriter::run, this);
+  }
+  wake.notify_one();
+}
+
+bool PersistenceWriter::flush(std::chrono::milliseconds timeout) {
+  auto t0 = std::chrono::high_resolution_clock::now();
+
+  std::unique_lock<std::mutex> lock(mutex);
+  if (pending.empty() && !writing) {
+    return true;
+  }
+
+  auto now = std::chrono::steady_clock::now();
+  for (auto& write : pending) {
+    write.second.due_at = now;
+  }
+  wake.notify_one();
+
+  bool done = written.wait_for(lock, timeout, [this]() {
+    return pending.empty() && !writing;
+  });
+
+  auto t1 = std::chrono::high_resolution_clock::now();
+  auto duration_ms = static_cast<long long int>(std::chrono::duration_cast<std::chrono::milliseconds>(t1 - t0).count());
+  if (!done) {
+    log_warn("Gave up waiting for %lu pending writes after %lld ms", pending.size() + (writing ? 1 : 0), duration_ms);
+  } else {
+    log_debug("Flushed pending writes in %lld ms", duration_ms);
+  }
+  return done;
+}
+
+bool PersistenceWriter::flush(const std::filesystem::path& path, std::chrono::milliseconds timeout) {
+  std::unique_lock<std::mutex> lock(mutex);
+  auto it = pending.find(path);
+  if (it != pending.end()) {
+    it->second.due_at = std::chrono::steady_clock::now();
+    wake.notify_one();
+  }
+
+  return written.wait_for(lock, timeout, [this, &path]() {
+    return pending.find(path) == pending.end() && !(writing && in_flight == path);
+  });
+}
+
+size_t PersistenceWriter::pending_count() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  return pending.size() + (writing ? 1 : 0);
+}
+
+void PersistenceWriter::run() {
+  std::unique_lock<std::mutex> lock(mutex);
+  while (true) {
+    if (pending.empty()) {
+      wake.wait(lock);
+      continue;
+    }
+
+    auto next = std::min_element(pending.begin(), pending.end(), [](const auto& a, const auto& b) {
+      return a.second.due_at < b.second.due_at;
+    });
+    if (next->second.due_at > std::chrono::steady_clock::now()) {
+      wake.wait_until(lock, next->second.due_at);
+      continue;
+    }
+
+    in_flight = next->first;
+    std::string contents = std::move(next->second.contents);
+    pending.erase(next);
+    writing = true;
+
+    // Newer contents for the same file may be queued meanwhile, they'll simply be written after this
+    lock.unlock();
+    {
+      ScopedTimer timer("persistence.write");
+      if (DurableFile::replace(in_flight, contents)) {
+        log_debug("Wrote %lu bytes to %s", contents.size(), in_flight.string().c_str());
+      }
+    }
+    lock.lock();
+
+    writing = false;
+    written.notify_all();
+  }
+}
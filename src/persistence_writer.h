@@ -0,0 +1,62 @@
+#ifndef MONOKL__PERSISTENCE_WRITER_H
+#define MONOKL__PERSISTENCE_WRITER_H
+
+#include <string>
+#include <map>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
+#include <filesystem>
+#include <cstddef>
+
+namespace monokl {
+
+/**
+ * Writes small files, like settings and `.monokl.toml`, on a background thread. A file is only
+ * written once no newer contents arrived for it during the debounce interval, so a burst of
+ * toggles costs one write. Every write goes through a synced temporary file and a rename.
+ */
+class PersistenceWriter {
+public:
+  static constexpr std::chrono::milliseconds DEBOUNCE{500};
+  // Writes are held back at most this long, even if new contents keep arriving
+  static constexpr std::chrono::milliseconds MAX_DELAY{2000};
+  // How long a flush waits for the disk, e.g. on exit, before giving up
+  static constexpr std::chrono::milliseconds FLUSH_TIMEOUT{2000};
+
+  static PersistenceWriter& get();
+
+  // Replaces whatever is still waiting to be written to `path`
+  void write(const std::filesystem::path& path, std::string contents);
+
+  // Writes everything right away and waits for it at most `timeout`, returns false if that wasn't enough
+  bool flush(std::chrono::milliseconds timeout);
+  // Same as `flush`, for a single file that is about to be read back
+  bool flush(const std::filesystem::path& path, std::chrono::milliseconds timeout);
+
+  size_t pending_count() const;
+
+private:
+  PersistenceWriter() = default;
+
+  struct PendingWrite {
+    std::string contents;
+    std::chrono::steady_clock::time_point queued_at;
+    std::chrono::steady_clock::time_point due_at;
+  };
+
+  mutable std::mutex mutex;
+  std::condition_variable wake;
+  std::condition_variable written;
+  std::map<std::filesystem::path, PendingWrite> pending;
+  std::filesystem::path in_flight;
+  bool writing = false;
+  std::thread worker;
+
+  void run();
+};
+
+}
+
+#endif
@@ -1,7 +1,15 @@
 #include "playlist.h"
+#include "parallel.h"
+#include "metadata_store.h"
+#include "persistence_writer.h"
+#include "io_scheduler.h"
 #include <chrono>
+#include <future>
 #include <memory>
 #include <unordered_map>
+#include <map>
+#include <algorithm>
+#include <string_view>
 
 using namespace monokl;
 
@@ -13,92 +21,328 @@ bool FolderEntry::is_folder() const {
   return true;
 }
 
+std::shared_ptr<FolderFlags> FolderFlags::of(const std::filesystem::path& settings_path) {
+  static std::mutex mutex;
+  static std::map<std::filesystem::path, std::weak_ptr<FolderFlags>> registry;
+
+  std::lock_guard<std::mutex> lock(mutex);
+  auto& slot = registry[settings_path];
+  auto flags = slot.lock();
+  if (flags == nullptr) {
+    flags = std::make_shared<FolderFlags>();
+    slot = flags;
+  }
+
+  // Folders nobody has open anymore are dropped on the way
+  for (auto it = registry.begin(); it != registry.end();) {
+    it = it->second.expired() ? registry.erase(it) : std::next(it);
+  }
+  return flags;
+}
+
+FolderFlags& FolderEntry::shared_flags() {
+  if (flags == nullptr) {
+    flags = FolderFlags::of(get_settings_path());
+  }
+  return *flags;
+}
+
 void FolderEntry::toggle_favorite(const std::string& name) {
-  if (favorites.find(name) != favorites.end()) {
-    favorites.erase(name);
-  } else {
-    favorites.insert(name);
+  if (!can_change_flags()) {
+    return;
   }
 
-  settings_changed = true;
+  {
+    auto& shared = shared_flags();
+    std::lock_guard<std::mutex> lock(shared.mutex);
+    if (shared.favorites.find(name) != shared.favorites.end()) {
+      shared.favorites.erase(name);
+    } else {
+      shared.favorites.insert(name);
+    }
+  }
+
+  store_flags(name);
 }
 
 void FolderEntry::toggle_hidden(const std::string& name) {
-  if (hidden.find(name) != hidden.end()) {
-    hidden.erase(name);
-  } else {
-    hidden.insert(name);
+  if (!can_change_flags()) {
+    return;
+  }
+
+  {
+    auto& shared = shared_flags();
+    std::lock_guard<std::mutex> lock(shared.mutex);
+    if (shared.hidden.find(name) != shared.hidden.end()) {
+      shared.hidden.erase(name);
+    } else {
+      shared.hidden.insert(name);
+    }
   }
 
-  settings_changed = true;
+  store_flags(name);
+}
+
+bool FolderEntry::is_favorite(const std::string& name) const {
+  if (flags == nullptr) {
+    return false;
+  }
+  std::lock_guard<std::mutex> lock(flags->mutex);
+  return flags->favorites.find(name) != flags->favorites.end();
+}
+
+bool FolderEntry::is_hidden(const std::string& name) const {
+  if (flags == nullptr) {
+    return false;
+  }
+  std::lock_guard<std::mutex> lock(flags->mutex);
+  return flags->hidden.find(name) != flags->hidden.end();
+}
+
+void FolderEntry::get_flags(std::set<std::string>& favorites, std::set<std::string>& hidden) const {
+  if (flags == nullptr) {
+    favorites.clear();
+    hidden.clear();
+    return;
+  }
+  std::lock_guard<std::mutex> lock(flags->mutex);
+  favorites = flags->favorites;
+  hidden = flags->hidden;
+}
+
+void FolderEntry::set_flags(std::set<std::string> favorites, std::set<std::string> hidden) {
+  auto& shared = shared_flags();
+  std::lock_guard<std::mutex> lock(shared.mutex);
+  shared.favorites = std::move(favorites);
+  shared.hidden = std::move(hidden);
+  settings_loaded = true;
+}
+
+bool FolderEntry::can_change_flags() const {
+  if (!settings_loaded) {
+    log_warn("The settings of %s haven't been read yet, not changing them", path.string().c_str());
+  }
+  return settings_loaded;
+}
+
+void FolderEntry::store_flags(const std::string& name) {
+  auto& store = MetadataStore::get();
+  if (!store.is_open()) {
+    settings_changed = true;
+    save_settings();
+    return;
+  }
+
+  uint32_t stored = 0;
+  if (is_favorite(name)) {
+    stored |= MetadataFlagFavorite;
+  }
+  if (is_hidden(name)) {
+    stored |= MetadataFlagHidden;
+  }
+
+  if (!store.set_flags(path, name, stored)) {
+    log_error("Failed to store flags of %s in %s", name.c_str(), path.string().c_str());
+  }
 }
 
 void FolderEntry::reload_settings() {
-  favorites.clear();
-  hidden.clear();
+  std::set<std::string> favorites;
+  std::set<std::string> hidden;
+  read_settings(favorites, hidden);
+  set_flags(std::move(favorites), std::move(hidden));
+}
+
+void FolderEntry::read_settings(std::set<std::string>& favorites, std::set<std::string>& hidden) {
+  // With the central store the folder's `.monokl.toml` is only read once, to import it
+  auto& store = MetadataStore::get();
+  bool use_store = store.is_open();
+  if (use_store && store.load_folder(path, favorites, hidden)) {
+    return;
+  }
+
+  // A toggle from moments ago, maybe from another window, may still be on its way to disk
+  auto settings_path = get_settings_path();
+  PersistenceWriter::get().flush(settings_path, PersistenceWriter::FLUSH_TIMEOUT);
 
-  auto settings_path = path / ".monokl.toml";
   std::filesystem::directory_entry entry(settings_path);
   if (!entry.exists() || !entry.is_regular_file()) {
+    settings_modified_at = 0;
+    if (use_store) {
+      store.import_folder(path, favorites, hidden);
+    }
     return;
   }
 
+  settings_modified_at = Util::get_last_modified_at(settings_path);
+
   auto data = toml::parse(settings_path);
 
   if (data.contains("favorites") && data.at("favorites").is_array()) {
-    auto favorites = toml::find<std::vector<std::string>>(data, "favorites");
-    for (const auto& favorite : favorites) {
-      this->favorites.insert(favorite);
+    for (const auto& favorite : toml::find<std::vector<std::string>>(data, "favorites")) {
+      favorites.insert(favorite);
     }
   }
 
   if (data.contains("hidden") && data.at("hidden").is_array()) {
-    auto hidden = toml::find<std::vector<std::string>>(data, "hidden");
-    for (const auto& h : hidden) {
-      this->hidden.insert(h);
+    for (const auto& h : toml::find<std::vector<std::string>>(data, "hidden")) {
+      hidden.insert(h);
     }
   }
 
-  log_debug("Loaded %lu favorites and %lu hidden images for %s", this->favorites.size(), this->hidden.size(), path.string().c_str());
+  log_debug("Loaded %lu favorites and %lu hidden images for %s", favorites.size(), hidden.size(), path.string().c_str());
+
+  if (use_store) {
+    store.import_folder(path, favorites, hidden);
+  }
 }
 
 void FolderEntry::save_settings() {
-  if (!settings_changed) {
+  if (!settings_changed || !settings_loaded) {
     return;
   }
 
-  auto settings_path = path / ".monokl.toml";
+  // Everything any window toggled in the folder, not just this entry's own toggles
+  std::set<std::string> favorites;
+  std::set<std::string> hidden;
+  get_flags(favorites, hidden);
 
   toml::value data;
   data["favorites"] = std::vector<std::string>(favorites.begin(), favorites.end());
   data["hidden"] = std::vector<std::string>(hidden.begin(), hidden.end());
 
-  auto result = toml::format(data);
-  std::ofstream file(settings_path);
-  file << result;
-  file.close();
+  PersistenceWriter::get().write(get_settings_path(), toml::format(data));
+  settings_changed = false;
+  settings_written = true;
+
+  log_debug("Queued %lu favorites and %lu hidden images for %s", favorites.size(), hidden.size(), path.string().c_str());
+}
+
+void FolderEntry::refresh_modified_at() {
+  // Our own write replaced `.monokl.toml` and so touched the folder too, it isn't an outside change
+  settings_modified_at = Util::get_last_modified_at(get_settings_path());
+  last_modified_at = Util::get_last_modified_at(path);
+  settings_written = false;
+}
+
+std::filesystem::path FolderEntry::get_settings_path() const {
+  if (is_archive) {
+    auto settings_path = path;
+    settings_path += ".monokl.toml";
+    return settings_path;
+  }
+  return path / ".monokl.toml";
+}
+
+std::shared_ptr<Archive> FolderEntry::get_archive() {
+  if (is_archive && archive == nullptr) {
+    archive = Archive::open(path);
+  }
+  return archive;
+}
 
-  log_debug("Saved %lu favorites and %lu hidden images for %s", favorites.size(), hidden.size(), path.string().c_str());
+void FolderEntry::set_archive(const std::shared_ptr<Archive>& archive) {
+  this->archive = archive;
+  is_archive = true;
 }
 
 bool ImageEntry::is_folder() const {
   return false;
 }
 
+std::string ImageEntry::get_name() const {
+  return member.empty() ? path.filename().string() : member;
+}
+
 bool ImageEntry::is_favorite() const {
-  if (parent == nullptr) {
-    return false;
+  return parent != nullptr && parent->is_favorite(get_name());
+}
+
+bool ImageEntry::is_hidden() const {
+  return parent != nullptr && parent->is_hidden(get_name());
+}
+
+PlaylistSortOrder monokl::reversed_sort_order(PlaylistSortOrder sort_order) {
+  switch (sort_order) {
+    case PlaylistSortOrderName:
+      return PlaylistSortOrderNameDesc;
+    case PlaylistSortOrderNameDesc:
+      return PlaylistSortOrderName;
+    case PlaylistSortOrderDate:
+      return PlaylistSortOrderDateDesc;
+    case PlaylistSortOrderDateDesc:
+      return PlaylistSortOrderDate;
+    default:
+      return sort_order;
+  }
+}
+
+std::string monokl::natural_sort_key(std::string_view name) {
+  std::string key;
+  key.reserve(name.size() + 8);
+
+  size_t i = 0;
+  while (i < name.size()) {
+    char c = name[i];
+    if (c < '0' || c > '9') {
+      key.push_back((c >= 'A' && c <= 'Z') ? static_cast<char>(c - 'A' + 'a') : c);
+      i++;
+      continue;
+    }
+
+    size_t begin = i;
+    while (i < name.size() && name[i] >= '0' && name[i] <= '9') {
+      i++;
+    }
+    while (begin + 1 < i && name[begin] == '0') {
+      begin++;
+    }
+
+    // Marker, digit count and digits, so numbers compare by magnitude first and sort before text
+    size_t digits = std::min<size_t>(i - begin, 0xFF);
+    key.push_back('\x01');
+    key.push_back(static_cast<char>(digits));
+    key.append(name.substr(begin, digits));
   }
 
-  return parent->favorites.find(path.filename().string()) != parent->favorites.end();
+  return key;
 }
 
-bool ImageEntry::is_hidden() const {
-  if (parent == nullptr) {
-    return false;
+// Images sort within their folder, and a folder right before its own images
+static bool name_less(const PlaylistEntry& a, const PlaylistEntry& b) {
+  bool a_is_folder = a.is_folder();
+  bool b_is_folder = b.is_folder();
+
+  const PlaylistEntry* a_folder = a_is_folder ? &a : static_cast<const ImageEntry&>(a).parent.get();
+  const PlaylistEntry* b_folder = b_is_folder ? &b : static_cast<const ImageEntry&>(b).parent.get();
+
+  if (a_folder != b_folder) {
+    if (a_folder == nullptr || b_folder == nullptr) {
+      return a_folder == nullptr;
+    }
+    int order = a_folder->sort_key.compare(b_folder->sort_key);
+    if (order != 0) {
+      return order < 0;
+    }
+    if (a_folder->path != b_folder->path) {
+      return a_folder->path < b_folder->path;
+    }
+  }
+
+  if (a_is_folder || b_is_folder) {
+    return a_is_folder && !b_is_folder;
   }
 
-  return parent->hidden.find(path.filename().string()) != parent->hidden.end();
+  int order = a.sort_key.compare(b.sort_key);
+  if (order != 0) {
+    return order < 0;
+  }
+
+  if (a.path != b.path) {
+    return a.path < b.path;
+  }
+
+  return static_cast<const ImageEntry&>(a).page < static_cast<const ImageEntry&>(b).page;
 }
 
 PlaylistEntryComparator::PlaylistEntryComparator(const PlaylistSortOrder& sort_order)
@@ -108,13 +352,19 @@ PlaylistEntryComparator::PlaylistEntryComparator(const PlaylistSortOrder& sort_o
 bool PlaylistEntryComparator::operator()(const std::shared_ptr<PlaylistEntry>& a, const std::shared_ptr<PlaylistEntry>& b) const {
   switch (sort_order) {
     case PlaylistSortOrderName:
-      return a->path < b->path;
+      return name_less(*a, *b);
     case PlaylistSortOrderNameDesc:
-      return a->path > b->path;
+      return name_less(*b, *a);
     case PlaylistSortOrderDate:
-      return a->last_modified_at < b->last_modified_at;
+      if (a->last_modified_at != b->last_modified_at) {
+        return a->last_modified_at < b->last_modified_at;
+      }
+      return name_less(*a, *b);
     case PlaylistSortOrderDateDesc:
-      return a->last_modified_at > b->last_modified_at;
+      if (a->last_modified_at != b->last_modified_at) {
+        return a->last_modified_at > b->last_modified_at;
+      }
+      return name_less(*b, *a);
     default:
       return false;
   }
@@ -124,10 +374,190 @@ Playlist::Playlist() {
 }
 
 void Playlist::set_sort_order(const PlaylistSortOrder& sort_order) {
-  PlaylistEntryComparator comparator(sort_order);
-  std::sort(all_entries.begin(), all_entries.end(), comparator);
-  std::sort(shown_entries.begin(), shown_entries.end(), comparator);
+  auto t0 = std::chrono::high_resolution_clock::now();
+
+  if (sort_order != options.sort_order && sort_order == reversed_sort_order(options.sort_order) && selection.empty()) {
+    // Ties are broken by path, so the opposite order is exactly the current one reversed
+    std::reverse(all_entries.begin(), all_entries.end());
+    std::reverse(shown_entries.begin(), shown_entries.end());
+    if (idx >= 0) {
+      idx = static_cast<int>(count) - 1 - idx;
+    }
+    name_index_reversed = !name_index_reversed;
+  } else if (sort_order != PlaylistSortOrderNone) {
+    sort_entries(sort_order);
+    refresh_shown_entries();
+  }
+
   options.sort_order = sort_order;
+
+  auto t1 = std::chrono::high_resolution_clock::now();
+  auto duration_ms = static_cast<long long int>(std::chrono::duration_cast<std::chrono::milliseconds>(t1 - t0).count());
+  log_debug("Sorted %lu entries in %lld ms", all_entries.size(), duration_ms);
+}
+
+/*
+ * Sorting the entries directly chases two or three pointers per comparison, so instead every
+ * entry gets a small record with its folder's rank, its date and the first 8 bytes of its sort
+ * key. Most comparisons are settled by those integers, the rest compare the keys themselves and
+ * only real ties look at the entries.
+ */
+struct SortRecord {
+  int64_t primary;
+  uint64_t secondary;
+  std::string_view key;
+  uint32_t index;
+};
+
+static uint64_t key_prefix(const std::string& key) {
+  uint64_t prefix = 0;
+  for (size_t i = 0; i < 8; i++) {
+    prefix = (prefix << 8) | (i < key.size() ? static_cast<uint8_t>(key[i]) : 0);
+  }
+  return prefix;
+}
+
+void Playlist::sort_entries(PlaylistSortOrder sort_order) {
+  compute_sort_keys();
+
+  bool by_date = sort_order == PlaylistSortOrderDate || sort_order == PlaylistSortOrderDateDesc;
+  bool descending = sort_order == PlaylistSortOrderNameDesc || sort_order == PlaylistSortOrderDateDesc;
+
+  // Folders are few, so they're ranked with the full comparison up front
+  std::vector<std::shared_ptr<PlaylistEntry>> folders;
+  for (const auto& entry : all_entries) {
+    if (entry->is_folder()) {
+      folders.push_back(entry);
+    }
+  }
+  std::sort(folders.begin(), folders.end(), PlaylistEntryComparator(PlaylistSortOrderName));
+
+  std::unordered_map<const PlaylistEntry*, int64_t> folder_ranks;
+  for (size_t i = 0; i < folders.size(); i++) {
+    folder_ranks[folders[i].get()] = static_cast<int64_t>(i) + 1;
+  }
+
+  std::vector<SortRecord> records(all_entries.size());
+  parallel_for(0, all_entries.size(), 4096, [&](size_t first, size_t last) {
+    for (size_t i = first; i < last; i++) {
+      const auto& entry = *all_entries[i];
+      bool is_folder = entry.is_folder();
+      const PlaylistEntry* folder = is_folder ? &entry : static_cast<const ImageEntry&>(entry).parent.get();
+
+      // Orphaned images have rank 0, and a folder comes right before its own images
+      int64_t rank = 0;
+      if (folder != nullptr) {
+        auto it = folder_ranks.find(folder);
+        rank = it != folder_ranks.end() ? it->second : 0;
+      }
+      int64_t folder_position = rank * 2 + (is_folder ? 0 : 1);
+
+      SortRecord& record = records[i];
+      record.index = static_cast<uint32_t>(i);
+      if (by_date) {
+        record.primary = entry.last_modified_at;
+        record.secondary = static_cast<uint64_t>(folder_position);
+      } else {
+        record.primary = folder_position;
+        record.secondary = is_folder ? 0 : key_prefix(entry.sort_key);
+        record.key = is_folder ? std::string_view() : std::string_view(entry.sort_key);
+      }
+    }
+  });
+
+  // Descending orders are the ascending ones reversed, which also keeps them exact opposites
+  PlaylistEntryComparator ascending(by_date ? PlaylistSortOrderDate : PlaylistSortOrderName);
+  parallel_sort(records, [&](const SortRecord& a, const SortRecord& b) {
+    if (a.primary != b.primary) {
+      return a.primary < b.primary;
+    }
+    if (a.secondary != b.secondary) {
+      return a.secondary < b.secondary;
+    }
+    int order = a.key.compare(b.key);
+    if (order != 0) {
+      return order < 0;
+    }
+    return ascending(all_entries[a.index], all_entries[b.index]);
+  });
+
+  if (descending) {
+    std::reverse(records.begin(), records.end());
+  }
+
+  std::vector<std::shared_ptr<PlaylistEntry>> sorted(all_entries.size());
+  parallel_for(0, records.size(), 4096, [&](size_t first, size_t last) {
+    for (size_t i = first; i < last; i++) {
+      sorted[i] = std::move(all_entries[records[i].index]);
+    }
+  });
+  all_entries.swap(sorted);
+}
+
+void Playlist::compute_sort_keys() {
+  parallel_for(0, all_entries.size(), 4096, [this](size_t first, size_t last) {
+    for (size_t i = first; i < last; i++) {
+      auto& entry = *all_entries[i];
+      if (!entry.sort_key.empty()) {
+        continue;
+      }
+      // Archive members sort by their whole path inside the archive, so chapters stay together
+      if (!entry.is_folder() && !static_cast<const ImageEntry&>(entry).member.empty()) {
+        entry.sort_key = natural_sort_key(static_cast<const ImageEntry&>(entry).member);
+        continue;
+      }
+      // Cheaper than `path::filename`, which builds and parses a whole new path
+#ifdef _WIN32
+      std::string path = entry.path.u8string();
+      std::string_view name = path;
+      size_t separator = name.find_last_of("/\\");
+#else
+      std::string_view name = entry.path.native();
+      size_t separator = name.find_last_of('/');
+#endif
+      if (!entry.is_folder() && separator != std::string_view::npos) {
+        name.remove_prefix(separator + 1);
+      }
+      entry.sort_key = natural_sort_key(name);
+    }
+  });
+}
+
+void ScanProgress::step() {
+  auto now = std::chrono::steady_clock::now().time_since_epoch();
+  stepped_at = std::max<int64_t>(1, std::chrono::duration_cast<std::chrono::milliseconds>(now).count());
+}
+
+bool ScanProgress::is_stuck(std::chrono::milliseconds timeout) const {
+  int64_t last = stepped_at;
+  if (last == 0) {
+    // Not started yet, the I/O scheduler gives up on it if it doesn't start in time
+    return false;
+  }
+  auto now = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+  return now - last > timeout.count();
+}
+
+static RootScan scan_root(const std::string& file_path, ScanProgress* progress) {
+  RootScan scan;
+  std::filesystem::directory_entry entry(file_path);
+
+  if (entry.is_directory() || (entry.is_regular_file() && Archive::is_archive(entry.path()))) {
+    scan.folder = entry.is_directory() ? Playlist::scan_folder(entry.path(), progress) : Playlist::scan_archive(entry.path(), progress);
+  } else if (Util::is_valid_image(entry.path())) {
+    scan.file = std::make_shared<ImageEntry>();
+    scan.file->path = entry.path();
+    scan.file->last_modified_at = Util::get_last_modified_at(entry.path());
+  }
+  return scan;
+}
+
+static std::shared_ptr<FolderEntry> load_folder(const std::filesystem::path& path) {
+  auto folder = std::make_shared<FolderEntry>();
+  folder->path = path;
+  folder->last_modified_at = Util::get_last_modified_at(path);
+  folder->reload_settings();
+  return folder;
 }
 
 void Playlist::reload_images_from(const std::vector<std::string>& file_paths) {
@@ -135,77 +565,316 @@ void Playlist::reload_images_from(const std::vector<std::string>& file_paths) {
 
   shown_entries.clear();
   all_entries.clear();
+  selection.clear();
+  pending_scans.clear();
+  pending_loads.clear();
+  file_folders.clear();
+  roots = file_paths;
   idx = 0;
 
-  std::unordered_map<std::filesystem::path, std::shared_ptr<FolderEntry>> tmp_folder_entries;
-
+  // Every path is scanned on the I/O threads of its own device, so a slow or hung mount only
+  // holds up its own images, and only those are added later
   for (const auto& file_path : file_paths) {
-    std::filesystem::directory_entry entry(file_path);
+    auto progress = std::make_shared<ScanProgress>();
+    auto scan = IoScheduler::get().submit<RootScan>(file_path, IoPriorityCurrent, IoScheduler::SCAN_TIMEOUT, [file_path, progress]() {
+      progress->step();
+      return scan_root(file_path, progress.get());
+    });
+    pending_scans.push_back(PendingScan{file_path, progress, std::move(scan)});
+  }
 
-    if (entry.is_directory()) {
-      auto folder = std::make_shared<FolderEntry>();
-      folder->path = entry.path();
-      folder->last_modified_at = 0; // TODO implement this
+  // Local folders are done well within this, so the playlist is usually complete right away
+  auto deadline = std::chrono::steady_clock::now() + SCAN_WAIT;
+  for (auto& pending : pending_scans) {
+    pending.scan.wait_until(deadline);
+  }
+  take_finished_scans();
+  for (auto& pending : pending_loads) {
+    pending.folder.wait_until(deadline);
+  }
+  take_finished_scans();
 
-      folder->reload_settings();
+  auto t1 = std::chrono::high_resolution_clock::now();
+  auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(t1 - t0);
+  auto duration_ms = static_cast<long long int>(duration.count());
 
-      for (const auto& child : std::filesystem::directory_iterator(file_path)) {
-        if (child.is_directory() || child.is_symlink()) {
-          continue;
-        }
+  set_sort_order(options.sort_order);
 
-        std::string child_path = child.path().string();
+  refresh_shown_entries();
+  rebuild_name_index();
 
-        if (!Util::is_valid_image(child.path())) {
-          continue;
-        }
+  log_debug("Loaded %lu images from %lu entries in %lu files in %lld ms, %lu still scanning", shown_entries.size(), all_entries.size(), file_paths.size(), duration_ms, pending_scans.size() + pending_loads.size());
+}
+
+bool Playlist::apply_late_scans() {
+  if (pending_scans.empty() && pending_loads.empty()) {
+    return false;
+  }
+  if (!take_finished_scans()) {
+    return false;
+  }
+
+  // Nothing was shown before, so the first image is, rather than wherever the old index lands
+  if (get_current() == nullptr) {
+    idx = 0;
+  }
+  set_sort_order(options.sort_order);
+  refresh_shown_entries();
+
+  log_debug("Added late scans, the playlist now has %lu images, %lu still scanning", shown_entries.size(), pending_scans.size() + pending_loads.size());
+  return true;
+}
+
+void Playlist::add_root(RootScan& scan) {
+  if (scan.folder != nullptr) {
+    for (const auto& child : scan.folder->children) {
+      all_entries.push_back(child);
+    }
+    all_entries.push_back(scan.folder);
+    return;
+  }
+  if (scan.file == nullptr) {
+    return;
+  }
 
-        auto file = std::make_shared<ImageEntry>();
-        file->path = child_path;
-        file->last_modified_at = 0; // TODO implement this
-        file->parent = folder;
+  auto parent_path = scan.file->path.parent_path();
+  auto& parent = file_folders[parent_path];
+  if (parent == nullptr) {
+    // Its settings are read once per folder however many of its files were given, the files are
+    // kept without them if the folder doesn't respond
+    parent = std::make_shared<FolderEntry>();
+    parent->path = parent_path;
+    all_entries.push_back(parent);
+
+    auto progress = std::make_shared<ScanProgress>();
+    auto folder = IoScheduler::get().submit<std::shared_ptr<FolderEntry>>(parent_path, IoPriorityCurrent, IoScheduler::SCAN_TIMEOUT, [parent_path, progress]() {
+      progress->step();
+      return load_folder(parent_path);
+    });
+    pending_loads.push_back(PendingLoad{parent, progress, std::move(folder)});
+  }
+  scan.file->parent = parent;
+  parent->children.push_back(scan.file);
+  all_entries.push_back(scan.file);
+}
 
-        all_entries.push_back(file);
-        folder->children.push_back(file);
+bool Playlist::take_finished_scans() {
+  bool changed = false;
+
+  for (auto it = pending_scans.begin(); it != pending_scans.end();) {
+    const char* root = it->root.c_str();
+    if (it->scan.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+      if (it->progress->is_stuck(IoScheduler::SCAN_TIMEOUT)) {
+        log_warn("Gave up scanning %s, its device stopped responding", root);
+        it = pending_scans.erase(it);
+      } else {
+        ++it;
       }
+      continue;
+    }
 
-      all_entries.push_back(folder);
-    } else {
-      if (!Util::is_valid_image(entry.path())) {
-        continue;
+    try {
+      RootScan scan = it->scan.get();
+      add_root(scan);
+      changed = true;
+    } catch (const MonoklError& e) {
+      log_warn("Gave up scanning %s: %s", root, e.what());
+    } catch (const std::exception& e) {
+      log_warn("Failed to scan %s: %s", root, e.what());
+    }
+    it = pending_scans.erase(it);
+  }
+
+  // Folders whose settings were read take the place of their placeholders, with the same children
+  std::unordered_map<const FolderEntry*, std::shared_ptr<FolderEntry>> loaded;
+  for (auto it = pending_loads.begin(); it != pending_loads.end();) {
+    const auto& placeholder = it->placeholder;
+    if (it->folder.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+      if (it->progress->is_stuck(IoScheduler::SCAN_TIMEOUT)) {
+        log_warn("Gave up reading the settings of %s, its device stopped responding", placeholder->path.string().c_str());
+        it = pending_loads.erase(it);
+      } else {
+        ++it;
+      }
+      continue;
+    }
+
+    try {
+      auto folder = it->folder.get();
+      folder->children = std::move(placeholder->children);
+      for (const auto& child : folder->children) {
+        std::static_pointer_cast<ImageEntry>(child)->parent = folder;
+      }
+      file_folders[folder->path] = folder;
+      loaded[placeholder.get()] = folder;
+    } catch (const MonoklError& e) {
+      log_warn("Gave up reading the settings of %s: %s", placeholder->path.string().c_str(), e.what());
+    } catch (const std::exception& e) {
+      log_warn("Failed to read the settings of %s: %s", placeholder->path.string().c_str(), e.what());
+    }
+    it = pending_loads.erase(it);
+  }
+
+  if (!loaded.empty()) {
+    for (auto& entry : all_entries) {
+      auto folder = loaded.find(entry.get());
+      if (folder != loaded.end()) {
+        entry = folder->second;
       }
+    }
+    changed = true;
+  }
+
+  return changed;
+}
+
+std::shared_ptr<FolderEntry> Playlist::scan_folder(const std::filesystem::path& path, ScanProgress* progress) {
+  auto folder = std::make_shared<FolderEntry>();
+  folder->path = path;
+  folder->last_modified_at = Util::get_last_modified_at(path);
+  folder->fully_scanned = true;
+
+  folder->reload_settings();
+
+  for (const auto& child : std::filesystem::directory_iterator(path)) {
+    if (progress != nullptr) {
+      progress->step();
+    }
+    if (child.is_directory() || child.is_symlink()) {
+      continue;
+    }
+
+    if (!Util::is_valid_image(child.path())) {
+      continue;
+    }
+
+    auto file = std::make_shared<ImageEntry>();
+    file->path = child.path();
+    file->last_modified_at = Util::get_last_modified_at(child.path());
+    file->parent = folder;
 
-      auto parent_path = entry.path().parent_path();
-      auto parent = tmp_folder_entries[parent_path];
-      if (parent == nullptr) {
-        parent = std::make_shared<FolderEntry>();
-        parent->path = parent_path;
-        parent->last_modified_at = 0; // TODO implement this
+    folder->children.push_back(file);
+  }
+
+  return folder;
+}
+
+std::shared_ptr<FolderEntry> Playlist::scan_archive(const std::filesystem::path& path, ScanProgress* progress) {
+  auto folder = std::make_shared<FolderEntry>();
+  folder->path = path;
+  folder->last_modified_at = Util::get_last_modified_at(path);
+  folder->fully_scanned = true;
+  folder->is_archive = true;
+
+  folder->reload_settings();
+
+  auto archive = Archive::open(path);
+  if (progress != nullptr) {
+    progress->step();
+  }
+  if (archive == nullptr) {
+    return folder;
+  }
+  folder->set_archive(archive);
+
+  folder->children.reserve(archive->get_members().size());
+  for (const auto& member : archive->get_members()) {
+    auto file = std::make_shared<ImageEntry>();
+    file->path = path / std::filesystem::u8path(member.name);
+    file->member = member.name;
+    file->last_modified_at = member.last_modified_at;
+    file->parent = folder;
+
+    folder->children.push_back(file);
+  }
+
+  return folder;
+}
 
-        parent->reload_settings();
+void Playlist::replace_folder(const std::shared_ptr<FolderEntry>& folder) {
+  // A selection could still hold entries that are about to be replaced
+  selection.clear();
 
-        tmp_folder_entries[parent_path] = parent;
-        all_entries.push_back(parent);
+  // Entries that survive keep their identity, so the current image stays selected
+  std::unordered_map<std::filesystem::path, std::shared_ptr<ImageEntry>> previous_children;
+
+  std::vector<std::shared_ptr<PlaylistEntry>> remaining;
+  remaining.reserve(all_entries.size());
+  for (const auto& entry : all_entries) {
+    if (entry->is_folder()) {
+      if (entry->path == folder->path) {
+        continue;
+      }
+    } else {
+      auto image_entry = std::static_pointer_cast<ImageEntry>(entry);
+      if (image_entry->parent != nullptr && image_entry->parent->path == folder->path) {
+        // Later pages are added again once their document is shown
+        if (image_entry->page == 0) {
+          previous_children[image_entry->path] = image_entry;
+        }
+        continue;
       }
+    }
+    remaining.push_back(entry);
+  }
 
-      auto file = std::make_shared<ImageEntry>();
-      file->path = entry.path();
-      file->last_modified_at = 0; // TODO implement this
-      file->parent = parent;
-      parent->children.push_back(file);
-      all_entries.push_back(file);
+  for (auto& child : folder->children) {
+    auto image_entry = std::static_pointer_cast<ImageEntry>(child);
+    auto previous = previous_children.find(image_entry->path);
+    if (previous != previous_children.end()) {
+      previous->second->parent = folder;
+      previous->second->last_modified_at = image_entry->last_modified_at;
+      child = previous->second;
     }
+    remaining.push_back(child);
   }
+  remaining.push_back(folder);
 
-  auto t1 = std::chrono::high_resolution_clock::now();
-  auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(t1 - t0);
-  auto duration_ms = static_cast<long long int>(duration.count());
+  all_entries.swap(remaining);
 
   set_sort_order(options.sort_order);
+  refresh_shown_entries();
+
+  log_debug("Replaced folder %s, it now has %lu images", folder->path.string().c_str(), folder->children.size());
+}
+
+void Playlist::expand_pages(const std::shared_ptr<ImageEntry>& entry, uint32_t page_count) {
+  entry->page_count = page_count;
+  if (page_count <= 1) {
+    return;
+  }
+
+  auto position = std::find(all_entries.begin(), all_entries.end(), entry);
+  if (position == all_entries.end()) {
+    return;
+  }
+
+  // Pages only differ in their number, which is the last tie breaker of every order
+  std::vector<std::shared_ptr<PlaylistEntry>> pages;
+  pages.reserve(page_count - 1);
+  for (uint32_t page = 1; page < page_count; page++) {
+    auto page_entry = std::make_shared<ImageEntry>(*entry);
+    page_entry->page = page;
+    pages.push_back(page_entry);
+  }
+
+  bool descending = options.sort_order == PlaylistSortOrderNameDesc || options.sort_order == PlaylistSortOrderDateDesc;
+  if (descending) {
+    std::reverse(pages.begin(), pages.end());
+    all_entries.insert(position, pages.begin(), pages.end());
+  } else {
+    all_entries.insert(position + 1, pages.begin(), pages.end());
+  }
 
+  // The pages share the entry's name, so they only lengthen its run instead of invalidating the index
+  bool index_fresh = !name_index_stale;
+  unsigned int shown_before = count;
   refresh_shown_entries();
+  if (index_fresh) {
+    name_index_stale = !extend_name_index(entry, count - shown_before, descending);
+  }
 
-  log_debug("Loaded %lu images from %lu entries in %lu files in %lld ms", shown_entries.size(), all_entries.size(), file_paths.size(), duration_ms);
+  log_debug("Added %u pages of %s", page_count - 1, entry->path.string().c_str());
 }
 
 std::shared_ptr<ImageEntry> Playlist::get_current() const {
@@ -243,6 +912,16 @@ std::shared_ptr<ImageEntry> Playlist::go_to_last() {
   return get_current();
 }
 
+std::shared_ptr<ImageEntry> Playlist::go_to(int index) {
+  if (count == 0) {
+    idx = -1;
+    return nullptr;
+  }
+
+  idx = std::clamp(index, 0, static_cast<int>(count) - 1);
+  return get_current();
+}
+
 void Playlist::toggle_only_favorites() {
   options.only_favorites = !options.only_favorites;
   refresh_shown_entries();
@@ -259,7 +938,7 @@ void Playlist::current_toggle_favorite() {
     return;
   }
 
-  current->parent->toggle_favorite(current->path.filename().string());
+  current->parent->toggle_favorite(current->get_name());
 
   refresh_shown_entries();
 }
@@ -270,14 +949,17 @@ void Playlist::current_toggle_hidden() {
     return;
   }
 
-  current->parent->toggle_hidden(current->path.filename().string());
+  current->parent->toggle_hidden(current->get_name());
 
   refresh_shown_entries();
 }
 
 void Playlist::refresh_shown_entries() {
+  name_index_stale = true;
+
   if (all_entries.empty()) {
     shown_entries.clear();
+    count = 0;
     idx = -1;
     return;
   }
@@ -289,30 +971,36 @@ void Playlist::refresh_shown_entries() {
   int i = 0;
   bool found = false;
 
-  shown_entries.clear();
-  for (const auto& entry : all_entries) {
-    if (entry->is_folder()) {
-      continue;
-    }
-
-    auto image_entry = std::static_pointer_cast<ImageEntry>(entry);
-
+  auto show = [&](const std::shared_ptr<ImageEntry>& image_entry) {
     if (options.only_favorites && !image_entry->is_favorite()) {
-      continue;
+      return;
     }
 
     if (options.skip_hidden && image_entry->is_hidden()) {
-      continue;
+      return;
     }
 
     shown_entries.push_back(image_entry);
 
-    if (entry == current) {
+    if (image_entry == current) {
       desired_idx = i;
       found = true;
     }
 
     i += 1;
+  };
+
+  shown_entries.clear();
+  if (!selection.empty()) {
+    for (const auto& entry : selection) {
+      show(entry);
+    }
+  } else {
+    for (const auto& entry : all_entries) {
+      if (!entry->is_folder()) {
+        show(std::static_pointer_cast<ImageEntry>(entry));
+      }
+    }
   }
 
   if (!found) {
@@ -323,3 +1011,89 @@ void Playlist::refresh_shown_entries() {
 
   idx = desired_idx < count ? desired_idx : count - 1;
 }
+
+void Playlist::show_selection(const std::vector<std::shared_ptr<ImageEntry>>& entries) {
+  selection = entries;
+  refresh_shown_entries();
+}
+
+void Playlist::clear_selection() {
+  selection.clear();
+  refresh_shown_entries();
+}
+
+bool Playlist::has_selection() const {
+  return !selection.empty();
+}
+
+const std::vector<uint32_t>& Playlist::search(const std::string& query) {
+  if (name_index_stale) {
+    rebuild_name_index();
+  }
+
+  // Names are found in index order, which is backwards once the shown entries were reversed
+  const auto& names = name_index.find(query);
+  uint32_t total = name_index_runs.back();
+  search_results.clear();
+  for (size_t i = 0; i < names.size(); i++) {
+    uint32_t name = names[name_index_reversed ? names.size() - 1 - i : i];
+    uint32_t begin = name_index_runs[name];
+    uint32_t end = name_index_runs[name + 1];
+    if (name_index_reversed) {
+      std::swap(begin, end);
+      begin = total - begin;
+      end = total - end;
+    }
+    for (uint32_t index = begin; index < end; index++) {
+      search_results.push_back(index);
+    }
+  }
+  return search_results;
+}
+
+void Playlist::rebuild_name_index() {
+  auto t0 = std::chrono::high_resolution_clock::now();
+
+  std::vector<std::string> names;
+  names.reserve(shown_entries.size());
+  for (const auto& entry : shown_entries) {
+    names.push_back(entry->path.filename().string());
+  }
+
+  name_index.build(names);
+  name_index_stale = false;
+  name_index_reversed = false;
+  name_index_runs.resize(names.size() + 1);
+  for (uint32_t i = 0; i <= names.size(); i++) {
+    name_index_runs[i] = i;
+  }
+
+  auto t1 = std::chrono::high_resolution_clock::now();
+  auto duration_ms = static_cast<long long int>(std::chrono::duration_cast<std::chrono::milliseconds>(t1 - t0).count());
+  log_debug("Indexed %lu file names (%lu bytes) in %lld ms", names.size(), name_index.size_in_bytes(), duration_ms);
+}
+
+bool Playlist::extend_name_index(const std::shared_ptr<ImageEntry>& entry, uint32_t added, bool added_before) {
+  if (added == 0) {
+    return true;
+  }
+
+  auto position = std::find(shown_entries.begin(), shown_entries.end(), entry);
+  if (position == shown_entries.end()) {
+    return false;
+  }
+
+  // Where the entry was shown before the pages were added, in the order the index was built in
+  uint32_t shown = static_cast<uint32_t>(position - shown_entries.begin()) - (added_before ? added : 0);
+  uint32_t total = name_index_runs.back();
+  uint32_t indexed = name_index_reversed ? total - 1 - shown : shown;
+  if (indexed >= total) {
+    return false;
+  }
+
+  auto run = std::upper_bound(name_index_runs.begin(), name_index_runs.end(), indexed);
+  for (; run != name_index_runs.end(); ++run) {
+    *run += added;
+  }
+  return true;
+}
@@ -3,10 +3,16 @@
 
 #include <memory>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <filesystem>
 #include <chrono>
 #include <set>
+#include <mutex>
+#include <atomic>
+#include <future>
+#include <unordered_map>
+#include <cstdint>
 
 #include <sail-c++/sail-c++.h>
 #include <sail-c++/codec_info.h>
@@ -17,6 +23,8 @@
 
 #include "logging.h"
 #include "util.h"
+#include "name_index.h"
+#include "archive.h"
 
 namespace monokl {
 
@@ -36,46 +44,138 @@ struct PlaylistOptions {
 
 struct PlaylistEntry {
   std::filesystem::path path;
-  long last_modified_at;
+  // Milliseconds since the filesystem clock's epoch
+  int64_t last_modified_at = 0;
+  // Natural order collation key of the folder path or the image file name, filled in on first sort
+  std::string sort_key;
 
   virtual bool is_folder() const;
 };
 
+/**
+ * Favorites and hidden images of one folder. Every window's entry for the folder shares one of
+ * these, so a toggle in one window isn't dropped by the next write of `.monokl.toml` from another.
+ */
+struct FolderFlags {
+  std::mutex mutex;
+  std::set<std::string> favorites;
+  std::set<std::string> hidden;
+
+  // The flags of the folder whose settings are at `settings_path`, kept while any entry holds them
+  static std::shared_ptr<FolderFlags> of(const std::filesystem::path& settings_path);
+};
+
 struct FolderEntry : public PlaylistEntry {
   std::vector<std::shared_ptr<PlaylistEntry>> children;
 
-  std::set<std::string> favorites;
-  std::set<std::string> hidden;
-  bool settings_changed;
+  // Whether the flags were read from disk, the store or the session. Until then the folder's
+  // settings are left alone, so a folder that didn't respond can't have them overwritten
+  bool settings_loaded = false;
+  bool settings_changed = false;
+  // Whether `.monokl.toml` was handed to the persistence writer since the mtimes were last read
+  bool settings_written = false;
+  // Whether every image in the folder was picked up, rather than just the files that were dropped
+  bool fully_scanned = false;
+  int64_t settings_modified_at = 0;
+  // A ZIP or CBZ file standing in for a folder, its images are members read in place
+  bool is_archive = false;
 
   void toggle_favorite(const std::string& name);
   void toggle_hidden(const std::string& name);
+  bool is_favorite(const std::string& name) const;
+  bool is_hidden(const std::string& name) const;
+  // Copies of the shared sets, or replaces them for every window, like after reading them from disk
+  void get_flags(std::set<std::string>& favorites, std::set<std::string>& hidden) const;
+  void set_flags(std::set<std::string> favorites, std::set<std::string> hidden);
 
   bool is_folder() const override;
   void reload_settings();
   void save_settings();
+  void refresh_modified_at();
+
+  // `.monokl.toml` inside the folder, or next to an archive as `name.zip.monokl.toml`
+  std::filesystem::path get_settings_path() const;
+  // Opened on first use, so a restored session doesn't have to touch its archives up front.
+  // Not thread safe: call it on the UI thread and hand the archive to any background work
+  std::shared_ptr<Archive> get_archive();
+  void set_archive(const std::shared_ptr<Archive>& archive);
+
+private:
+  std::shared_ptr<Archive> archive;
+  std::shared_ptr<FolderFlags> flags = nullptr;
+
+  FolderFlags& shared_flags();
+  // Whether the flags were loaded, logs why the toggle is dropped if they weren't
+  bool can_change_flags() const;
+  void read_settings(std::set<std::string>& favorites, std::set<std::string>& hidden);
+
+  // Writes the name's flags to the central store right away, or queues `.monokl.toml` for writing
+  void store_flags(const std::string& name);
 };
 
 struct ImageEntry : public PlaylistEntry {
   std::shared_ptr<FolderEntry> parent;
+  // Path inside the parent archive, empty for regular files
+  std::string member;
+  // Pages after the first of a multi-page document are entries of their own, sharing the path
+  uint32_t page = 0;
+  // 0 until the document has been opened and its pages counted
+  uint32_t page_count = 0;
+
+  // What favorites and hidden images are keyed by within the parent
+  std::string get_name() const;
 
   bool is_folder() const override;
   bool is_favorite() const;
   bool is_hidden() const;
 };
 
+PlaylistSortOrder reversed_sort_order(PlaylistSortOrder sort_order);
+
+// Lowercased, with every run of digits encoded so that "img2" sorts before "img10"
+std::string natural_sort_key(std::string_view name);
+
 struct PlaylistEntryComparator {
   PlaylistSortOrder sort_order;
   PlaylistEntryComparator(const PlaylistSortOrder& sort_order);
   bool operator()(const std::shared_ptr<PlaylistEntry>& a, const std::shared_ptr<PlaylistEntry>& b) const;
 };
 
+// Bumped by a scan as it goes, so a slow scan of a large folder can be told apart from a hung one
+struct ScanProgress {
+  // Milliseconds on the steady clock, 0 until the scan starts
+  std::atomic<int64_t> stepped_at{0};
+
+  void step();
+  // Whether the scan started and then went `timeout` without a step
+  bool is_stuck(std::chrono::milliseconds timeout) const;
+};
+
+// A folder or archive given as a root, or a single file without its folder yet
+struct RootScan {
+  std::shared_ptr<FolderEntry> folder;
+  std::shared_ptr<ImageEntry> file;
+};
+
 class Playlist {
 public:
+  // How long dropping files waits for their scans, the ones that take longer are added when they're done
+  static constexpr std::chrono::milliseconds SCAN_WAIT{500};
+
   Playlist();
 
   void set_sort_order(const PlaylistSortOrder& sort_order);
   void reload_images_from(const std::vector<std::string>& file_paths);
+  void replace_folder(const std::shared_ptr<FolderEntry>& folder);
+  // Adds entries for pages 2 and up of `entry`, right where sorting would put them
+  void expand_pages(const std::shared_ptr<ImageEntry>& entry, uint32_t page_count);
+
+  // Adds the roots and folder settings that were still being read when `reload_images_from`
+  // returned, once they're done. Returns whether the playlist changed
+  bool apply_late_scans();
+
+  static std::shared_ptr<FolderEntry> scan_folder(const std::filesystem::path& path, ScanProgress* progress = nullptr);
+  static std::shared_ptr<FolderEntry> scan_archive(const std::filesystem::path& path, ScanProgress* progress = nullptr);
 
   std::shared_ptr<ImageEntry> get_current() const;
 
@@ -85,21 +185,66 @@ public:
   std::shared_ptr<ImageEntry> advance(int by);
   std::shared_ptr<ImageEntry> go_to_first();
   std::shared_ptr<ImageEntry> go_to_last();
+  std::shared_ptr<ImageEntry> go_to(int index);
 
   void refresh_shown_entries();
+  // Shows only `entries`, in their own order, until the selection is cleared; filters still apply
+  void show_selection(const std::vector<std::shared_ptr<ImageEntry>>& entries);
+  void clear_selection();
+  bool has_selection() const;
   void toggle_only_favorites();
   void toggle_skip_hidden();
 
   void current_toggle_favorite();
   void current_toggle_hidden();
 
+  // Positions in `shown_entries` whose file name contains `query`, ignoring case
+  const std::vector<uint32_t>& search(const std::string& query);
+
   std::vector<std::shared_ptr<PlaylistEntry>> all_entries;
   std::vector<std::shared_ptr<ImageEntry>> shown_entries;
+  std::vector<std::string> roots;
   PlaylistOptions options;
 
 private:
   int idx = -1;
   unsigned int count = 0;
+  std::vector<std::shared_ptr<ImageEntry>> selection;
+
+  struct PendingScan {
+    std::string root;
+    std::shared_ptr<ScanProgress> progress;
+    std::future<RootScan> scan;
+  };
+
+  struct PendingLoad {
+    std::shared_ptr<FolderEntry> placeholder;
+    std::shared_ptr<ScanProgress> progress;
+    std::future<std::shared_ptr<FolderEntry>> folder;
+  };
+
+  std::vector<PendingScan> pending_scans;
+  std::vector<PendingLoad> pending_loads;
+  // Folders of the files given one by one, so every file of a folder shares one entry
+  std::unordered_map<std::filesystem::path, std::shared_ptr<FolderEntry>> file_folders;
+
+  void add_root(RootScan& scan);
+  // Takes the scans that are done and gives up on the ones that stopped making progress, returns whether anything was added
+  bool take_finished_scans();
+
+  void compute_sort_keys();
+  void sort_entries(PlaylistSortOrder sort_order);
+
+  NameIndex name_index;
+  bool name_index_stale = true;
+  // Where the shown entries of every indexed name start, plus the end, pages added later join their name's run
+  std::vector<uint32_t> name_index_runs;
+  // The shown entries were reversed since the index was built
+  bool name_index_reversed = false;
+  std::vector<uint32_t> search_results;
+  void rebuild_name_index();
+  // Adds pages shown next to `entry` to its name's run, returns false when the index has to be rebuilt instead
+  bool extend_name_index(const std::shared_ptr<ImageEntry>& entry, uint32_t added, bool added_before);
 };
 
 }
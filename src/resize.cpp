@@ -0,0 +1,251 @@
+#include <cmath>
+
+#include "resize.h"
+#include "parallel.h"
+#include "simd.h"
+
+#include <algorithm>
+#include <vector>
+
+using namespace monokl;
+
+// Fewer rows aren't worth a thread of their own
+static const size_t MIN_ROWS_PER_BAND = 32;
+
+// Which source pixels contribute to each output pixel, and by how much
+struct ResampleFilter {
+  std::vector<unsigned int> first;
+  std::vector<unsigned int> count;
+  std::vector<size_t> offset;
+  std::vector<float> weights;
+  unsigned int max_count = 0;
+};
+
+// Weight of a source pixel `distance` source pixels away, in units of the kernel's support
+static double kernel_weight(ResampleKernel kernel, double distance) {
+  distance = std::abs(distance);
+  if (kernel == ResampleKernelBicubic) {
+    // Catmull-Rom, sharper than the tent but it can overshoot, which the rounding clamps
+    if (distance < 1.0) {
+      return 1.5 * distance * distance * distance - 2.5 * distance * distance + 1.0;
+    }
+    if (distance < 2.0) {
+      return -0.5 * distance * distance * distance + 2.5 * distance * distance - 4.0 * distance + 2.0;
+    }
+    return 0.0;
+  }
+  return std::max(0.0, 1.0 - distance);
+}
+
+static double kernel_support(ResampleKernel kernel) {
+  return kernel == ResampleKernelBicubic ? 2.0 : 1.0;
+}
+
+/**
+ * Output pixel `i` covers the source from `start + i * scale` to `start + (i + 1) * scale`. The
+ * kernel is as is when upscaling, widened to cover every source pixel when downscaling.
+ */
+static ResampleFilter make_filter(unsigned int src_size, unsigned int dst_size, double start, double scale, ResampleKernel kernel) {
+  ResampleFilter filter;
+  filter.first.resize(dst_size);
+  filter.count.resize(dst_size);
+  filter.offset.resize(dst_size);
+
+  double stretch = std::max(1.0, scale);
+  double radius = kernel_support(kernel) * stretch;
+
+  for (unsigned int i = 0; i < dst_size; i++) {
+    double center = start + (i + 0.5) * scale - 0.5;
+    int left = std::max(0, static_cast<int>(std::ceil(center - radius)));
+    int right = std::min(static_cast<int>(src_size) - 1, static_cast<int>(std::floor(center + radius)));
+    // Past the edges, the nearest pixel is all there is
+    if (right < left) {
+      left = right = std::clamp(static_cast<int>(std::lround(center)), 0, static_cast<int>(src_size) - 1);
+    }
+
+    // Pixels right on the edge of the kernel get no weight, and would only cost time
+    while (left < right && kernel_weight(kernel, (left - center) / stretch) == 0.0) {
+      left++;
+    }
+    while (right > left && kernel_weight(kernel, (right - center) / stretch) == 0.0) {
+      right--;
+    }
+
+    size_t offset = filter.weights.size();
+    double sum = 0.0;
+    for (int x = left; x <= right; x++) {
+      double weight = kernel_weight(kernel, (x - center) / stretch);
+      filter.weights.push_back(static_cast<float>(weight));
+      sum += weight;
+    }
+    // The edges lose part of their filter, the rest is scaled up to make up for it
+    for (size_t k = offset; k < filter.weights.size(); k++) {
+      filter.weights[k] = sum != 0.0 ? static_cast<float>(filter.weights[k] / sum) : 1.0f / (right - left + 1);
+    }
+
+    filter.first[i] = static_cast<unsigned int>(left);
+    filter.count[i] = static_cast<unsigned int>(right - left + 1);
+    filter.offset[i] = offset;
+    filter.max_count = std::max(filter.max_count, filter.count[i]);
+  }
+
+  return filter;
+}
+
+// Filters one source row down to `width` pixels of four floats each
+static void filter_row(const uint32_t* src, const ResampleFilter& filter, unsigned int width, float* out) {
+#if defined(MONOKL_SIMD_SSE2)
+  const __m128i zero = _mm_setzero_si128();
+#endif
+  for (unsigned int x = 0; x < width; x++) {
+    const uint32_t* pixels = src + filter.first[x];
+    const float* weights = filter.weights.data() + filter.offset[x];
+    unsigned int count = filter.count[x];
+
+#if defined(MONOKL_SIMD_SSE2)
+    __m128 sum = _mm_setzero_ps();
+    for (unsigned int k = 0; k < count; k++) {
+      __m128i pixel = _mm_cvtsi32_si128(static_cast<int>(pixels[k]));
+      pixel = _mm_unpacklo_epi16(_mm_unpacklo_epi8(pixel, zero), zero);
+      sum = _mm_add_ps(sum, _mm_mul_ps(_mm_cvtepi32_ps(pixel), _mm_set1_ps(weights[k])));
+    }
+    _mm_storeu_ps(out + x * 4, sum);
+#elif defined(MONOKL_SIMD_NEON)
+    float32x4_t sum = vdupq_n_f32(0.0f);
+    for (unsigned int k = 0; k < count; k++) {
+      uint8x8_t pixel = vreinterpret_u8_u32(vdup_n_u32(pixels[k]));
+      float32x4_t channels = vcvtq_f32_u32(vmovl_u16(vget_low_u16(vmovl_u8(pixel))));
+      sum = vmlaq_n_f32(sum, channels, weights[k]);
+    }
+    vst1q_f32(out + x * 4, sum);
+#else
+    float sum[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+    for (unsigned int k = 0; k < count; k++) {
+      const uint8_t* channels = reinterpret_cast<const uint8_t*>(pixels + k);
+      for (int c = 0; c < 4; c++) {
+        sum[c] += channels[c] * weights[k];
+      }
+    }
+    std::copy(sum, sum + 4, out + x * 4);
+#endif
+  }
+}
+
+// Weighs `count` filtered rows together into one row of RGBA8 pixels
+static void blend_rows(const float* const* rows, const float* weights, unsigned int count, unsigned int width, uint32_t* out) {
+  for (unsigned int x = 0; x < width; x++) {
+#if defined(MONOKL_SIMD_SSE2)
+    __m128 sum = _mm_setzero_ps();
+    for (unsigned int k = 0; k < count; k++) {
+      sum = _mm_add_ps(sum, _mm_mul_ps(_mm_loadu_ps(rows[k] + x * 4), _mm_set1_ps(weights[k])));
+    }
+    __m128i channels = _mm_cvtps_epi32(sum);
+    channels = _mm_packs_epi32(channels, channels);
+    channels = _mm_packus_epi16(channels, channels);
+    out[x] = static_cast<uint32_t>(_mm_cvtsi128_si32(channels));
+#elif defined(MONOKL_SIMD_NEON)
+    float32x4_t sum = vdupq_n_f32(0.0f);
+    for (unsigned int k = 0; k < count; k++) {
+      sum = vmlaq_n_f32(sum, vld1q_f32(rows[k] + x * 4), weights[k]);
+    }
+    uint16x4_t channels = vqmovn_u32(vcvtq_u32_f32(vaddq_f32(sum, vdupq_n_f32(0.5f))));
+    out[x] = vget_lane_u32(vreinterpret_u32_u8(vqmovn_u16(vcombine_u16(channels, channels))), 0);
+#else
+    uint8_t* channels = reinterpret_cast<uint8_t*>(out + x);
+    for (int c = 0; c < 4; c++) {
+      float sum = 0.0f;
+      for (unsigned int k = 0; k < count; k++) {
+        sum += rows[k][x * 4 + c] * weights[k];
+      }
+      channels[c] = static_cast<uint8_t>(std::clamp(sum + 0.5f, 0.0f, 255.0f));
+    }
+#endif
+  }
+}
+
+// Fills output rows `[first, last)`, filtering the source rows they need as they come up
+static void resample_rows(const ImageBuffer& src, const ResampleFilter& horizontal, const ResampleFilter& vertical, unsigned int first, unsigned int last, ImageBuffer& dst) {
+  unsigned int width = dst.width;
+
+  // Output rows need ever later source rows, so a ring as tall as the widest vertical filter is enough
+  unsigned int ring_size = vertical.max_count;
+  std::vector<float> ring(static_cast<size_t>(ring_size) * width * 4);
+  std::vector<int> ring_rows(ring_size, -1);
+  std::vector<const float*> rows(ring_size);
+
+  for (unsigned int y = first; y < last; y++) {
+    unsigned int first_row = vertical.first[y];
+    unsigned int count = vertical.count[y];
+
+    for (unsigned int k = 0; k < count; k++) {
+      unsigned int source_row = first_row + k;
+      unsigned int slot = source_row % ring_size;
+      float* row = ring.data() + static_cast<size_t>(slot) * width * 4;
+      if (ring_rows[slot] != static_cast<int>(source_row)) {
+        filter_row(src.row(source_row), horizontal, width, row);
+        ring_rows[slot] = static_cast<int>(source_row);
+      }
+      rows[k] = row;
+    }
+
+    blend_rows(rows.data(), vertical.weights.data() + vertical.offset[y], count, width, dst.row(y));
+  }
+}
+
+void monokl::resize_image(const ImageBuffer& src, ImageBuffer& dst, unsigned int width, unsigned int height) {
+  dst.allocate(width, height);
+  if (width == 0 || height == 0 || src.width == 0 || src.height == 0) {
+    return;
+  }
+
+  auto horizontal = make_filter(src.width, width, 0.0, static_cast<double>(src.width) / width, ResampleKernelBilinear);
+  auto vertical = make_filter(src.height, height, 0.0, static_cast<double>(src.height) / height, ResampleKernelBilinear);
+  resample_rows(src, horizontal, vertical, 0, height, dst);
+}
+
+void monokl::resample_region(const ImageBuffer& src, double x, double y, double zoom, ResampleKernel kernel, ImageBuffer& dst) {
+  if (dst.width == 0 || dst.height == 0 || src.width == 0 || src.height == 0 || zoom <= 0.0) {
+    return;
+  }
+
+  auto horizontal = make_filter(src.width, dst.width, x, 1.0 / zoom, kernel);
+  auto vertical = make_filter(src.height, dst.height, y, 1.0 / zoom, kernel);
+
+  // Every band of rows keeps a ring of its own, the few source rows two bands share are filtered twice
+  parallel_for(0, dst.height, MIN_ROWS_PER_BAND, [&](size_t first, size_t last) {
+    resample_rows(src, horizontal, vertical, static_cast<unsigned int>(first), static_cast<unsigned int>(last), dst);
+  });
+}
+
+void monokl::halve_rows(const uint32_t* top, const uint32_t* bottom, unsigned int width, uint32_t* out) {
+  unsigned int x = 0;
+#if defined(MONOKL_SIMD_SSE2)
+  for (; x + 4 <= width; x += 4) {
+    __m128i top_left = _mm_loadu_si128(reinterpret_cast<const __m128i*>(top + x * 2));
+    __m128i top_right = _mm_loadu_si128(reinterpret_cast<const __m128i*>(top + x * 2 + 4));
+    __m128i bottom_left = _mm_loadu_si128(reinterpret_cast<const __m128i*>(bottom + x * 2));
+    __m128i bottom_right = _mm_loadu_si128(reinterpret_cast<const __m128i*>(bottom + x * 2 + 4));
+    __m128 left = _mm_castsi128_ps(_mm_avg_epu8(top_left, bottom_left));
+    __m128 right = _mm_castsi128_ps(_mm_avg_epu8(top_right, bottom_right));
+    __m128i even = _mm_castps_si128(_mm_shuffle_ps(left, right, _MM_SHUFFLE(2, 0, 2, 0)));
+    __m128i odd = _mm_castps_si128(_mm_shuffle_ps(left, right, _MM_SHUFFLE(3, 1, 3, 1)));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out + x), _mm_avg_epu8(even, odd));
+  }
+#elif defined(MONOKL_SIMD_NEON)
+  for (; x + 4 <= width; x += 4) {
+    uint32x4x2_t top_pixels = vld2q_u32(top + x * 2);
+    uint32x4x2_t bottom_pixels = vld2q_u32(bottom + x * 2);
+    uint8x16_t even = vrhaddq_u8(vreinterpretq_u8_u32(top_pixels.val[0]), vreinterpretq_u8_u32(bottom_pixels.val[0]));
+    uint8x16_t odd = vrhaddq_u8(vreinterpretq_u8_u32(top_pixels.val[1]), vreinterpretq_u8_u32(bottom_pixels.val[1]));
+    vst1q_u32(out + x, vreinterpretq_u32_u8(vrhaddq_u8(even, odd)));
+  }
+#endif
+  for (; x < width; x++) {
+    const uint8_t* a = reinterpret_cast<const uint8_t*>(top + x * 2);
+    const uint8_t* b = reinterpret_cast<const uint8_t*>(bottom + x * 2);
+    uint8_t* dst = reinterpret_cast<uint8_t*>(out + x);
+    for (int c = 0; c < 4; c++) {
+      dst[c] = static_cast<uint8_t>((a[c] + a[c + 4] + b[c] + b[c + 4] + 2) / 4);
+    }
+  }
+}
@@ -0,0 +1,35 @@
+#ifndef MONOKL__RESIZE_H
+#define MONOKL__RESIZE_H
+
+#include <cstdint>
+
+#include "image_buffer.h"
+
+namespace monokl {
+
+typedef enum {
+  ResampleKernelBilinear,
+  ResampleKernelBicubic
+} ResampleKernel;
+
+/**
+ * Resamples RGBA8 pixels to `width` x `height` with a separable tent filter that widens along with
+ * the scale factor, so downscaling averages every source pixel instead of skipping most of them.
+ * The four channels of a pixel are filtered together as one SIMD vector. Source rows are filtered
+ * horizontally as the output rows that need them come up, so only a few rows are ever held in
+ * floating point, however large the source is.
+ */
+void resize_image(const ImageBuffer& src, ImageBuffer& dst, unsigned int width, unsigned int height);
+
+/**
+ * Fills `dst` with the part of `src` that starts at (`x`, `y`), in source pixels, scaled by
+ * `zoom`. Filtered the same way as `resize_image`, with bands of rows spread over all cores.
+ */
+void resample_region(const ImageBuffer& src, double x, double y, double zoom, ResampleKernel kernel, ImageBuffer& dst);
+
+// Averages every 2x2 block of `top` and `bottom` into one pixel of `out`, which is `width` pixels wide
+void halve_rows(const uint32_t* top, const uint32_t* bottom, unsigned int width, uint32_t* out);
+
+}
+
+#endif
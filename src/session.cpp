@@ -0,0 +1,459 @@
+#include "session.h"
+#include "mapped_file.h"
+#include "durable_file.h"
+#include "util.h"
+#include "logging.h"
+#include "io_scheduler.h"
+
+#include <chrono>
+#include <cstring>
+#include <future>
+#include <unordered_map>
+
+using namespace monokl;
+
+// "MNKL" when read back on a machine with the same byte order
+static const uint32_t SESSION_MAGIC = 0x4C4B4E4D;
+static const uint32_t SESSION_VERSION = 1;
+
+static const uint32_t FOLDER_FLAG_FULLY_SCANNED = 1;
+static const uint32_t FOLDER_FLAG_ARCHIVE = 2;
+static const uint32_t ENTRY_FLAG_FOLDER = 1;
+static const uint32_t NO_ENTRY = UINT32_MAX;
+
+/*
+ * The file is laid out as the header, then the tables below back to back and finally the
+ * string pool. Every record is a multiple of 8 bytes, so all of them are properly aligned when
+ * the file is mapped and can be read in place.
+ */
+struct SessionHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t sort_order;
+  uint32_t current_entry;
+  uint32_t root_count;
+  uint32_t folder_count;
+  uint32_t entry_count;
+  uint32_t name_count;
+  uint64_t strings_size;
+};
+
+struct StringRef {
+  uint32_t offset;
+  uint32_t length;
+};
+
+struct FolderRecord {
+  StringRef path;
+  uint32_t flags;
+  uint32_t favorites_begin;
+  uint32_t favorites_count;
+  uint32_t hidden_begin;
+  uint32_t hidden_count;
+  uint32_t reserved;
+  int64_t last_modified_at;
+  int64_t settings_modified_at;
+};
+
+// Images store their file name only, the folder path is shared through `folder_index`
+struct EntryRecord {
+  uint32_t folder_index;
+  uint32_t flags;
+  StringRef name;
+  int64_t last_modified_at;
+};
+
+static_assert(sizeof(SessionHeader) % 8 == 0, "SessionHeader must keep the tables 8 byte aligned");
+static_assert(sizeof(FolderRecord) % 8 == 0, "FolderRecord must keep the tables 8 byte aligned");
+static_assert(sizeof(EntryRecord) % 8 == 0, "EntryRecord must keep the tables 8 byte aligned");
+
+class StringPool {
+public:
+  StringRef add(const std::string& value) {
+    StringRef ref;
+    ref.offset = static_cast<uint32_t>(data.size());
+    ref.length = static_cast<uint32_t>(value.size());
+    data.append(value);
+    return ref;
+  }
+
+  std::string data;
+};
+
+template<typename T>
+static void append_records(std::string& out, const std::vector<T>& records) {
+  if (!records.empty()) {
+    out.append(reinterpret_cast<const char*>(records.data()), records.size() * sizeof(T));
+  }
+}
+
+std::filesystem::path Session::get_session_path() {
+  return Util::get_user_home_dir() / ".monokl" / "session.bin";
+}
+
+bool Session::save(const Playlist& playlist, const std::filesystem::path& path) {
+  auto t0 = std::chrono::high_resolution_clock::now();
+
+  StringPool strings;
+  std::vector<StringRef> roots;
+  std::vector<FolderRecord> folders;
+  std::vector<EntryRecord> entries;
+  std::vector<StringRef> names;
+
+  for (const auto& root : playlist.roots) {
+    roots.push_back(strings.add(root));
+  }
+
+  std::unordered_map<const FolderEntry*, uint32_t> folder_indices;
+  auto folder_index_of = [&](const FolderEntry* folder) {
+    auto it = folder_indices.find(folder);
+    if (it != folder_indices.end()) {
+      return it->second;
+    }
+
+    FolderRecord record = {};
+    record.path = strings.add(folder->path.u8string());
+    record.flags = (folder->fully_scanned ? FOLDER_FLAG_FULLY_SCANNED : 0) | (folder->is_archive ? FOLDER_FLAG_ARCHIVE : 0);
+    record.last_modified_at = folder->last_modified_at;
+    record.settings_modified_at = folder->settings_modified_at;
+    std::set<std::string> favorites;
+    std::set<std::string> hidden;
+    folder->get_flags(favorites, hidden);
+    record.favorites_begin = static_cast<uint32_t>(names.size());
+    record.favorites_count = static_cast<uint32_t>(favorites.size());
+    for (const auto& name : favorites) {
+      names.push_back(strings.add(name));
+    }
+    record.hidden_begin = static_cast<uint32_t>(names.size());
+    record.hidden_count = static_cast<uint32_t>(hidden.size());
+    for (const auto& name : hidden) {
+      names.push_back(strings.add(name));
+    }
+
+    auto index = static_cast<uint32_t>(folders.size());
+    folders.push_back(record);
+    folder_indices[folder] = index;
+    return index;
+  };
+
+  auto current = playlist.get_current();
+  uint32_t current_entry = NO_ENTRY;
+
+  for (const auto& entry : playlist.all_entries) {
+    EntryRecord record = {};
+    record.last_modified_at = entry->last_modified_at;
+
+    if (entry->is_folder()) {
+      record.flags = ENTRY_FLAG_FOLDER;
+      record.folder_index = folder_index_of(static_cast<const FolderEntry*>(entry.get()));
+    } else {
+      auto image_entry = std::static_pointer_cast<ImageEntry>(entry);
+      // Later pages are added again when their document is shown
+      if (image_entry->parent == nullptr || image_entry->page > 0) {
+        continue;
+      }
+      if (image_entry == current) {
+        current_entry = static_cast<uint32_t>(entries.size());
+      }
+      record.folder_index = folder_index_of(image_entry->parent.get());
+      record.name = strings.add(image_entry->member.empty() ? image_entry->path.filename().u8string() : image_entry->member);
+    }
+
+    entries.push_back(record);
+  }
+
+  SessionHeader header = {};
+  header.magic = SESSION_MAGIC;
+  header.version = SESSION_VERSION;
+  header.sort_order = static_cast<uint32_t>(playlist.options.sort_order);
+  header.current_entry = current_entry;
+  header.root_count = static_cast<uint32_t>(roots.size());
+  header.folder_count = static_cast<uint32_t>(folders.size());
+  header.entry_count = static_cast<uint32_t>(entries.size());
+  header.name_count = static_cast<uint32_t>(names.size());
+  header.strings_size = strings.data.size();
+
+  std::string out;
+  out.reserve(sizeof(header) + roots.size() * sizeof(StringRef) + folders.size() * sizeof(FolderRecord) + entries.size() * sizeof(EntryRecord) + names.size() * sizeof(StringRef) + strings.data.size());
+  out.append(reinterpret_cast<const char*>(&header), sizeof(header));
+  append_records(out, roots);
+  append_records(out, folders);
+  append_records(out, entries);
+  append_records(out, names);
+  out.append(strings.data);
+
+  std::error_code error;
+  std::filesystem::create_directories(path.parent_path(), error);
+
+  // Synced before it's moved over the old snapshot, so a crash leaves either one whole
+  if (!DurableFile::replace(path, out)) {
+    return false;
+  }
+
+  auto t1 = std::chrono::high_resolution_clock::now();
+  auto duration_ms = static_cast<long long int>(std::chrono::duration_cast<std::chrono::milliseconds>(t1 - t0).count());
+  log_debug("Saved session with %lu entries (%lu bytes) in %lld ms", entries.size(), out.size(), duration_ms);
+
+  return true;
+}
+
+bool Session::restore(Playlist& playlist, const std::filesystem::path& path) {
+  auto t0 = std::chrono::high_resolution_clock::now();
+
+  auto file = MappedFile::open(path);
+  if (file == nullptr) {
+    log_debug("No session found at %s", path.string().c_str());
+    return false;
+  }
+
+  const uint8_t* data = file->data();
+  size_t size = file->size();
+
+  if (size < sizeof(SessionHeader)) {
+    log_warn("Ignoring truncated session at %s", path.string().c_str());
+    return false;
+  }
+
+  const auto* header = reinterpret_cast<const SessionHeader*>(data);
+  if (header->magic != SESSION_MAGIC || header->version != SESSION_VERSION) {
+    log_warn("Ignoring session with an unknown format at %s", path.string().c_str());
+    return false;
+  }
+
+  uint64_t expected_size = sizeof(SessionHeader)
+    + static_cast<uint64_t>(header->root_count) * sizeof(StringRef)
+    + static_cast<uint64_t>(header->folder_count) * sizeof(FolderRecord)
+    + static_cast<uint64_t>(header->entry_count) * sizeof(EntryRecord)
+    + static_cast<uint64_t>(header->name_count) * sizeof(StringRef)
+    + header->strings_size;
+  if (expected_size != size) {
+    log_warn("Ignoring truncated session at %s", path.string().c_str());
+    return false;
+  }
+
+  const auto* roots = reinterpret_cast<const StringRef*>(data + sizeof(SessionHeader));
+  const auto* folders = reinterpret_cast<const FolderRecord*>(roots + header->root_count);
+  const auto* entries = reinterpret_cast<const EntryRecord*>(folders + header->folder_count);
+  const auto* names = reinterpret_cast<const StringRef*>(entries + header->entry_count);
+  const char* strings = reinterpret_cast<const char*>(names + header->name_count);
+
+  bool valid = true;
+  auto read_string = [&](const StringRef& ref) {
+    if (static_cast<uint64_t>(ref.offset) + ref.length > header->strings_size) {
+      valid = false;
+      return std::string();
+    }
+    return std::string(strings + ref.offset, ref.length);
+  };
+  auto read_names = [&](uint32_t begin, uint32_t count, std::set<std::string>& out) {
+    if (static_cast<uint64_t>(begin) + count > header->name_count) {
+      valid = false;
+      return;
+    }
+    for (uint32_t i = begin; i < begin + count; i++) {
+      out.insert(read_string(names[i]));
+    }
+  };
+
+  std::vector<std::string> restored_roots;
+  restored_roots.reserve(header->root_count);
+  for (uint32_t i = 0; i < header->root_count; i++) {
+    restored_roots.push_back(read_string(roots[i]));
+  }
+
+  std::vector<std::shared_ptr<FolderEntry>> restored_folders;
+  restored_folders.reserve(header->folder_count);
+  for (uint32_t i = 0; i < header->folder_count; i++) {
+    const auto& record = folders[i];
+    auto folder = std::make_shared<FolderEntry>();
+    folder->path = std::filesystem::u8path(read_string(record.path));
+    folder->last_modified_at = record.last_modified_at;
+    folder->settings_modified_at = record.settings_modified_at;
+    folder->fully_scanned = (record.flags & FOLDER_FLAG_FULLY_SCANNED) != 0;
+    folder->is_archive = (record.flags & FOLDER_FLAG_ARCHIVE) != 0;
+    std::set<std::string> favorites;
+    std::set<std::string> hidden;
+    read_names(record.favorites_begin, record.favorites_count, favorites);
+    read_names(record.hidden_begin, record.hidden_count, hidden);
+    folder->set_flags(std::move(favorites), std::move(hidden));
+    restored_folders.push_back(folder);
+  }
+
+  std::vector<std::shared_ptr<PlaylistEntry>> restored_entries;
+  restored_entries.reserve(header->entry_count);
+  std::shared_ptr<ImageEntry> current = nullptr;
+  for (uint32_t i = 0; i < header->entry_count && valid; i++) {
+    const auto& record = entries[i];
+    if (record.folder_index >= restored_folders.size()) {
+      valid = false;
+      break;
+    }
+
+    const auto& folder = restored_folders[record.folder_index];
+    if (record.flags & ENTRY_FLAG_FOLDER) {
+      restored_entries.push_back(folder);
+      continue;
+    }
+
+    auto image_entry = std::make_shared<ImageEntry>();
+    auto name = read_string(record.name);
+    image_entry->path = folder->path / std::filesystem::u8path(name);
+    if (folder->is_archive) {
+      image_entry->member = std::move(name);
+    }
+    image_entry->last_modified_at = record.last_modified_at;
+    image_entry->parent = folder;
+    folder->children.push_back(image_entry);
+    restored_entries.push_back(image_entry);
+
+    if (i == header->current_entry) {
+      current = image_entry;
+    }
+  }
+
+  if (!valid) {
+    log_warn("Ignoring corrupted session at %s", path.string().c_str());
+    return false;
+  }
+
+  playlist.roots = std::move(restored_roots);
+  playlist.all_entries = std::move(restored_entries);
+  playlist.options.sort_order = static_cast<PlaylistSortOrder>(header->sort_order);
+  playlist.refresh_shown_entries();
+
+  for (size_t i = 0; i < playlist.shown_entries.size(); i++) {
+    if (playlist.shown_entries[i] == current) {
+      playlist.go_to(static_cast<int>(i));
+      break;
+    }
+  }
+
+  auto t1 = std::chrono::high_resolution_clock::now();
+  auto duration_ms = static_cast<long long int>(std::chrono::duration_cast<std::chrono::milliseconds>(t1 - t0).count());
+  log_debug("Restored session with %lu entries from %s in %lld ms", playlist.all_entries.size(), path.string().c_str(), duration_ms);
+
+  return true;
+}
+
+std::vector<FolderState> Session::capture_folder_states(const Playlist& playlist) {
+  std::vector<FolderState> states;
+  for (const auto& entry : playlist.all_entries) {
+    if (!entry->is_folder()) {
+      continue;
+    }
+
+    auto folder = std::static_pointer_cast<FolderEntry>(entry);
+
+    FolderState state;
+    state.path = folder->path;
+    state.last_modified_at = folder->last_modified_at;
+    state.settings_modified_at = folder->settings_modified_at;
+    state.fully_scanned = folder->fully_scanned;
+    state.is_archive = folder->is_archive;
+    if (!folder->fully_scanned) {
+      for (const auto& child : folder->children) {
+        state.files.push_back(child->path);
+      }
+    }
+    states.push_back(std::move(state));
+  }
+  return states;
+}
+
+// Rescans the folder if it changed since `state` was captured, returns `nullptr` if it didn't
+static std::shared_ptr<FolderEntry> revalidate_folder(const FolderState& state, ScanProgress* progress) {
+  // Adding, removing or renaming a file bumps the folder's mtime, and so does rewriting
+  // `.monokl.toml` through a temporary file; in-place edits of it are caught by its own mtime
+  int64_t last_modified_at = Util::get_last_modified_at(state.path);
+  // Archives keep theirs next to them, see `FolderEntry::get_settings_path`
+  auto settings_path = state.path / ".monokl.toml";
+  if (state.is_archive) {
+    settings_path = state.path;
+    settings_path += ".monokl.toml";
+  }
+  int64_t settings_modified_at = Util::get_last_modified_at(settings_path);
+  if (last_modified_at == state.last_modified_at && settings_modified_at == state.settings_modified_at) {
+    return nullptr;
+  }
+
+  try {
+    if (state.is_archive) {
+      return Playlist::scan_archive(state.path, progress);
+    }
+    if (state.fully_scanned) {
+      return Playlist::scan_folder(state.path, progress);
+    }
+
+    // Only some of the files were dropped, keep to those that are still around
+    auto folder = std::make_shared<FolderEntry>();
+    folder->path = state.path;
+    folder->last_modified_at = last_modified_at;
+    folder->reload_settings();
+
+    for (const auto& file_path : state.files) {
+      std::error_code error;
+      if (!std::filesystem::is_regular_file(file_path, error)) {
+        continue;
+      }
+
+      auto file = std::make_shared<ImageEntry>();
+      file->path = file_path;
+      file->last_modified_at = Util::get_last_modified_at(file_path);
+      file->parent = folder;
+      folder->children.push_back(file);
+    }
+
+    return folder;
+  } catch (const std::exception& e) {
+    // The folder is gone or unreadable, an empty entry drops its images from the playlist
+    log_warn("Failed to rescan %s: %s", state.path.string().c_str(), e.what());
+    auto folder = std::make_shared<FolderEntry>();
+    folder->path = state.path;
+    folder->is_archive = state.is_archive;
+    return folder;
+  }
+}
+
+std::vector<std::shared_ptr<FolderEntry>> Session::revalidate(const std::vector<FolderState>& folders) {
+  auto t0 = std::chrono::high_resolution_clock::now();
+
+  // Every folder is checked on the I/O threads of its own device, so a hung mount only keeps its
+  // own folders as they were restored
+  std::vector<std::future<std::shared_ptr<FolderEntry>>> checks;
+  std::vector<std::shared_ptr<ScanProgress>> progress;
+  for (const auto& state : folders) {
+    auto folder_progress = std::make_shared<ScanProgress>();
+    checks.push_back(IoScheduler::get().submit<std::shared_ptr<FolderEntry>>(state.path, IoPriorityBackground, IoScheduler::SCAN_TIMEOUT, [state, folder_progress]() {
+      folder_progress->step();
+      return revalidate_folder(state, folder_progress.get());
+    }));
+    progress.push_back(folder_progress);
+  }
+
+  // Large folders on slow drives can take a while, they're only given up on once they stop making progress
+  std::vector<std::shared_ptr<FolderEntry>> changed;
+  for (size_t i = 0; i < checks.size(); i++) {
+    auto status = checks[i].wait_for(std::chrono::milliseconds(100));
+    while (status != std::future_status::ready && !progress[i]->is_stuck(IoScheduler::SCAN_TIMEOUT)) {
+      status = checks[i].wait_for(std::chrono::milliseconds(100));
+    }
+    if (status != std::future_status::ready) {
+      log_warn("Gave up revalidating %s, its device stopped responding", folders[i].path.string().c_str());
+      continue;
+    }
+    try {
+      auto folder = checks[i].get();
+      if (folder != nullptr) {
+        changed.push_back(folder);
+      }
+    } catch (const MonoklError& e) {
+      log_warn("Gave up revalidating %s: %s", folders[i].path.string().c_str(), e.what());
+    }
+  }
+
+  auto t1 = std::chrono::high_resolution_clock::now();
+  auto duration_ms = static_cast<long long int>(std::chrono::duration_cast<std::chrono::milliseconds>(t1 - t0).count());
+  log_debug("Revalidated %lu folders in %lld ms, %lu changed", folders.size(), duration_ms, changed.size());
+
+  return changed;
+}
@@ -0,0 +1,46 @@
+#ifndef MONOKL__SESSION_H
+#define MONOKL__SESSION_H
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <filesystem>
+#include <cstdint>
+
+#include "playlist.h"
+
+namespace monokl {
+
+/**
+ * What a folder looked like when the snapshot was taken, copied out of the playlist so it can
+ * be checked against the disk on another thread.
+ */
+struct FolderState {
+  std::filesystem::path path;
+  int64_t last_modified_at = 0;
+  int64_t settings_modified_at = 0;
+  bool fully_scanned = false;
+  bool is_archive = false;
+  std::vector<std::filesystem::path> files;
+};
+
+/**
+ * The playlist of the last session, kept as a flat binary file next to settings.toml. Restoring
+ * maps the file and builds the entries straight from it, without touching the folders or their
+ * `.monokl.toml` files; `revalidate` then catches up with whatever changed on disk since.
+ */
+class Session {
+public:
+  static std::filesystem::path get_session_path();
+
+  static bool save(const Playlist& playlist, const std::filesystem::path& path);
+  static bool restore(Playlist& playlist, const std::filesystem::path& path);
+
+  static std::vector<FolderState> capture_folder_states(const Playlist& playlist);
+  // Returns the folders whose mtime changed, rescanned and ready for `Playlist::replace_folder`
+  static std::vector<std::shared_ptr<FolderEntry>> revalidate(const std::vector<FolderState>& folders);
+};
+
+}
+
+#endif
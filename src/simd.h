@@ -0,0 +1,14 @@
+#ifndef MONOKL__SIMD_H
+#define MONOKL__SIMD_H
+
+// Picks the vector instruction set the pixel kernels are compiled for. SSE2 is part of the x86-64
+// baseline and NEON of AArch64, so neither needs a runtime check. Everything else gets the scalar paths.
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define MONOKL_SIMD_SSE2 1
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define MONOKL_SIMD_NEON 1
+#include <arm_neon.h>
+#endif
+
+#endif
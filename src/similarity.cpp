@@ -0,0 +1,363 @@
+#include "similarity.h"
+#include "decoder.h"
+#include "durable_file.h"
+#include "mapped_file.h"
+#include "instrumentation.h"
+#include "parallel.h"
+#include "util.h"
+#include "logging.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <numeric>
+#include <thread>
+
+using namespace monokl;
+
+// "PHSH" when read back on a machine with the same byte order
+static const uint32_t CACHE_MAGIC = 0x48534850;
+static const uint32_t CACHE_VERSION = 1;
+
+struct CacheHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t count;
+};
+
+// Keyed by a hash of the path, 64 bits are plenty to tell apart every image a user will ever have
+struct CacheRecord {
+  uint64_t key;
+  int64_t last_modified_at;
+  uint64_t hash;
+};
+
+static uint64_t cache_key(const ImageEntry& entry) {
+  auto key = entry.path.u8string();
+  if (!entry.member.empty()) {
+    key += '\0';
+    key += entry.member;
+  }
+  return Util::hash_string(key);
+}
+
+static std::unordered_map<uint64_t, CacheRecord> load_cache(const std::filesystem::path& path) {
+  std::unordered_map<uint64_t, CacheRecord> cache;
+
+  auto file = MappedFile::open(path);
+  if (file == nullptr || file->size() < sizeof(CacheHeader)) {
+    return cache;
+  }
+
+  CacheHeader header;
+  std::memcpy(&header, file->data(), sizeof(header));
+  if (header.magic != CACHE_MAGIC || header.version != CACHE_VERSION || header.count != (file->size() - sizeof(header)) / sizeof(CacheRecord)) {
+    log_warn("Ignoring hash cache with an unknown format at %s", path.string().c_str());
+    return cache;
+  }
+
+  const auto* records = reinterpret_cast<const CacheRecord*>(file->data() + sizeof(header));
+  cache.reserve(static_cast<size_t>(header.count));
+  for (uint64_t i = 0; i < header.count; i++) {
+    cache[records[i].key] = records[i];
+  }
+  return cache;
+}
+
+static bool save_cache(const std::filesystem::path& path, const std::unordered_map<uint64_t, CacheRecord>& cache) {
+  CacheHeader header = {CACHE_MAGIC, CACHE_VERSION, cache.size()};
+
+  std::string out;
+  out.reserve(sizeof(header) + cache.size() * sizeof(CacheRecord));
+  out.append(reinterpret_cast<const char*>(&header), sizeof(header));
+  for (const auto& entry : cache) {
+    out.append(reinterpret_cast<const char*>(&entry.second), sizeof(CacheRecord));
+  }
+
+  std::error_code error;
+  std::filesystem::create_directories(path.parent_path(), error);
+  return DurableFile::replace(path, out);
+}
+
+static bool compute_hash(const ImageEntry& entry, const Archive* archive, const std::shared_ptr<MemoryGovernor>& governor, uint64_t& hash) {
+  // Images on a mount that's hanging are left unhashed rather than queued behind it
+  if (archive == nullptr && IoScheduler::get().is_stalled(entry.path)) {
+    return false;
+  }
+
+  sail::image image = archive != nullptr ? ImageDecoder::read_first_frame(*archive, entry.member, governor) : ImageDecoder::read_first_frame(entry.path.string(), IoPriorityBackground);
+  if (!image.is_valid()) {
+    return false;
+  }
+
+  if (image.pixel_format() != SAIL_PIXEL_FORMAT_BPP32_RGBA && image.convert(SAIL_PIXEL_FORMAT_BPP32_RGBA) != SAIL_OK) {
+    return false;
+  }
+
+  hash = PerceptualHash::compute(static_cast<const uint32_t*>(image.pixels()), image.width(), image.height(), image.bytes_per_line() / sizeof(uint32_t));
+  return true;
+}
+
+static uint32_t find_root(std::vector<uint32_t>& parents, uint32_t item) {
+  while (parents[item] != item) {
+    parents[item] = parents[parents[item]];
+    item = parents[item];
+  }
+  return item;
+}
+
+SimilarityEngine::SimilarityEngine(const std::shared_ptr<MemoryGovernor>& governor) : governor(governor) {
+}
+
+SimilarityEngine::~SimilarityEngine() {
+  cancel();
+}
+
+std::filesystem::path SimilarityEngine::get_cache_path() {
+  return Util::get_user_home_dir() / ".monokl" / "hashes.bin";
+}
+
+void SimilarityEngine::start(const std::vector<std::shared_ptr<ImageEntry>>& entries) {
+  cancel();
+
+  source = entries;
+
+  std::vector<std::shared_ptr<ImageEntry>> images;
+  std::vector<std::shared_ptr<Archive>> archives;
+  images.reserve(entries.size());
+  archives.reserve(entries.size());
+  for (const auto& entry : entries) {
+    // Later pages share their file with the first one, only the first page is hashed
+    if (entry->page > 0) {
+      continue;
+    }
+    images.push_back(entry);
+    archives.push_back(!entry->member.empty() && entry->parent != nullptr ? entry->parent->get_archive() : nullptr);
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    index.reset();
+  }
+
+  cancelled = false;
+  hashed = 0;
+  total = images.size();
+  job = std::async(std::launch::async, &SimilarityEngine::run, this, std::move(images), std::move(archives));
+}
+
+void SimilarityEngine::cancel() {
+  cancelled = true;
+  if (job.valid()) {
+    job.wait();
+    job = std::future<void>();
+  }
+}
+
+bool SimilarityEngine::is_running() const {
+  return job.valid() && job.wait_for(std::chrono::seconds(0)) != std::future_status::ready;
+}
+
+bool SimilarityEngine::is_started_with(const std::vector<std::shared_ptr<ImageEntry>>& entries) const {
+  return job.valid() && entries == source;
+}
+
+bool SimilarityEngine::is_ready() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  return index != nullptr;
+}
+
+size_t SimilarityEngine::hashed_count() const {
+  return hashed;
+}
+
+size_t SimilarityEngine::total_count() const {
+  return total;
+}
+
+void SimilarityEngine::run(std::vector<std::shared_ptr<ImageEntry>> entries, std::vector<std::shared_ptr<Archive>> archives) {
+  auto t0 = std::chrono::high_resolution_clock::now();
+
+  auto cache_path = get_cache_path();
+  auto cache = load_cache(cache_path);
+
+  std::vector<uint64_t> keys(entries.size());
+  std::vector<uint64_t> hashes(entries.size());
+  std::vector<uint8_t> valid(entries.size(), 0);
+  std::vector<size_t> pending;
+  for (size_t i = 0; i < entries.size(); i++) {
+    keys[i] = cache_key(*entries[i]);
+    auto cached = cache.find(keys[i]);
+    if (cached != cache.end() && cached->second.last_modified_at == entries[i]->last_modified_at) {
+      hashes[i] = cached->second.hash;
+      valid[i] = 1;
+    } else {
+      pending.push_back(i);
+    }
+  }
+  hashed = entries.size() - pending.size();
+
+  // One core is left to the UI and the viewer's own decoding, and each worker holds a full size
+  // decode, so they're cut down to one when memory is already tight
+  size_t workers = std::max<size_t>(1, parallel_worker_count() - 1);
+  if (governor != nullptr && governor->should_downscale_inactive()) {
+    workers = 1;
+  }
+
+  // Decode times vary wildly between images, so workers pull the next one instead of taking a fixed share.
+  // They wait on reads, so they're threads of their own rather than ones of the shared pool
+  std::atomic<size_t> next{0};
+  std::vector<std::thread> threads;
+  for (size_t worker = 0; worker < std::min(workers, pending.size()); worker++) {
+    threads.emplace_back([&]() {
+      size_t position;
+      while (!cancelled && (position = next++) < pending.size()) {
+        size_t i = pending[position];
+        ScopedTimer timer("similarity.hash");
+        valid[i] = compute_hash(*entries[i], archives[i].get(), governor, hashes[i]) ? 1 : 0;
+        hashed++;
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  if (cancelled) {
+    log_debug("Cancelled hashing after %lu of %lu images", hashed.load(), entries.size());
+    return;
+  }
+
+  auto t1 = std::chrono::high_resolution_clock::now();
+
+  auto result = std::make_shared<SimilarityIndex>();
+  result->entries.reserve(entries.size());
+  result->hashes.reserve(entries.size());
+  for (size_t i = 0; i < entries.size(); i++) {
+    if (!valid[i]) {
+      continue;
+    }
+    auto item = static_cast<uint32_t>(result->entries.size());
+    result->positions[entries[i].get()] = item;
+    result->entries.push_back(entries[i]);
+    result->hashes.push_back(hashes[i]);
+  }
+
+  result->hash_index.build(result->hashes);
+
+  // Every image is queried once, then near duplicates are merged into groups, transitively
+  size_t count = result->entries.size();
+  std::vector<std::vector<uint32_t>> neighbors(count);
+  parallel_for(0, count, 256, [&](size_t first, size_t last) {
+    for (size_t item = first; item < last; item++) {
+      result->hash_index.find(result->hashes[item], DEFAULT_MAX_DISTANCE, neighbors[item]);
+    }
+  });
+
+  std::vector<uint32_t> parents(count);
+  std::iota(parents.begin(), parents.end(), 0);
+  for (uint32_t item = 0; item < count; item++) {
+    for (uint32_t neighbor : neighbors[item]) {
+      parents[find_root(parents, neighbor)] = find_root(parents, item);
+    }
+  }
+
+  // Groups come in the order of their first image, and keep their images in playlist order
+  std::vector<std::vector<uint32_t>> groups(count);
+  std::vector<uint32_t> group_order;
+  for (uint32_t item = 0; item < count; item++) {
+    uint32_t root = find_root(parents, item);
+    if (groups[root].empty()) {
+      group_order.push_back(root);
+    }
+    groups[root].push_back(item);
+  }
+  for (uint32_t root : group_order) {
+    if (groups[root].size() > 1) {
+      result->grouped.insert(result->grouped.end(), groups[root].begin(), groups[root].end());
+    }
+  }
+
+  auto t2 = std::chrono::high_resolution_clock::now();
+
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    index = result;
+  }
+
+  auto hash_ms = static_cast<long long int>(std::chrono::duration_cast<std::chrono::milliseconds>(t1 - t0).count());
+  auto group_ms = static_cast<long long int>(std::chrono::duration_cast<std::chrono::milliseconds>(t2 - t1).count());
+  log_debug("Hashed %lu images (%lu cached) in %lld ms, found %lu images with near duplicates in %lld ms",
+      entries.size(), entries.size() - pending.size(), hash_ms, result->grouped.size(), group_ms);
+
+  if (!pending.empty()) {
+    for (size_t i : pending) {
+      if (valid[i]) {
+        cache[keys[i]] = {keys[i], entries[i]->last_modified_at, hashes[i]};
+      }
+    }
+    if (!save_cache(cache_path, cache)) {
+      log_error("Failed to write hash cache to %s", cache_path.string().c_str());
+    }
+  }
+}
+
+std::vector<std::shared_ptr<ImageEntry>> SimilarityEngine::find_similar(const std::shared_ptr<ImageEntry>& entry, int max_distance) const {
+  std::shared_ptr<const SimilarityIndex> current;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    current = index;
+  }
+
+  std::vector<std::shared_ptr<ImageEntry>> similar;
+  if (current == nullptr || entry == nullptr) {
+    return similar;
+  }
+
+  auto t0 = std::chrono::high_resolution_clock::now();
+
+  auto position = current->positions.find(entry.get());
+  if (position == current->positions.end()) {
+    return similar;
+  }
+
+  uint64_t hash = current->hashes[position->second];
+  std::vector<uint32_t> items;
+  current->hash_index.find(hash, max_distance, items);
+
+  // Ties keep playlist order, and the query itself always comes first at distance 0
+  std::sort(items.begin(), items.end(), [&](uint32_t a, uint32_t b) {
+    int distance_a = a == position->second ? -1 : PerceptualHash::distance(hash, current->hashes[a]);
+    int distance_b = b == position->second ? -1 : PerceptualHash::distance(hash, current->hashes[b]);
+    return distance_a != distance_b ? distance_a < distance_b : a < b;
+  });
+
+  similar.reserve(items.size());
+  for (uint32_t item : items) {
+    similar.push_back(current->entries[item]);
+  }
+
+  auto t1 = std::chrono::high_resolution_clock::now();
+  Instrumentation::get().record_timing("similarity.query", std::chrono::duration<double, std::milli>(t1 - t0).count());
+
+  return similar;
+}
+
+std::vector<std::shared_ptr<ImageEntry>> SimilarityEngine::group_by_similarity() const {
+  std::shared_ptr<const SimilarityIndex> current;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    current = index;
+  }
+
+  std::vector<std::shared_ptr<ImageEntry>> grouped;
+  if (current == nullptr) {
+    return grouped;
+  }
+
+  grouped.reserve(current->grouped.size());
+  for (uint32_t item : current->grouped) {
+    grouped.push_back(current->entries[item]);
+  }
+  return grouped;
+}
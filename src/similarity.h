@@ -0,0 +1,80 @@
+#ifndef MONOKL__SIMILARITY_H
+#define MONOKL__SIMILARITY_H
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <future>
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
+#include <filesystem>
+#include <cstdint>
+#include <cstddef>
+
+#include "playlist.h"
+#include "memory_governor.h"
+#include "perceptual_hash.h"
+
+namespace monokl {
+
+struct SimilarityIndex {
+  std::vector<std::shared_ptr<ImageEntry>> entries;
+  std::vector<uint64_t> hashes;
+  std::unordered_map<const ImageEntry*, uint32_t> positions;
+  HashIndex hash_index;
+  // Images with at least one near duplicate, one group after the other in playlist order
+  std::vector<uint32_t> grouped;
+};
+
+/**
+ * Perceptual hashes of a playlist, computed in the background and cached in `hashes.bin` by
+ * path and modification time, so only new or changed images are decoded again. Once every image
+ * is hashed they go into a multi-index hash, which answers "what looks like this one" without
+ * comparing against every other image.
+ */
+class SimilarityEngine {
+public:
+  // Out of 64 bits, recompressed or resized copies and burst shots are usually well within this
+  static const int DEFAULT_MAX_DISTANCE = 10;
+
+  explicit SimilarityEngine(const std::shared_ptr<MemoryGovernor>& governor);
+  ~SimilarityEngine();
+
+  static std::filesystem::path get_cache_path();
+
+  // Cancels a running job and starts hashing `entries` from scratch
+  void start(const std::vector<std::shared_ptr<ImageEntry>>& entries);
+  void cancel();
+
+  bool is_running() const;
+  // Whether the last job was started with exactly `entries`, whether or not it's done yet
+  bool is_started_with(const std::vector<std::shared_ptr<ImageEntry>>& entries) const;
+  // Whether the last job is done and queries can be answered
+  bool is_ready() const;
+  size_t hashed_count() const;
+  size_t total_count() const;
+
+  // `entry` followed by the images within `max_distance` of it, closest first
+  std::vector<std::shared_ptr<ImageEntry>> find_similar(const std::shared_ptr<ImageEntry>& entry, int max_distance = DEFAULT_MAX_DISTANCE) const;
+  // Every image that has a near duplicate, with each group of near duplicates kept together
+  std::vector<std::shared_ptr<ImageEntry>> group_by_similarity() const;
+
+private:
+  std::shared_ptr<MemoryGovernor> governor;
+
+  std::vector<std::shared_ptr<ImageEntry>> source;
+  std::future<void> job;
+  std::atomic<bool> cancelled{false};
+  std::atomic<size_t> hashed{0};
+  std::atomic<size_t> total{0};
+
+  mutable std::mutex mutex;
+  std::shared_ptr<const SimilarityIndex> index;
+
+  void run(std::vector<std::shared_ptr<ImageEntry>> entries, std::vector<std::shared_ptr<Archive>> archives);
+};
+
+}
+
+#endif
@@ -0,0 +1,94 @@
+#ifndef MONOKL__TIFF_H
+#define MONOKL__TIFF_H
+
+#include <cstdint>
+
+namespace monokl {
+
+// Tags, types and values of the TIFF and BigTIFF formats, as far as the readers here need them
+
+static const uint16_t TIFF_MAGIC = 42;
+static const uint16_t BIG_TIFF_MAGIC = 43;
+
+static const uint16_t TIFF_TAG_NEW_SUBFILE_TYPE = 254;
+static const uint16_t TIFF_TAG_IMAGE_WIDTH = 256;
+static const uint16_t TIFF_TAG_IMAGE_LENGTH = 257;
+static const uint16_t TIFF_TAG_BITS_PER_SAMPLE = 258;
+static const uint16_t TIFF_TAG_COMPRESSION = 259;
+static const uint16_t TIFF_TAG_PHOTOMETRIC = 262;
+static const uint16_t TIFF_TAG_STRIP_OFFSETS = 273;
+static const uint16_t TIFF_TAG_ORIENTATION = 274;
+static const uint16_t TIFF_TAG_SAMPLES_PER_PIXEL = 277;
+static const uint16_t TIFF_TAG_ROWS_PER_STRIP = 278;
+static const uint16_t TIFF_TAG_STRIP_BYTE_COUNTS = 279;
+static const uint16_t TIFF_TAG_PLANAR_CONFIGURATION = 284;
+static const uint16_t TIFF_TAG_PREDICTOR = 317;
+static const uint16_t TIFF_TAG_TILE_WIDTH = 322;
+static const uint16_t TIFF_TAG_TILE_LENGTH = 323;
+static const uint16_t TIFF_TAG_TILE_OFFSETS = 324;
+static const uint16_t TIFF_TAG_TILE_BYTE_COUNTS = 325;
+static const uint16_t TIFF_TAG_SUB_IFDS = 330;
+static const uint16_t TIFF_TAG_EXTRA_SAMPLES = 338;
+static const uint16_t TIFF_TAG_SAMPLE_FORMAT = 339;
+static const uint16_t TIFF_TAG_ICC_PROFILE = 34675;
+
+static const uint16_t TIFF_TYPE_BYTE = 1;
+static const uint16_t TIFF_TYPE_SHORT = 3;
+static const uint16_t TIFF_TYPE_LONG = 4;
+static const uint16_t TIFF_TYPE_UNDEFINED = 7;
+static const uint16_t TIFF_TYPE_IFD = 13;
+static const uint16_t TIFF_TYPE_LONG8 = 16;
+static const uint16_t TIFF_TYPE_IFD8 = 18;
+
+static const uint16_t TIFF_COMPRESSION_NONE = 1;
+static const uint16_t TIFF_COMPRESSION_LZW = 5;
+static const uint16_t TIFF_COMPRESSION_DEFLATE = 8;
+static const uint16_t TIFF_COMPRESSION_PACKBITS = 32773;
+static const uint16_t TIFF_COMPRESSION_ADOBE_DEFLATE = 32946;
+
+static const uint16_t TIFF_PHOTOMETRIC_WHITE_IS_ZERO = 0;
+static const uint16_t TIFF_PHOTOMETRIC_BLACK_IS_ZERO = 1;
+static const uint16_t TIFF_PHOTOMETRIC_RGB = 2;
+
+static const uint16_t TIFF_PREDICTOR_HORIZONTAL = 2;
+static const uint64_t TIFF_EXTRA_SAMPLE_ASSOCIATED_ALPHA = 1;
+static const uint64_t TIFF_EXTRA_SAMPLE_UNASSOCIATED_ALPHA = 2;
+// Set on thumbnails, pyramid levels and other reduced resolution copies of an image
+static const uint64_t TIFF_SUBFILE_REDUCED_IMAGE = 1;
+
+// TIFF files are in either byte order, `big_endian` is what their header says
+
+inline uint16_t tiff_read_u16(const uint8_t* p, bool big_endian) {
+  return big_endian ? static_cast<uint16_t>((p[0] << 8) | p[1]) : static_cast<uint16_t>(p[0] | (p[1] << 8));
+}
+
+inline uint32_t tiff_read_u32(const uint8_t* p, bool big_endian) {
+  uint32_t high = tiff_read_u16(p, big_endian);
+  uint32_t low = tiff_read_u16(p + 2, big_endian);
+  return big_endian ? (high << 16) | low : high | (low << 16);
+}
+
+inline uint64_t tiff_read_u64(const uint8_t* p, bool big_endian) {
+  uint64_t high = tiff_read_u32(p, big_endian);
+  uint64_t low = tiff_read_u32(p + 4, big_endian);
+  return big_endian ? (high << 32) | low : high | (low << 32);
+}
+
+inline void tiff_write_u16(uint8_t* p, uint16_t value, bool big_endian) {
+  p[big_endian ? 0 : 1] = static_cast<uint8_t>(value >> 8);
+  p[big_endian ? 1 : 0] = static_cast<uint8_t>(value);
+}
+
+inline void tiff_write_u32(uint8_t* p, uint32_t value, bool big_endian) {
+  tiff_write_u16(p + (big_endian ? 0 : 2), static_cast<uint16_t>(value >> 16), big_endian);
+  tiff_write_u16(p + (big_endian ? 2 : 0), static_cast<uint16_t>(value), big_endian);
+}
+
+inline void tiff_write_u64(uint8_t* p, uint64_t value, bool big_endian) {
+  tiff_write_u32(p + (big_endian ? 0 : 4), static_cast<uint32_t>(value >> 32), big_endian);
+  tiff_write_u32(p + (big_endian ? 4 : 0), static_cast<uint32_t>(value), big_endian);
+}
+
+}
+
+#endif
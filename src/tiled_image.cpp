@@ -0,0 +1,965 @@
+#include "tiled_image.h"
+#include "tiff.h"
+#include "instrumentation.h"
+#include "parallel.h"
+#include "resize.h"
+#include "logging.h"
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <unordered_set>
+
+#include <zlib.h>
+
+using namespace monokl;
+
+// Pyramids are a handful of directories, a long chain is a document with many pages
+static const size_t MAX_DIRECTORIES = 64;
+// Tiles of the levels made here, and of uncompressed strips
+static const uint32_t TILE_SIZE = 512;
+// A strip or tile that decodes to more than this is no better than the whole image
+static const uint64_t MAX_TILE_BYTES = 64ull * 1024 * 1024;
+// 256 MB of RGBA8, anything smaller is simply decoded whole
+static const uint64_t REGION_DECODE_MIN_PIXELS = 64ull * 1024 * 1024;
+static const uint64_t TILE_CACHE_BYTES = 256ull * 1024 * 1024;
+// Under memory pressure the cache keeps only about what's on screen
+static const uint64_t TILE_CACHE_BYTES_SHRUNK = 64ull * 1024 * 1024;
+
+static size_t type_size(uint16_t type) {
+  switch (type) {
+    case TIFF_TYPE_SHORT:
+      return 2;
+    case TIFF_TYPE_LONG:
+    case TIFF_TYPE_IFD:
+      return 4;
+    case TIFF_TYPE_LONG8:
+    case TIFF_TYPE_IFD8:
+      return 8;
+    default:
+      return 1;
+  }
+}
+
+static uint64_t tile_key(size_t level, uint32_t index) {
+  return (static_cast<uint64_t>(level) << 32) | index;
+}
+
+// TIFF's LZW: codes are written most significant bit first and get wider one code early
+static size_t decode_lzw(const uint8_t* src, size_t size, uint8_t* dst, size_t capacity) {
+  static const uint32_t CODE_CLEAR = 256;
+  static const uint32_t CODE_END = 257;
+  static const uint32_t MAX_CODES = 4096;
+
+  // Every string in the table was written to the output before, so it's kept as a slice of it
+  std::vector<uint32_t> starts(MAX_CODES);
+  std::vector<uint32_t> lengths(MAX_CODES);
+
+  size_t in = 0;
+  size_t out = 0;
+  uint32_t buffer = 0;
+  int buffered_bits = 0;
+  int width = 9;
+  uint32_t next = 258;
+  bool has_previous = false;
+  size_t previous_start = 0;
+  size_t previous_length = 0;
+
+  while (out < capacity) {
+    while (buffered_bits < width) {
+      if (in >= size) {
+        return out;
+      }
+      buffer = (buffer << 8) | src[in++];
+      buffered_bits += 8;
+    }
+    uint32_t code = (buffer >> (buffered_bits - width)) & ((1u << width) - 1);
+    buffered_bits -= width;
+
+    if (code == CODE_END) {
+      break;
+    }
+    if (code == CODE_CLEAR) {
+      width = 9;
+      next = 258;
+      has_previous = false;
+      continue;
+    }
+
+    size_t start = out;
+    size_t length;
+    if (code < 256) {
+      dst[out++] = static_cast<uint8_t>(code);
+      length = 1;
+    } else if (!has_previous) {
+      return out;
+    } else if (code < next) {
+      length = std::min<size_t>(lengths[code], capacity - out);
+      std::memcpy(dst + out, dst + starts[code], length);
+      out += length;
+    } else if (code == next) {
+      // The string being defined by this very code: the previous one plus its own first byte
+      length = std::min(previous_length + 1, capacity - out);
+      std::memcpy(dst + out, dst + previous_start, std::min(previous_length, length));
+      if (length > previous_length) {
+        dst[out + previous_length] = dst[previous_start];
+      }
+      out += length;
+    } else {
+      return out;
+    }
+
+    if (has_previous && next < MAX_CODES) {
+      starts[next] = static_cast<uint32_t>(previous_start);
+      lengths[next] = static_cast<uint32_t>(previous_length + 1);
+      next++;
+      if (next + 1 >= (1u << width) && width < 12) {
+        width++;
+      }
+    }
+
+    has_previous = true;
+    previous_start = start;
+    previous_length = length;
+  }
+
+  return out;
+}
+
+static size_t decode_packbits(const uint8_t* src, size_t size, uint8_t* dst, size_t capacity) {
+  size_t in = 0;
+  size_t out = 0;
+  while (in < size && out < capacity) {
+    int8_t header = static_cast<int8_t>(src[in++]);
+    if (header >= 0) {
+      size_t count = std::min({static_cast<size_t>(header) + 1, size - in, capacity - out});
+      std::memcpy(dst + out, src + in, count);
+      in += count;
+      out += count;
+    } else if (header != -128 && in < size) {
+      size_t count = std::min(static_cast<size_t>(1 - header), capacity - out);
+      std::memset(dst + out, src[in++], count);
+      out += count;
+    }
+  }
+  return out;
+}
+
+// With a zlib header, unlike the raw deflate of ZIP archives
+static size_t decode_deflate(const uint8_t* src, size_t size, uint8_t* dst, size_t capacity) {
+  z_stream stream = {};
+  if (inflateInit(&stream) != Z_OK) {
+    return 0;
+  }
+
+  // Tiles are far below the 4 GB zlib counts in
+  stream.next_in = const_cast<Bytef*>(src);
+  stream.avail_in = static_cast<uInt>(std::min<size_t>(size, UINT32_MAX));
+  stream.next_out = dst;
+  stream.avail_out = static_cast<uInt>(std::min<size_t>(capacity, UINT32_MAX));
+  inflate(&stream, Z_FINISH);
+  size_t produced = static_cast<size_t>(stream.total_out);
+  inflateEnd(&stream);
+  return produced;
+}
+
+static size_t decompress(uint16_t compression, const uint8_t* src, size_t size, uint8_t* dst, size_t capacity) {
+  switch (compression) {
+    case TIFF_COMPRESSION_LZW:
+      return decode_lzw(src, size, dst, capacity);
+    case TIFF_COMPRESSION_DEFLATE:
+    case TIFF_COMPRESSION_ADOBE_DEFLATE:
+      return decode_deflate(src, size, dst, capacity);
+    case TIFF_COMPRESSION_PACKBITS:
+      return decode_packbits(src, size, dst, capacity);
+    default: {
+      size_t count = std::min(size, capacity);
+      std::memcpy(dst, src, count);
+      return count;
+    }
+  }
+}
+
+// Every sample was stored as the difference to the same sample of the pixel before it
+static void undo_horizontal_predictor(uint8_t* data, size_t row_bytes, size_t rows, const TiledImageLayout& layout, bool big_endian) {
+  size_t samples = layout.samples_per_pixel;
+  for (size_t y = 0; y < rows; y++) {
+    uint8_t* row = data + y * row_bytes;
+    if (layout.bits_per_sample == 8) {
+      for (size_t i = samples; i < row_bytes; i++) {
+        row[i] = static_cast<uint8_t>(row[i] + row[i - samples]);
+      }
+    } else {
+      for (size_t i = samples; i < row_bytes / 2; i++) {
+        uint16_t value = static_cast<uint16_t>(tiff_read_u16(row + i * 2, big_endian) + tiff_read_u16(row + (i - samples) * 2, big_endian));
+        tiff_write_u16(row + i * 2, value, big_endian);
+      }
+    }
+  }
+}
+
+// Converts `count` stored pixels to RGBA8, 16-bit samples keep their high byte
+static void convert_row(const uint8_t* src, unsigned int count, const TiledImageLayout& layout, bool big_endian, uint32_t* out) {
+  size_t sample_bytes = layout.bits_per_sample / 8;
+  size_t pixel_bytes = layout.samples_per_pixel * sample_bytes;
+  size_t high_byte = sample_bytes == 2 && !big_endian ? 1 : 0;
+  size_t color_samples = layout.photometric == TIFF_PHOTOMETRIC_RGB ? 3 : 1;
+  const uint8_t* alpha = layout.has_alpha ? src + color_samples * sample_bytes + high_byte : nullptr;
+  uint8_t* dst = reinterpret_cast<uint8_t*>(out);
+
+  for (unsigned int i = 0; i < count; i++) {
+    const uint8_t* pixel = src + i * pixel_bytes + high_byte;
+    if (color_samples == 3) {
+      dst[0] = pixel[0];
+      dst[1] = pixel[sample_bytes];
+      dst[2] = pixel[sample_bytes * 2];
+    } else {
+      uint8_t gray = layout.photometric == TIFF_PHOTOMETRIC_WHITE_IS_ZERO ? static_cast<uint8_t>(255 - pixel[0]) : pixel[0];
+      dst[0] = gray;
+      dst[1] = gray;
+      dst[2] = gray;
+    }
+    dst[3] = alpha != nullptr ? alpha[i * pixel_bytes] : 255;
+    dst += 4;
+  }
+}
+
+static bool is_supported(const TiledImageLayout& layout) {
+  switch (layout.compression) {
+    case TIFF_COMPRESSION_NONE:
+    case TIFF_COMPRESSION_LZW:
+    case TIFF_COMPRESSION_DEFLATE:
+    case TIFF_COMPRESSION_PACKBITS:
+    case TIFF_COMPRESSION_ADOBE_DEFLATE:
+      break;
+    default:
+      return false;
+  }
+
+  if (layout.bits_per_sample != 8 && layout.bits_per_sample != 16) {
+    return false;
+  }
+  if (layout.predictor != 1 && layout.predictor != TIFF_PREDICTOR_HORIZONTAL) {
+    return false;
+  }
+
+  size_t color_samples = layout.photometric == TIFF_PHOTOMETRIC_RGB ? 3 : 1;
+  if (layout.photometric != TIFF_PHOTOMETRIC_RGB && layout.photometric != TIFF_PHOTOMETRIC_WHITE_IS_ZERO && layout.photometric != TIFF_PHOTOMETRIC_BLACK_IS_ZERO) {
+    return false;
+  }
+  return layout.samples_per_pixel >= color_samples + (layout.has_alpha ? 1 : 0);
+}
+
+bool TiledImageLevel::is_stored() const {
+  return !offsets.empty();
+}
+
+bool TiledImage::may_be_tiled(const std::filesystem::path& path) {
+  auto extension = path.extension().string();
+  std::transform(extension.begin(), extension.end(), extension.begin(), [](unsigned char c) {
+    return static_cast<char>(std::tolower(c));
+  });
+  return extension == ".tif" || extension == ".tiff";
+}
+
+std::shared_ptr<TiledImage> TiledImage::open(const std::filesystem::path& path, const std::shared_ptr<MemoryGovernor>& governor) {
+  auto t0 = std::chrono::high_resolution_clock::now();
+
+  std::shared_ptr<TiledImage> image(new TiledImage());
+  image->path = path;
+  image->governor = governor;
+  image->file = MappedFile::open(path);
+  if (image->file == nullptr || image->file->size() < 16) {
+    return nullptr;
+  }
+
+  const uint8_t* data = image->file->data();
+  if (!((data[0] == 'I' && data[1] == 'I') || (data[0] == 'M' && data[1] == 'M'))) {
+    return nullptr;
+  }
+  image->big_endian = data[0] == 'M';
+  uint16_t magic = tiff_read_u16(data + 2, image->big_endian);
+  if (magic != TIFF_MAGIC && magic != BIG_TIFF_MAGIC) {
+    return nullptr;
+  }
+  image->big_tiff = magic == BIG_TIFF_MAGIC;
+
+  uint64_t first = image->big_tiff ? tiff_read_u64(data + 8, image->big_endian) : tiff_read_u32(data + 4, image->big_endian);
+  Directory base;
+  if (!image->read_directory(first, base) || !base.supported) {
+    return nullptr;
+  }
+  image->levels.push_back(base.level);
+  if (base.icc != nullptr) {
+    image->color_profile = ColorProfile::from_bytes(base.icc, base.icc_size);
+  }
+
+  // Reduced resolution copies are kept in sub-directories (OME-TIFF) or in the chain after the image (COG)
+  std::vector<uint64_t> candidates = base.sub_directories;
+  std::unordered_set<uint64_t> visited = {first};
+  uint64_t next = base.next;
+  while (next != 0 && visited.size() < MAX_DIRECTORIES && visited.insert(next).second) {
+    candidates.push_back(next);
+    Directory directory;
+    if (!image->read_directory(next, directory)) {
+      break;
+    }
+    next = directory.next;
+  }
+
+  uint32_t full_width = base.level.width;
+  uint32_t full_height = base.level.height;
+  for (size_t i = 0; i < candidates.size(); i++) {
+    Directory directory;
+    if (!image->read_directory(candidates[i], directory) || !directory.supported) {
+      continue;
+    }
+    // Other pages of a document share the chain, only a smaller copy of the same image counts
+    const auto& level = directory.level;
+    bool reduced = i < base.sub_directories.size() || (directory.subfile_type & TIFF_SUBFILE_REDUCED_IMAGE) != 0;
+    double scale_x = static_cast<double>(level.width) / full_width;
+    double scale_y = static_cast<double>(level.height) / full_height;
+    if (!reduced || level.width >= full_width || std::abs(scale_x - scale_y) > 0.01 + 2.0 / std::min(level.width, level.height)) {
+      continue;
+    }
+    image->levels.push_back(level);
+  }
+
+  std::stable_sort(image->levels.begin() + 1, image->levels.end(), [](const TiledImageLevel& a, const TiledImageLevel& b) {
+    return a.width > b.width;
+  });
+  image->levels.erase(std::unique(image->levels.begin(), image->levels.end(), [](const TiledImageLevel& a, const TiledImageLevel& b) {
+    return a.width == b.width;
+  }), image->levels.end());
+  size_t stored_levels = image->levels.size();
+  image->add_halved_levels();
+
+  auto t1 = std::chrono::high_resolution_clock::now();
+  auto duration_ms = static_cast<long long int>(std::chrono::duration_cast<std::chrono::milliseconds>(t1 - t0).count());
+  log_debug("Indexed %ux%u tiled image %s in %lld ms (%lu stored levels, %lu in total)",
+      image->width(), image->height(), path.string().c_str(), duration_ms, stored_levels, image->levels.size());
+
+  return image;
+}
+
+const uint8_t* TiledImage::find_values(const uint8_t* entry, uint16_t& type, uint64_t& count) const {
+  type = tiff_read_u16(entry + 2, big_endian);
+  count = big_tiff ? tiff_read_u64(entry + 4, big_endian) : tiff_read_u32(entry + 4, big_endian);
+
+  uint64_t size = file->size();
+  size_t inline_size = big_tiff ? 8 : 4;
+  const uint8_t* field = entry + (big_tiff ? 12 : 8);
+  if (count > size / type_size(type)) {
+    return nullptr;
+  }
+
+  uint64_t bytes = count * type_size(type);
+  if (bytes <= inline_size) {
+    return field;
+  }
+
+  uint64_t offset = big_tiff ? tiff_read_u64(field, big_endian) : tiff_read_u32(field, big_endian);
+  if (offset > size || bytes > size - offset) {
+    return nullptr;
+  }
+  return file->data() + offset;
+}
+
+std::vector<uint64_t> TiledImage::read_values(const uint8_t* entry) const {
+  uint16_t type = 0;
+  uint64_t count = 0;
+  const uint8_t* values = find_values(entry, type, count);
+
+  std::vector<uint64_t> result;
+  if (values == nullptr) {
+    return result;
+  }
+
+  result.resize(static_cast<size_t>(count));
+  for (size_t i = 0; i < result.size(); i++) {
+    switch (type) {
+      case TIFF_TYPE_BYTE:
+        result[i] = values[i];
+        break;
+      case TIFF_TYPE_SHORT:
+        result[i] = tiff_read_u16(values + i * 2, big_endian);
+        break;
+      case TIFF_TYPE_LONG:
+      case TIFF_TYPE_IFD:
+        result[i] = tiff_read_u32(values + i * 4, big_endian);
+        break;
+      case TIFF_TYPE_LONG8:
+      case TIFF_TYPE_IFD8:
+        result[i] = tiff_read_u64(values + i * 8, big_endian);
+        break;
+      default:
+        result.clear();
+        return result;
+    }
+  }
+  return result;
+}
+
+bool TiledImage::read_directory(uint64_t offset, Directory& directory) const {
+  const uint8_t* data = file->data();
+  uint64_t size = file->size();
+
+  size_t count_size = big_tiff ? 8 : 2;
+  size_t entry_size = big_tiff ? 20 : 12;
+  size_t next_size = big_tiff ? 8 : 4;
+
+  if (offset > size || offset + count_size + next_size > size) {
+    return false;
+  }
+  uint64_t entry_count = big_tiff ? tiff_read_u64(data + offset, big_endian) : tiff_read_u16(data + offset, big_endian);
+  uint64_t entries = offset + count_size;
+  if (entry_count > (size - entries - next_size) / entry_size) {
+    return false;
+  }
+
+  auto& level = directory.level;
+  auto& layout = level.layout;
+  uint64_t rows_per_strip = UINT32_MAX;
+  uint64_t planar_configuration = 1;
+  uint64_t orientation = 1;
+  uint64_t sample_format = 1;
+  uint64_t extra_sample = 0;
+  std::vector<uint64_t> strip_offsets;
+  std::vector<uint64_t> strip_byte_counts;
+
+  for (uint64_t i = 0; i < entry_count; i++) {
+    const uint8_t* entry = data + entries + i * entry_size;
+    uint16_t tag = tiff_read_u16(entry, big_endian);
+
+    if (tag == TIFF_TAG_ICC_PROFILE) {
+      uint16_t type = 0;
+      uint64_t count = 0;
+      const uint8_t* values = find_values(entry, type, count);
+      if (values != nullptr && (type == TIFF_TYPE_UNDEFINED || type == TIFF_TYPE_BYTE)) {
+        directory.icc = values;
+        directory.icc_size = static_cast<size_t>(count);
+      }
+      continue;
+    }
+
+    auto values = read_values(entry);
+    if (values.empty()) {
+      continue;
+    }
+    uint64_t value = values.front();
+
+    switch (tag) {
+      case TIFF_TAG_NEW_SUBFILE_TYPE:
+        directory.subfile_type = value;
+        break;
+      case TIFF_TAG_IMAGE_WIDTH:
+        level.width = static_cast<uint32_t>(value);
+        break;
+      case TIFF_TAG_IMAGE_LENGTH:
+        level.height = static_cast<uint32_t>(value);
+        break;
+      case TIFF_TAG_BITS_PER_SAMPLE:
+        layout.bits_per_sample = static_cast<uint16_t>(value);
+        // Samples of different sizes can't be read here
+        for (uint64_t bits : values) {
+          if (bits != value) {
+            layout.bits_per_sample = 0;
+          }
+        }
+        break;
+      case TIFF_TAG_COMPRESSION:
+        layout.compression = static_cast<uint16_t>(value);
+        break;
+      case TIFF_TAG_PHOTOMETRIC:
+        layout.photometric = static_cast<uint16_t>(value);
+        break;
+      case TIFF_TAG_STRIP_OFFSETS:
+        strip_offsets = std::move(values);
+        break;
+      case TIFF_TAG_ORIENTATION:
+        orientation = value;
+        break;
+      case TIFF_TAG_SAMPLES_PER_PIXEL:
+        layout.samples_per_pixel = static_cast<uint16_t>(value);
+        break;
+      case TIFF_TAG_ROWS_PER_STRIP:
+        rows_per_strip = value;
+        break;
+      case TIFF_TAG_STRIP_BYTE_COUNTS:
+        strip_byte_counts = std::move(values);
+        break;
+      case TIFF_TAG_PLANAR_CONFIGURATION:
+        planar_configuration = value;
+        break;
+      case TIFF_TAG_PREDICTOR:
+        layout.predictor = static_cast<uint16_t>(value);
+        break;
+      case TIFF_TAG_TILE_WIDTH:
+        level.tile_width = static_cast<uint32_t>(value);
+        break;
+      case TIFF_TAG_TILE_LENGTH:
+        level.tile_height = static_cast<uint32_t>(value);
+        break;
+      case TIFF_TAG_TILE_OFFSETS:
+        level.offsets = std::move(values);
+        break;
+      case TIFF_TAG_TILE_BYTE_COUNTS:
+        level.byte_counts = std::move(values);
+        break;
+      case TIFF_TAG_SUB_IFDS:
+        directory.sub_directories = std::move(values);
+        break;
+      case TIFF_TAG_EXTRA_SAMPLES:
+        extra_sample = value;
+        break;
+      case TIFF_TAG_SAMPLE_FORMAT:
+        sample_format = value;
+        break;
+      default:
+        break;
+    }
+  }
+
+  const uint8_t* next = data + entries + entry_count * entry_size;
+  directory.next = big_tiff ? tiff_read_u64(next, big_endian) : tiff_read_u32(next, big_endian);
+
+  layout.has_alpha = extra_sample == TIFF_EXTRA_SAMPLE_ASSOCIATED_ALPHA || extra_sample == TIFF_EXTRA_SAMPLE_UNASSOCIATED_ALPHA;
+  if (level.width == 0 || level.height == 0 || planar_configuration != 1 || orientation != 1 || sample_format != 1 || !is_supported(layout)) {
+    return true;
+  }
+
+  uint64_t pixel_bytes = static_cast<uint64_t>(layout.samples_per_pixel) * layout.bits_per_sample / 8;
+  uint64_t chunk_bytes;
+  if (level.tile_width > 0 && level.tile_height > 0) {
+    level.columns = (level.width + level.tile_width - 1) / level.tile_width;
+    level.rows = (level.height + level.tile_height - 1) / level.tile_height;
+    chunk_bytes = static_cast<uint64_t>(level.tile_width) * level.tile_height * std::max<uint64_t>(pixel_bytes, 4);
+  } else {
+    level.strips = true;
+    level.rows_per_strip = static_cast<uint32_t>(std::clamp<uint64_t>(rows_per_strip, 1, level.height));
+    level.offsets = std::move(strip_offsets);
+    level.byte_counts = std::move(strip_byte_counts);
+    if (layout.compression == TIFF_COMPRESSION_NONE) {
+      level.tile_width = std::min(level.width, TILE_SIZE);
+      level.tile_height = std::min(level.height, TILE_SIZE);
+    } else {
+      level.tile_width = level.width;
+      level.tile_height = level.rows_per_strip;
+    }
+    level.columns = (level.width + level.tile_width - 1) / level.tile_width;
+    level.rows = (level.height + level.tile_height - 1) / level.tile_height;
+    chunk_bytes = static_cast<uint64_t>(level.tile_width) * level.tile_height * std::max<uint64_t>(pixel_bytes, 4);
+  }
+
+  uint64_t expected_chunks = level.strips ? (level.height + level.rows_per_strip - 1) / level.rows_per_strip : static_cast<uint64_t>(level.columns) * level.rows;
+  directory.supported = chunk_bytes <= MAX_TILE_BYTES && level.offsets.size() == expected_chunks && level.byte_counts.size() == expected_chunks;
+  return true;
+}
+
+void TiledImage::add_halved_levels() {
+  // Every level gets a neighbour about half its size, so no level is ever read at less than half its resolution
+  std::vector<TiledImageLevel> complete;
+  for (auto& level : levels) {
+    while (!complete.empty()) {
+      const auto& previous = complete.back();
+      uint32_t half_width = (previous.width + 1) / 2;
+      if (half_width <= level.width * 1.01) {
+        break;
+      }
+
+      TiledImageLevel halved;
+      halved.width = half_width;
+      halved.height = (previous.height + 1) / 2;
+      halved.rebuild_cost = previous.rebuild_cost * 4;
+      halved.tile_width = std::min(halved.width, TILE_SIZE);
+      halved.tile_height = std::min(halved.height, TILE_SIZE);
+      halved.columns = (halved.width + halved.tile_width - 1) / halved.tile_width;
+      halved.rows = (halved.height + halved.tile_height - 1) / halved.tile_height;
+      complete.push_back(halved);
+    }
+    complete.push_back(std::move(level));
+  }
+
+  while (complete.back().width > TILE_SIZE || complete.back().height > TILE_SIZE) {
+    const auto& previous = complete.back();
+    TiledImageLevel halved;
+    halved.width = (previous.width + 1) / 2;
+    halved.height = (previous.height + 1) / 2;
+    halved.rebuild_cost = previous.rebuild_cost * 4;
+    halved.tile_width = std::min(halved.width, TILE_SIZE);
+    halved.tile_height = std::min(halved.height, TILE_SIZE);
+    halved.columns = (halved.width + halved.tile_width - 1) / halved.tile_width;
+    halved.rows = (halved.height + halved.tile_height - 1) / halved.tile_height;
+    complete.push_back(halved);
+  }
+
+  levels = std::move(complete);
+}
+
+unsigned int TiledImage::width() const {
+  return levels.front().width;
+}
+
+unsigned int TiledImage::height() const {
+  return levels.front().height;
+}
+
+bool TiledImage::needs_region_decode() const {
+  return static_cast<uint64_t>(width()) * height() >= REGION_DECODE_MIN_PIXELS;
+}
+
+const ColorProfile& TiledImage::get_color_profile() const {
+  return color_profile;
+}
+
+void TiledImage::set_color_transform(const std::shared_ptr<const PixelTransform>& transform) {
+  this->transform = transform;
+  clear_cache();
+}
+
+void TiledImage::clear_cache() {
+  cache.clear();
+  eviction_order.clear();
+  eviction_floor = 0.0;
+  cached_bytes = 0;
+}
+
+bool TiledImage::can_decode_whole() const {
+  return levels.front().layout.bits_per_sample == 8;
+}
+
+bool TiledImage::decode(ImageBuffer& out) const {
+  if (!can_decode_whole()) {
+    return false;
+  }
+
+  auto t0 = std::chrono::high_resolution_clock::now();
+
+  // Every strip or tile is compressed on its own, so they're decoded on all cores straight into their place in `out`
+  const auto& level = levels.front();
+  out.allocate(level.width, level.height);
+  size_t count = static_cast<size_t>(level.columns) * level.rows;
+  parallel_for(0, count, 1, [&](size_t first, size_t last) {
+    for (size_t index = first; index < last; index++) {
+      uint32_t x0 = (index % level.columns) * level.tile_width;
+      uint32_t y0 = (index / level.columns) * level.tile_height;
+      decode_stored_tile(level, static_cast<uint32_t>(index), out.row(y0) + x0, out.width);
+    }
+  });
+
+  auto t1 = std::chrono::high_resolution_clock::now();
+  auto duration_ms = static_cast<long long int>(std::chrono::duration_cast<std::chrono::milliseconds>(t1 - t0).count());
+  Instrumentation::get().record_timing("tiled.decode", std::chrono::duration<double, std::milli>(t1 - t0).count());
+  log_debug("Decoded %s from %lu %s in %lld ms", path.string().c_str(), count, level.strips ? "strips" : "tiles", duration_ms);
+  return true;
+}
+
+size_t TiledImage::pick_level(double zoom) const {
+  // The smallest level that still has a pixel for every screen pixel
+  double needed_width = levels.front().width * zoom;
+  for (size_t i = levels.size(); i-- > 1;) {
+    if (levels[i].width + 1 >= needed_width) {
+      return i;
+    }
+  }
+  return 0;
+}
+
+void TiledImage::render_region(double x, double y, double zoom, ImageBuffer& out) {
+  if (out.width == 0 || out.height == 0 || zoom <= 0) {
+    return;
+  }
+
+  auto t0 = std::chrono::high_resolution_clock::now();
+
+  size_t index = pick_level(zoom);
+  const auto& level = levels[index];
+  double scale_x = static_cast<double>(level.width) / width();
+  double scale_y = static_cast<double>(level.height) / height();
+
+  // Where every column and row of the output is taken from, as a tile and an offset into it
+  std::vector<uint32_t> tile_columns(out.width);
+  std::vector<uint32_t> column_offsets(out.width);
+  for (unsigned int i = 0; i < out.width; i++) {
+    double source = std::floor((x + (i + 0.5) / zoom) * scale_x);
+    auto level_x = static_cast<uint32_t>(std::clamp(source, 0.0, level.width - 1.0));
+    tile_columns[i] = level_x / level.tile_width;
+    column_offsets[i] = level_x % level.tile_width;
+  }
+  std::vector<uint32_t> tile_rows(out.height);
+  std::vector<uint32_t> row_offsets(out.height);
+  for (unsigned int j = 0; j < out.height; j++) {
+    double source = std::floor((y + (j + 0.5) / zoom) * scale_y);
+    auto level_y = static_cast<uint32_t>(std::clamp(source, 0.0, level.height - 1.0));
+    tile_rows[j] = level_y / level.tile_height;
+    row_offsets[j] = level_y % level.tile_height;
+  }
+
+  // A ring of tiles around the visible ones is decoded too, so the next small pan doesn't wait for them
+  uint32_t first_column = tile_columns.front() > 0 ? tile_columns.front() - 1 : 0;
+  uint32_t last_column = std::min(level.columns - 1, tile_columns.back() + 1);
+  uint32_t first_row = tile_rows.front() > 0 ? tile_rows.front() - 1 : 0;
+  uint32_t last_row = std::min(level.rows - 1, tile_rows.back() + 1);
+  uint32_t grid_width = last_column - first_column + 1;
+
+  std::vector<uint32_t> indices;
+  for (uint32_t row = first_row; row <= last_row; row++) {
+    for (uint32_t column = first_column; column <= last_column; column++) {
+      indices.push_back(row * level.columns + column);
+    }
+  }
+  auto tiles = fetch(index, indices);
+
+  parallel_for(0, out.height, 16, [&](size_t first, size_t last) {
+    for (size_t j = first; j < last; j++) {
+      const TilePtr* row_tiles = tiles.data() + static_cast<size_t>(tile_rows[j] - first_row) * grid_width;
+      uint32_t row_offset = row_offsets[j];
+      uint32_t* dst = out.row(static_cast<unsigned int>(j));
+      for (unsigned int i = 0; i < out.width; i++) {
+        const auto& tile = row_tiles[tile_columns[i] - first_column];
+        dst[i] = tile != nullptr ? tile->row(row_offset)[column_offsets[i]] : 0;
+      }
+    }
+  });
+
+  auto t1 = std::chrono::high_resolution_clock::now();
+  Instrumentation::get().record_timing("tiled.render_region", std::chrono::duration<double, std::milli>(t1 - t0).count());
+}
+
+std::vector<TiledImage::TilePtr> TiledImage::fetch(size_t level, const std::vector<uint32_t>& indices) {
+  std::vector<TilePtr> tiles(indices.size());
+  std::vector<size_t> missing;
+  for (size_t i = 0; i < indices.size(); i++) {
+    auto it = cache.find(tile_key(level, indices[i]));
+    if (it == cache.end()) {
+      missing.push_back(i);
+      continue;
+    }
+    tiles[i] = it->second.tile;
+    touch(it->first, it->second);
+  }
+
+  if (missing.empty()) {
+    return tiles;
+  }
+
+  const auto& target = levels[level];
+  if (target.is_stored()) {
+    parallel_for(0, missing.size(), 1, [&](size_t first, size_t last) {
+      for (size_t k = first; k < last; k++) {
+        tiles[missing[k]] = load_stored_tile(target, indices[missing[k]]);
+      }
+    });
+  } else {
+    // A few tiles at a time, so the tiles of the level above don't all have to be in memory at once
+    size_t batch = std::max<size_t>(4, parallel_worker_count());
+    for (size_t start = 0; start < missing.size(); start += batch) {
+      size_t end = std::min(missing.size(), start + batch);
+
+      std::vector<uint32_t> source_indices;
+      for (size_t k = start; k < end; k++) {
+        find_source_tiles(level, indices[missing[k]], source_indices);
+      }
+      std::sort(source_indices.begin(), source_indices.end());
+      source_indices.erase(std::unique(source_indices.begin(), source_indices.end()), source_indices.end());
+
+      auto source_tiles = fetch(level - 1, source_indices);
+      std::unordered_map<uint32_t, TilePtr> sources;
+      for (size_t k = 0; k < source_indices.size(); k++) {
+        sources[source_indices[k]] = source_tiles[k];
+      }
+
+      parallel_for(start, end, 1, [&](size_t first, size_t last) {
+        for (size_t k = first; k < last; k++) {
+          tiles[missing[k]] = halve_tiles(level, indices[missing[k]], sources);
+        }
+      });
+    }
+  }
+
+  for (size_t i : missing) {
+    if (tiles[i] != nullptr) {
+      insert_into_cache(tile_key(level, indices[i]), tiles[i]);
+    }
+  }
+  evict(governor != nullptr && governor->should_shrink_caches() ? TILE_CACHE_BYTES_SHRUNK : TILE_CACHE_BYTES);
+
+  return tiles;
+}
+
+TiledImage::TilePtr TiledImage::load_stored_tile(const TiledImageLevel& level, uint32_t index) const {
+  uint32_t x0 = (index % level.columns) * level.tile_width;
+  uint32_t y0 = (index / level.columns) * level.tile_height;
+
+  auto tile = std::make_shared<ImageBuffer>();
+  tile->allocate(std::min(level.tile_width, level.width - x0), std::min(level.tile_height, level.height - y0));
+  decode_stored_tile(level, index, tile->pixels.data(), tile->width);
+  tile->lease = MemoryLease(governor, MemoryCategoryCaches, tile->size_in_bytes());
+  return tile;
+}
+
+void TiledImage::decode_stored_tile(const TiledImageLevel& level, uint32_t index, uint32_t* out, size_t stride) const {
+  const auto& layout = level.layout;
+  uint32_t x0 = (index % level.columns) * level.tile_width;
+  uint32_t y0 = (index / level.columns) * level.tile_height;
+  uint32_t tile_width = std::min(level.tile_width, level.width - x0);
+  uint32_t tile_height = std::min(level.tile_height, level.height - y0);
+
+  const uint8_t* data = file->data();
+  uint64_t size = file->size();
+  size_t pixel_bytes = static_cast<size_t>(layout.samples_per_pixel) * layout.bits_per_sample / 8;
+
+  if (level.strips && layout.compression == TIFF_COMPRESSION_NONE) {
+    // Uncompressed rows are read straight from the mapping, only the part of them inside the tile
+    size_t row_bytes = static_cast<size_t>(level.width) * pixel_bytes;
+    for (uint32_t y = 0; y < tile_height; y++) {
+      uint32_t image_y = y0 + y;
+      uint32_t strip = image_y / level.rows_per_strip;
+      uint64_t offset = level.offsets[strip] + static_cast<uint64_t>(image_y % level.rows_per_strip) * row_bytes + static_cast<uint64_t>(x0) * pixel_bytes;
+      uint64_t length = static_cast<uint64_t>(tile_width) * pixel_bytes;
+      if (offset > size || length > size - offset) {
+        continue;
+      }
+      convert_row(data + offset, tile_width, layout, big_endian, out + y * stride);
+    }
+  } else {
+    uint64_t offset = level.offsets[index];
+    uint64_t byte_count = level.byte_counts[index];
+    if (offset > size || byte_count > size - offset) {
+      log_debug("Tile %u of %s is outside of the file", index, path.string().c_str());
+      return;
+    }
+
+    // Tiles are always stored whole, even where they hang over the edge, strips are only as tall as what's left
+    size_t stored_width = level.strips ? level.width : level.tile_width;
+    size_t stored_rows = level.strips ? tile_height : level.tile_height;
+    size_t row_bytes = stored_width * pixel_bytes;
+    std::vector<uint8_t> stored(row_bytes * stored_rows);
+    size_t produced = decompress(layout.compression, data + offset, static_cast<size_t>(byte_count), stored.data(), stored.size());
+    if (produced < stored.size()) {
+      log_debug("Tile %u of %s is truncated", index, path.string().c_str());
+    }
+
+    if (layout.predictor == TIFF_PREDICTOR_HORIZONTAL) {
+      undo_horizontal_predictor(stored.data(), row_bytes, stored_rows, layout, big_endian);
+    }
+    for (uint32_t y = 0; y < tile_height; y++) {
+      convert_row(stored.data() + y * row_bytes, tile_width, layout, big_endian, out + y * stride);
+    }
+  }
+
+  // While the rows are still in cache
+  if (transform != nullptr) {
+    for (uint32_t y = 0; y < tile_height; y++) {
+      transform->apply(out + y * stride, tile_width);
+    }
+  }
+}
+
+void TiledImage::find_source_tiles(size_t level, uint32_t index, std::vector<uint32_t>& out) const {
+  const auto& target = levels[level];
+  const auto& source = levels[level - 1];
+
+  uint32_t x0 = (index % target.columns) * target.tile_width;
+  uint32_t y0 = (index / target.columns) * target.tile_height;
+  uint32_t x1 = std::min(source.width, (x0 + target.tile_width) * 2) - 1;
+  uint32_t y1 = std::min(source.height, (y0 + target.tile_height) * 2) - 1;
+
+  for (uint32_t row = y0 * 2 / source.tile_height; row <= y1 / source.tile_height; row++) {
+    for (uint32_t column = x0 * 2 / source.tile_width; column <= x1 / source.tile_width; column++) {
+      out.push_back(row * source.columns + column);
+    }
+  }
+}
+
+TiledImage::TilePtr TiledImage::halve_tiles(size_t level, uint32_t index, const std::unordered_map<uint32_t, TilePtr>& sources) const {
+  const auto& target = levels[level];
+  const auto& source = levels[level - 1];
+
+  uint32_t x0 = (index % target.columns) * target.tile_width;
+  uint32_t y0 = (index / target.columns) * target.tile_height;
+  uint32_t tile_width = std::min(target.tile_width, target.width - x0);
+  uint32_t tile_height = std::min(target.tile_height, target.height - y0);
+
+  // The source pixels are gathered into one block first, padded by repeating the last column and row
+  uint32_t source_x0 = x0 * 2;
+  uint32_t source_y0 = y0 * 2;
+  uint32_t source_width = std::min(source.width - source_x0, tile_width * 2);
+  uint32_t source_height = std::min(source.height - source_y0, tile_height * 2);
+  ImageBuffer block;
+  block.allocate(tile_width * 2, tile_height * 2);
+
+  std::vector<uint32_t> needed;
+  find_source_tiles(level, index, needed);
+  for (uint32_t source_index : needed) {
+    auto it = sources.find(source_index);
+    if (it == sources.end() || it->second == nullptr) {
+      continue;
+    }
+    const auto& tile = *it->second;
+    uint32_t tile_x0 = (source_index % source.columns) * source.tile_width;
+    uint32_t tile_y0 = (source_index / source.columns) * source.tile_height;
+
+    uint32_t from_x = std::max(tile_x0, source_x0);
+    uint32_t to_x = std::min(tile_x0 + tile.width, source_x0 + source_width);
+    uint32_t from_y = std::max(tile_y0, source_y0);
+    uint32_t to_y = std::min(tile_y0 + tile.height, source_y0 + source_height);
+    for (uint32_t y = from_y; y < to_y; y++) {
+      std::memcpy(block.row(y - source_y0) + (from_x - source_x0), tile.row(y - tile_y0) + (from_x - tile_x0), (to_x - from_x) * sizeof(uint32_t));
+    }
+  }
+
+  for (uint32_t y = 0; y < source_height; y++) {
+    uint32_t* row = block.row(y);
+    std::fill(row + source_width, row + block.width, row[source_width - 1]);
+  }
+  for (uint32_t y = source_height; y < block.height; y++) {
+    std::memcpy(block.row(y), block.row(source_height - 1), block.width * sizeof(uint32_t));
+  }
+
+  auto tile = std::make_shared<ImageBuffer>();
+  tile->allocate(tile_width, tile_height);
+  for (uint32_t y = 0; y < tile_height; y++) {
+    halve_rows(block.row(y * 2), block.row(y * 2 + 1), tile_width, tile->row(y));
+  }
+  tile->lease = MemoryLease(governor, MemoryCategoryCaches, tile->size_in_bytes());
+  return tile;
+}
+
+void TiledImage::touch(uint64_t key, CachedTile& cached) {
+  eviction_order.erase({cached.priority, key});
+  cached.priority = eviction_floor + levels[key >> 32].rebuild_cost;
+  eviction_order.insert({cached.priority, key});
+}
+
+void TiledImage::insert_into_cache(uint64_t key, const TilePtr& tile) {
+  if (cache.count(key) > 0) {
+    return;
+  }
+  CachedTile cached;
+  cached.tile = tile;
+  cached.priority = eviction_floor + levels[key >> 32].rebuild_cost;
+  eviction_order.insert({cached.priority, key});
+  cache[key] = cached;
+  cached_bytes += tile->size_in_bytes();
+}
+
+void TiledImage::evict(uint64_t budget) {
+  auto it = eviction_order.begin();
+  while (cached_bytes > budget && it != eviction_order.end()) {
+    auto cached = cache.find(it->second);
+    // Tiles that are still being drawn would only be decoded again on the next frame
+    if (cached->second.tile.use_count() > 1) {
+      ++it;
+      continue;
+    }
+
+    // Whatever stays ages by what the evicted tile was worth, so unused tiles go eventually however costly
+    eviction_floor = std::max(eviction_floor, it->first);
+    cached_bytes -= cached->second.tile->size_in_bytes();
+    cache.erase(cached);
+    it = eviction_order.erase(it);
+  }
+}
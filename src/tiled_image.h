@@ -0,0 +1,153 @@
+#ifndef MONOKL__TILED_IMAGE_H
+#define MONOKL__TILED_IMAGE_H
+
+#include <memory>
+#include <vector>
+#include <set>
+#include <utility>
+#include <unordered_map>
+#include <filesystem>
+#include <cstdint>
+#include <cstddef>
+
+#include "mapped_file.h"
+#include "image_buffer.h"
+#include "memory_governor.h"
+#include "orientation.h"
+#include "color.h"
+
+namespace monokl {
+
+// How the samples of one TIFF directory are stored
+struct TiledImageLayout {
+  uint16_t compression = 1;
+  uint16_t predictor = 1;
+  uint16_t photometric = 1;
+  uint16_t samples_per_pixel = 1;
+  uint16_t bits_per_sample = 8;
+  // The sample after the color ones is alpha
+  bool has_alpha = false;
+};
+
+/**
+ * One resolution of the image, cut into a grid of tiles. Strips are tiles as wide as the image,
+ * except for uncompressed ones, which are cut into square tiles since any of their rows can be
+ * read directly. Levels without offsets are made by halving the level before them.
+ */
+struct TiledImageLevel {
+  uint32_t width = 0;
+  uint32_t height = 0;
+  uint32_t tile_width = 0;
+  uint32_t tile_height = 0;
+  uint32_t columns = 0;
+  uint32_t rows = 0;
+
+  TiledImageLayout layout;
+  bool strips = false;
+  uint32_t rows_per_strip = 0;
+  std::vector<uint64_t> offsets;
+  std::vector<uint64_t> byte_counts;
+  // About how many stored tiles have to be decoded to make one of its tiles again
+  double rebuild_cost = 1.0;
+
+  bool is_stored() const;
+};
+
+/**
+ * A TIFF that is read a tile or strip at a time through the offsets in its directory, instead
+ * of being decoded whole. Only the tiles under the viewport are decoded, at the smallest level
+ * that still has enough pixels for the zoom: one stored in the file as a reduced resolution
+ * directory where there is one, otherwise one made by halving the level before it. Decoded
+ * tiles are kept in a cache of bounded size, so images of any size are shown in about the
+ * same memory. The cache evicts by recency weighed by what a tile costs to make again
+ * (GreedyDual), so the small levels that took the whole image to build outlive the tiles they
+ * were built from. Not thread safe, it's meant to be used by the thread that renders.
+ */
+class TiledImage {
+public:
+  // Goes by the extension, to avoid mapping every image just to find out it isn't a TIFF
+  static bool may_be_tiled(const std::filesystem::path& path);
+  // Returns `nullptr` unless the file is a TIFF whose compression and sample layout can be read here
+  static std::shared_ptr<TiledImage> open(const std::filesystem::path& path, const std::shared_ptr<MemoryGovernor>& governor = nullptr);
+
+  unsigned int width() const;
+  unsigned int height() const;
+  // Too large to be worth decoding whole, so it should be shown a region at a time
+  bool needs_region_decode() const;
+
+  // The profile embedded in the file, empty for sRGB
+  const ColorProfile& get_color_profile() const;
+  // Applied to every tile as it's decoded, drops the tiles decoded so far
+  void set_color_transform(const std::shared_ptr<const PixelTransform>& transform);
+
+  // False for 16-bit images, those are left to the codec, which keeps them at 16 bits for tone mapping
+  bool can_decode_whole() const;
+  // Decodes the whole image at full resolution, with its strips or tiles spread over all cores
+  bool decode(ImageBuffer& out) const;
+
+  /**
+   * Fills `out` with the part of the image that starts at (`x`, `y`), in image pixels, shown
+   * at `zoom` screen pixels per image pixel. The tiles around it are decoded along the way,
+   * so the next small pan doesn't have to wait for them.
+   */
+  void render_region(double x, double y, double zoom, ImageBuffer& out);
+  void clear_cache();
+
+private:
+  typedef std::shared_ptr<const ImageBuffer> TilePtr;
+
+  // What's read from one TIFF directory
+  struct Directory {
+    TiledImageLevel level;
+    bool supported = false;
+    uint64_t subfile_type = 0;
+    std::vector<uint64_t> sub_directories;
+    uint64_t next = 0;
+    const uint8_t* icc = nullptr;
+    size_t icc_size = 0;
+  };
+
+  struct CachedTile {
+    TilePtr tile;
+    double priority = 0.0;
+  };
+
+  TiledImage() = default;
+
+  std::filesystem::path path;
+  std::unique_ptr<MappedFile> file;
+  std::shared_ptr<MemoryGovernor> governor;
+  bool big_endian = false;
+  bool big_tiff = false;
+
+  // From the largest to the smallest
+  std::vector<TiledImageLevel> levels;
+  ColorProfile color_profile;
+  std::shared_ptr<const PixelTransform> transform;
+
+  std::unordered_map<uint64_t, CachedTile> cache;
+  // Lowest priority first, that's the next tile to go
+  std::set<std::pair<double, uint64_t>> eviction_order;
+  double eviction_floor = 0.0;
+  uint64_t cached_bytes = 0;
+
+  bool read_directory(uint64_t offset, Directory& directory) const;
+  const uint8_t* find_values(const uint8_t* entry, uint16_t& type, uint64_t& count) const;
+  std::vector<uint64_t> read_values(const uint8_t* entry) const;
+  void add_halved_levels();
+  size_t pick_level(double zoom) const;
+
+  std::vector<TilePtr> fetch(size_t level, const std::vector<uint32_t>& indices);
+  TilePtr load_stored_tile(const TiledImageLevel& level, uint32_t index) const;
+  // Writes the tile's pixels to `out`, whose rows are `stride` pixels apart
+  void decode_stored_tile(const TiledImageLevel& level, uint32_t index, uint32_t* out, size_t stride) const;
+  void find_source_tiles(size_t level, uint32_t index, std::vector<uint32_t>& out) const;
+  TilePtr halve_tiles(size_t level, uint32_t index, const std::unordered_map<uint32_t, TilePtr>& sources) const;
+  void touch(uint64_t key, CachedTile& cached);
+  void insert_into_cache(uint64_t key, const TilePtr& tile);
+  void evict(uint64_t budget);
+};
+
+}
+
+#endif
@@ -0,0 +1,57 @@
+#include "tiles.h"
+
+#include <algorithm>
+
+using namespace monokl;
+
+void TileTracker::reset(unsigned int width, unsigned int height, unsigned int tile_size) {
+  this->width = width;
+  this->height = height;
+  this->tile_size = std::max(1u, tile_size);
+  columns = (width + this->tile_size - 1) / this->tile_size;
+  rows = (height + this->tile_size - 1) / this->tile_size;
+  stale.assign(static_cast<size_t>(columns) * rows, 0);
+  stale_count = 0;
+}
+
+void TileTracker::mark_all_stale() {
+  std::fill(stale.begin(), stale.end(), 1);
+  stale_count = stale.size();
+}
+
+bool TileTracker::has_stale() const {
+  return stale_count > 0;
+}
+
+std::vector<PixelRect> TileTracker::take_stale(const PixelRect& region, size_t limit) {
+  std::vector<PixelRect> result;
+  if (stale_count == 0 || region.w == 0 || region.h == 0) {
+    return result;
+  }
+
+  unsigned int first_column = std::min(columns, region.x / tile_size);
+  unsigned int last_column = std::min(columns, (region.x + region.w + tile_size - 1) / tile_size);
+  unsigned int first_row = std::min(rows, region.y / tile_size);
+  unsigned int last_row = std::min(rows, (region.y + region.h + tile_size - 1) / tile_size);
+
+  for (unsigned int row = first_row; row < last_row && result.size() < limit; row++) {
+    for (unsigned int column = first_column; column < last_column && result.size() < limit; column++) {
+      auto& flag = stale[static_cast<size_t>(row) * columns + column];
+      if (!flag) {
+        continue;
+      }
+
+      flag = 0;
+      stale_count -= 1;
+
+      PixelRect rect;
+      rect.x = column * tile_size;
+      rect.y = row * tile_size;
+      rect.w = std::min(tile_size, width - rect.x);
+      rect.h = std::min(tile_size, height - rect.y);
+      result.push_back(rect);
+    }
+  }
+
+  return result;
+}
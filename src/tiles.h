@@ -0,0 +1,37 @@
+#ifndef MONOKL__TILES_H
+#define MONOKL__TILES_H
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+#include "image_buffer.h"
+
+namespace monokl {
+
+/**
+ * Splits an image into square tiles and remembers which of them are out of date, so derived
+ * pixels can be recomputed lazily, starting with the ones that are actually on screen.
+ */
+class TileTracker {
+public:
+  void reset(unsigned int width, unsigned int height, unsigned int tile_size);
+  void mark_all_stale();
+  bool has_stale() const;
+
+  // Marks up to `limit` stale tiles intersecting `region` as fresh and returns their rects, clipped to the image
+  std::vector<PixelRect> take_stale(const PixelRect& region, size_t limit);
+
+private:
+  unsigned int width = 0;
+  unsigned int height = 0;
+  unsigned int tile_size = 1;
+  unsigned int columns = 0;
+  unsigned int rows = 0;
+  std::vector<uint8_t> stale;
+  size_t stale_count = 0;
+};
+
+}
+
+#endif
@@ -0,0 +1,149 @@
+#include "tone_mapping.h"
+#include "simd.h"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+using namespace monokl;
+
+// Resolution of the linear to sRGB encoding table
+static const int ENCODE_STEPS = 4096;
+
+struct ToneMappingTables {
+  std::vector<float> linear;
+  std::vector<uint8_t> encoded;
+
+  ToneMappingTables() : linear(65536), encoded(ENCODE_STEPS) {
+    for (int v = 0; v < 65536; v++) {
+      float c = v / 65535.0f;
+      linear[v] = c <= 0.04045f ? c / 12.92f : std::pow((c + 0.055f) / 1.055f, 2.4f);
+    }
+
+    for (int i = 0; i < ENCODE_STEPS; i++) {
+      float c = i / static_cast<float>(ENCODE_STEPS - 1);
+      float srgb = c <= 0.0031308f ? c * 12.92f : 1.055f * std::pow(c, 1.0f / 2.4f) - 0.055f;
+      encoded[i] = static_cast<uint8_t>(std::min(255.0f, std::max(0.0f, srgb * 255.0f + 0.5f)));
+    }
+  }
+};
+
+static const ToneMappingTables& get_tables() {
+  static ToneMappingTables tables;
+  return tables;
+}
+
+ToneMapper::ToneMapper(const ToneMappingParams& params) {
+  exposure_scale = std::pow(2.0f, params.exposure);
+  float white_point = params.white_point > 0.0f ? params.white_point : std::max(1.0f, exposure_scale);
+  inverse_white_squared = 1.0f / (white_point * white_point);
+}
+
+// Tone maps four linear pixels given as separate channel lanes, writing encoding table indices
+static inline void tone_map4(const float* r, const float* g, const float* b, float exposure_scale, float inverse_white_squared, int32_t* out_r, int32_t* out_g, int32_t* out_b) {
+  const float max_index = static_cast<float>(ENCODE_STEPS - 1);
+
+#if defined(MONOKL_SIMD_SSE2)
+  __m128 scale = _mm_set1_ps(exposure_scale);
+  __m128 vr = _mm_mul_ps(_mm_loadu_ps(r), scale);
+  __m128 vg = _mm_mul_ps(_mm_loadu_ps(g), scale);
+  __m128 vb = _mm_mul_ps(_mm_loadu_ps(b), scale);
+
+  __m128 one = _mm_set1_ps(1.0f);
+  __m128 luminance = _mm_add_ps(_mm_add_ps(_mm_mul_ps(vr, _mm_set1_ps(0.2126f)), _mm_mul_ps(vg, _mm_set1_ps(0.7152f))), _mm_mul_ps(vb, _mm_set1_ps(0.0722f)));
+  __m128 mapped = _mm_div_ps(_mm_mul_ps(luminance, _mm_add_ps(one, _mm_mul_ps(luminance, _mm_set1_ps(inverse_white_squared)))), _mm_add_ps(one, luminance));
+  __m128 ratio = _mm_div_ps(mapped, _mm_max_ps(luminance, _mm_set1_ps(1e-6f)));
+
+  __m128 to_index = _mm_set1_ps(max_index);
+  __m128 zero = _mm_setzero_ps();
+  vr = _mm_mul_ps(_mm_min_ps(one, _mm_max_ps(zero, _mm_mul_ps(vr, ratio))), to_index);
+  vg = _mm_mul_ps(_mm_min_ps(one, _mm_max_ps(zero, _mm_mul_ps(vg, ratio))), to_index);
+  vb = _mm_mul_ps(_mm_min_ps(one, _mm_max_ps(zero, _mm_mul_ps(vb, ratio))), to_index);
+
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(out_r), _mm_cvtps_epi32(vr));
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(out_g), _mm_cvtps_epi32(vg));
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(out_b), _mm_cvtps_epi32(vb));
+#elif defined(MONOKL_SIMD_NEON)
+  float32x4_t vr = vmulq_n_f32(vld1q_f32(r), exposure_scale);
+  float32x4_t vg = vmulq_n_f32(vld1q_f32(g), exposure_scale);
+  float32x4_t vb = vmulq_n_f32(vld1q_f32(b), exposure_scale);
+
+  float32x4_t one = vdupq_n_f32(1.0f);
+  float32x4_t luminance = vmlaq_n_f32(vmlaq_n_f32(vmulq_n_f32(vr, 0.2126f), vg, 0.7152f), vb, 0.0722f);
+  float32x4_t numerator = vmulq_f32(luminance, vmlaq_n_f32(one, luminance, inverse_white_squared));
+  float32x4_t denominator = vmulq_f32(vaddq_f32(one, luminance), vmaxq_f32(luminance, vdupq_n_f32(1e-6f)));
+
+  // ARMv7 NEON has no vector division, so refine the reciprocal estimate twice instead
+  float32x4_t reciprocal = vrecpeq_f32(denominator);
+  reciprocal = vmulq_f32(reciprocal, vrecpsq_f32(denominator, reciprocal));
+  reciprocal = vmulq_f32(reciprocal, vrecpsq_f32(denominator, reciprocal));
+  float32x4_t ratio = vmulq_f32(numerator, reciprocal);
+
+  float32x4_t zero = vdupq_n_f32(0.0f);
+  vr = vmulq_n_f32(vminq_f32(one, vmaxq_f32(zero, vmulq_f32(vr, ratio))), max_index);
+  vg = vmulq_n_f32(vminq_f32(one, vmaxq_f32(zero, vmulq_f32(vg, ratio))), max_index);
+  vb = vmulq_n_f32(vminq_f32(one, vmaxq_f32(zero, vmulq_f32(vb, ratio))), max_index);
+
+  float32x4_t half = vdupq_n_f32(0.5f);
+  vst1q_s32(out_r, vcvtq_s32_f32(vaddq_f32(vr, half)));
+  vst1q_s32(out_g, vcvtq_s32_f32(vaddq_f32(vg, half)));
+  vst1q_s32(out_b, vcvtq_s32_f32(vaddq_f32(vb, half)));
+#else
+  for (int k = 0; k < 4; k++) {
+    float vr = r[k] * exposure_scale;
+    float vg = g[k] * exposure_scale;
+    float vb = b[k] * exposure_scale;
+
+    float luminance = 0.2126f * vr + 0.7152f * vg + 0.0722f * vb;
+    float mapped = luminance * (1.0f + luminance * inverse_white_squared) / (1.0f + luminance);
+    float ratio = mapped / std::max(luminance, 1e-6f);
+
+    out_r[k] = static_cast<int32_t>(std::min(1.0f, std::max(0.0f, vr * ratio)) * max_index + 0.5f);
+    out_g[k] = static_cast<int32_t>(std::min(1.0f, std::max(0.0f, vg * ratio)) * max_index + 0.5f);
+    out_b[k] = static_cast<int32_t>(std::min(1.0f, std::max(0.0f, vb * ratio)) * max_index + 0.5f);
+  }
+#endif
+}
+
+void ToneMapper::map(const WideImageBuffer& src, const PixelRect& region, ImageBuffer& dst, const PixelTransform* transform) const {
+  const auto& tables = get_tables();
+  const float* linear = tables.linear.data();
+  const uint8_t* encoded = tables.encoded.data();
+
+  unsigned int x_end = std::min(src.width, region.x + region.w);
+  unsigned int y_end = std::min(src.height, region.y + region.h);
+  if (region.x >= x_end || region.y >= y_end) {
+    return;
+  }
+
+  for (unsigned int y = region.y; y < y_end; y++) {
+    const uint64_t* in = src.row(y);
+    uint32_t* out = dst.row(y);
+
+    for (unsigned int x = region.x; x < x_end; x += 4) {
+      unsigned int count = std::min(4u, x_end - x);
+
+      float r[4] = {0, 0, 0, 0};
+      float g[4] = {0, 0, 0, 0};
+      float b[4] = {0, 0, 0, 0};
+      for (unsigned int k = 0; k < count; k++) {
+        uint64_t pixel = in[x + k];
+        r[k] = linear[pixel & 0xFFFF];
+        g[k] = linear[(pixel >> 16) & 0xFFFF];
+        b[k] = linear[(pixel >> 32) & 0xFFFF];
+      }
+
+      int32_t ir[4], ig[4], ib[4];
+      tone_map4(r, g, b, exposure_scale, inverse_white_squared, ir, ig, ib);
+
+      for (unsigned int k = 0; k < count; k++) {
+        uint32_t alpha = static_cast<uint32_t>(in[x + k] >> 56);
+        out[x + k] = encoded[ir[k]] | (encoded[ig[k]] << 8) | (encoded[ib[k]] << 16) | (alpha << 24);
+      }
+    }
+
+    if (transform != nullptr) {
+      transform->apply(out + region.x, x_end - region.x);
+    }
+  }
+}
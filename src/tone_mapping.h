@@ -0,0 +1,36 @@
+#ifndef MONOKL__TONE_MAPPING_H
+#define MONOKL__TONE_MAPPING_H
+
+#include "image_buffer.h"
+#include "orientation.h"
+
+namespace monokl {
+
+struct ToneMappingParams {
+  // Exposure compensation, in stops
+  float exposure = 0.0f;
+  // Linear luminance (after exposure) that ends up as pure white, 0 keeps the brightest value of the source
+  // at white, which leaves images untouched at an exposure of 0
+  float white_point = 0.0f;
+};
+
+/**
+ * Maps RGBA16 pixels (sRGB encoded) to RGBA8 for display. Pixels are linearized through a lookup
+ * table, exposed, compressed with the extended Reinhard operator on their luminance four pixels
+ * at a time with SIMD, and encoded back to sRGB.
+ */
+class ToneMapper {
+public:
+  explicit ToneMapper(const ToneMappingParams& params);
+
+  // Maps `region` of `src` into the same region of `dst`, which must have the same dimensions
+  void map(const WideImageBuffer& src, const PixelRect& region, ImageBuffer& dst, const PixelTransform* transform = nullptr) const;
+
+private:
+  float exposure_scale;
+  float inverse_white_squared;
+};
+
+}
+
+#endif
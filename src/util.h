@@ -4,7 +4,8 @@
 #include <filesystem>
 #include <string>
 #include <codecvt>
-#include <filesystem>
+#include <chrono>
+#include <cstdint>
 
 #include <sail-c++/codec_info.h>
 
@@ -22,12 +23,31 @@ public:
   #endif
   }
 
+  static int64_t get_last_modified_at(const std::filesystem::path& path) {
+    std::error_code error;
+    auto time = std::filesystem::last_write_time(path, error);
+    if (error) {
+      return 0;
+    }
+    return std::chrono::duration_cast<std::chrono::milliseconds>(time.time_since_epoch()).count();
+  }
+
   static std::string ws2s(const std::wstring& wstr) {
     using convert_typeX = std::codecvt_utf8<wchar_t>;
     std::wstring_convert<convert_typeX, wchar_t> converterX;
     return converterX.to_bytes(wstr);
   }
 
+  // 64-bit FNV-1a, the same on every platform and run, so it can be kept in files on disk
+  static uint64_t hash_string(const std::string& value) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (unsigned char c : value) {
+      hash ^= c;
+      hash *= 1099511628211ULL;
+    }
+    return hash;
+  }
+
   static bool is_valid_image(const std::filesystem::path& path) {
     auto path_str = ws2s(path.wstring());
     auto codec = sail::codec_info::from_path(path_str);
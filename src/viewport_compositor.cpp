@@ -0,0 +1,133 @@
+#include "viewport_compositor.h"
+#include "instrumentation.h"
+#include "parallel.h"
+#include "logging.h"
+
+#include <algorithm>
+#include <chrono>
+
+using namespace monokl;
+
+// No level is made smaller than this, a view zoomed out further filters a few more pixels each
+static const unsigned int MIN_LEVEL_SIZE = 256;
+static const size_t MIN_ROWS_PER_CHUNK = 64;
+
+const char* monokl::compositor_mode_name(CompositorMode mode) {
+  switch (mode) {
+    case CompositorModeGpu:
+      return "gpu";
+    case CompositorModeCpu:
+      return "cpu";
+    default:
+      return "auto";
+  }
+}
+
+CompositorMode monokl::parse_compositor_mode(const std::string& name) {
+  if (name == "gpu") {
+    return CompositorModeGpu;
+  }
+  if (name == "cpu") {
+    return CompositorModeCpu;
+  }
+  return CompositorModeAuto;
+}
+
+const char* monokl::resample_kernel_name(ResampleKernel kernel) {
+  return kernel == ResampleKernelBilinear ? "bilinear" : "bicubic";
+}
+
+ResampleKernel monokl::parse_resample_kernel(const std::string& name) {
+  return name == "bilinear" ? ResampleKernelBilinear : ResampleKernelBicubic;
+}
+
+void ViewportCompositor::set_image(const std::shared_ptr<const ImageBuffer>& pixels, const std::shared_ptr<MemoryGovernor>& governor) {
+  clear();
+  source = pixels;
+  this->governor = governor;
+}
+
+void ViewportCompositor::clear() {
+  source.reset();
+  levels.clear();
+}
+
+bool ViewportCompositor::has_image() const {
+  return source != nullptr;
+}
+
+void ViewportCompositor::refresh(const PixelRect& region) {
+  unsigned int x0 = region.x;
+  unsigned int y0 = region.y;
+  unsigned int x1 = region.x + region.w;
+  unsigned int y1 = region.y + region.h;
+
+  for (size_t index = 1; index <= levels.size(); index++) {
+    const ImageBuffer& halved = levels[index - 1];
+    x0 /= 2;
+    y0 /= 2;
+    x1 = std::min((x1 + 1) / 2, halved.width);
+    y1 = std::min((y1 + 1) / 2, halved.height);
+    if (x0 >= x1 || y0 >= y1) {
+      break;
+    }
+    halve(index, y0, y1, x0, x1);
+  }
+}
+
+void ViewportCompositor::render(double x, double y, double zoom, ResampleKernel kernel, ImageBuffer& out) {
+  if (source == nullptr || zoom <= 0.0) {
+    return;
+  }
+
+  // The smallest level that still has a pixel for every pixel on screen
+  size_t index = 0;
+  double scale = 1.0;
+  while (zoom * scale * 2.0 <= 1.0) {
+    const ImageBuffer& larger = level(index);
+    if (larger.width / 2 == 0 || larger.height / 2 == 0 || std::max(larger.width, larger.height) <= MIN_LEVEL_SIZE) {
+      break;
+    }
+    index++;
+    scale *= 2.0;
+  }
+
+  resample_region(level(index), x / scale, y / scale, zoom * scale, kernel, out);
+}
+
+const ImageBuffer& ViewportCompositor::level(size_t index) {
+  if (index == 0) {
+    return *source;
+  }
+  if (index <= levels.size()) {
+    return levels[index - 1];
+  }
+
+  auto t0 = std::chrono::high_resolution_clock::now();
+
+  const ImageBuffer& larger = level(index - 1);
+  ImageBuffer halved;
+  halved.allocate(larger.width / 2, larger.height / 2);
+  halved.lease = MemoryLease(governor, MemoryCategoryCaches, halved.size_in_bytes());
+  levels.push_back(std::move(halved));
+  halve(index, 0, levels.back().height, 0, levels.back().width);
+
+  auto t1 = std::chrono::high_resolution_clock::now();
+  auto duration_ms = static_cast<long long int>(std::chrono::duration_cast<std::chrono::milliseconds>(t1 - t0).count());
+  Instrumentation::get().record_timing("compositor.halve", static_cast<double>(duration_ms));
+  log_debug("Halved a %ux%u image down to level %lu in %lld ms", source->width, source->height, index, duration_ms);
+
+  return levels.back();
+}
+
+void ViewportCompositor::halve(size_t index, unsigned int first_row, unsigned int last_row, unsigned int first_column, unsigned int last_column) {
+  const ImageBuffer& larger = index == 1 ? *source : levels[index - 2];
+  ImageBuffer& halved = levels[index - 1];
+
+  parallel_for(first_row, last_row, MIN_ROWS_PER_CHUNK, [&](size_t first, size_t last) {
+    for (size_t y = first; y < last; y++) {
+      unsigned int row = static_cast<unsigned int>(y);
+      halve_rows(larger.row(row * 2) + first_column * 2, larger.row(row * 2 + 1) + first_column * 2, last_column - first_column, halved.row(row) + first_column);
+    }
+  });
+}
@@ -0,0 +1,65 @@
+#ifndef MONOKL__VIEWPORT_COMPOSITOR_H
+#define MONOKL__VIEWPORT_COMPOSITOR_H
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "image_buffer.h"
+#include "memory_governor.h"
+#include "resize.h"
+
+namespace monokl {
+
+typedef enum {
+  // On the CPU when SDL only has its software renderer, on the GPU otherwise
+  CompositorModeAuto,
+  CompositorModeGpu,
+  CompositorModeCpu
+} CompositorMode;
+
+struct RenderOptions {
+  CompositorMode compositor = CompositorModeAuto;
+  // How the CPU compositor scales, the GPU always filters bilinearly
+  ResampleKernel filter = ResampleKernelBicubic;
+};
+
+const char* compositor_mode_name(CompositorMode mode);
+// Accepts the names `compositor_mode_name` returns, anything else is `CompositorModeAuto`
+CompositorMode parse_compositor_mode(const std::string& name);
+const char* resample_kernel_name(ResampleKernel kernel);
+// Accepts the names `resample_kernel_name` returns, anything else is bicubic
+ResampleKernel parse_resample_kernel(const std::string& name);
+
+/**
+ * Scales the visible part of a decoded image on the CPU, for renderers that are too slow to scale
+ * a full size texture on every frame. Halved copies of the image are made the first time the view
+ * is zoomed out that far, so however far out it is, each output pixel only filters a few source
+ * pixels of the level closest to the zoom and a frame costs about the same for any image size.
+ */
+class ViewportCompositor {
+public:
+  // Keeps `pixels` to read from, they can be changed in place as long as `refresh` is called afterwards
+  void set_image(const std::shared_ptr<const ImageBuffer>& pixels, const std::shared_ptr<MemoryGovernor>& governor);
+  void clear();
+  bool has_image() const;
+
+  // Makes the halved copies of `region` again, after its pixels were changed
+  void refresh(const PixelRect& region);
+
+  // Fills `out` with the part of the image that starts at (`x`, `y`), in image pixels, shown at `zoom`
+  void render(double x, double y, double zoom, ResampleKernel kernel, ImageBuffer& out);
+
+private:
+  std::shared_ptr<const ImageBuffer> source = nullptr;
+  std::shared_ptr<MemoryGovernor> governor = nullptr;
+  // Each half the size of the one before, starting from half of `source`. Odd last rows and columns are left out
+  std::vector<ImageBuffer> levels;
+
+  const ImageBuffer& level(size_t index);
+  void halve(size_t index, unsigned int first_row, unsigned int last_row, unsigned int first_column, unsigned int last_column);
+};
+
+}
+
+#endif
@@ -1,8 +1,17 @@
 #include "window.h"
+#include "application.h"
+#include "decoder.h"
+#include "instrumentation.h"
+#include "metadata_store.h"
+#include "persistence_writer.h"
 #include "logging.h"
 #include <SDL_surface.h>
 #include <SDL_video.h>
-#include <sail-common/status.h>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
 
 // TODO: Determine the window flags based on the platform
 #ifdef __APPLE__
@@ -15,6 +24,34 @@
 
 using namespace monokl;
 
+static const unsigned int TONE_MAPPING_TILE_SIZE = 256;
+// Tiles outside of the viewport that get tone mapped on each frame until all are up to date
+static const size_t OFFSCREEN_TILES_PER_FRAME = 8;
+// Between the panes of compare mode, where the background shows through
+static const int COMPARE_PANE_GAP = 2;
+// A pixel column per histogram bin, in the bottom right corner
+static const int OVERLAY_WIDTH = 256;
+static const int OVERLAY_HEIGHT = 100;
+static const int OVERLAY_MARGIN = 12;
+
+// Rotating works in place, so a decode that's also shown elsewhere is copied first
+static std::shared_ptr<DecodedImage> copy_decoded(const DecodedImage& image, const std::shared_ptr<MemoryGovernor>& governor) {
+  auto copy = std::make_shared<DecodedImage>();
+  copy->pixels = std::make_shared<ImageBuffer>();
+  copy->pixels->allocate(image.pixels->width, image.pixels->height);
+  copy->pixels->pixels = image.pixels->pixels;
+  copy->pixels->lease = MemoryLease(governor, MemoryCategoryDecodedImages, copy->pixels->size_in_bytes());
+  if (image.wide_pixels != nullptr) {
+    copy->wide_pixels = std::make_shared<WideImageBuffer>();
+    copy->wide_pixels->allocate(image.wide_pixels->width, image.wide_pixels->height);
+    copy->wide_pixels->pixels = image.wide_pixels->pixels;
+    copy->wide_pixels->lease = MemoryLease(governor, MemoryCategoryDecodedImages, copy->wide_pixels->size_in_bytes());
+  }
+  copy->color_transform = image.color_transform;
+  copy->histogram = image.histogram;
+  return copy;
+}
+
 WindowOptions::WindowOptions() {}
 
 WindowOptions::WindowOptions(const WindowOptions& options) {
@@ -26,6 +63,20 @@ WindowOptions::WindowOptions(const WindowOptions& options) {
   maximized = options.maximized;
 }
 
+int ComparePane::width() const {
+  if (image != nullptr) {
+    return static_cast<int>(image->pixels->width);
+  }
+  return tiled != nullptr ? static_cast<int>(tiled->width()) : 0;
+}
+
+int ComparePane::height() const {
+  if (image != nullptr) {
+    return static_cast<int>(image->pixels->height);
+  }
+  return tiled != nullptr ? static_cast<int>(tiled->height()) : 0;
+}
+
 Window::Window(const Application& app, const WindowOptions& options) : app(app), options(options) {
   uint32_t flags = SDL_WINDOW_RESIZABLE | OTHER_WINDOW_FLAGS;
 
@@ -36,26 +87,41 @@ Window::Window(const Application& app, const WindowOptions& options) : app(app),
     flags |= SDL_WINDOW_MAXIMIZED;
   }
 
-  SDL_Window* wnd = SDL_CreateWindow("monokl", x, y, 1366, 768, flags);
+  SDL_Window* wnd = SDL_CreateWindow("monokl", x, y, options.width, options.height, flags);
   if (wnd == nullptr) {
     throw MonoklError(fmt::format("Failed to create window: %s", SDL_GetError()));
   }
   window = wnd;
 
   SDL_Renderer* rnd = SDL_CreateRenderer(wnd, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC);
+  if (rnd == nullptr) {
+    // Remote and headless displays often have no accelerated renderer at all
+    log_warn("Failed to create an accelerated renderer, falling back to software: %s", SDL_GetError());
+    rnd = SDL_CreateRenderer(wnd, -1, SDL_RENDERER_SOFTWARE);
+  }
   if (rnd == nullptr) {
     throw MonoklError(fmt::format("Failed to create renderer: %s", SDL_GetError()));
   }
   renderer = rnd;
 
+  SDL_RendererInfo renderer_info;
+  if (SDL_GetRendererInfo(rnd, &renderer_info) == 0) {
+    software_renderer = (renderer_info.flags & SDL_RENDERER_SOFTWARE) != 0;
+    log_debug("Using the %s renderer", renderer_info.name);
+  }
+
   SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "linear");
   SDL_SetHint(SDL_HINT_RENDER_VSYNC, "1");
 
   SDL_ShowWindow(wnd);
 
+  // Text input is only wanted while searching, otherwise every key press would also go through the IME
+  SDL_StopTextInput();
+
   id = SDL_GetWindowID(wnd);
   playlist = std::make_shared<Playlist>();
 
+  refresh_display_profile();
   refresh_size();
 }
 
@@ -69,13 +135,33 @@ Window::~Window() {
     folder_entry->save_settings();
   }
 
+  auto settings = app.get_settings();
+  if (settings != nullptr && settings->restore_session) {
+    // The session records the mtimes of `.monokl.toml`, so our own writes have to land first
+    if (PersistenceWriter::get().flush(PersistenceWriter::FLUSH_TIMEOUT)) {
+      for (auto entry : playlist->all_entries) {
+        if (entry->is_folder() && std::static_pointer_cast<FolderEntry>(entry)->settings_written) {
+          std::static_pointer_cast<FolderEntry>(entry)->refresh_modified_at();
+        }
+      }
+    }
+
+    Session::save(*playlist, Session::get_session_path());
+  }
+
   playlist.reset();
 
   if (main_tex != nullptr) {
     SDL_DestroyTexture(main_tex);
+    main_tex_lease.reset();
     log_debug("Texture destroyed");
   }
 
+  if (viewport_tex != nullptr) {
+    SDL_DestroyTexture(viewport_tex);
+    viewport_tex_lease.reset();
+  }
+
   if (renderer != nullptr) {
     SDL_DestroyRenderer(renderer);
     log_debug("Renderer destroyed");
@@ -96,16 +182,150 @@ void Window::refresh_size() {
     return;
   }
 
-  fmt::println("Window size updated: {}x{}", window_rect.w, window_rect.h);
+  log_debug("Window size updated: %dx%d", window_rect.w, window_rect.h);
   fit_image_to_screen();
 }
 
+void Window::refresh_display_profile() {
+  size_t size = 0;
+  void* icc = SDL_GetWindowICCProfile(window, &size);
+
+  auto profile = std::make_shared<ColorProfile>(ColorProfile::from_bytes(icc, size));
+  SDL_free(icc);
+
+  bool changed = display_profile == nullptr || display_profile->hash != profile->hash;
+  display_profile = profile;
+
+  if (!changed) {
+    return;
+  }
+
+  log_debug("Display color profile is %s", profile->is_srgb() ? "sRGB" : "a custom ICC profile");
+
+  // Color transforms are baked into the decoded pixels, so the current image has to be decoded again.
+  // Panes keep their place, zoom and pan, but not their pixels. Cached decodes are keyed by the
+  // profile, other windows may still be on the old display
+  for (auto& pane : compare_panes) {
+    pane.entry.reset();
+  }
+  if (current_image != nullptr || current_tiled != nullptr || !compare_panes.empty()) {
+    reload_current_image();
+  }
+}
+
+void Window::restore_session() {
+  if (!Session::restore(*playlist, Session::get_session_path())) {
+    return;
+  }
+
+  reload_current_image();
+
+  auto folders = Session::capture_folder_states(*playlist);
+  session_revalidation = std::async(std::launch::async, [folders = std::move(folders)]() {
+    return Session::revalidate(folders);
+  });
+}
+
+void Window::open_playlist(const std::shared_ptr<Playlist>& playlist, sail::image* first_frame) {
+  this->playlist = playlist;
+  discard_session_revalidation = true;
+  pending_similarity_view = SimilarityViewNone;
+  reload_current_image(first_frame);
+}
+
+void Window::open_like(const Window& other) {
+  auto shown = other.playlist->get_current();
+  playlist->options = other.playlist->options;
+  playlist->reload_images_from(other.playlist->roots);
+  discard_session_revalidation = true;
+
+  for (size_t i = 0; shown != nullptr && i < playlist->shown_entries.size(); i++) {
+    const auto& entry = playlist->shown_entries[i];
+    if (entry->path == shown->path && entry->member == shown->member && entry->page == shown->page) {
+      playlist->go_to(static_cast<int>(i));
+      break;
+    }
+  }
+  reload_current_image();
+}
+
+void Window::apply_session_revalidation() {
+  if (!session_revalidation.valid() || session_revalidation.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+    return;
+  }
+
+  auto folders = session_revalidation.get();
+  pending_similarity_view = SimilarityViewNone;
+
+  // Files dropped in the meantime replaced the restored playlist, so the results no longer apply
+  if (discard_session_revalidation || folders.empty()) {
+    return;
+  }
+
+  auto previous = playlist->get_current();
+  for (const auto& folder : folders) {
+    playlist->replace_folder(folder);
+  }
+
+  if (playlist->get_current() != previous) {
+    reload_current_image();
+  } else {
+    refresh_title();
+  }
+}
+
+void Window::apply_late_scans() {
+  auto previous = playlist->get_current();
+  if (!playlist->apply_late_scans()) {
+    return;
+  }
+
+  if (playlist->get_current() != previous) {
+    reload_current_image();
+  } else {
+    refresh_title();
+  }
+}
+
 void Window::render() {
+  apply_session_revalidation();
+  apply_late_scans();
+  apply_similarity_view();
+  refresh_export_progress();
+  refresh_tone_mapped_tiles();
+  refresh_viewport();
+  refresh_histogram();
+  present();
+
+  if (startup_image_pending) {
+    startup_image_pending = false;
+    if (main_tex != nullptr || current_tiled != nullptr || compositor.has_image()) {
+      auto elapsed = std::chrono::steady_clock::now() - app.get_started_at();
+      double elapsed_ms = std::chrono::duration<double, std::milli>(elapsed).count();
+      Instrumentation::get().record_timing("startup.time_to_first_image", elapsed_ms);
+      log_debug("First image on screen %.1f ms after startup", elapsed_ms);
+    }
+  }
+}
+
+void Window::present() {
   SDL_SetRenderDrawColor(renderer, 49, 49, 49, 255);
   SDL_RenderClear(renderer);
-  if (main_tex != nullptr) {
+  if (!compare_panes.empty()) {
+    SDL_SetRenderDrawColor(renderer, 38, 38, 38, 255);
+    for (const auto& pane : compare_panes) {
+      SDL_RenderFillRect(renderer, &pane.rect);
+      if (viewport_tex != nullptr && pane.visible_rect.w > 0 && pane.visible_rect.h > 0) {
+        SDL_RenderCopy(renderer, viewport_tex, &pane.visible_rect, &pane.visible_rect);
+      }
+    }
+  } else if (main_tex != nullptr) {
     SDL_RenderCopy(renderer, main_tex, nullptr, &render_rect);
+  } else if ((current_tiled != nullptr || compositor.has_image()) && viewport_tex != nullptr && viewport_rect.w > 0 && viewport_rect.h > 0) {
+    SDL_Rect source = {0, 0, viewport_rect.w, viewport_rect.h};
+    SDL_RenderCopy(renderer, viewport_tex, &source, &viewport_rect);
   }
+  render_overlay();
   SDL_RenderPresent(renderer);
 }
 
@@ -120,6 +340,8 @@ void Window::drop_file(const char* file) {
 
 void Window::end_drop_files() {
   playlist->reload_images_from(dropped_files);
+  discard_session_revalidation = true;
+  pending_similarity_view = SimilarityViewNone;
   dropped_files.clear();
   is_dropping_files = false;
 
@@ -145,17 +367,34 @@ void Window::fit_image_to_screen() {
   double aspect_ratio = (double)image_rect.w / (double)image_rect.h;
   double window_aspect_ratio = (double)window_rect.w / (double)window_rect.h;
 
-  if (aspect_ratio > window_aspect_ratio) {
+  if (!compare_panes.empty()) {
+    // Every image fits in its pane at the shared zoom
+    layout_compare_panes();
+    zoom_level = 0.0;
+    for (const auto& pane : compare_panes) {
+      if (pane.width() > 0 && pane.height() > 0) {
+        double fit = std::min((double)pane.rect.w / pane.width(), (double)pane.rect.h / pane.height());
+        zoom_level = zoom_level > 0.0 ? std::min(zoom_level, fit) : fit;
+      }
+    }
+    if (zoom_level <= 0.0) {
+      zoom_level = 1.0;
+    }
+  } else if (aspect_ratio > window_aspect_ratio) {
     zoom_level = (double)window_rect.w / (double)image_rect.w;
   } else {
     zoom_level = (double)window_rect.h / (double)image_rect.h;
   }
 
+  pan_x = 0.0;
+  pan_y = 0.0;
   recalculate_render_rect();
 }
 
 void Window::set_original_image_size() {
   zoom_level = 1.0;
+  pan_x = 0.0;
+  pan_y = 0.0;
   recalculate_render_rect();
 }
 
@@ -163,21 +402,60 @@ void Window::recalculate_render_rect() {
   render_rect.w = image_rect.w * zoom_level;
   render_rect.h = image_rect.h * zoom_level;
 
-  render_rect.x = (window_rect.w - render_rect.w) / 2;
-  render_rect.y = (window_rect.h - render_rect.h) / 2;
+  // Only a side that's larger than the window can be panned, and never past the image's edges.
+  // Panes are panned together, as far as the one with the most to pan allows
+  double max_pan_x = 0.0;
+  double max_pan_y = 0.0;
+  if (compare_panes.empty()) {
+    max_pan_x = std::max(0, render_rect.w - window_rect.w) / 2.0;
+    max_pan_y = std::max(0, render_rect.h - window_rect.h) / 2.0;
+  }
+  layout_compare_panes();
+  for (auto& pane : compare_panes) {
+    pane.render_rect.w = static_cast<int>(pane.width() * zoom_level);
+    pane.render_rect.h = static_cast<int>(pane.height() * zoom_level);
+    max_pan_x = std::max(max_pan_x, std::max(0, pane.render_rect.w - pane.rect.w) / 2.0);
+    max_pan_y = std::max(max_pan_y, std::max(0, pane.render_rect.h - pane.rect.h) / 2.0);
+  }
+  pan_x = std::clamp(pan_x, -max_pan_x, max_pan_x);
+  pan_y = std::clamp(pan_y, -max_pan_y, max_pan_y);
 
+  render_rect.x = (window_rect.w - render_rect.w) / 2 + static_cast<int>(std::lround(pan_x));
+  render_rect.y = (window_rect.h - render_rect.h) / 2 + static_cast<int>(std::lround(pan_y));
+
+  // Images with less to pan than the others stop at their edges
+  for (auto& pane : compare_panes) {
+    double pane_max_x = std::max(0, pane.render_rect.w - pane.rect.w) / 2.0;
+    double pane_max_y = std::max(0, pane.render_rect.h - pane.rect.h) / 2.0;
+    pane.render_rect.x = pane.rect.x + (pane.rect.w - pane.render_rect.w) / 2 + static_cast<int>(std::lround(std::clamp(pan_x, -pane_max_x, pane_max_x)));
+    pane.render_rect.y = pane.rect.y + (pane.rect.h - pane.render_rect.h) / 2 + static_cast<int>(std::lround(std::clamp(pan_y, -pane_max_y, pane_max_y)));
+  }
+
+  viewport_stale = true;
   refresh_title();
 }
 
-void Window::reload_current_image() {
+void Window::pan_by(int x, int y) {
+  pan_x += x;
+  pan_y += y;
+  recalculate_render_rect();
+}
+
+void Window::reload_current_image(sail::image* frame) {
   if (main_tex != nullptr) {
     SDL_DestroyTexture(main_tex);
     main_tex = nullptr;
+    main_tex_lease.reset();
   }
 
   if (current_image != nullptr) {
     current_image.reset();
   }
+  current_tiled.reset();
+  compositor.clear();
+  region_histogram.clear();
+  has_shown_histogram = false;
+  app.get_decode_cache()->trim(app.get_memory_governor());
 
   image_rect.h = 0;
   image_rect.w = 0;
@@ -188,78 +466,347 @@ void Window::reload_current_image() {
   refresh_title(entry);
 
   if (entry == nullptr) {
+    compare_panes.clear();
     return;
   }
 
   std::string image_path = entry->path.string();
-  sail::image_input input(image_path);
-  sail::image image = input.next_frame();
+  DecodeContext context;
+  context.governor = app.get_memory_governor();
+  context.color_manager = app.get_color_manager();
+  context.display_profile = display_profile;
+  context.tone_mapping = tone_mapping;
+
+  if (compare_pane_count > 0) {
+    load_compare_panes(context);
+    return;
+  }
+
+  // Documents are only opened once they're shown, which is also when their other pages are added
+  if (entry->member.empty() && PagedDocument::may_have_pages(entry->path)) {
+    if (current_document == nullptr || current_document->get_path() != entry->path) {
+      current_document = PagedDocument::open(entry->path);
+    }
+    if (current_document != nullptr && entry->page_count == 0) {
+      playlist->expand_pages(entry, static_cast<uint32_t>(current_document->page_count()));
+      refresh_title(entry);
+    }
+  } else {
+    current_document.reset();
+  }
+
+  // TIFFs too large to decode whole are read a region at a time, as they're scrolled into view.
+  // The others are decoded whole, but still with their strips or tiles spread over all cores
+  std::shared_ptr<TiledImage> tiled = nullptr;
+  if (entry->member.empty() && entry->page == 0 && TiledImage::may_be_tiled(entry->path)) {
+    tiled = TiledImage::open(entry->path, context.governor);
+    if (tiled != nullptr && tiled->needs_region_decode()) {
+      if (context.color_manager != nullptr && display_profile != nullptr) {
+        tiled->set_color_transform(context.color_manager->get_transform(tiled->get_color_profile(), *display_profile));
+      }
+      current_tiled = tiled;
+      image_rect.w = static_cast<int>(tiled->width());
+      image_rect.h = static_cast<int>(tiled->height());
+      fit_image_to_screen();
+      return;
+    }
+  }
+
+  // Images that were just shown, like in compare mode or before stepping away, are still decoded
+  current_image = app.get_decode_cache()->find(decode_key(*entry));
+  if (current_image != nullptr && current_image->downscaled) {
+    // Shown at the size it was kept at while the image is decoded again
+    upload_current_image();
+    refresh_viewport();
+    present();
+    current_image.reset();
+  }
+
+  if (current_image != nullptr) {
+    log_debug("Reusing the decode of %s", image_path.c_str());
+  } else if (tiled != nullptr && tiled->can_decode_whole()) {
+    current_image = ImageDecoder::decode(*tiled, image_path, context);
+  } else if (frame != nullptr) {
+    current_image = ImageDecoder::decode(*frame, image_path, context);
+  } else if (current_document != nullptr && entry->page_count > 1) {
+    sail::image page_frame = current_document->read_page(entry->page);
+    current_image = ImageDecoder::decode(page_frame, image_path, context);
+  } else if (!entry->member.empty()) {
+    auto archive = entry->parent != nullptr ? entry->parent->get_archive() : nullptr;
+    sail::image archived_frame = archive != nullptr ? ImageDecoder::read_first_frame(*archive, entry->member, context.governor) : sail::image();
+    current_image = ImageDecoder::decode(archived_frame, image_path, context);
+  } else {
+    current_image = ImageDecoder::decode(image_path, context);
+  }
+
+  if (current_image != nullptr) {
+    app.get_decode_cache()->insert(decode_key(*entry), current_image);
+    stale_tiles.reset(current_image->pixels->width, current_image->pixels->height, TONE_MAPPING_TILE_SIZE);
+  }
 
-  if (!image.is_valid()) {
-    log_error("Failed to load image: %s", image_path.c_str());
+  upload_current_image();
+}
+
+bool Window::should_composite() const {
+  auto settings = app.get_settings();
+  CompositorMode mode = settings != nullptr ? settings->render_options.compositor : CompositorModeAuto;
+  return mode == CompositorModeCpu || (mode == CompositorModeAuto && software_renderer);
+}
+
+void Window::refresh_viewport() {
+  if ((current_tiled == nullptr && !compositor.has_image() && compare_panes.empty()) || !viewport_stale) {
+    return;
+  }
+  viewport_stale = false;
+  ScopedTimer timer("render.viewport");
+
+  if (!compare_panes.empty()) {
+    refresh_compare_viewport();
     return;
   }
 
-  auto convert_result = image.convert(SAIL_PIXEL_FORMAT_BPP32_RGBA);
-  if (convert_result != SAIL_OK) {
-    log_error("Failed to convert image to RGBA: %s", image_path.c_str());
+  int x0 = std::max(0, render_rect.x);
+  int y0 = std::max(0, render_rect.y);
+  int x1 = std::min(window_rect.w, render_rect.x + render_rect.w);
+  int y1 = std::min(window_rect.h, render_rect.y + render_rect.h);
+  viewport_rect = {x0, y0, std::max(0, x1 - x0), std::max(0, y1 - y0)};
+  if (viewport_rect.w == 0 || viewport_rect.h == 0 || !reserve_viewport_texture(viewport_rect.w, viewport_rect.h)) {
     return;
   }
 
-  SDL_Surface* surface = SDL_CreateRGBSurfaceFrom(
-    image.pixels(),
-    image.width(),
-    image.height(),
-    32,
-    image.bytes_per_line(),
-    0x000000FF,
-    0x0000FF00,
-    0x00FF0000,
-    0xFF000000
-  );
+  viewport_pixels.allocate(viewport_rect.w, viewport_rect.h);
+  double x = (viewport_rect.x - render_rect.x) / zoom_level;
+  double y = (viewport_rect.y - render_rect.y) / zoom_level;
+  if (current_tiled != nullptr) {
+    current_tiled->render_region(x, y, zoom_level, viewport_pixels);
+  } else {
+    auto settings = app.get_settings();
+    compositor.render(x, y, zoom_level, settings != nullptr ? settings->render_options.filter : ResampleKernelBicubic, viewport_pixels);
+  }
+
+  SDL_Rect target = {0, 0, viewport_rect.w, viewport_rect.h};
+  if (SDL_UpdateTexture(viewport_tex, &target, viewport_pixels.pixels.data(), viewport_rect.w * sizeof(uint32_t)) != 0) {
+    log_error("Failed to upload viewport: %s", SDL_GetError());
+  }
+}
 
-  if (surface == nullptr) {
-    log_error("Failed to create surface from image: %s", image_path.c_str());
+bool Window::reserve_viewport_texture(int width, int height) {
+  // Made as large as the window, so it only has to be made again when the window grows
+  int texture_w = 0;
+  int texture_h = 0;
+  if (viewport_tex != nullptr) {
+    SDL_QueryTexture(viewport_tex, nullptr, nullptr, &texture_w, &texture_h);
+  }
+  if (texture_w >= width && texture_h >= height) {
+    return true;
+  }
+
+  if (viewport_tex != nullptr) {
+    SDL_DestroyTexture(viewport_tex);
+    viewport_tex_lease.reset();
+  }
+  viewport_tex = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA32, SDL_TEXTUREACCESS_STREAMING, window_rect.w, window_rect.h);
+  if (viewport_tex == nullptr) {
+    log_error("Failed to create viewport texture: %s", SDL_GetError());
+    return false;
+  }
+  viewport_tex_lease = MemoryLease(app.get_memory_governor(), MemoryCategoryTextures, static_cast<uint64_t>(window_rect.w) * window_rect.h * sizeof(uint32_t));
+  return true;
+}
+
+void Window::transform_current_image(ImageOrientation orientation) {
+  if (current_image == nullptr) {
     return;
   }
 
-  SDL_Texture* tex = SDL_CreateTextureFromSurface(renderer, surface);
+  // Works on the decode we already hold, the file is never read again. It's no longer what the
+  // file decodes to though, so it isn't kept for the next time the image is shown, and other
+  // windows showing the same file get to keep the decode as it was
+  app.get_decode_cache()->erase(decode_key(*playlist->get_current()));
+  // The histogram counts the pixel buffer itself on another thread, and rotating may free it
+  region_histogram.clear();
+  auto t0 = std::chrono::high_resolution_clock::now();
+  if (current_image.use_count() > 1) {
+    current_image = copy_decoded(*current_image, app.get_memory_governor());
+  }
+  apply_orientation(*current_image->pixels, orientation);
+  if (current_image->is_high_bit_depth()) {
+    apply_orientation(*current_image->wide_pixels, orientation);
+  }
+  auto t1 = std::chrono::high_resolution_clock::now();
+
+  log_debug("Transformed current image in %lld ms", static_cast<long long int>(std::chrono::duration_cast<std::chrono::milliseconds>(t1 - t0).count()));
+
+  // Tiles that weren't tone mapped yet got moved around along with the pixels, so start over
+  bool had_stale_tiles = stale_tiles.has_stale();
+  stale_tiles.reset(current_image->pixels->width, current_image->pixels->height, TONE_MAPPING_TILE_SIZE);
+  if (had_stale_tiles) {
+    stale_tiles.mark_all_stale();
+  }
+
+  upload_current_image();
+}
+
+void Window::upload_current_image() {
+  if (main_tex != nullptr) {
+    SDL_DestroyTexture(main_tex);
+    main_tex = nullptr;
+    main_tex_lease.reset();
+  }
+
+  if (current_image == nullptr) {
+    return;
+  }
+
+  const auto& pixels = *current_image->pixels;
+  region_histogram.set_image(current_image->pixels, current_image->histogram);
+  histogram_region = PixelRect();
+
+  // Only the window sized viewport is ever uploaded, so the image never has to fit in a texture
+  if (should_composite()) {
+    compositor.set_image(current_image->pixels, app.get_memory_governor());
+    image_rect.w = pixels.width;
+    image_rect.h = pixels.height;
+    fit_image_to_screen();
+    return;
+  }
+
+  SDL_Texture* tex = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA32, SDL_TEXTUREACCESS_STATIC, pixels.width, pixels.height);
   if (tex == nullptr) {
-    log_error("Failed to create texture from surface: %s", image_path.c_str());
+    log_error("Failed to create texture: %s", SDL_GetError());
     return;
   }
 
-  SDL_FreeSurface(surface);
+  if (SDL_UpdateTexture(tex, nullptr, pixels.pixels.data(), pixels.width * sizeof(uint32_t)) != 0) {
+    log_error("Failed to upload texture: %s", SDL_GetError());
+    SDL_DestroyTexture(tex);
+    return;
+  }
 
   main_tex = tex;
+  main_tex_lease = MemoryLease(app.get_memory_governor(), MemoryCategoryTextures, pixels.size_in_bytes());
 
-  image_rect.w = image.width();
-  image_rect.h = image.height();
+  image_rect.w = pixels.width;
+  image_rect.h = pixels.height;
 
   fit_image_to_screen();
 }
 
+void Window::change_exposure(float by) {
+  if (current_image == nullptr || !current_image->is_high_bit_depth()) {
+    return;
+  }
+
+  tone_mapping.exposure += by;
+
+  // Only the visible tiles are redone right away, the rest catch up over the next frames
+  stale_tiles.mark_all_stale();
+  refresh_tone_mapped_tiles();
+  refresh_title();
+}
+
+PixelRect Window::visible_image_region() const {
+  PixelRect region;
+  if (image_rect.w <= 0 || image_rect.h <= 0 || zoom_level <= 0) {
+    return region;
+  }
+
+  int screen_x0 = std::max(0, render_rect.x);
+  int screen_y0 = std::max(0, render_rect.y);
+  int screen_x1 = std::min(window_rect.w, render_rect.x + render_rect.w);
+  int screen_y1 = std::min(window_rect.h, render_rect.y + render_rect.h);
+  if (screen_x1 <= screen_x0 || screen_y1 <= screen_y0) {
+    return region;
+  }
+
+  int x0 = std::clamp(static_cast<int>((screen_x0 - render_rect.x) / zoom_level), 0, image_rect.w);
+  int y0 = std::clamp(static_cast<int>((screen_y0 - render_rect.y) / zoom_level), 0, image_rect.h);
+  int x1 = std::clamp(static_cast<int>(std::ceil((screen_x1 - render_rect.x) / zoom_level)), 0, image_rect.w);
+  int y1 = std::clamp(static_cast<int>(std::ceil((screen_y1 - render_rect.y) / zoom_level)), 0, image_rect.h);
+
+  region.x = x0;
+  region.y = y0;
+  region.w = x1 - x0;
+  region.h = y1 - y0;
+  return region;
+}
+
+void Window::refresh_tone_mapped_tiles() {
+  if (current_image == nullptr || !current_image->is_high_bit_depth() || (main_tex == nullptr && !compositor.has_image()) || !stale_tiles.has_stale()) {
+    return;
+  }
+
+  auto tiles = stale_tiles.take_stale(visible_image_region(), SIZE_MAX);
+  // Tiles off screen are caught up without drawing the viewport again
+  bool visible_changed = !tiles.empty();
+
+  PixelRect whole_image;
+  whole_image.w = current_image->pixels->width;
+  whole_image.h = current_image->pixels->height;
+
+  auto offscreen_tiles = stale_tiles.take_stale(whole_image, OFFSCREEN_TILES_PER_FRAME);
+  tiles.insert(tiles.end(), offscreen_tiles.begin(), offscreen_tiles.end());
+
+  // Tone mapping writes the pixels the histogram may be counting right now
+  region_histogram.wait_for_count();
+  current_image->tone_map(tone_mapping, tiles);
+  for (const auto& tile : tiles) {
+    region_histogram.invalidate(tile);
+  }
+  if (visible_changed) {
+    histogram_region = PixelRect();
+  }
+
+  if (compositor.has_image()) {
+    for (const auto& tile : tiles) {
+      compositor.refresh(tile);
+    }
+    viewport_stale = viewport_stale || visible_changed;
+    return;
+  }
+
+  const auto& pixels = *current_image->pixels;
+  for (const auto& tile : tiles) {
+    SDL_Rect rect = {static_cast<int>(tile.x), static_cast<int>(tile.y), static_cast<int>(tile.w), static_cast<int>(tile.h)};
+    SDL_UpdateTexture(main_tex, &rect, pixels.row(tile.y) + tile.x, pixels.width * sizeof(uint32_t));
+  }
+}
+
 void Window::refresh_title() {
   refresh_title(playlist->get_current());
 }
 
 void Window::refresh_title(const std::shared_ptr<ImageEntry>& entry) {
   if (entry == nullptr) {
-    SDL_SetWindowTitle(window, "monokl");
+    auto title = fmt::format("{}{}{}{}monokl", search_title(), export_title(), similarity_title(), compare_title());
+    SDL_SetWindowTitle(window, title.c_str());
   } else {
     int zoom_percentage = (int)(zoom_level * 100);
-    auto title = fmt::format("[{}%] {}{}/{} - {}", zoom_percentage, entry->is_favorite() ? "♥" : "", playlist->current_index() + 1, playlist->size(), entry->path.filename().string());
+    std::string exposure = "";
+    if (current_image != nullptr && current_image->is_high_bit_depth()) {
+      exposure = fmt::format("[{:+.1f} EV] ", tone_mapping.exposure);
+    }
+    std::string page = "";
+    if (entry->page_count > 1) {
+      page = fmt::format(" (page {}/{})", entry->page + 1, entry->page_count);
+    }
+    auto title = fmt::format("{}{}{}{}{}[{}%] {}{}{}/{} - {}{}", search_title(), export_title(), similarity_title(), compare_title(), inspector_title(), zoom_percentage, exposure, entry->is_favorite() ? "♥" : "", playlist->current_index() + 1, playlist->size(), entry->path.filename().string(), page);
     SDL_SetWindowTitle(window, title.c_str());
   }
 }
 
 void Window::change_zoom(float by) {
+  double previous_zoom = zoom_level;
   zoom_level += by;
   if (zoom_level < 0.1) {
     zoom_level = 0.1;
   } else if (zoom_level > 10.0) {
     zoom_level = 10.0;
   }
+
+  // Whatever was in the middle of the window stays there
+  pan_x *= zoom_level / previous_zoom;
+  pan_y *= zoom_level / previous_zoom;
   recalculate_render_rect();
 }
 
@@ -284,3 +831,574 @@ void Window::playlist_toggle_skip_hidden() {
   playlist->refresh_shown_entries();
   reload_current_image();
 }
+
+void Window::playlist_cycle_sort_order() {
+  // Switches between sorting by name and by date, keeping the direction
+  PlaylistSortOrder sort_order;
+  switch (playlist->options.sort_order) {
+    case PlaylistSortOrderName:
+      sort_order = PlaylistSortOrderDate;
+      break;
+    case PlaylistSortOrderNameDesc:
+      sort_order = PlaylistSortOrderDateDesc;
+      break;
+    case PlaylistSortOrderDateDesc:
+      sort_order = PlaylistSortOrderNameDesc;
+      break;
+    default:
+      sort_order = PlaylistSortOrderName;
+      break;
+  }
+
+  playlist->set_sort_order(sort_order);
+  refresh_title();
+}
+
+void Window::playlist_reverse_sort_order() {
+  playlist->set_sort_order(reversed_sort_order(playlist->options.sort_order));
+  refresh_title();
+}
+
+void Window::playlist_export_metadata() {
+  auto& store = MetadataStore::get();
+  if (!store.is_open()) {
+    return;
+  }
+
+  size_t exported = 0;
+  for (const auto& entry : playlist->all_entries) {
+    if (entry->is_folder() && store.export_folder(entry->path, std::static_pointer_cast<FolderEntry>(entry)->get_settings_path())) {
+      exported++;
+    }
+  }
+
+  log_info("Exported favorites and hidden images of %lu folders to .monokl.toml", exported);
+}
+
+void Window::playlist_export_shown() {
+  if (batch_export != nullptr && batch_export->is_running()) {
+    batch_export->cancel();
+    return;
+  }
+
+  if (playlist->shown_entries.empty()) {
+    return;
+  }
+
+  if (batch_export == nullptr) {
+    batch_export = std::make_unique<BatchExport>(app.get_memory_governor(), app.get_color_manager());
+  }
+
+  auto settings = app.get_settings();
+  batch_export->start(playlist->shown_entries, settings != nullptr ? settings->export_options : ExportOptions());
+  refresh_title();
+}
+
+void Window::refresh_export_progress() {
+  if (batch_export == nullptr) {
+    return;
+  }
+
+  // Also refreshed once more after the batch is done, to take the progress out of the title
+  size_t progress = batch_export->is_running() ? batch_export->finished_count() : SIZE_MAX;
+  if (progress != export_progress) {
+    export_progress = progress;
+    refresh_title();
+  }
+}
+
+std::string Window::export_title() const {
+  if (batch_export == nullptr || !batch_export->is_running()) {
+    return "";
+  }
+
+  return fmt::format("[Exporting {}/{}] ", batch_export->finished_count(), batch_export->total_count());
+}
+
+void Window::playlist_show_duplicates() {
+  toggle_similarity_view(SimilarityViewDuplicates);
+}
+
+void Window::playlist_group_by_similarity() {
+  toggle_similarity_view(SimilarityViewGroups);
+}
+
+void Window::toggle_similarity_view(SimilarityView view) {
+  // Asking again while a view is shown or on its way goes back to the whole playlist
+  if (playlist->has_selection() || pending_similarity_view != SimilarityViewNone) {
+    pending_similarity_view = SimilarityViewNone;
+    if (playlist->has_selection()) {
+      auto previous = playlist->get_current();
+      playlist->clear_selection();
+      if (playlist->get_current() != previous) {
+        reload_current_image();
+        return;
+      }
+    }
+    refresh_title();
+    return;
+  }
+
+  if (similarity == nullptr) {
+    similarity = std::make_unique<SimilarityEngine>(app.get_memory_governor());
+  }
+  if (!similarity->is_started_with(playlist->shown_entries)) {
+    similarity->start(playlist->shown_entries);
+  }
+
+  pending_similarity_view = view;
+  similarity_progress = 0;
+  apply_similarity_view();
+  refresh_title();
+}
+
+void Window::apply_similarity_view() {
+  if (pending_similarity_view == SimilarityViewNone || similarity == nullptr) {
+    return;
+  }
+
+  if (!similarity->is_ready()) {
+    if (similarity->hashed_count() != similarity_progress) {
+      similarity_progress = similarity->hashed_count();
+      refresh_title();
+    }
+    return;
+  }
+
+  auto view = pending_similarity_view;
+  pending_similarity_view = SimilarityViewNone;
+
+  std::vector<std::shared_ptr<ImageEntry>> entries;
+  if (view == SimilarityViewDuplicates) {
+    entries = similarity->find_similar(playlist->get_current());
+  } else {
+    entries = similarity->group_by_similarity();
+  }
+
+  if (entries.size() < 2) {
+    log_info("No near duplicates found");
+    refresh_title();
+    return;
+  }
+
+  auto previous = playlist->get_current();
+  playlist->show_selection(entries);
+  if (playlist->get_current() != previous) {
+    reload_current_image();
+  } else {
+    refresh_title();
+  }
+}
+
+std::string Window::similarity_title() const {
+  if (pending_similarity_view != SimilarityViewNone && similarity != nullptr) {
+    return fmt::format("[Hashing {}/{}] ", similarity->hashed_count(), similarity->total_count());
+  }
+
+  if (playlist->has_selection()) {
+    return "[Similar] ";
+  }
+
+  return "";
+}
+
+void Window::toggle_compare(size_t panes) {
+  compare_pane_count = compare_pane_count == panes ? 0 : panes;
+  compare_panes.clear();
+  reload_current_image();
+}
+
+// Pages, archive members and TIFFs go through the same paths as in the single view. Images too
+// large to decode whole are only opened, and come back through `tiled`
+static std::shared_ptr<DecodedImage> decode_pane(const ImageEntry& entry, const std::shared_ptr<Archive>& archive, const DecodeContext& context, std::shared_ptr<TiledImage>& tiled) {
+  std::string path = entry.path.string();
+
+  if (!entry.member.empty()) {
+    sail::image frame = archive != nullptr ? ImageDecoder::read_first_frame(*archive, entry.member, context.governor) : sail::image();
+    return ImageDecoder::decode(frame, path, context);
+  }
+
+  if (entry.page > 0) {
+    auto document = PagedDocument::open(entry.path);
+    sail::image frame = document != nullptr ? document->read_page(entry.page) : sail::image();
+    return ImageDecoder::decode(frame, path, context);
+  }
+
+  if (TiledImage::may_be_tiled(entry.path)) {
+    auto opened = TiledImage::open(entry.path, context.governor);
+    if (opened != nullptr && opened->needs_region_decode()) {
+      if (context.color_manager != nullptr && context.display_profile != nullptr) {
+        opened->set_color_transform(context.color_manager->get_transform(opened->get_color_profile(), *context.display_profile));
+      }
+      tiled = opened;
+      return nullptr;
+    }
+    if (opened != nullptr && opened->can_decode_whole()) {
+      return ImageDecoder::decode(*opened, path, context);
+    }
+  }
+
+  return ImageDecoder::decode(path, context);
+}
+
+DecodeKey Window::decode_key(const ImageEntry& entry) const {
+  return DecodeKey(entry, display_profile != nullptr ? display_profile->hash : 0);
+}
+
+void Window::load_compare_panes(const DecodeContext& context) {
+  auto t0 = std::chrono::high_resolution_clock::now();
+
+  // Stepping keeps the zoom and pan, so the same crop of every candidate can be gone through
+  bool entering = compare_panes.empty();
+  std::vector<ComparePane> previous;
+  previous.swap(compare_panes);
+
+  size_t count = std::min<size_t>(compare_pane_count, playlist->size());
+  compare_panes.resize(count);
+
+  std::vector<std::future<void>> decodes;
+  for (size_t i = 0; i < count; i++) {
+    auto& pane = compare_panes[i];
+    pane.entry = playlist->shown_entries[(playlist->current_index() + i) % playlist->size()];
+
+    // Images still on screen keep their pane's halved levels too
+    auto kept = std::find_if(previous.begin(), previous.end(), [&pane](const ComparePane& other) {
+      return other.entry != nullptr && other.entry == pane.entry;
+    });
+    if (kept != previous.end()) {
+      pane.image = kept->image;
+      pane.tiled = kept->tiled;
+      pane.compositor = std::move(kept->compositor);
+      kept->entry.reset();
+      continue;
+    }
+
+    // Every pane is decoded at full size, they're compared pixel for pixel
+    pane.image = app.get_decode_cache()->find(decode_key(*pane.entry));
+    if (pane.image != nullptr && !pane.image->downscaled) {
+      continue;
+    }
+    pane.image.reset();
+
+    std::shared_ptr<Archive> archive = nullptr;
+    if (!pane.entry->member.empty() && pane.entry->parent != nullptr) {
+      archive = pane.entry->parent->get_archive();
+    }
+    decodes.push_back(std::async(std::launch::async, [&pane, archive, context]() {
+      pane.image = decode_pane(*pane.entry, archive, context, pane.tiled);
+    }));
+  }
+
+  // Every image has its own codec on its own thread, so a pane of large images takes as long as the largest one
+  for (auto& decode : decodes) {
+    decode.wait();
+  }
+  previous.clear();
+
+  for (auto& pane : compare_panes) {
+    app.get_decode_cache()->insert(decode_key(*pane.entry), pane.image);
+    if (pane.image != nullptr && !pane.compositor.has_image()) {
+      pane.compositor.set_image(pane.image->pixels, context.governor);
+    }
+  }
+
+  auto t1 = std::chrono::high_resolution_clock::now();
+  auto duration_ms = static_cast<long long int>(std::chrono::duration_cast<std::chrono::milliseconds>(t1 - t0).count());
+  Instrumentation::get().record_timing("compare.load", static_cast<double>(duration_ms));
+  log_debug("Loaded %lu compare panes in %lld ms, %lu decoded", count, duration_ms, decodes.size());
+
+  image_rect.w = compare_panes.empty() ? 0 : compare_panes.front().width();
+  image_rect.h = compare_panes.empty() ? 0 : compare_panes.front().height();
+  if (entering) {
+    fit_image_to_screen();
+  } else {
+    recalculate_render_rect();
+  }
+}
+
+void Window::layout_compare_panes() {
+  if (compare_panes.empty()) {
+    return;
+  }
+
+  // Two panes side by side, more in a grid of two columns
+  int columns = compare_panes.size() <= 2 ? static_cast<int>(compare_panes.size()) : 2;
+  int rows = (static_cast<int>(compare_panes.size()) + columns - 1) / columns;
+  int width = std::max(1, (window_rect.w - COMPARE_PANE_GAP * (columns - 1)) / columns);
+  int height = std::max(1, (window_rect.h - COMPARE_PANE_GAP * (rows - 1)) / rows);
+
+  for (size_t i = 0; i < compare_panes.size(); i++) {
+    int column = static_cast<int>(i) % columns;
+    int row = static_cast<int>(i) / columns;
+    compare_panes[i].rect = {column * (width + COMPARE_PANE_GAP), row * (height + COMPARE_PANE_GAP), width, height};
+  }
+}
+
+void Window::refresh_compare_viewport() {
+  if (!reserve_viewport_texture(window_rect.w, window_rect.h)) {
+    return;
+  }
+
+  auto settings = app.get_settings();
+  ResampleKernel kernel = settings != nullptr ? settings->render_options.filter : ResampleKernelBicubic;
+
+  // Every pane's crop goes where it's shown in the window, so the texture is drawn a pane at a time
+  for (auto& pane : compare_panes) {
+    int x0 = std::max(pane.rect.x, pane.render_rect.x);
+    int y0 = std::max(pane.rect.y, pane.render_rect.y);
+    int x1 = std::min(pane.rect.x + pane.rect.w, pane.render_rect.x + pane.render_rect.w);
+    int y1 = std::min(pane.rect.y + pane.rect.h, pane.render_rect.y + pane.render_rect.h);
+    pane.visible_rect = {x0, y0, std::max(0, x1 - x0), std::max(0, y1 - y0)};
+    if (pane.visible_rect.w == 0 || pane.visible_rect.h == 0) {
+      continue;
+    }
+
+    pane.pixels.allocate(pane.visible_rect.w, pane.visible_rect.h);
+    double x = (pane.visible_rect.x - pane.render_rect.x) / zoom_level;
+    double y = (pane.visible_rect.y - pane.render_rect.y) / zoom_level;
+    if (pane.tiled != nullptr) {
+      pane.tiled->render_region(x, y, zoom_level, pane.pixels);
+    } else {
+      pane.compositor.render(x, y, zoom_level, kernel, pane.pixels);
+    }
+
+    if (SDL_UpdateTexture(viewport_tex, &pane.visible_rect, pane.pixels.pixels.data(), pane.visible_rect.w * sizeof(uint32_t)) != 0) {
+      log_error("Failed to upload compare pane: %s", SDL_GetError());
+    }
+  }
+}
+
+std::string Window::compare_title() const {
+  if (compare_panes.empty()) {
+    return "";
+  }
+  return fmt::format("[Comparing {}] ", compare_panes.size());
+}
+
+bool Window::is_searching() const {
+  return searching;
+}
+
+void Window::begin_search(const std::string& query) {
+  searching = true;
+  search_query = query;
+  search_origin = std::max(0, playlist->current_index());
+  search_match_count = 0;
+
+  SDL_StartTextInput();
+  update_search();
+}
+
+void Window::end_search(bool accept) {
+  searching = false;
+  SDL_StopTextInput();
+
+  if (!accept) {
+    show_playlist_index(search_origin);
+  }
+
+  search_query.clear();
+  refresh_title();
+}
+
+void Window::search_input(const char* text) {
+  search_query += text;
+  update_search();
+}
+
+void Window::search_backspace() {
+  // Drops a whole UTF-8 sequence, not just its last byte
+  while (!search_query.empty() && (static_cast<uint8_t>(search_query.back()) & 0xC0) == 0x80) {
+    search_query.pop_back();
+  }
+  if (!search_query.empty()) {
+    search_query.pop_back();
+  }
+  update_search();
+}
+
+void Window::search_step(int by) {
+  if (search_query.empty() || search_query[0] == ':') {
+    playlist_advance(by);
+    return;
+  }
+
+  const auto& results = playlist->search(search_query);
+  if (results.empty()) {
+    return;
+  }
+
+  auto current = static_cast<uint32_t>(std::max(0, playlist->current_index()));
+  int target;
+  if (by > 0) {
+    auto it = std::upper_bound(results.begin(), results.end(), current);
+    target = it != results.end() ? *it : results.front();
+  } else {
+    auto it = std::lower_bound(results.begin(), results.end(), current);
+    target = it != results.begin() ? *(it - 1) : results.back();
+  }
+
+  show_playlist_index(target);
+}
+
+void Window::update_search() {
+  int target = search_origin;
+  search_match_count = 0;
+
+  if (!search_query.empty() && search_query[0] == ':') {
+    // ":120" jumps to the 120th image, ":50%" to the middle of the playlist
+    std::string number = search_query.substr(1);
+    bool percentage = !number.empty() && number.back() == '%';
+    if (percentage) {
+      number.pop_back();
+    }
+
+    char* end = nullptr;
+    double value = std::strtod(number.c_str(), &end);
+    // Clamped before converting, a double out of the range of int (or NaN) can't be cast
+    if (!number.empty() && end == number.c_str() + number.size() && !std::isnan(value) && playlist->size() > 0) {
+      if (percentage) {
+        target = static_cast<int>(std::round(std::clamp(value, 0.0, 100.0) / 100.0 * (playlist->size() - 1)));
+      } else {
+        target = static_cast<int>(std::clamp(value, 1.0, static_cast<double>(playlist->size()))) - 1;
+      }
+    }
+  } else if (!search_query.empty()) {
+    auto t0 = std::chrono::high_resolution_clock::now();
+    const auto& results = playlist->search(search_query);
+    auto t1 = std::chrono::high_resolution_clock::now();
+    Instrumentation::get().record_timing("search.query", std::chrono::duration<double, std::milli>(t1 - t0).count());
+
+    // Stay on the first match at or after where the search started
+    search_match_count = results.size();
+    if (!results.empty()) {
+      auto it = std::lower_bound(results.begin(), results.end(), static_cast<uint32_t>(search_origin));
+      target = it != results.end() ? *it : results.front();
+    }
+  }
+
+  show_playlist_index(target);
+}
+
+void Window::show_playlist_index(int index) {
+  if (playlist->size() == 0 || index == playlist->current_index()) {
+    refresh_title();
+    return;
+  }
+
+  playlist->go_to(index);
+  reload_current_image();
+}
+
+std::string Window::search_title() const {
+  if (!searching) {
+    return "";
+  }
+
+  if (!search_query.empty() && search_query[0] == ':') {
+    return fmt::format("[Go to {}] ", search_query.substr(1));
+  }
+
+  return fmt::format("[/{} - {} matches] ", search_query, search_match_count);
+}
+
+void Window::toggle_overlay() {
+  show_overlay = !show_overlay;
+  has_shown_histogram = false;
+  histogram_region = PixelRect();
+  refresh_title();
+}
+
+void Window::move_cursor(int x, int y) {
+  cursor_x = x;
+  cursor_y = y;
+  if (show_overlay) {
+    refresh_title();
+  }
+}
+
+// Only asks for the histogram of what's on screen and picks it up once it's counted, the counting
+// is never done here. Images too large to decode whole are left out, there's nothing to count from
+void Window::refresh_histogram() {
+  if (!show_overlay || current_image == nullptr || !compare_panes.empty()) {
+    return;
+  }
+
+  PixelRect region = visible_image_region();
+  if (region.x != histogram_region.x || region.y != histogram_region.y || region.w != histogram_region.w || region.h != histogram_region.h) {
+    histogram_region = region;
+    region_histogram.request(region);
+  }
+  if (region_histogram.poll(shown_histogram)) {
+    has_shown_histogram = true;
+  }
+}
+
+void Window::render_overlay() {
+  if (!show_overlay || !has_shown_histogram || current_image == nullptr || !compare_panes.empty()) {
+    return;
+  }
+
+  SDL_Rect panel = {window_rect.w - OVERLAY_WIDTH - OVERLAY_MARGIN, window_rect.h - OVERLAY_HEIGHT - OVERLAY_MARGIN, OVERLAY_WIDTH, OVERLAY_HEIGHT};
+  SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_BLEND);
+  SDL_SetRenderDrawColor(renderer, 0, 0, 0, 160);
+  SDL_RenderFillRect(renderer, &panel);
+
+  // Scaled to the tallest bin between the clipped ends, so a blown out sky doesn't flatten the rest
+  const Histogram& histogram = shown_histogram;
+  uint32_t peak = 1;
+  for (size_t i = 1; i + 1 < Histogram::BINS; i++) {
+    peak = std::max({peak, histogram.red[i], histogram.green[i], histogram.blue[i], histogram.luma[i]});
+  }
+  auto bar_height = [&](uint32_t count) {
+    return static_cast<int>(std::min<uint64_t>(OVERLAY_HEIGHT - 1, static_cast<uint64_t>(count) * (OVERLAY_HEIGHT - 1) / peak));
+  };
+
+  SDL_Rect bars[Histogram::BINS];
+  for (size_t i = 0; i < Histogram::BINS; i++) {
+    int height = bar_height(histogram.luma[i]);
+    bars[i] = {panel.x + static_cast<int>(i), panel.y + panel.h - height, 1, height};
+  }
+  SDL_SetRenderDrawColor(renderer, 160, 160, 160, 110);
+  SDL_RenderFillRects(renderer, bars, Histogram::BINS);
+
+  const uint32_t* channels[] = {histogram.red, histogram.green, histogram.blue};
+  const uint8_t colors[][3] = {{255, 80, 80}, {80, 220, 80}, {90, 140, 255}};
+  SDL_Point points[Histogram::BINS];
+  for (size_t c = 0; c < 3; c++) {
+    for (size_t i = 0; i < Histogram::BINS; i++) {
+      points[i] = {panel.x + static_cast<int>(i), panel.y + panel.h - 1 - bar_height(channels[c][i])};
+    }
+    SDL_SetRenderDrawColor(renderer, colors[c][0], colors[c][1], colors[c][2], 200);
+    SDL_RenderDrawLines(renderer, points, Histogram::BINS);
+  }
+  SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_NONE);
+}
+
+std::string Window::inspector_title() const {
+  if (!show_overlay || !compare_panes.empty() || zoom_level <= 0 || cursor_x < render_rect.x || cursor_y < render_rect.y) {
+    return "";
+  }
+
+  int x = static_cast<int>((cursor_x - render_rect.x) / zoom_level);
+  int y = static_cast<int>((cursor_y - render_rect.y) / zoom_level);
+  if (x >= image_rect.w || y >= image_rect.h) {
+    return "";
+  }
+
+  // High bit depth images are read before they're tone mapped and converted for the display
+  if (current_image != nullptr && current_image->is_high_bit_depth()) {
+    uint64_t pixel = current_image->wide_pixels->row(y)[x];
+    return fmt::format("[{},{} RGB16 {} {} {}] ", x, y, pixel & 0xFFFF, (pixel >> 16) & 0xFFFF, (pixel >> 32) & 0xFFFF);
+  }
+
+  uint32_t pixel = 0;
+  if (current_image != nullptr) {
+    pixel = current_image->pixels->row(y)[x];
+  } else if (current_tiled != nullptr && cursor_x >= viewport_rect.x && cursor_x < viewport_rect.x + viewport_rect.w && cursor_y >= viewport_rect.y && cursor_y < viewport_rect.y + viewport_rect.h) {
+    pixel = viewport_pixels.row(cursor_y - viewport_rect.y)[cursor_x - viewport_rect.x];
+  } else {
+    return "";
+  }
+  return fmt::format("[{},{} RGB {} {} {}] ", x, y, pixel & 0xFF, (pixel >> 8) & 0xFF, (pixel >> 16) & 0xFF);
+}
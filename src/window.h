@@ -1,10 +1,10 @@
 #ifndef MONOKL__WINDOW_H
 #define MONOKL__WINDOW_H
 
-#include <sail-c++/image.h>
 #include <string>
 #include <vector>
 #include <memory>
+#include <future>
 
 #include <fmt/format.h>
 
@@ -21,11 +21,33 @@
 #include "logging.h"
 #include "error.h"
 #include "playlist.h"
+#include "memory_governor.h"
+#include "image_buffer.h"
+#include "orientation.h"
+#include "color.h"
+#include "decoder.h"
+#include "tiles.h"
+#include "session.h"
+#include "paged_document.h"
+#include "tiled_image.h"
+#include "similarity.h"
+#include "batch_export.h"
+#include "viewport_compositor.h"
+#include "decode_cache.h"
+#include "histogram.h"
 
 namespace monokl {
 
 class Application;
 
+typedef enum {
+  SimilarityViewNone,
+  // The current image and its near duplicates
+  SimilarityViewDuplicates,
+  // Every image that has near duplicates, group by group
+  SimilarityViewGroups
+} SimilarityView;
+
 struct WindowOptions {
   int x = 0;
   int y = 0;
@@ -38,6 +60,25 @@ struct WindowOptions {
   WindowOptions(const WindowOptions& options);
 };
 
+// One of the images shown side by side in compare mode
+struct ComparePane {
+  std::shared_ptr<ImageEntry> entry;
+  std::shared_ptr<DecodedImage> image;
+  // Set instead of `image` for images too large to decode whole
+  std::shared_ptr<TiledImage> tiled;
+  ViewportCompositor compositor;
+
+  // The part of the window the pane takes up, where its image is drawn at the shared zoom and
+  // pan, and what's left of that within the pane
+  SDL_Rect rect = {0, 0, 0, 0};
+  SDL_Rect render_rect = {0, 0, 0, 0};
+  SDL_Rect visible_rect = {0, 0, 0, 0};
+  ImageBuffer pixels;
+
+  int width() const;
+  int height() const;
+};
+
 class Window : public std::enable_shared_from_this<Window> {
 
 public:
@@ -46,10 +87,17 @@ public:
   void render();
 
   void refresh_size();
+  void refresh_display_profile();
   void refresh_title();
   void refresh_title(const std::shared_ptr<ImageEntry>& entry);
 
-  void reload_current_image();
+  void restore_session();
+  void open_playlist(const std::shared_ptr<Playlist>& playlist, sail::image* first_frame);
+  // Shows the image `other` shows, from a playlist of its own over the same paths
+  void open_like(const Window& other);
+  void reload_current_image(sail::image* frame = nullptr);
+  void transform_current_image(ImageOrientation orientation);
+  void change_exposure(float by);
   void playlist_advance(int by);
   void playlist_go_to_first();
   void playlist_go_to_last();
@@ -59,6 +107,24 @@ public:
 
   void playlist_toggle_only_favorites();
   void playlist_toggle_skip_hidden();
+  void playlist_cycle_sort_order();
+  void playlist_export_metadata();
+  void playlist_reverse_sort_order();
+  void playlist_export_shown();
+  void playlist_show_duplicates();
+  void playlist_group_by_similarity();
+  // Shows the current image and the ones after it side by side, or goes back to a single image
+  void toggle_compare(size_t panes);
+  // Histograms of what's on screen, and the value of the pixel under the cursor in the title
+  void toggle_overlay();
+  void move_cursor(int x, int y);
+
+  bool is_searching() const;
+  void begin_search(const std::string& query = "");
+  void end_search(bool accept);
+  void search_input(const char* text);
+  void search_backspace();
+  void search_step(int by);
 
 private:
   friend class Application;
@@ -76,22 +142,107 @@ private:
   void drop_file(const char* file);
   void end_drop_files();
 
+  // Folders restored from the session are checked against the disk in the background
+  std::future<std::vector<std::shared_ptr<FolderEntry>>> session_revalidation;
+  bool discard_session_revalidation = false;
+  void apply_session_revalidation();
+  void apply_late_scans();
+
   SDL_Rect window_rect;
   SDL_Rect image_rect;
   SDL_Rect render_rect;
   double zoom_level = 1.0;
+  // How far the image was dragged off center, in screen pixels
+  double pan_x = 0.0;
+  double pan_y = 0.0;
   void recalculate_render_rect();
   void fit_image_to_screen();
   void set_original_image_size();
   void change_zoom(float by);
+  void pan_by(int x, int y);
+  void upload_current_image();
+  PixelRect visible_image_region() const;
+  void refresh_tone_mapped_tiles();
 
   unsigned int id = 0;
   bool has_focus = false;
   SDL_Window* window = nullptr;
   SDL_Renderer* renderer = nullptr;
   SDL_Texture* main_tex = nullptr;
-
-  std::unique_ptr<sail::image> current_image = nullptr;
+  MemoryLease main_tex_lease;
+
+  std::shared_ptr<const ColorProfile> display_profile = nullptr;
+  std::shared_ptr<DecodedImage> current_image = nullptr;
+  // Kept open while its pages are being flipped through, so the file is mapped and indexed once
+  std::shared_ptr<PagedDocument> current_document = nullptr;
+
+  // Shown instead of `current_image` when it's too large to decode whole, only what's on screen is read
+  std::shared_ptr<TiledImage> current_tiled = nullptr;
+  // As large as the window, the visible part of the image is drawn into its top left corner
+  SDL_Texture* viewport_tex = nullptr;
+  MemoryLease viewport_tex_lease;
+  ImageBuffer viewport_pixels;
+  SDL_Rect viewport_rect = {0, 0, 0, 0};
+  bool viewport_stale = false;
+  void refresh_viewport();
+  // Draws what's already prepared, without picking up anything that finished in the background
+  void present();
+
+  // Scales `current_image` into `viewport_tex` on the CPU, instead of having the renderer scale `main_tex`
+  ViewportCompositor compositor;
+  bool software_renderer = false;
+  bool should_composite() const;
+
+  ToneMappingParams tone_mapping;
+  TileTracker stale_tiles;
+
+  // File name filter, or a ":N" / ":N%" jump, typed into the title bar
+  bool searching = false;
+  std::string search_query;
+  int search_origin = 0;
+  size_t search_match_count = 0;
+  void update_search();
+  void show_playlist_index(int index);
+  std::string search_title() const;
+
+  // Created on first use, its progress is shown in the title until the batch is done
+  std::unique_ptr<BatchExport> batch_export = nullptr;
+  size_t export_progress = 0;
+  void refresh_export_progress();
+  std::string export_title() const;
+
+  // Created on first use, the view is applied once every shown image has been hashed
+  std::unique_ptr<SimilarityEngine> similarity = nullptr;
+  SimilarityView pending_similarity_view = SimilarityViewNone;
+  size_t similarity_progress = 0;
+  void toggle_similarity_view(SimilarityView view);
+  void apply_similarity_view();
+  std::string similarity_title() const;
+
+  // The current image and the ones after it, zoomed and panned together. Empty outside of compare mode
+  std::vector<ComparePane> compare_panes;
+  size_t compare_pane_count = 0;
+  DecodeKey decode_key(const ImageEntry& entry) const;
+  void load_compare_panes(const DecodeContext& context);
+  void layout_compare_panes();
+  void refresh_compare_viewport();
+  bool reserve_viewport_texture(int width, int height);
+  std::string compare_title() const;
+
+  bool show_overlay = false;
+  // Counted in the background for whatever part of `current_image` is on screen
+  RegionHistogram region_histogram;
+  PixelRect histogram_region;
+  Histogram shown_histogram;
+  bool has_shown_histogram = false;
+  int cursor_x = -1;
+  int cursor_y = -1;
+  void refresh_histogram();
+  void render_overlay();
+  std::string inspector_title() const;
+
+  // Set while the image the application was started with is on its way to the screen
+  bool startup_image_pending = false;
 };
 
 }